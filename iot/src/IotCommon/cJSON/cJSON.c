@@ -69,6 +69,56 @@ void cJSON_InitHooks(cJSON_Hooks* hooks)
 	cJSON_free	 = (hooks->free_fn)?hooks->free_fn:free;
 }
 
+/* Arena hooks: allocate from the thread's current arena, if any. */
+static __thread cJSON_Arena *cJSON_arena=0;
+
+/* Allocations that did not fit the buffer, chained in front of the data until cJSON_ArenaEnd. */
+typedef union cJSON_ArenaOverflow {union cJSON_ArenaOverflow *next;double align;} cJSON_ArenaOverflow;
+
+static void *cJSON_arena_malloc(size_t sz)
+{
+	cJSON_Arena *a=cJSON_arena;
+	if (!a) return malloc(sz);
+	size_t start=(a->used+7)&~(size_t)7;	/* Keep doubles and pointers aligned. */
+	if (start+sz>a->size)
+	{
+		cJSON_ArenaOverflow *o=(cJSON_ArenaOverflow*)malloc(sizeof(cJSON_ArenaOverflow)+sz);
+		if (!o) return 0;
+		o->next=(cJSON_ArenaOverflow*)a->overflow;a->overflow=o;a->failed++;
+		return o+1;
+	}
+	a->used=start+sz;
+	return a->buffer+start;
+}
+
+static void cJSON_arena_free(void *ptr)
+{
+	cJSON_Arena *a=cJSON_arena;
+	if (a)
+	{
+		cJSON_ArenaOverflow *o;
+		if ((char*)ptr>=a->buffer && (char*)ptr<a->buffer+a->size) return;	/* Released by cJSON_ArenaEnd. */
+		for (o=(cJSON_ArenaOverflow*)a->overflow;o;o=o->next) if (ptr==(void*)(o+1)) return;
+	}
+	free(ptr);
+}
+
+void cJSON_ArenaBegin(cJSON_Arena *arena,void *buffer,size_t size)
+{
+	static cJSON_Hooks hooks={cJSON_arena_malloc,cJSON_arena_free};
+	arena->buffer=(char*)buffer;arena->size=size;arena->used=0;arena->failed=0;arena->overflow=0;
+	cJSON_InitHooks(&hooks);	/* Idempotent; behaves as malloc/free for threads without an arena. */
+	cJSON_arena=arena;
+}
+
+void cJSON_ArenaEnd(cJSON_Arena *arena)
+{
+	cJSON_ArenaOverflow *o=(cJSON_ArenaOverflow*)arena->overflow,*next;
+	if (cJSON_arena==arena) cJSON_arena=0;
+	while (o) {next=o->next;free(o);o=next;}
+	arena->overflow=0;arena->used=0;
+}
+
 /* Internal constructor. */
 static cJSON *cJSON_New_Item(void)
 {
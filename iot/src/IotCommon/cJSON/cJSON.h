@@ -62,6 +62,23 @@ typedef struct cJSON_Hooks {
 /* Supply malloc, realloc and free functions to cJSON */
 extern void cJSON_InitHooks(cJSON_Hooks* hooks);
 
+/* Arena allocation. Everything cJSON allocates on this thread between cJSON_ArenaBegin and
+   cJSON_ArenaEnd is carved out of the supplied buffer (via the hooks), and released at once by
+   cJSON_ArenaEnd. Do not cJSON_Delete such items or free strings printed from them, and do not
+   use them after cJSON_ArenaEnd.
+   When the buffer is full allocations overflow to the heap, those are freed by cJSON_ArenaEnd as
+   well. Outside an arena malloc/free are used. */
+typedef struct cJSON_Arena {
+	char *buffer;
+	size_t size;
+	size_t used;
+	size_t failed;		/* Number of allocations that did not fit the buffer */
+	void *overflow;		/* Heap blocks of those allocations */
+} cJSON_Arena;
+
+extern void cJSON_ArenaBegin(cJSON_Arena *arena,void *buffer,size_t size);
+extern void cJSON_ArenaEnd(cJSON_Arena *arena);
+
 
 /* Supply a block of JSON, and this returns a cJSON object you can interrogate. Call cJSON_Delete when finished. */
 extern cJSON *cJSON_Parse(const char *value);
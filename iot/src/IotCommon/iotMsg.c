@@ -0,0 +1,417 @@
+// ------------------------------------------------------------------
+// Binary inter-daemon messages
+// ------------------------------------------------------------------
+// Compact binary form of the flat JSON messages on the internal
+// queues, with a JSON <-> binary translator for the external edges
+// ------------------------------------------------------------------
+// Part of gateway_zigbee, licensed under the GNU GPL v3 (see LICENSE)
+// ------------------------------------------------------------------
+
+/** \file
+ * \brief Binary inter-daemon messages. Encode/decode and JSON translation.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "iotError.h"
+#include "json.h"
+#include "queue.h"
+#include "jsonCreate.h"
+#include "iotMsg.h"
+
+// #define IOTMSG_DEBUG
+
+#ifdef IOTMSG_DEBUG
+#define DEBUG_PRINTF(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_PRINTF(...)
+#endif /* IOTMSG_DEBUG */
+
+#define MAXNAME    30
+
+// ------------------------------------------------------------------
+// Tables (indexed by iotMsgType / iotMsgTag)
+// ------------------------------------------------------------------
+
+static const char * typeNames[IOTMSG_TYPE_CNT] = {
+    NULL, "lmp", "plg", "grp", "sensor", "zcb", "tp", "tp+", "ctrl", "cmd", "tunnel"
+};
+
+static const char * tagNames[IOTMSG_TAG_CNT] = {
+    NULL, "mac", "cmd", "lvl", "rgb", "kelvin", "xcr", "ycr", "grp", "grpid", "scn", "scnid",
+    "heat", "cool", "id", "nm", "rm", "ty", "dev", "joined", "jnd", "ui", "tmp", "hum", "prs",
+    "co2", "bat", "batl", "als", "xloc", "yloc", "zloc", "act", "sum", "h24", "autoinsert",
+    "sid", "open", "close", "clr", "end", "sen", "man", "pmp", "lmp", "plg"
+};
+
+static int lookup( const char ** names, int cnt, const char * name ) {
+    int i;
+    for ( i=1; i<cnt; i++ ) {
+        if ( names[i][0] == name[0] && strcmp( names[i], name ) == 0 ) return( i );
+    }
+    return( IOTMSG_NAMED );
+}
+
+// ------------------------------------------------------------------
+// Encode
+// ------------------------------------------------------------------
+
+static int room( iotMsg_t * msg, int n ) {
+    if ( msg->error || ( msg->len + n ) > IOTMSG_MAXLEN ) {
+        msg->error = 1;
+        return( 0 );
+    }
+    return( 1 );
+}
+
+static void putName( iotMsg_t * msg, const char ** names, int cnt, const char * name ) {
+    int code = lookup( names, cnt, name );
+    if ( code != IOTMSG_NAMED ) {
+        if ( room( msg, 1 ) ) msg->data[msg->len++] = code;
+    } else {
+        int n = strlen( name );
+        if ( n <= MAXNAME && room( msg, 2 + n ) ) {
+            msg->data[msg->len++] = IOTMSG_NAMED;
+            msg->data[msg->len++] = n;
+            memcpy( msg->data + msg->len, name, n );
+            msg->len += n;
+        } else {
+            msg->error = 1;
+        }
+    }
+}
+
+/**
+ * \brief Start a new (empty) binary message
+ */
+void iotMsgInit( iotMsg_t * msg ) {
+    msg->data[0] = IOTMSG_MAGIC;
+    msg->data[1] = IOTMSG_VERSION;
+    msg->len     = 2;
+    msg->error   = 0;
+    msg->typed   = 0;
+}
+
+/**
+ * \brief Set the message type (the JSON object name, e.g. "lmp"). Must be called once, first.
+ */
+void iotMsgSetType( iotMsg_t * msg, const char * type ) {
+    if ( msg->typed ) {
+        // Only flat messages are supported
+        msg->error = 1;
+    } else {
+        msg->typed = 1;
+        putName( msg, typeNames, IOTMSG_TYPE_CNT, type );
+    }
+}
+
+/**
+ * \brief Add an integer attribute
+ */
+void iotMsgAddInt( iotMsg_t * msg, const char * name, int value ) {
+    if ( !msg->typed ) msg->error = 1;
+    putName( msg, tagNames, IOTMSG_TAG_CNT, name );
+    if ( room( msg, 5 ) ) {
+        unsigned int u = (unsigned int)value;
+        unsigned char * p = msg->data + msg->len;
+        p[0] = IOTMSG_INT;
+        p[1] = u;
+        p[2] = u >> 8;
+        p[3] = u >> 16;
+        p[4] = u >> 24;
+        msg->len += 5;
+    }
+}
+
+/**
+ * \brief Add a string attribute
+ */
+void iotMsgAddString( iotMsg_t * msg, const char * name, const char * value ) {
+    int n = strlen( value );
+    if ( !msg->typed || n > 255 ) msg->error = 1;
+    putName( msg, tagNames, IOTMSG_TAG_CNT, name );
+    if ( room( msg, 2 + n ) ) {
+        msg->data[msg->len++] = IOTMSG_STR;
+        msg->data[msg->len++] = n;
+        memcpy( msg->data + msg->len, value, n );
+        msg->len += n;
+    }
+}
+
+// ------------------------------------------------------------------
+// Decode
+// ------------------------------------------------------------------
+
+/**
+ * \brief Checks if a received queue message is binary (or JSON text)
+ */
+int iotMsgIsBinary( const char * buf, int len ) {
+    return( len >= 3 && (unsigned char)buf[0] == IOTMSG_MAGIC );
+}
+
+/**
+ * \brief Read a type or tag name at <pos>
+ * \returns The position after the name, or -1 when malformed
+ */
+static int getName( const unsigned char * p, int pos, int len,
+                    const char ** names, int cnt, char * name ) {
+    if ( pos >= len ) return( -1 );
+    int code = p[pos++];
+    if ( code != IOTMSG_NAMED ) {
+        if ( code >= cnt ) return( -1 );
+        strcpy( name, names[code] );
+        return( pos );
+    }
+    if ( pos >= len ) return( -1 );
+    int n = p[pos++];
+    if ( n > MAXNAME || pos + n > len ) return( -1 );
+    memcpy( name, p + pos, n );
+    name[n] = '\0';
+    return( pos + n );
+}
+
+/**
+ * \brief Walks a binary message and calls the callbacks (when cb != NULL)
+ * \returns 1 when the message is well-formed, 0 otherwise
+ */
+static int walk( const unsigned char * p, int len, const json_callbacks_t * cb, void * user ) {
+    char type[MAXNAME+2];
+    char name[MAXNAME+2];
+    char value[256];
+    int  pos;
+
+    if ( !iotMsgIsBinary( (const char *)p, len ) || p[1] != IOTMSG_VERSION ) return( 0 );
+    if ( ( pos = getName( p, 2, len, typeNames, IOTMSG_TYPE_CNT, type ) ) < 0 ) return( 0 );
+
+    if ( cb && cb->onObjectStart ) cb->onObjectStart( user, type );
+
+    while ( pos < len ) {
+        if ( ( pos = getName( p, pos, len, tagNames, IOTMSG_TAG_CNT, name ) ) < 0 ||
+             pos >= len ) return( 0 );
+
+        if ( p[pos] == IOTMSG_INT ) {
+            if ( pos + 5 > len ) return( 0 );
+            int v = (int)( (unsigned int)p[pos+1]         | ( (unsigned int)p[pos+2] << 8 ) |
+                         ( (unsigned int)p[pos+3] << 16 ) | ( (unsigned int)p[pos+4] << 24 ) );
+            pos += 5;
+            if ( cb && cb->onInteger ) cb->onInteger( user, name, v );
+
+        } else if ( p[pos] == IOTMSG_STR ) {
+            if ( pos + 2 > len ) return( 0 );
+            int n = p[pos+1];
+            pos += 2;
+            if ( pos + n > len ) return( 0 );
+            memcpy( value, p + pos, n );
+            value[n] = '\0';
+            pos += n;
+            if ( cb && cb->onString ) cb->onString( user, name, value );
+
+        } else {
+            return( 0 );
+        }
+    }
+
+    if ( cb && cb->onObjectComplete ) cb->onObjectComplete( user, type );
+    return( 1 );
+}
+
+/**
+ * \brief Decodes a binary message into the same callbacks as the JSON parser would give
+ * for the equivalent text message. Nothing is called for a malformed message.
+ * \param buf Received message
+ * \param len Length of the message
+ * \param cb Parser callbacks
+ * \param user User pointer passed to the callbacks
+ * \returns 1 on success, 0 when the message was malformed
+ */
+int iotMsgDecode( const char * buf, int len, const json_callbacks_t * cb, void * user ) {
+    const unsigned char * p = (const unsigned char *)buf;
+    if ( !walk( p, len, NULL, NULL ) ) {
+        printf( "Error: malformed binary message (%d bytes)\n", len );
+        return( 0 );
+    }
+    return( walk( p, len, cb, user ) );
+}
+
+// ------------------------------------------------------------------
+// JSON -> binary
+// ------------------------------------------------------------------
+
+typedef struct {
+    iotMsg_t * msg;
+    int        depth;
+} fromJson_t;
+
+static void fj_onError( void * user, int error, char * errtext, char * lastchars ) {
+    ((fromJson_t *)user)->msg->error = 1;
+}
+
+static void fj_onObjectStart( void * user, char * name ) {
+    fromJson_t * fj = (fromJson_t *)user;
+    if ( fj->depth++ == 0 ) {
+        iotMsgSetType( fj->msg, name );
+    } else {
+        fj->msg->error = 1;
+    }
+}
+
+static void fj_onObjectComplete( void * user, char * name ) {
+    ((fromJson_t *)user)->depth--;
+}
+
+static void fj_onArrayStart( void * user, char * name ) {
+    ((fromJson_t *)user)->msg->error = 1;
+}
+
+static void fj_onString( void * user, char * name, char * value ) {
+    fromJson_t * fj = (fromJson_t *)user;
+    if ( fj->depth == 1 ) iotMsgAddString( fj->msg, name, value );
+    else fj->msg->error = 1;
+}
+
+static void fj_onInteger( void * user, char * name, int value ) {
+    fromJson_t * fj = (fromJson_t *)user;
+    if ( fj->depth == 1 ) iotMsgAddInt( fj->msg, name, value );
+    else fj->msg->error = 1;
+}
+
+static const json_callbacks_t fromJsonCallbacks = {
+    fj_onError,
+    fj_onObjectStart,
+    fj_onObjectComplete,
+    fj_onArrayStart,
+    NULL,
+    fj_onString,
+    fj_onInteger
+};
+
+static __thread json_parser_t * fromJsonParser = NULL;
+
+/**
+ * \brief Translates a flat JSON message (one object with string and integer values)
+ * \param msg Binary message to fill
+ * \param json JSON text
+ * \param len Length of the JSON text
+ * \returns 1 on success, 0 when the JSON text can not be expressed as a binary message
+ */
+int iotMsgFromJson( iotMsg_t * msg, const char * json, int len ) {
+    fromJson_t fj;
+
+    if ( fromJsonParser == NULL && ( fromJsonParser = jsonParserCreate() ) == NULL ) {
+        return( 0 );
+    }
+
+    fj.msg   = msg;
+    fj.depth = 0;
+    iotMsgInit( msg );
+    jsonParserSetCallbacks( fromJsonParser, &fromJsonCallbacks, &fj );
+    jsonParserReset( fromJsonParser );
+    jsonParserEatBuffer( fromJsonParser, json, len );
+
+    return( msg->typed && !msg->error && fj.depth == 0 );
+}
+
+// ------------------------------------------------------------------
+// Binary -> JSON
+// ------------------------------------------------------------------
+
+typedef struct {
+    jsonBuilder_t b;
+    int           n;
+} toJson_t;
+
+static void tj_onObjectStart( void * user, char * name ) {
+    toJson_t * tj = (toJson_t *)user;
+    jsonBuilderName( &tj->b, name );
+    jsonBuilderRaw( &tj->b, " : { " );
+}
+
+static void tj_onObjectComplete( void * user, char * name ) {
+    jsonBuilderRaw( &((toJson_t *)user)->b, " }\n" );
+}
+
+static void tj_onString( void * user, char * name, char * value ) {
+    toJson_t * tj = (toJson_t *)user;
+    if ( tj->n++ ) jsonBuilderRaw( &tj->b, ", " );
+    jsonBuilderString( &tj->b, name, value );
+}
+
+static void tj_onInteger( void * user, char * name, int value ) {
+    toJson_t * tj = (toJson_t *)user;
+    if ( tj->n++ ) jsonBuilderRaw( &tj->b, ", " );
+    jsonBuilderInt( &tj->b, name, value );
+}
+
+static const json_callbacks_t toJsonCallbacks = {
+    NULL,
+    tj_onObjectStart,
+    tj_onObjectComplete,
+    NULL,
+    NULL,
+    tj_onString,
+    tj_onInteger
+};
+
+/**
+ * \brief Translates a binary message into JSON text, in the same layout as jsonCreate
+ * \param buf Binary message
+ * \param len Length of the binary message
+ * \param json Buffer for the JSON text
+ * \param size Size of the buffer
+ * \returns Length of the JSON text, or -1 when the message is malformed
+ */
+int iotMsgToJson( const char * buf, int len, char * json, int size ) {
+    toJson_t tj;
+    jsonBuilderInit( &tj.b, json, size );
+    tj.n = 0;
+    if ( !iotMsgDecode( buf, len, &toJsonCallbacks, &tj ) ) {
+        json[0] = '\0';
+        return( -1 );
+    }
+    return( tj.b.len );
+}
+
+// ------------------------------------------------------------------
+// Queues
+// ------------------------------------------------------------------
+
+/**
+ * \brief Write a binary message into a queue
+ * \returns 1 on success, or 0 on error (and sets the global iotError)
+ */
+int iotMsgQueueWrite( int queue, iotMsg_t * msg ) {
+    if ( msg->error || !msg->typed ) {
+        printf( "Error: binary message not written\n" );
+        iotError = IOT_ERROR_QUEUE_BUFSIZE;
+        return( 0 );
+    }
+    DEBUG_PRINTF( "QW binary (%d)\n", msg->len );
+    return( queueWriteBinary( queue, (const char *)msg->data, msg->len ) );
+}
+
+/**
+ * \brief Write one binary message. Opens a queue, writes the message and closes queue again
+ * \returns 1 on success, or 0 on error (and sets the global iotError)
+ */
+int iotMsgQueueWriteOne( queueKey key, iotMsg_t * msg ) {
+    if ( msg->error || !msg->typed ) {
+        printf( "Error: binary message not written\n" );
+        iotError = IOT_ERROR_QUEUE_BUFSIZE;
+        return( 0 );
+    }
+    return( queueWriteOneBinary( key, (const char *)msg->data, msg->len ) );
+}
+
+/**
+ * \brief Write a JSON message into a queue, translated to binary when possible
+ * (otherwise as text, which the receivers also still accept)
+ * \returns 1 on success, or 0 on error (and sets the global iotError)
+ */
+int iotMsgQueueWriteJson( int queue, char * json ) {
+    iotMsg_t msg;
+    if ( iotMsgFromJson( &msg, json, strlen( json ) ) ) {
+        return( iotMsgQueueWrite( queue, &msg ) );
+    }
+    return( queueWrite( queue, json ) );
+}
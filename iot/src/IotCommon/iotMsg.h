@@ -0,0 +1,139 @@
+// ------------------------------------------------------------------
+// Binary inter-daemon messages - include file
+// ------------------------------------------------------------------
+// Part of gateway_zigbee, licensed under the GNU GPL v3 (see LICENSE)
+// ------------------------------------------------------------------
+//
+// Compact binary form of the flat JSON messages that go over the
+// internal queues, e.g.
+//
+//    "lmp" : { "mac":"00158D0000414243", "lvl":80 }
+//
+// Layout (integers are little endian):
+//
+//    <magic> <version> <type> ( <tag> <kind> <value> )*
+//
+//    <magic>    IOTMSG_MAGIC, never the first byte of a JSON message
+//    <type>     iotMsgType, or IOTMSG_NAMED + <len> + name
+//    <tag>      iotMsgTag,  or IOTMSG_NAMED + <len> + name
+//    <kind>     IOTMSG_INT: 4 byte value, IOTMSG_STR: <len> + chars
+//
+// Receivers replay a binary message as the same JSON parser callbacks
+// (onObjectStart( type ), onString/onInteger, onObjectComplete( type ))
+// that the text message would have given, so handlers stay the same.
+// ------------------------------------------------------------------
+
+// Needs json.h and queue.h to be included first
+
+#define IOTMSG_MAGIC      0xB1
+#define IOTMSG_VERSION    1
+#define IOTMSG_MAXLEN     ( MAXMESSAGESIZE - 2 )
+
+#define IOTMSG_NAMED      0     // Type or tag is not in the tables, name follows
+#define IOTMSG_INT        0
+#define IOTMSG_STR        1
+
+// Never reorder or remove entries, only append (or bump IOTMSG_VERSION)
+typedef enum {
+    IOTMSG_TYPE_LMP = 1,      // Lamp (incl. lamp group/scene membership)
+    IOTMSG_TYPE_PLG,          // Plug
+    IOTMSG_TYPE_GRP,          // Group (incl. group scenes)
+    IOTMSG_TYPE_SENSOR,       // Sensor report
+    IOTMSG_TYPE_ZCB,          // ZCB status, e.g. device announce
+    IOTMSG_TYPE_TP,           // Topo commands
+    IOTMSG_TYPE_TPADD,        // Topo add
+    IOTMSG_TYPE_CTRL,
+    IOTMSG_TYPE_CMD,
+    IOTMSG_TYPE_TUNNEL,
+    IOTMSG_TYPE_CNT
+} iotMsgType;
+
+typedef enum {
+    IOTMSG_TAG_MAC = 1,
+    IOTMSG_TAG_CMD,
+    IOTMSG_TAG_LVL,
+    IOTMSG_TAG_RGB,
+    IOTMSG_TAG_KELVIN,
+    IOTMSG_TAG_XCR,
+    IOTMSG_TAG_YCR,
+    IOTMSG_TAG_GRP,
+    IOTMSG_TAG_GRPID,
+    IOTMSG_TAG_SCN,
+    IOTMSG_TAG_SCNID,
+    IOTMSG_TAG_HEAT,
+    IOTMSG_TAG_COOL,
+    IOTMSG_TAG_ID,
+    IOTMSG_TAG_NM,
+    IOTMSG_TAG_RM,
+    IOTMSG_TAG_TY,
+    IOTMSG_TAG_DEV,
+    IOTMSG_TAG_JOINED,
+    IOTMSG_TAG_JND,
+    IOTMSG_TAG_UI,
+    IOTMSG_TAG_TMP,
+    IOTMSG_TAG_HUM,
+    IOTMSG_TAG_PRS,
+    IOTMSG_TAG_CO2,
+    IOTMSG_TAG_BAT,
+    IOTMSG_TAG_BATL,
+    IOTMSG_TAG_ALS,
+    IOTMSG_TAG_XLOC,
+    IOTMSG_TAG_YLOC,
+    IOTMSG_TAG_ZLOC,
+    IOTMSG_TAG_ACT,
+    IOTMSG_TAG_SUM,
+    IOTMSG_TAG_H24,
+    IOTMSG_TAG_AUTOINSERT,
+    IOTMSG_TAG_SID,
+    IOTMSG_TAG_OPEN,
+    IOTMSG_TAG_CLOSE,
+    IOTMSG_TAG_CLR,
+    IOTMSG_TAG_END,
+    IOTMSG_TAG_SEN,
+    IOTMSG_TAG_MAN,
+    IOTMSG_TAG_PMP,
+    IOTMSG_TAG_LMP,
+    IOTMSG_TAG_PLG,
+    IOTMSG_TAG_CNT
+} iotMsgTag;
+
+typedef struct iotMsg {
+    int           len;
+    int           error;      // Set when something did not fit or was not flat
+    int           typed;      // Type has been set
+    unsigned char data[IOTMSG_MAXLEN];
+} iotMsg_t;
+
+// ------------------------------------------------------------------
+// Encode
+// ------------------------------------------------------------------
+
+void iotMsgInit( iotMsg_t * msg );
+void iotMsgSetType( iotMsg_t * msg, const char * type );
+void iotMsgAddInt( iotMsg_t * msg, const char * name, int value );
+void iotMsgAddString( iotMsg_t * msg, const char * name, const char * value );
+
+// ------------------------------------------------------------------
+// Decode
+// ------------------------------------------------------------------
+
+int  iotMsgIsBinary( const char * buf, int len );
+int  iotMsgDecode( const char * buf, int len, const json_callbacks_t * cb, void * user );
+
+// ------------------------------------------------------------------
+// JSON <-> binary translation (for the external edges and logging)
+// ------------------------------------------------------------------
+
+int  iotMsgFromJson( iotMsg_t * msg, const char * json, int len );
+int  iotMsgToJson( const char * buf, int len, char * json, int size );
+
+// ------------------------------------------------------------------
+// Queues
+// ------------------------------------------------------------------
+
+// Binary messages are built with the iotMsg* constructors in jsonCreate.h, e.g.
+//    iotMsgQueueWriteOne( key, iotMsgPlugCmd( &msg, mac, cmd ) );
+
+int  iotMsgQueueWrite( int queue, iotMsg_t * msg );
+int  iotMsgQueueWriteOne( queueKey key, iotMsg_t * msg );
+int  iotMsgQueueWriteJson( int queue, char * json );
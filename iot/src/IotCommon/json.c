@@ -74,7 +74,7 @@ static char * json_errors[] = {
 // Globals
 // -------------------------------------------------------------
 
-typedef struct {
+struct json_parser {
     int state;
     int states[MAXSTATES];
     int stateIndex;
@@ -90,6 +90,12 @@ typedef struct {
     int errbufIndex;
     int numchars;
 
+    const char * inbuf;         // Buffer being eaten by jsonEatBuffer, for error context
+    const char * inbufPos;
+
+    json_callbacks_t cb;        // Context callbacks, take precedence over the ones below
+    void * user;
+
     OnError          onError;
     OnObjectStart    onObjectStart;
     OnObjectComplete onObjectComplete;
@@ -98,34 +104,57 @@ typedef struct {
     OnString         onString;
     OnInteger        onInteger;
 
-} parser_data_t;
+};
+
+// Parsers for the global (jsonSelect) interface
+static json_parser_t parserData[MAXPARSERS];
+static json_parser_t * selected = &parserData[0];
 
-static parser_data_t parserData[MAXPARSERS];
-static parser_data_t * parser = &parserData[0];
+#define JSON_CALLBACK( name, ... ) \
+    do { \
+        if ( parser->cb.name != NULL ) parser->cb.name( parser->user, __VA_ARGS__ ); \
+        else if ( parser->name != NULL ) parser->name( __VA_ARGS__ ); \
+    } while ( 0 )
+
+static int isWhiteSpace(char c);
 
 // -------------------------------------------------------------
 // Error handling
 // -------------------------------------------------------------
 
-static void jsonError(int err) {
+static void jsonError(json_parser_t * parser, int err) {
     char locerrbuf[MAXERRORBUFFER + 2];
 
     int i;
     int start;
     int len = parser->numchars;
-    if (len >= MAXERRORBUFFER) len = MAXERRORBUFFER;
-    start = parser->errbufIndex - len;
-    if (start < 0) start += MAXERRORBUFFER;
-    for (i = 0; i < len; i++) {
-        locerrbuf[i] = parser->errbuf[start++];
-        if (start >= MAXERRORBUFFER) start = 0;
+    if (parser->inbuf != NULL) {
+        // Bulk mode: take the last non-whitespace chars straight from the buffer
+        const char * p = parser->inbufPos;
+        len = MAXERRORBUFFER;
+        locerrbuf[len] = '\0';
+        while (len > 0) {
+            if (!isWhiteSpace(*p)) locerrbuf[--len] = *p;
+            // Stop at the start of the buffer, never point before it
+            if (p == parser->inbuf) break;
+            p--;
+        }
+        memmove(locerrbuf, &locerrbuf[len], MAXERRORBUFFER - len + 1);
+    } else {
+        if (len >= MAXERRORBUFFER) len = MAXERRORBUFFER;
+        start = parser->errbufIndex - len;
+        if (start < 0) start += MAXERRORBUFFER;
+        for (i = 0; i < len; i++) {
+            locerrbuf[i] = parser->errbuf[start++];
+            if (start >= MAXERRORBUFFER) start = 0;
+        }
+        locerrbuf[len] = '\0';
     }
-    locerrbuf[len] = '\0';
 
     // printf("JSON error %d (%s) @ %s\n", err, json_errors[err], locerrbuf);
-    if (parser->onError != NULL) parser->onError(err, json_errors[err], locerrbuf);
+    JSON_CALLBACK(onError, err, json_errors[err], locerrbuf);
 
-    jsonReset();
+    jsonParserReset(parser);
 }
 
 // -------------------------------------------------------------
@@ -152,29 +181,53 @@ static int isValidNameChar(char c) {
     return ( isAlpha(c) || isNum(c) || (c == '_' ) || (c == '+') );
 }
 
-static void appendName(char c) {
+static void appendName(json_parser_t * parser, char c) {
     int len = strlen(parser->name[parser->stack]);
-    if (len < MAXNAME) {
+    if (len < MAXNAME - 1) {
         parser->name[parser->stack][len] = c;
         parser->name[parser->stack][len + 1] = '\0';
     } else {
         // printf( "Name too long\n" );
-        jsonError(ERR_NAMETOOLONG);
+        jsonError(parser, ERR_NAMETOOLONG);
     }
 }
 
-static void appendValue(char c) {
+static void appendValue(json_parser_t * parser, char c) {
     int len = strlen(parser->value[parser->stack]);
-    if (len < MAXVALUE) {
+    if (len < MAXVALUE - 1) {
         parser->value[parser->stack][len] = c;
         parser->value[parser->stack][len + 1] = '\0';
     } else {
         // printf( "Value too long\n" );
-        jsonError(ERR_VALUETOOLONG);
+        jsonError(parser, ERR_VALUETOOLONG);
     }
 }
 
-static void setState(int st) {
+/**
+ * \brief Appends a run of characters at once. When the run does not fit, the part
+ * that fits is appended and the error is raised on the first char that does not.
+ * \returns Number of characters consumed
+ */
+static int appendRun(json_parser_t * parser, char * dst, int max, int errcode, const char * p, int n) {
+    int len = strlen(dst);
+    int room = max - 1 - len;
+    if (n <= room) {
+        memcpy(&dst[len], p, n);
+        dst[len + n] = '\0';
+        return n;
+    }
+    if (room > 0) {
+        memcpy(&dst[len], p, room);
+        dst[len + room] = '\0';
+    } else {
+        room = 0;
+    }
+    parser->inbufPos = p + room;
+    jsonError(parser, errcode);
+    return room + 1;
+}
+
+static void setState(json_parser_t * parser, int st) {
     // printf("Set state %d\n", st);
     parser->state = st;
 
@@ -193,23 +246,23 @@ static void setState(int st) {
             if (++parser->stack < MAXSTACK) {
                 parser->name[parser->stack][0] = '\0';
             } else {
-                jsonError(ERR_INTERNAL);
+                jsonError(parser, ERR_INTERNAL);
             }
             break;
     }
 }
 
-static void toState(int st) {
+static void toState(json_parser_t * parser, int st) {
     // printf("To state %d\n", st);
     parser->states[parser->stateIndex] = parser->state;
     if (++parser->stateIndex < MAXSTATES) {
-        setState(st);
+        setState(parser, st);
     } else {
-        jsonError(ERR_INTERNAL);
+        jsonError(parser, ERR_INTERNAL);
     }
 }
 
-static void upState(void) {
+static void upState(json_parser_t * parser) {
     // printf("Up state\n");
     if (parser->stateIndex > 0) {
         parser->state = parser->states[--(parser->stateIndex)];
@@ -219,14 +272,14 @@ static void upState(void) {
                 // printf("Pop name '%s'\n", parser->name[parser->stack]);
                 parser->allowComma = 1;
             } else {
-                jsonError(ERR_INTERNAL);
+                jsonError(parser, ERR_INTERNAL);
             }
         } else if (parser->state == STATE_NONE) {
             // printf( "Reset name - 2\n" );
             parser->name[parser->stack][0] = '\0';
         }
     } else {
-        jsonError(ERR_INTERNAL);
+        jsonError(parser, ERR_INTERNAL);
     }
 }
 
@@ -234,7 +287,7 @@ static void upState(void) {
 // Eat character
 // -------------------------------------------------------------
 
-static void jsonEatNoLog(char c) {
+static void jsonEatNoLog(json_parser_t * parser, char c) {
     int again = 0;
 
     // int prevstate = parser->state;
@@ -242,15 +295,15 @@ static void jsonEatNoLog(char c) {
     switch (parser->state) {
         case STATE_NONE:
             if (c == '{') {
-                if (parser->onObjectStart != NULL) parser->onObjectStart(parser->name[parser->stack]);
-                toState(STATE_INOBJECT);
-                toState(STATE_TONAME);
+                JSON_CALLBACK(onObjectStart, parser->name[parser->stack]);
+                toState(parser, STATE_INOBJECT);
+                toState(parser, STATE_TONAME);
                 parser->allowComma = 0;
             } else if (c == '"') {
-                toState(STATE_INNAME);
+                toState(parser, STATE_INNAME);
             } else if (!isWhiteSpace(c)) {
 #ifdef GENERATE_ERROR_ON_DISCARD
-                jsonError(ERR_DISCARD);
+                jsonError(parser, ERR_DISCARD);
 #endif
             }
             break;
@@ -258,61 +311,61 @@ static void jsonEatNoLog(char c) {
         case STATE_INOBJECT:
             if (c == '}') {
                 // printf( "-------> onObjectComplete( '%s' )\n", parser->name[parser->stack] );
-                if (parser->onObjectComplete != NULL) parser->onObjectComplete(parser->name[parser->stack]);
-                upState();
+                JSON_CALLBACK(onObjectComplete, parser->name[parser->stack]);
+                upState(parser);
             } else if (c == '"') {
-                toState(STATE_INNAME);
+                toState(parser, STATE_INNAME);
             } else if (c == ',' && parser->allowComma) {
                 parser->allowComma = 0;
-                toState(STATE_TONAME);
+                toState(parser, STATE_TONAME);
             } else if (!isWhiteSpace(c)) {
-                jsonError(ERR_PARSE_OBJECT);
+                jsonError(parser, ERR_PARSE_OBJECT);
             }
             break;
 
         case STATE_TONAME:
             if (c == '"') {
-                setState(STATE_INNAME);
+                setState(parser, STATE_INNAME);
             } else if (!isWhiteSpace(c)) {
-                jsonError(ERR_PARSE_NAME);
+                jsonError(parser, ERR_PARSE_NAME);
             }
             break;
 
         case STATE_INNAME:
             if (c == '"') {
-                setState(STATE_TOCOLUMN);
+                setState(parser, STATE_TOCOLUMN);
             } else if (isValidNameChar(c)) {
-                appendName(c);
+                appendName(parser, c);
             } else {
-                jsonError(ERR_PARSE_ILLNAME);
+                jsonError(parser, ERR_PARSE_ILLNAME);
             }
             break;
 
         case STATE_TOCOLUMN:
             if (c == ':') {
-                setState(STATE_TOVALUE);
+                setState(parser, STATE_TOVALUE);
             } else if (!isWhiteSpace(c)) {
-                jsonError(ERR_PARSE_ASSIGNMENT);
+                jsonError(parser, ERR_PARSE_ASSIGNMENT);
             }
             break;
 
         case STATE_TOVALUE:
             if (c == '"') {
                 parser->isSlash = 0;
-                setState(STATE_INSTRING);
+                setState(parser, STATE_INSTRING);
             } else if (isNum(c) || isSign(c)) {
-                appendValue(c);
-                setState(STATE_INNUM);
+                appendValue(parser, c);
+                setState(parser, STATE_INNUM);
             } else if (c == '[') {
-                if (parser->onArrayStart != NULL) parser->onArrayStart(parser->name[parser->stack]);
-                setState(STATE_INARRAY);
-                toState(STATE_TONAME);
+                JSON_CALLBACK(onArrayStart, parser->name[parser->stack]);
+                setState(parser, STATE_INARRAY);
+                toState(parser, STATE_TONAME);
             } else if (c == '{') {
-                if (parser->onObjectStart != NULL) parser->onObjectStart(parser->name[parser->stack]);
-                setState(STATE_INOBJECT);
-                toState(STATE_TONAME);
+                JSON_CALLBACK(onObjectStart, parser->name[parser->stack]);
+                setState(parser, STATE_INOBJECT);
+                toState(parser, STATE_TONAME);
             } else if (!isWhiteSpace(c)) {
-                jsonError(ERR_PARSE_VALUE);
+                jsonError(parser, ERR_PARSE_VALUE);
             }
             break;
 
@@ -321,27 +374,25 @@ static void jsonEatNoLog(char c) {
                 parser->isSlash = 1;
             } else if (parser->isSlash) {
                 parser->isSlash = 0;
-                appendValue('\\');
-                appendValue(c);
+                appendValue(parser, '\\');
+                appendValue(parser, c);
             } else if (c == '"') {
                 // printf( "-------> onString( '%s', '%s' )\n", parser->name[parser->stack], parser->value[parser->stack] );
-                if (parser->onString != NULL) parser->onString(parser->name[parser->stack], parser->value[parser->stack]);
-                setState(STATE_OUTVALUE);
+                JSON_CALLBACK(onString, parser->name[parser->stack], parser->value[parser->stack]);
+                setState(parser, STATE_OUTVALUE);
             } else {
-                appendValue(c);
+                appendValue(parser, c);
             }
             break;
 
         case STATE_INNUM:
             if (isNum(c)) {
-                appendValue(c);
+                appendValue(parser, c);
             } else {
                 // printf( "-------> onInteger( Name='%s', value='%s' )\n", parser->name[parser->stack], parser->value[parser->stack] );
-                if (parser->onInteger != NULL) {
-                     parser->onInteger( parser->name[parser->stack],
-                                        Atoi( parser->value[parser->stack] ) );
-                }
-                setState(STATE_OUTVALUE);
+                JSON_CALLBACK(onInteger, parser->name[parser->stack],
+                              Atoi( parser->value[parser->stack] ) );
+                setState(parser, STATE_OUTVALUE);
                 again = 1;
             }
             break;
@@ -349,25 +400,25 @@ static void jsonEatNoLog(char c) {
         case STATE_INARRAY:
             if (c == ']') {
                 // printf( "-------> onArrayComplete( '%s' )\n", parser->name[parser->stack] );
-                if (parser->onArrayComplete != NULL) parser->onArrayComplete(parser->name[parser->stack]);
-                upState();
-                // setState( STATE_OUTVALUE );
+                JSON_CALLBACK(onArrayComplete, parser->name[parser->stack]);
+                upState(parser);
+                // setState(parser,  STATE_OUTVALUE );
             } else if (c == '"') {
-                toState(STATE_INNAME);
+                toState(parser, STATE_INNAME);
             } else if (c == ',' && parser->allowComma) {
                 parser->allowComma = 0;
-                toState(STATE_TONAME);
+                toState(parser, STATE_TONAME);
             } else if (!isWhiteSpace(c)) {
-                jsonError(ERR_PARSE_ARRAY);
+                jsonError(parser, ERR_PARSE_ARRAY);
             }
             break;
 
         case STATE_OUTVALUE:
             if (!isWhiteSpace(c)) {
                 if (c == ',') {
-                    toState(STATE_TONAME);
+                    toState(parser, STATE_TONAME);
                 } else {
-                    upState();
+                    upState(parser);
                     again = 1;
                 }
             }
@@ -381,7 +432,7 @@ static void jsonEatNoLog(char c) {
     // for (i = 0; i < parser->stateIndex; i++) printf("%d ", parser->states[i]);
     // printf(", state=%d, A=%d - %d\n", parser->state, parser->allowComma, again);
 
-    if (again) jsonEatNoLog(c);
+    if (again) jsonEatNoLog(parser, c);
 }
 
 // -------------------------------------------------------------
@@ -389,9 +440,41 @@ static void jsonEatNoLog(char c) {
 // -------------------------------------------------------------
 
 /**
- * \brief Reset the JSON parser
+ * \brief Create a JSON parser context, to be used with the jsonParser functions.
+ * Each context can be used on its own thread, independent of the jsonSelect interface.
+ * \returns Parser, NULL when out of memory
  */
-void jsonReset(void) {
+json_parser_t * jsonParserCreate(void) {
+    json_parser_t * parser = calloc(1, sizeof(json_parser_t));
+    if (parser != NULL) jsonParserReset(parser);
+    return parser;
+}
+
+/**
+ * \brief Free a parser context from jsonParserCreate()
+ */
+void jsonParserDestroy(json_parser_t * parser) {
+    free(parser);
+}
+
+/**
+ * \brief Set the callbacks of a parser context. The callbacks get <user> as first argument.
+ * \param cb Callbacks (copied), members can be NULL
+ * \param user Context for the callbacks
+ */
+void jsonParserSetCallbacks(json_parser_t * parser, const json_callbacks_t * cb, void * user) {
+    if (cb != NULL) {
+        parser->cb = *cb;
+    } else {
+        memset(&parser->cb, 0, sizeof(json_callbacks_t));
+    }
+    parser->user = user;
+}
+
+/**
+ * \brief Reset a JSON parser context
+ */
+void jsonParserReset(json_parser_t * parser) {
     parser->allowComma      = 0;
     parser->isSlash         = 0;
     parser->state           = STATE_NONE;
@@ -407,7 +490,7 @@ void jsonReset(void) {
  * \brief Parse a JSON stream, one character at a time
  * \param c Character to parse
  */
-void jsonEat(char c) {
+void jsonParserEat(json_parser_t * parser, char c) {
 
     parser->numchars++;
 
@@ -417,35 +500,113 @@ void jsonEat(char c) {
         if (parser->errbufIndex >= MAXERRORBUFFER) parser->errbufIndex = 0;
     }
 
-    jsonEatNoLog(c);
+    jsonEatNoLog(parser, c);
+}
+
+/**
+ * \brief Parse a buffer of JSON stream. Same as calling jsonEat() for each character,
+ * but runs of name, string and number characters are scanned and copied at once.
+ * \param buf Characters to parse
+ * \param len Number of characters
+ */
+void jsonParserEatBuffer(json_parser_t * parser, const char * buf, int len) {
+    const char * p = buf;
+    const char * end = buf + len;
+    const char * q;
+
+    parser->inbuf = buf;
+
+    while (p < end) {
+        parser->inbufPos = p;
+
+        switch (parser->state) {
+            case STATE_INNAME:
+                for (q = p; q < end && isValidNameChar(*q); q++);
+                if (q > p) {
+                    p += appendRun(parser, parser->name[parser->stack], MAXNAME, ERR_NAMETOOLONG, p, q - p);
+                    continue;
+                }
+                break;
+
+            case STATE_INSTRING:
+                if (!parser->isSlash) {
+                    for (q = p; q < end && *q != '"' && *q != '\\'; q++);
+                    if (q > p) {
+                        p += appendRun(parser, parser->value[parser->stack], MAXVALUE, ERR_VALUETOOLONG, p, q - p);
+                        continue;
+                    }
+                }
+                break;
+
+            case STATE_INNUM:
+                for (q = p; q < end && isNum(*q); q++);
+                if (q > p) {
+                    p += appendRun(parser, parser->value[parser->stack], MAXVALUE, ERR_VALUETOOLONG, p, q - p);
+                    continue;
+                }
+                break;
+        }
+
+        jsonEatNoLog(parser, *p++);
+    }
+
+    parser->inbuf = NULL;
+    parser->numchars += len;
+
+    // Keep the error buffer up to date for following jsonEat() calls
+    for (q = (len > MAXERRORBUFFER) ? end - MAXERRORBUFFER : buf; q < end; q++) {
+        if (!isWhiteSpace(*q)) {
+            parser->errbuf[parser->errbufIndex++] = *q;
+            if (parser->errbufIndex >= MAXERRORBUFFER) parser->errbufIndex = 0;
+        }
+    }
+}
+
+// -------------------------------------------------------------
+// Global Interface (on the selected parser)
+// -------------------------------------------------------------
+
+/**
+ * \brief Reset the JSON parser
+ */
+void jsonReset(void) {
+    jsonParserReset(selected);
+}
+
+void jsonEat(char c) {
+    jsonParserEat(selected, c);
+}
+
+void jsonEatBuffer(const char * buf, int len) {
+    jsonParserEatBuffer(selected, buf, len);
 }
 
 void jsonSetOnError(OnError oe) {
-    parser->onError = oe;
+    selected->onError = oe;
 }
 
 void jsonSetOnObjectStart(OnObjectStart oos) {
-    parser->onObjectStart = oos;
+    selected->onObjectStart = oos;
 }
 
 void jsonSetOnObjectComplete(OnObjectComplete oo) {
-    parser->onObjectComplete = oo;
+    selected->onObjectComplete = oo;
 }
 
 void jsonSetOnArrayStart(OnArrayStart oas) {
-    parser->onArrayStart = oas;
+    selected->onArrayStart = oas;
 }
 
 void jsonSetOnArrayComplete(OnArrayComplete oa) {
-    parser->onArrayComplete = oa;
+    selected->onArrayComplete = oa;
 }
 
 void jsonSetOnString(OnString os) {
-    parser->onString = os;
+    selected->onString = os;
 }
 
 void jsonSetOnInteger(OnInteger oi) {
-    parser->onInteger = oi;
+    selected->onInteger = oi;
 }
 
 // -------------------------------------------------------------
@@ -455,7 +616,7 @@ void jsonSetOnInteger(OnInteger oi) {
 int jsonGetSelected( void ) {
     int i;
     for ( i=0; i<MAXPARSERS; i++ ) {
-        if ( parser == &parserData[i] ) return( i );
+        if ( selected == &parserData[i] ) return( i );
     }
     return( 0 );
 }
@@ -464,7 +625,7 @@ void jsonSelectNext( void ) {
     int p = jsonGetSelected();
     if ( p < ( MAXPARSERS - 1 ) ) {
         // printf( "JSON select %d\n", p+1 );
-        parser = &parserData[p+1];
+        selected = &parserData[p+1];
     } else {
         printf( "Error: parser overflow\n" );
     }
@@ -474,7 +635,7 @@ void jsonSelectPrev( void ) {
     int p = jsonGetSelected();
     if ( p > 0 ) {
         // printf( "JSON select %d\n", p-1 );
-        parser = &parserData[p-1];
+        selected = &parserData[p-1];
     } else {
         printf( "Error: parser underflow\n" );
     }
@@ -45,11 +45,35 @@ typedef void (*OnString)( char * name, char * value );
 typedef void (*OnInteger)( char * name, int value );
 
 // ------------------------------------------------------------------
-// User functions
+// Parser contexts (reentrant, e.g. one per thread)
+// ------------------------------------------------------------------
+
+typedef struct json_parser json_parser_t;
+
+typedef struct {
+    void (*onError)( void * user, int error, char * errtext, char * lastchars );
+    void (*onObjectStart)( void * user, char * name );
+    void (*onObjectComplete)( void * user, char * name );
+    void (*onArrayStart)( void * user, char * name );
+    void (*onArrayComplete)( void * user, char * name );
+    void (*onString)( void * user, char * name, char * value );
+    void (*onInteger)( void * user, char * name, int value );
+} json_callbacks_t;
+
+json_parser_t * jsonParserCreate( void );
+void jsonParserDestroy( json_parser_t * parser );
+void jsonParserSetCallbacks( json_parser_t * parser, const json_callbacks_t * cb, void * user );
+void jsonParserReset( json_parser_t * parser );
+void jsonParserEat( json_parser_t * parser, char c );
+void jsonParserEatBuffer( json_parser_t * parser, const char * buf, int len );
+
+// ------------------------------------------------------------------
+// User functions (on the selected global parser)
 // ------------------------------------------------------------------
 
 void jsonReset( void );
 void jsonEat( char c );
+void jsonEatBuffer( const char * buf, int len );
 void jsonSetOnError( OnError oe );
 void jsonSetOnObjectStart( OnObjectStart oos );
 void jsonSetOnObjectComplete( OnObjectComplete oo );
@@ -2,7 +2,8 @@
 // JSON Message Constructors
 // ------------------------------------------------------------------
 // Contruct valid IoT JSON messages of all types
-// Uses a global character buffer so result must be used immediately
+// Uses a per-thread character buffer so result must be used immediately
+// The jsonBuilder functions can be used to build into a caller buffer
 // ------------------------------------------------------------------
 // Author:    nlv10677
 // Copyright: NXP B.V. 2014. All rights reserved
@@ -17,10 +18,12 @@
 #include <limits.h>
 
 #include "colorConv.h"
+#include "json.h"
+#include "queue.h"
+#include "iotMsg.h"
+#include "jsonCreate.h"
 
 #define MAXJSONMESSAGE    500
-#define MAXNAME           30
-#define MAXNAMEVALUE      160   // was 80
 
 // #define JSON_DEBUG
 
@@ -31,39 +34,204 @@
 #endif /* MAIN_DEBUG */
 
 // ------------------------------------------------------------------
-// Global buffer
+// Builder
 // ------------------------------------------------------------------
 
-static char jsonMessage[MAXJSONMESSAGE+2];
+/**
+ * \brief Start building a message in a caller provided buffer
+ * \param b Builder
+ * \param buf Buffer to build in
+ * \param size Size of the buffer, including room for the terminating '\0'
+ */
+void jsonBuilderInit( jsonBuilder_t * b, char * buf, int size ) {
+    b->buf      = buf;
+    b->size     = size;
+    b->len      = 0;
+    b->overflow = 0;
+    buf[0] = '\0';
+}
+
+/**
+ * \brief Check if a fragment of <n> bytes fits. Fragments that do not fit are
+ * dropped as a whole (like the old strcat version did), later smaller ones may still fit.
+ */
+static int jsonBuilderFits( jsonBuilder_t * b, int n ) {
+    if ( ( b->len + n ) < b->size ) return( 1 );
+    printf( "Error: overflow in jsonCreate\n" );
+    b->overflow = 1;
+    return( 0 );
+}
+
+static inline void put( jsonBuilder_t * b, const char * s, int n ) {
+    memcpy( b->buf + b->len, s, n );
+    b->len += n;
+}
+
+/**
+ * \brief Format an integer, right aligned at the end of <end>
+ * \returns Pointer to the first character
+ */
+static char * formatInt( char * end, int value ) {
+    unsigned int u = ( value < 0 ) ? 0u - (unsigned int)value : (unsigned int)value;
+    do {
+        *--end = '0' + ( u % 10 );
+        u /= 10;
+    } while ( u );
+    if ( value < 0 ) *--end = '-';
+    return( end );
+}
+
+/**
+ * \brief Is s at an escape sequence that is already valid JSON?
+ * The parser (json.c) delivers string values with their escapes intact,
+ * so those are passed through and a parsed value is written back unchanged
+ */
+static int isEscaped( const char * s ) {
+    return( s[0] == '\\' && s[1] != '\0' && strchr( "\"\\/bfnrtu", s[1] ) != NULL );
+}
+
+/**
+ * \brief Length of a string value after escaping
+ */
+static int escapedLength( const char * s ) {
+    int n = 0;
+    for ( ; *s; s++ ) {
+        unsigned char c = (unsigned char)*s;
+        if ( isEscaped( s ) ) { n += 2; s++; }
+        else if ( c == '"' || c == '\\' || c == '\n' || c == '\r' || c == '\t' ) n += 2;
+        else if ( c < 0x20 ) n += 6;
+        else n++;
+    }
+    return( n );
+}
+
+static void putEscaped( jsonBuilder_t * b, const char * s ) {
+    static const char hex[] = "0123456789abcdef";
+    char * p = b->buf + b->len;
+    for ( ; *s; s++ ) {
+        unsigned char c = (unsigned char)*s;
+        if ( isEscaped( s ) ) {
+            *p++ = *s++;
+            *p++ = *s;
+            continue;
+        }
+        switch ( c ) {
+        case '"':  *p++ = '\\'; *p++ = '"';  break;
+        case '\\': *p++ = '\\'; *p++ = '\\'; break;
+        case '\n': *p++ = '\\'; *p++ = 'n';  break;
+        case '\r': *p++ = '\\'; *p++ = 'r';  break;
+        case '\t': *p++ = '\\'; *p++ = 't';  break;
+        default:
+            if ( c < 0x20 ) {
+                memcpy( p, "\\u00", 4 );
+                p[4] = hex[c >> 4];
+                p[5] = hex[c & 0xF];
+                p += 6;
+            } else {
+                *p++ = c;
+            }
+            break;
+        }
+    }
+    b->len = p - b->buf;
+}
+
+/**
+ * \brief Append raw text
+ */
+void jsonBuilderRaw( jsonBuilder_t * b, const char * text ) {
+    int n = strlen( text );
+    if ( jsonBuilderFits( b, n ) ) {
+        put( b, text, n );
+        b->buf[b->len] = '\0';
+    }
+}
+
+/**
+ * \brief Append a quoted name: "name"
+ */
+void jsonBuilderName( jsonBuilder_t * b, const char * name ) {
+    int n = strlen( name );
+    if ( jsonBuilderFits( b, n + 2 ) ) {
+        put( b, "\"", 1 );
+        put( b, name, n );
+        put( b, "\"", 1 );
+        b->buf[b->len] = '\0';
+    }
+}
+
+/**
+ * \brief Append a name with an integer value: "name":value
+ */
+void jsonBuilderInt( jsonBuilder_t * b, const char * name, int value ) {
+    char   num[12];
+    char * p = formatInt( num + sizeof( num ), value );
+    int    v = num + sizeof( num ) - p;
+    int    n = strlen( name );
+    if ( jsonBuilderFits( b, n + 3 + v ) ) {
+        put( b, "\"", 1 );
+        put( b, name, n );
+        put( b, "\":", 2 );
+        put( b, p, v );
+        b->buf[b->len] = '\0';
+    }
+}
+
+/**
+ * \brief Append a name with a string value: "name":"value"
+ * Quotes, backslashes and control characters in the value are escaped.
+ * Escape sequences already in the value are kept as they are
+ */
+void jsonBuilderString( jsonBuilder_t * b, const char * name, const char * value ) {
+    int n = strlen( name );
+    if ( jsonBuilderFits( b, n + 5 + escapedLength( value ) ) ) {
+        put( b, "\"", 1 );
+        put( b, name, n );
+        put( b, "\":\"", 3 );
+        putEscaped( b, value );
+        put( b, "\"", 1 );
+        b->buf[b->len] = '\0';
+    }
+}
 
 // ------------------------------------------------------------------
-// Constructors
+// Per-thread buffer for the constructors below
 // ------------------------------------------------------------------
 
-static void catString( char * String ) {
-    if ( ( strlen( jsonMessage ) + strlen( String ) ) < MAXJSONMESSAGE ) {
-        strcat( jsonMessage, String );
-    } else {
-        printf( "Error: overflow in jsonCreate\n" );
+static __thread char jsonMessage[MAXJSONMESSAGE+2];
+static __thread jsonBuilder_t jsonBuilder;
+
+// Binary message of the running constructor (NULL = text), set by every catStart()
+static __thread iotMsg_t * binary = NULL;
+
+/**
+ * \brief Starts a message: JSON text, or binary into <msg> when not NULL.
+ * The text result of a binary constructor is empty. Only for flat messages.
+ */
+static void catStart( iotMsg_t * msg ) {
+    jsonBuilderInit( &jsonBuilder, jsonMessage, MAXJSONMESSAGE );
+    if ( ( binary = msg ) != NULL ) {
+        iotMsgInit( binary );
     }
 }
 
+static void catString( char * String ) {
+    if ( !binary ) jsonBuilderRaw( &jsonBuilder, String );
+}
+
 static void catName( char * name ) {
-    char buf[MAXNAME+2];
-    sprintf( buf, "\"%s\"", name );
-    catString( buf );
+    if ( binary ) iotMsgSetType( binary, name );
+    else jsonBuilderName( &jsonBuilder, name );
 }
 
 static void catNameValueInt( char * name, int value ) {
-    char buf[MAXNAMEVALUE+2];
-    sprintf( buf, "\"%s\":%d", name, value );
-    catString( buf );
+    if ( binary ) iotMsgAddInt( binary, name, value );
+    else jsonBuilderInt( &jsonBuilder, name, value );
 }
 
 static void catNameValueString( char * name, char * value ) {
-    char buf[MAXNAMEVALUE+2];
-    sprintf( buf, "\"%s\":\"%s\"", name, value );
-    catString( buf );
+    if ( binary ) iotMsgAddString( binary, name, value );
+    else jsonBuilderString( &jsonBuilder, name, value );
 }
 
 // ------------------------------------------------------------------------
@@ -71,7 +239,7 @@ static void catNameValueString( char * name, char * value ) {
 // ------------------------------------------------------------------------
 
 static char * jsonCmd( char * name, int value ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "cmd" );
     catString( " : { " );
     catNameValueInt( name, value );
@@ -81,7 +249,7 @@ static char * jsonCmd( char * name, int value ) {
 }
 
 static char * jsonCmdString( char * name, char * value ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "cmd" );
     catString( " : { " );
     catNameValueString( name, value );
@@ -91,7 +259,7 @@ static char * jsonCmdString( char * name, char * value ) {
 }
 
 static char * jsonZcb( char * name, int value ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "zcb" );
     catString( " : { " );
     catNameValueInt( name, value );
@@ -101,7 +269,7 @@ static char * jsonZcb( char * name, int value ) {
 }
 
 static char * jsonZcbString( char * name, char * value ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "zcb" );
     catString( " : { " );
     catNameValueString( name, value );
@@ -159,7 +327,7 @@ char * jsonCmdErase( void ) {
 }
 
 char * jsonCmdSystem( int system, char * strval ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "cmd" );
     catString( " : { " );
     catNameValueInt( "system", system );
@@ -177,7 +345,7 @@ char * jsonCmdSystem( int system, char * strval ) {
 // ------------------------------------------------------------------------
 
 char * jsonZcbAnnounce( char * mac, char * dev, char * ty ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "zcb" );
     catString( " : { " );
     catNameValueString( "joined", mac );
@@ -200,6 +368,18 @@ char * jsonCmdGetVersion( void ) {
     return( jsonCmd( "getversion", 1 ) );
 }
 
+// ------------------------------------------------------------------------
+// Serial link statistics (logged by the ZCB)
+// ------------------------------------------------------------------------
+
+char * jsonCmdLinkStats( void ) {
+    return( jsonCmd( "linkstats", 1 ) );
+}
+
+char * jsonCmdNeighbours( void ) {
+    return( jsonCmd( "neighbours", 1 ) );
+}
+
 char * jsonZcbVersion( int major, int minor ) {
     char buf[20];
     sprintf( buf, "r%d.%d", major, minor );
@@ -259,7 +439,7 @@ char * jsonZcbRspPermitJoin( int status ) {
 }
 
 char * jsonCmdSetPermitJoin( char * target, int duration ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "cmd" );
     catString( " : { " );
     catNameValueString( "setpermit", ( target != NULL ) ? target : "1" );
@@ -275,7 +455,7 @@ char * jsonCmdSetPermitJoin( char * target, int duration ) {
 // ------------------------------------------------------------------------
 
 char * jsonCmdAuthorizeRequest( char * mac, char * linkkey ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "cmd" );
     catString( " : { " );
     catNameValueString( "authorize", mac );
@@ -288,7 +468,7 @@ char * jsonCmdAuthorizeRequest( char * mac, char * linkkey ) {
 
 char * jsonZcbAuthorizeResponse( char * mac, char * nwKey, char * mic, char * tcAddress, 
                                  int keySeq, int channel, char * pan, char * extPan  ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "zcb" );
     catString( " : { " );
     catNameValueString( "authorize", mac );
@@ -316,7 +496,7 @@ char * jsonZcbAuthorizeResponse( char * mac, char * nwKey, char * mic, char * tc
 // ------------------------------------------------------------------------
 
 char * jsonCmdAuthorizeOobRequest( char * mac, char * key ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "cmd" );
     catString( " : { " );
     catNameValueString( "authorize_oob", mac );
@@ -330,7 +510,7 @@ char * jsonCmdAuthorizeOobRequest( char * mac, char * key ) {
 char * jsonZcbAuthorizeOobResponse( char * mac, char * nwKey, char * mic, char * tcAddress,
                                     int keySeq, int channel, char * pan, char * extPan,
                                     int tcShortAddr, int deviceId) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "zcb" );
     catString( " : { " );
     catNameValueString( "authorize_oob", mac );
@@ -362,7 +542,7 @@ char * jsonZcbAuthorizeOobResponse( char * mac, char * nwKey, char * mic, char *
 // ------------------------------------------------------------------------
 
 char * jsonTls( char * label, char * val ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "tls" );
     catString( " : { " );
     catNameValueString( label, val );
@@ -373,7 +553,7 @@ char * jsonTls( char * label, char * val ) {
 
 char * jsonLinkInfo( int nw_version, int nw_type, int nw_profile,
                      char * mac, char * linkkey ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "linkinfo" );
     catString( " : { " );
     catNameValueInt( "version", nw_version );
@@ -393,7 +573,7 @@ char * jsonLinkInfo( int nw_version, int nw_type, int nw_profile,
 char * jsonJoinSecure( int channel, int keysequence, char * pan,
                        char * extendedPan, char * networkKey,
                        char * mic, char * tcAddress ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "joinsecure" );
     catString( " : { " );
 
@@ -418,7 +598,7 @@ char * jsonJoinSecure( int channel, int keysequence, char * pan,
 
 char * jsonOobCommissioningRequest( int nw_version, int nw_type, int nw_profile,
                                     char * mac, char * key ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "oobrequest" );
     catString( " : { " );
     catNameValueInt( "version", nw_version );
@@ -439,7 +619,7 @@ char * jsonOobCommissioningResponse( int channel, int keysequence, char * pan,
                                      char * extendedPan, char * key,
                                      char * mic, char * tcExtAddress,
                                      int tcShortAddress, int deviceId ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "oobresponse" );
     catString( " : { " );
 
@@ -472,7 +652,7 @@ char * jsonOobCommissioningResponse( int channel, int keysequence, char * pan,
 
 char * jsonManager( int id, char * mac, char * nm, int rm,
                     char * ty, int joined ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "manager" );
     catString( " : { " );
     if ( id >= 0 ) {
@@ -507,7 +687,7 @@ char * jsonManager( int id, char * mac, char * nm, int rm,
 
 char * jsonUI( int id, char * mac, char * nm, int rm, int man,
                int heat, int cool, int joined ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "ui" );
     catString( " : { " );
     if ( id >= 0 ) {
@@ -545,7 +725,7 @@ char * jsonUI( int id, char * mac, char * nm, int rm, int man,
 }
 
 char * jsonUiCtrl( char * mac, int heat, int cool ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "ctrl" );
     catString( " : { " );
     catNameValueString( "mac", mac );
@@ -566,10 +746,10 @@ char * jsonUiCtrl( char * mac, int heat, int cool ) {
 // Sensor
 // ------------------------------------------------------------------------
 
-char * jsonSensor( int id, char * mac, char * nm, int rm, int ui,
-                   int tmp, int hum, int prs, int co2, int bat, int batl, int als,
-                   int xloc, int yloc, int zloc, int joined ) {
-    jsonMessage[0] = '\0';
+static char * jsonSensorTo( iotMsg_t * msg, int id, char * mac, char * nm, int rm, int ui,
+                            int tmp, int hum, int prs, int co2, int bat, int batl, int als,
+                            int xloc, int yloc, int zloc, int joined ) {
+    catStart( msg );
     catName( "sensor" );
     catString( " : { " );
     if ( id >= 0 ) {
@@ -638,13 +818,28 @@ char * jsonSensor( int id, char * mac, char * nm, int rm, int ui,
     return( jsonMessage );
 }
 
+char * jsonSensor( int id, char * mac, char * nm, int rm, int ui,
+                   int tmp, int hum, int prs, int co2, int bat, int batl, int als,
+                   int xloc, int yloc, int zloc, int joined ) {
+    return( jsonSensorTo( NULL, id, mac, nm, rm, ui, tmp, hum, prs, co2, bat, batl, als,
+                          xloc, yloc, zloc, joined ) );
+}
+
+iotMsg_t * iotMsgSensor( iotMsg_t * msg, int id, char * mac, char * nm, int rm, int ui,
+                         int tmp, int hum, int prs, int co2, int bat, int batl, int als,
+                         int xloc, int yloc, int zloc, int joined ) {
+    jsonSensorTo( msg, id, mac, nm, rm, ui, tmp, hum, prs, co2, bat, batl, als,
+                  xloc, yloc, zloc, joined );
+    return( msg );
+}
+
 // ------------------------------------------------------------------------
 // Pump
 // ------------------------------------------------------------------------
 
 char * jsonPump( int id, char * mac, char * nm, int rm, int sen,
                  int sid, char * cmd, int lvl, int joined ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "pmp" );
     catString( " : { " );
     if ( id >= 0 ) {
@@ -693,7 +888,7 @@ char * jsonPump( int id, char * mac, char * nm, int rm, int sen,
 static char * jsonLampInternal( int id, char * mac, char * nm, int rm,
                  char * ty, char * cmd, int lvl,
                  int rgb, int kelvin, int xcr, int ycr, int joined ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "lmp" );
     catString( " : { " );
     if ( id >= 0 ) {
@@ -762,9 +957,9 @@ char * jsonLamp_xyY( int id, char * mac, char * nm, int rm,
 // Plug
 // ------------------------------------------------------------------------
 
-char * jsonPlug( int id, char * mac, char * nm, int rm,
-                 char * cmd, int act, int sum, int h24, int joined, int autoinsert ) {
-    jsonMessage[0] = '\0';
+static char * jsonPlugTo( iotMsg_t * msg, int id, char * mac, char * nm, int rm,
+                          char * cmd, int act, int sum, int h24, int joined, int autoinsert ) {
+    catStart( msg );
     catName( "plg" );
     catString( " : { " );
     if ( id >= 0 ) {
@@ -809,8 +1004,18 @@ char * jsonPlug( int id, char * mac, char * nm, int rm,
     return( jsonMessage );
 }
 
+char * jsonPlug( int id, char * mac, char * nm, int rm,
+                 char * cmd, int act, int sum, int h24, int joined, int autoinsert ) {
+    return( jsonPlugTo( NULL, id, mac, nm, rm, cmd, act, sum, h24, joined, autoinsert ) );
+}
+
 char * jsonPlugCmd( char * mac, char * cmd ) {
-    return( jsonPlug( -1, mac, NULL, -1, cmd, -1, -1, -1, -1, -1 ) );
+    return( jsonPlugTo( NULL, -1, mac, NULL, -1, cmd, -1, -1, -1, -1, -1 ) );
+}
+
+iotMsg_t * iotMsgPlugCmd( iotMsg_t * msg, char * mac, char * cmd ) {
+    jsonPlugTo( msg, -1, mac, NULL, -1, cmd, -1, -1, -1, -1, -1 );
+    return( msg );
 }
 
 // ------------------------------------------------------------------
@@ -818,7 +1023,7 @@ char * jsonPlugCmd( char * mac, char * cmd ) {
 // ------------------------------------------------------------------
 
 char * jsonAct( char * mac, int sid, char * cmd, int lvl ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "act" );
     catString( " : { " );
     catNameValueString( "mac", mac );
@@ -846,7 +1051,7 @@ char * jsonAct( char * mac, int sid, char * cmd, int lvl ) {
 char * jsonControl( char * mac, char * cmd, int sid,
                     int lvl, int rgb, int kelvin,
                     int heat, int cool ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "ctrl" );
     catString( " : { " );
     catNameValueString( "mac", mac );
@@ -884,10 +1089,10 @@ char * jsonControl( char * mac, char * cmd, int sid,
 // - Requires xyY color space
 // ------------------------------------------------------------------------
 
-char * jsonLampToZigbee( char * mac, char * cmd, int lvl, int rgb, int kelvin ) {
+static char * jsonLampToZigbeeTo( iotMsg_t * msg, char * mac, char * cmd, int lvl, int rgb, int kelvin ) {
     int xcr = -1, ycr = -1;
 
-    jsonMessage[0] = '\0';
+    catStart( msg );
     catName( "lmp" );
     catString( " : { " );
     catNameValueString( "mac", mac );
@@ -942,12 +1147,21 @@ char * jsonLampToZigbee( char * mac, char * cmd, int lvl, int rgb, int kelvin )
     return( jsonMessage );
 }
 
+char * jsonLampToZigbee( char * mac, char * cmd, int lvl, int rgb, int kelvin ) {
+    return( jsonLampToZigbeeTo( NULL, mac, cmd, lvl, rgb, kelvin ) );
+}
+
+iotMsg_t * iotMsgLampToZigbee( iotMsg_t * msg, char * mac, char * cmd, int lvl, int rgb, int kelvin ) {
+    jsonLampToZigbeeTo( msg, mac, cmd, lvl, rgb, kelvin );
+    return( msg );
+}
+
 // ------------------------------------------------------------------------
 // Climate Manager Status
 // ------------------------------------------------------------------------
 
 char * jsonClimateWater( char * mac, int out, int ret ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "status" );
     catString( " : { " );
     catNameValueString( "cmh", mac );
@@ -965,7 +1179,7 @@ char * jsonClimateWater( char * mac, int out, int ret ) {
 }
 
 char * jsonClimateBurner( char * mac, char * burner, int power ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "status" );
     catString( " : { " );
     catNameValueString( "cmh", mac );
@@ -983,7 +1197,7 @@ char * jsonClimateBurner( char * mac, char * burner, int power ) {
 }
 
 char * jsonClimateCooler( char * mac, char * cooler, int power ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "status" );
     catString( " : { " );
     catNameValueString( "cmc", mac );
@@ -1005,7 +1219,7 @@ char * jsonClimateCooler( char * mac, char * cooler, int power ) {
 // ------------------------------------------------------------------------
 
 char * jsonTopoClear( void ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "tp" );
     catString( " : { " );
     catNameValueString( "cmd", "clearall" );
@@ -1015,7 +1229,7 @@ char * jsonTopoClear( void ) {
 }
 
 char * jsonTopoClearTopo( void ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "tp" );
     catString( " : { " );
     catNameValueString( "cmd", "cleartopo" );
@@ -1025,7 +1239,7 @@ char * jsonTopoClearTopo( void ) {
 }
 
 char * jsonTopoEnd( void ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "tp" );
     catString( " : { " );
     catNameValueString( "cmd", "endconf" );
@@ -1035,7 +1249,7 @@ char * jsonTopoEnd( void ) {
 }
 
 char * jsonTopoGet( void ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "tp" );
     catString( " : { " );
     catNameValueString( "cmd", "getconf" );
@@ -1045,7 +1259,7 @@ char * jsonTopoGet( void ) {
 }
 
 char * jsonTopoUpload( void ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "tp" );
     catString( " : { " );
     catNameValueString( "cmd", "upload" );
@@ -1055,7 +1269,7 @@ char * jsonTopoUpload( void ) {
 }
 
 char * jsonTopoStatus( int status ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "tp" );
     catString( " : { " );
     catNameValueInt( "status", status );
@@ -1070,7 +1284,7 @@ char * jsonTopoStatus( int status ) {
 
 static char * jsonTopoAddDevice( char * device, char * mac,
                                  char * name, char * type, int sid ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "tp+" );
     catString( " : { " );
     catNameValueString( device, mac );
@@ -1116,7 +1330,7 @@ char * jsonTopoAddLamp( char * mac, char * name, char * type ) {
 }
 
 char * jsonTopoAddNone( void ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "tp+" );
     catString( " : { " );
     catNameValueString( "cmd", "none" );
@@ -1130,7 +1344,7 @@ char * jsonTopoAddNone( void ) {
 // ------------------------------------------------------------------------
 
 char * jsonTopoResponse( int errcode ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "tprsp" );
     catString( " : { " );
     catNameValueInt( "errcode", errcode );
@@ -1144,7 +1358,7 @@ char * jsonTopoResponse( int errcode ) {
 // ------------------------------------------------------------------------
 
 char * jsonTunnelOpen( char * mac ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "tunnel" );
     catString( " : { " );
     catNameValueString( "open", mac );
@@ -1154,7 +1368,7 @@ char * jsonTunnelOpen( char * mac ) {
 }
 
 char * jsonTunnelClose( void ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "tunnel" );
     catString( " : { " );
     catNameValueInt( "close", 0 );
@@ -1168,7 +1382,7 @@ char * jsonTunnelClose( void ) {
 // ------------------------------------------------------------------------
 
 char * jsonError( int error ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catNameValueInt( "error", error );
     catString( "\n" );
     DEBUG_PRINTF( "JSON message length = %d\n", (int)strlen( jsonMessage ) );
@@ -1180,7 +1394,7 @@ char * jsonError( int error ) {
 // ------------------------------------------------------------------------
 
 char * jsonDbGet( char * mac ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "dbget" );
     catString( " : { " );
     catNameValueString( "mac", mac );
@@ -1190,7 +1404,7 @@ char * jsonDbGet( char * mac ) {
 }
 
 char * jsonDbGetRoom( int room, int ts ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "dbget" );
     catString( " : { " );
     catNameValueInt( "room", room );
@@ -1204,7 +1418,7 @@ char * jsonDbGetRoom( int room, int ts ) {
 }
 
 char * jsonDbGetBegin( int ts ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "dbget" );
     catString( " : { " );
     catNameValueInt( "begin", ts );
@@ -1214,7 +1428,7 @@ char * jsonDbGetBegin( int ts ) {
 }
 
 char * jsonDbGetEnd( int count ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "dbget" );
     catString( " : { " );
     catNameValueInt( "end", count );
@@ -1228,7 +1442,7 @@ char * jsonDbGetEnd( int count ) {
 // ------------------------------------------------------------------------
 
 char * jsonDbEditAdd( char * mac, int dev, char * ty ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "dbedit" );
     catString( " : { " );
     catNameValueString( "add", mac );
@@ -1244,7 +1458,7 @@ char * jsonDbEditAdd( char * mac, int dev, char * ty ) {
 }
 
 char * jsonDbEditRem( char * mac ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "dbedit" );
     catString( " : { " );
     catNameValueString( "rem", mac );
@@ -1254,7 +1468,7 @@ char * jsonDbEditRem( char * mac ) {
 }
 
 char * jsonDbEditClr( char * clr ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "dbedit" );
     catString( " : { " );
     catNameValueString( "clr", clr );
@@ -1267,9 +1481,9 @@ char * jsonDbEditClr( char * clr ) {
 // Group support
 // ------------------------------------------------------------------------
 
-char * jsonLampGroup( char * mac, char * grp, int grpid,
-                                  char * scn, int scnid ) {
-    jsonMessage[0] = '\0';
+static char * jsonLampGroupTo( iotMsg_t * msg, char * mac, char * grp, int grpid,
+                               char * scn, int scnid ) {
+    catStart( msg );
     catName( "lmp" );
     catString( " : { " );
     catNameValueString( "mac", mac );
@@ -1294,8 +1508,19 @@ char * jsonLampGroup( char * mac, char * grp, int grpid,
     return( jsonMessage );
 }
 
-char * jsonGroup( int grpid, char * scn, int scnid, char * cmd,
-                  int lvl, int rgb, int kelvin, int xcr, int ycr ) {
+char * jsonLampGroup( char * mac, char * grp, int grpid,
+                                  char * scn, int scnid ) {
+    return( jsonLampGroupTo( NULL, mac, grp, grpid, scn, scnid ) );
+}
+
+iotMsg_t * iotMsgLampGroup( iotMsg_t * msg, char * mac, char * grp, int grpid,
+                            char * scn, int scnid ) {
+    jsonLampGroupTo( msg, mac, grp, grpid, scn, scnid );
+    return( msg );
+}
+
+static char * jsonGroupTo( iotMsg_t * msg, int grpid, char * scn, int scnid, char * cmd,
+                           int lvl, int rgb, int kelvin, int xcr, int ycr ) {
 
     if ( rgb >= 0 ) {
         // If RGB is specified, then we convert that to the xy color space
@@ -1318,7 +1543,7 @@ char * jsonGroup( int grpid, char * scn, int scnid, char * cmd,
         }
     }
 
-    jsonMessage[0] = '\0';
+    catStart( msg );
     catName( "grp" );
     catString( " : { " );
     catNameValueInt( "grpid", grpid );
@@ -1351,12 +1576,23 @@ char * jsonGroup( int grpid, char * scn, int scnid, char * cmd,
     return( jsonMessage );
 }
 
+char * jsonGroup( int grpid, char * scn, int scnid, char * cmd,
+                  int lvl, int rgb, int kelvin, int xcr, int ycr ) {
+    return( jsonGroupTo( NULL, grpid, scn, scnid, cmd, lvl, rgb, kelvin, xcr, ycr ) );
+}
+
+iotMsg_t * iotMsgGroup( iotMsg_t * msg, int grpid, char * scn, int scnid, char * cmd,
+                        int lvl, int rgb, int kelvin, int xcr, int ycr ) {
+    jsonGroupTo( msg, grpid, scn, scnid, cmd, lvl, rgb, kelvin, xcr, ycr );
+    return( msg );
+}
+
 // ------------------------------------------------------------------------
 // Gateway properties
 // ------------------------------------------------------------------------
 
 char * jsonGwProperties( char * name, int ifversion ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "gateway" );
     catString( " : { " );
     catNameValueString( "name", name );
@@ -1372,7 +1608,7 @@ char * jsonGwProperties( char * name, int ifversion ) {
 // ------------------------------------------------------------------
 
 char * jsonProcStart( char * proc ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "proc" );
     catString( " : { " );
     catNameValueString( "start", proc );
@@ -1382,7 +1618,7 @@ char * jsonProcStart( char * proc ) {
 }
 
 char * jsonProcStop( char * proc ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "proc" );
     catString( " : { " );
     catNameValueString( "stop", proc );
@@ -1392,7 +1628,7 @@ char * jsonProcStop( char * proc ) {
 }
 
 char * jsonProcRestart( char * proc ) {
-    jsonMessage[0] = '\0';
+    catStart( NULL );
     catName( "proc" );
     catString( " : { " );
     catNameValueString( "restart", proc );
@@ -16,6 +16,40 @@
 #define CMD_SYSTEM_REBOOT           7
 #define CMD_SYSTEM_NETWORK_RESTART  8
 
+// ------------------------------------------------------------------
+// Builder (for messages in a caller provided buffer)
+// ------------------------------------------------------------------
+
+typedef struct jsonBuilder {
+    char * buf;
+    int    size;       // Including the terminating '\0'
+    int    len;
+    int    overflow;   // Set when a fragment had to be dropped
+} jsonBuilder_t;
+
+void jsonBuilderInit( jsonBuilder_t * b, char * buf, int size );
+void jsonBuilderRaw( jsonBuilder_t * b, const char * text );
+void jsonBuilderName( jsonBuilder_t * b, const char * name );
+void jsonBuilderInt( jsonBuilder_t * b, const char * name, int value );
+void jsonBuilderString( jsonBuilder_t * b, const char * name, const char * value );
+
+// ------------------------------------------------------------------
+// Binary (see iotMsg.h): the same messages encoded into <msg> instead
+// of JSON text, for the queues between the daemons. Return <msg>
+// ------------------------------------------------------------------
+
+struct iotMsg;
+struct iotMsg * iotMsgSensor( struct iotMsg * msg, int id, char * mac, char * nm, int rm, int ui,
+           int tmp, int hum, int prs, int co2, int bat, int batl, int als,
+           int xloc, int yloc, int zloc, int joined );
+struct iotMsg * iotMsgPlugCmd( struct iotMsg * msg, char * mac, char * cmd );
+struct iotMsg * iotMsgLampToZigbee( struct iotMsg * msg, char * mac, char * cmd,
+           int lvl, int rgb, int kelvin );
+struct iotMsg * iotMsgLampGroup( struct iotMsg * msg, char * mac, char * grp, int grpid,
+           char * scn, int scnid );
+struct iotMsg * iotMsgGroup( struct iotMsg * msg, int grpid, char * scn, int scnid,
+           char * cmd, int lvl, int rgb, int kelvin, int xcr, int ycr );
+
 // ------------------------------------------------------------------
 // Status
 // ------------------------------------------------------------------
@@ -54,6 +88,13 @@ char * jsonZcbAnnounce( char * mac, char * dev, char * ty );
 char * jsonCmdGetVersion( void );
 char * jsonZcbVersion( int major, int minor );
 
+// ------------------------------------------------------------------
+// Serial link statistics
+// ------------------------------------------------------------------
+
+char * jsonCmdLinkStats( void );
+char * jsonCmdNeighbours( void );
+
 // ------------------------------------------------------------------
 // NFC mode
 // ------------------------------------------------------------------
@@ -461,10 +461,11 @@ static int newDbRestore( void ) {
                     memcpy( newDbSharedMemory, dbCopy, len );
                     ret = 1;
                 } else {
-                    sprintf( logbuffer, "Incompatible database version: %d != %d", pnewdb->version, NEWDB_VERSION );
-                    printf( "%s\n", logbuffer );
-                    newLogAdd( NEWLOG_FROM_DATABASE, logbuffer );
-                    LL_LOG( "/tmp/dbby", logbuffer );
+                    char text[MAX_LOG_BUFFER];
+                    snprintf( text, sizeof( text ), "Incompatible database version: %d != %d", pnewdb->version, NEWDB_VERSION );
+                    printf( "%s\n", text );
+                    newLogAddFmt( NEWLOG_FROM_DATABASE, NEWLOG_FMT_DB_VERSION, pnewdb->version, NEWDB_VERSION );
+                    LL_LOG( "/tmp/dbby", text );
                 }
             }
 
@@ -881,6 +882,44 @@ int newDbSetDevice( newdb_dev_t * pdev ) {
     return 0;
 }
 
+/**
+ * \brief Loop through the device table and call call-back with each used row, all in
+ * one semaphore section. The call-back may alter the row in place and then returns 1,
+ * so that changes to many devices cost one database access.
+ * \param deviceCb Call-back function
+ * \returns Number of rows changed
+ */
+int newDbUpdateDevices( deviceCb_t deviceCb ) {
+    int changed = 0;
+    if ( newDbSharedMemory && deviceCb ) {
+        int now = (int)time( NULL );
+        newdb_t * pnewdb = (newdb_t *)newDbSharedMemory;
+        int i;
+        
+        semP( NEWDB_SEMKEY );
+        for ( i=0; i<NEWDB_MAX_DEVICES; i++ ) {
+            if ( pnewdb->devices[i].mac[0] != '\0' && deviceCb( &pnewdb->devices[i] ) ) {
+                pnewdb->devices[i].lastupdate = now;
+                changed++;
+            }
+        }
+        if ( changed ) {
+            pnewdb->numwrites++;
+            pnewdb->lastupdate_devices = now;
+        }
+        semV( NEWDB_SEMKEY );
+        
+        if ( changed ) {
+            DEBUG_PRINTF( "Updated %d devices\n", changed );
+            newLogAdd( NEWLOG_FROM_DATABASE, "Updated device table" );
+        }
+    } else {
+        printf( "Error updating devices\n" );
+        newLogAdd( NEWLOG_FROM_DATABASE, "Error updating devices" );
+    }
+    return( changed );
+}
+
 /**
  * \brief Gets the mac of a device row with key <id>
  * \param id Key of the table row
@@ -152,6 +152,7 @@ int newDbGetDevice( char * mac, newdb_dev_t * pdev );
 int newDbGetNewDevice( char * mac, newdb_dev_t * pdev );
 int newDbGetDeviceId( int id, newdb_dev_t * pdev );
 int newDbSetDevice( newdb_dev_t * pdev );
+int newDbUpdateDevices( deviceCb_t deviceCb );
 char * newDbDeviceGetMac( int id, char * mac );
 int newDbDeleteDevice( char * mac );
 int newDbEmptyDevices( int mode );
@@ -13,21 +13,27 @@
 #include <sys/ipc.h>
 #include <sys/sem.h>
 #include <sys/shm.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 // #include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
-// #include <fcntl.h>
+#include <fcntl.h>
 #include <time.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "dump.h"
 #include "iotSemaphore.h"
 // #include "fileCreate.h"
 #include "newLog.h"
 
-#define NEWLOG_SHMKEY   99613
+#define NEWLOG_SHMKEY   99615     // Bumped on each layout change (99613, 99614)
 #define NEWLOG_SEMKEY   99621
 
 // #define LOG_DEBUG
@@ -43,16 +49,30 @@
 
 #define NEWLOG_MAX_LOGS        120
 
+#define SPOOL_BUFFER_SIZE      8192
+#define SPOOL_FLUSH_MSEC       1000
+
+// Slot stamps: odd while a writer fills the slot, even when complete
+#define STAMP_BUSY( pos )     ( (uint32_t)( (pos) * 2 + 1 ) )
+#define STAMP_DONE( pos )     ( (uint32_t)( (pos) * 2 + 2 ) )
+
+typedef struct newlogslot {
+    volatile uint32_t seq;
+    int fmt;                // NEWLOG_FMT_TEXT, or format of the packed arguments in l.text
+    onelog_t l;
+} newlogslot_t;
 
 typedef struct newlog {
 
-    int cnt;
-    int index;
+    uint64_t wr;            // Write cursor: number of slots ever claimed
+    uint64_t base;          // Write cursor at the last newLogEmpty()
     int lastupdate;
     
-    int reserve[7];
+    volatile uint32_t waiters;    // Number of blocked newLogFollow() callers
+    volatile uint32_t wakeseq;    // Futex word, bumped when there are waiters
+    int reserve[5];
 
-    onelog_t log[NEWLOG_MAX_LOGS];
+    newlogslot_t log[NEWLOG_MAX_LOGS];
     
 } newlog_t;
 
@@ -72,9 +92,31 @@ char * logNames[11] = { "none",
     "Gw Discovery",       // 9
     "Test" };             // 10
 
-static char * newLogSharedMemory = NULL;
+static const char * newLogFormats[NEWLOG_FMT_CNT] = { "%s",
+    "Announce %s",
+    "Actuator %s",
+    "Actuator %s %s",
+    "Actuator %s %d",
+    "UI %s: heat %d",
+    "UI %s: cool %d",
+    "Sensor %s: tmp %d",
+    "Sensor %s: hum %d",
+    "Sensor %s: als %d",
+    "Sensor %s: bat %d",
+    "Sensor %s: batl %d",
+    "Sensor %s type=%s data=%d",
+    "Plug %d/%d",
+    "Command: %s",
+    "Set channel mask to %s",
+    "Response - %s",
+    "Socket - %s",
+    "Socket write failed(%s)",
+    "Error opening Control Interface socket %s/%s",
+    "Ctrl error: %s",
+    "Sensor error: %s",
+    "Incompatible database version: %d != %d" };
 
-char logbuffer[MAX_LOG_BUFFER];
+static char * newLogSharedMemory = NULL;
 
 // ------------------------------------------------------------------
 // Open / Close
@@ -132,17 +174,8 @@ static int newLogOpen( void ) {
                 // Wipe memory
                 memset( newLogSharedMemory, 0, sizeof( newlog_t ) );
                 
-                // Newly created:  init structure
-                newlog_t * pnewlog = (newlog_t *)newLogSharedMemory;
-                    
-                pnewlog->index = 0;
-                
-                int i;
-                
-                for ( i=0; i<NEWLOG_MAX_LOGS; i++ ) {
-                    pnewlog->log[i].from    = 0;
-                    pnewlog->log[i].text[0] = '\0';
-                }
+                // Newly created: all cursors and stamps are zero, which
+                // means empty and no slot valid
                 
                 DEBUG_PRINTF( "Initialized new SHM for DB\n" );
             }
@@ -170,7 +203,30 @@ static int newLogOpen( void ) {
 // -------------------------------------------------------------
 
 /**
- * \brief Adds a log line to the log module
+ * \brief Atomically reads a cursor from the shared memory
+ */
+static uint64_t newLogCursor( uint64_t * cursor ) {
+    return __sync_fetch_and_add( cursor, 0 );
+}
+
+/**
+ * \brief Wakes blocked followers (in any process). Costs nothing when nobody follows.
+ */
+static void newLogWake( newlog_t * pnewlog ) {
+    // Orders the slot stamp before the load of waiters, pairs with the
+    // increment of waiters before the follower checks the slot
+    __sync_synchronize();
+    if ( pnewlog->waiters ) {
+        __sync_fetch_and_add( &pnewlog->wakeseq, 1 );
+        syscall( SYS_futex, &pnewlog->wakeseq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0 );
+    }
+}
+
+/**
+ * \brief Adds a log line to the log module.
+ * Lock-free: slots are claimed with one atomic add on the write cursor and
+ * stamped so that readers can detect slots that are torn or overwritten.
+ * Texts longer than NEWLOG_MAX_TEXT take consecutive slots.
  * \param from Where the log comes from
  * \param text Log-text
  * \returns 1 when ok, 0 on error
@@ -180,25 +236,97 @@ int newLogAdd( newLogFrom from, char * text ) {
         newlog_t * pnewlog = (newlog_t *)newLogSharedMemory;
         int now = (int)time( NULL );      
         int len = strlen( text );
+        int num = ( len + NEWLOG_MAX_TEXT - 1 ) / NEWLOG_MAX_TEXT;
         
-        semP( NEWLOG_SEMKEY );
+        uint64_t pos = __sync_fetch_and_add( &pnewlog->wr, (uint64_t)num );
         
         while ( len > 0 ) {
-            pnewlog->log[pnewlog->index].from = from;
-            pnewlog->log[pnewlog->index].ts = now;
+            newlogslot_t * slot = &pnewlog->log[pos % NEWLOG_MAX_LOGS];
+            int n = ( len < NEWLOG_MAX_TEXT ) ? len : NEWLOG_MAX_TEXT;
+            
+            slot->seq = STAMP_BUSY( pos );
+            __sync_synchronize();
             
-            strncpy( pnewlog->log[pnewlog->index].text, text, NEWLOG_MAX_TEXT );
-            pnewlog->log[pnewlog->index].text[NEWLOG_MAX_TEXT] = '\0';
+            slot->fmt    = NEWLOG_FMT_TEXT;
+            slot->l.from = from;
+            slot->l.ts   = now;
+            memcpy( slot->l.text, text, n );
+            slot->l.text[n] = '\0';
             
-            text += NEWLOG_MAX_TEXT;
-            len -= NEWLOG_MAX_TEXT;
+            __sync_synchronize();
+            slot->seq = STAMP_DONE( pos );
             
-            if ( ++pnewlog->index >= NEWLOG_MAX_LOGS ) pnewlog->index = 0;
-            pnewlog->cnt++;
+            text += n;
+            len  -= n;
+            pos++;
         }            
         
         pnewlog->lastupdate = now;
-        semV( NEWLOG_SEMKEY );
+        newLogWake( pnewlog );
+        
+        return 1;
+    } else {
+        printf( "Error adding log\n" );
+    }
+    return 0;
+}
+
+
+/**
+ * \brief Adds a structured log record: only the format id and the raw arguments
+ * are stored, formatting is deferred to the readers (see newLogLoop).
+ * Integer conversions take an int, %s takes a string that is copied into the record.
+ * Arguments that do not fit in one record are truncated.
+ * \param from Where the log comes from
+ * \param fmt Static format id
+ * \returns 1 when ok, 0 on error
+ */
+int newLogAddFmt( newLogFrom from, newLogFmt fmt, ... ) {
+    if ( fmt <= NEWLOG_FMT_TEXT || fmt >= NEWLOG_FMT_CNT ) return 0;
+    if ( newLogSharedMemory || newLogOpen() ) {
+        newlog_t * pnewlog = (newlog_t *)newLogSharedMemory;
+        int now = (int)time( NULL );
+        const char * f = newLogFormats[fmt];
+        va_list ap;
+        
+        uint64_t pos = __sync_fetch_and_add( &pnewlog->wr, 1 );
+        newlogslot_t * slot = &pnewlog->log[pos % NEWLOG_MAX_LOGS];
+        
+        slot->seq = STAMP_BUSY( pos );
+        __sync_synchronize();
+        
+        slot->fmt    = fmt;
+        slot->l.from = from;
+        slot->l.ts   = now;
+        
+        // Pack: ints as raw words, strings as zero-terminated bytes
+        char * p = slot->l.text, * end = slot->l.text + NEWLOG_MAX_TEXT;
+        va_start( ap, fmt );
+        while ( ( f = strchr( f, '%' ) ) != NULL ) {
+            f += strcspn( f + 1, "diuxXcs%" ) + 1;
+            if ( *f == 's' ) {
+                char * str = va_arg( ap, char * );
+                int n = strlen( str );
+                if ( n > end - p - 1 ) n = end - p - 1;
+                memcpy( p, str, n );
+                p += n;
+                *p++ = '\0';
+            } else if ( *f != '%' && *f != '\0' ) {
+                int val = va_arg( ap, int );
+                if ( end - p < sizeof( int ) ) break;
+                memcpy( p, &val, sizeof( int ) );
+                p += sizeof( int );
+            }
+            if ( *f ) f++;
+            if ( p >= end ) break;
+        }
+        va_end( ap );
+        
+        __sync_synchronize();
+        slot->seq = STAMP_DONE( pos );
+        
+        pnewlog->lastupdate = now;
+        newLogWake( pnewlog );
         
         return 1;
     } else {
@@ -216,11 +344,15 @@ int newLogEmpty( void ) {
     if ( newLogSharedMemory || newLogOpen() ) {
         newlog_t * pnewlog = (newlog_t *)newLogSharedMemory;
         int now = (int)time( NULL );
-        semP( NEWLOG_SEMKEY );
-        pnewlog->cnt        = 0;
-        pnewlog->index      = 0;
+        uint64_t wr = newLogCursor( &pnewlog->wr );
+        uint64_t base = newLogCursor( &pnewlog->base );
+        // Only move base forward, a concurrent empty may have passed us
+        while ( base < wr ) {
+            uint64_t prev = __sync_val_compare_and_swap( &pnewlog->base, base, wr );
+            if ( prev == base ) break;
+            base = prev;
+        }
         pnewlog->lastupdate = now;
-        semV( NEWLOG_SEMKEY );
         return 1;
     }
     return 0;
@@ -234,9 +366,8 @@ int newLogGetIndex( void ) {
     int index = -1;
     if ( newLogSharedMemory || newLogOpen() ) {
         newlog_t * pnewlog = (newlog_t *)newLogSharedMemory;
-        semP( NEWLOG_SEMKEY );
-        if ( pnewlog->cnt > 0 ) index = pnewlog->index;
-        semV( NEWLOG_SEMKEY );
+        uint64_t wr = newLogCursor( &pnewlog->wr );
+        if ( wr > newLogCursor( &pnewlog->base ) ) index = (int)( wr % NEWLOG_MAX_LOGS );
     }
     return index;
 }
@@ -245,65 +376,394 @@ int newLogGetIndex( void ) {
 // Loopers
 // ------------------------------------------------------------------
 
+/**
+ * \brief Renders a structured record into text, following its static format
+ * \param fmt Format id
+ * \param packed Packed arguments, as stored by newLogAddFmt
+ * \param text Output, NEWLOG_MAX_TEXT+1 bytes
+ */
+static void newLogFormat( int fmt, const char * packed, char * text ) {
+    const char * f = newLogFormats[fmt];
+    const char * p = packed, * pend = packed + NEWLOG_MAX_TEXT;
+    char spec[16];
+    int len = 0;
+    
+    while ( *f && len < NEWLOG_MAX_TEXT ) {
+        if ( *f != '%' ) {
+            text[len++] = *f++;
+            continue;
+        }
+        int n = strcspn( f + 1, "diuxXcs%" ) + 2;
+        if ( n >= sizeof( spec ) || f[n-1] == '\0' ) break;
+        memcpy( spec, f, n );
+        spec[n] = '\0';
+        f += n;
+        
+        int room = NEWLOG_MAX_TEXT + 1 - len;
+        if ( spec[n-1] == '%' ) {
+            n = snprintf( text + len, room, "%%" );
+        } else if ( spec[n-1] == 's' ) {
+            if ( p < pend ) {
+                n = snprintf( text + len, room, spec, p );
+                p += strnlen( p, pend - p ) + 1;
+            } else {
+                n = snprintf( text + len, room, spec, "" );
+            }
+        } else {
+            int val = 0;
+            if ( pend - p >= sizeof( int ) ) memcpy( &val, p, sizeof( int ) );
+            p += sizeof( int );
+            n = snprintf( text + len, room, spec, val );
+        }
+        len += ( n < room ) ? n : room - 1;
+    }
+    text[len] = '\0';
+}
+
+/**
+ * \brief Copies the log at cursor <pos> out of the ring
+ * \returns 1 when the copy is consistent, 0 when the slot was torn, overwritten or not yet complete
+ */
+static int newLogRead( newlog_t * pnewlog, uint64_t pos, onelog_t * l ) {
+    newlogslot_t * slot = &pnewlog->log[pos % NEWLOG_MAX_LOGS];
+    uint32_t seq = slot->seq;
+    if ( seq != STAMP_DONE( pos ) ) return 0;
+    __sync_synchronize();
+    int fmt = slot->fmt;
+    memcpy( l, &slot->l, sizeof( onelog_t ) );
+    __sync_synchronize();
+    if ( slot->seq != seq ) return 0;
+    
+    if ( fmt > NEWLOG_FMT_TEXT && fmt < NEWLOG_FMT_CNT ) {
+        char packed[NEWLOG_MAX_TEXT];
+        memcpy( packed, l->text, NEWLOG_MAX_TEXT );
+        newLogFormat( fmt, packed, l->text );
+    }
+    l->text[NEWLOG_MAX_TEXT] = '\0';
+    return 1;
+}
+
 /**
  * \brief Loops the current Log module from <fromindex> to current index, or all when <fromindex> < 0. 
- * Note that the call-back may not alter the logs as it peeks right into the shared memory
+ * The call-back gets a private copy of each log, with structured records already
+ * formatted; slots that are being written or got overwritten during the loop are skipped.
  * \param cb Call-back function
  * \returns Last index on success, -1 on error
  */
 int newLogLoop( int from, int startIndex, newlogCb_t cb ) {
     if ( cb && ( newLogSharedMemory || newLogOpen() ) ) {
         newlog_t * pnewlog = (newlog_t *)newLogSharedMemory;
-        int i, cnt;
+        uint64_t wr   = newLogCursor( &pnewlog->wr );
+        uint64_t base = newLogCursor( &pnewlog->base );
+        uint64_t cnt, pos;
+        onelog_t l;
         
-        semP( NEWLOG_SEMKEY );
         if ( startIndex < 0 ) {
             // Loop all
-            cnt = pnewlog->cnt % NEWLOG_MAX_LOGS;
+            cnt = wr - base;
         } else {
             // Loop since
-            cnt = pnewlog->index - startIndex;
-            if ( cnt < 0 ) cnt += NEWLOG_MAX_LOGS;
+            int diff = (int)( wr % NEWLOG_MAX_LOGS ) - startIndex;
+            if ( diff < 0 ) diff += NEWLOG_MAX_LOGS;
+            cnt = diff;
         }
-        int ok = 1, start = pnewlog->index - cnt;
-        if ( start < 0 ) start += NEWLOG_MAX_LOGS;
-        for ( i=0; i<cnt && ok; i++ ) {
-            if ( from == NEWLOG_FROM_NONE || pnewlog->log[start].from == from ) {
-                ok = cb( start, &pnewlog->log[start] );
+        if ( cnt > NEWLOG_MAX_LOGS ) cnt = NEWLOG_MAX_LOGS;
+        if ( cnt > wr - base ) cnt = wr - base;
+        
+        int ok = 1;
+        for ( pos = wr - cnt; pos < wr && ok; pos++ ) {
+            if ( newLogRead( pnewlog, pos, &l ) &&
+                 ( from == NEWLOG_FROM_NONE || l.from == from ) ) {
+                ok = cb( (int)( pos % NEWLOG_MAX_LOGS ), &l );
             }
-            if ( ++start >= NEWLOG_MAX_LOGS ) start = 0;
         }
-        semV( NEWLOG_SEMKEY );
     
-        return( start );
+        return( (int)( pos % NEWLOG_MAX_LOGS ) );
+    }
+    return -1;
+}
+
+
+// ------------------------------------------------------------------
+// Follow
+// ------------------------------------------------------------------
+
+/**
+ * \brief Gets the write cursor, to start following the Log module from now on
+ * \returns Cursor, 0 on error
+ */
+uint64_t newLogFollowStart( void ) {
+    if ( newLogSharedMemory || newLogOpen() ) {
+        return newLogCursor( &((newlog_t *)newLogSharedMemory)->wr );
+    }
+    return 0;
+}
+
+/**
+ * \brief Compares the stamp of the slot for <pos> with a complete <pos>
+ * \returns < 0 when <pos> is claimed but not yet complete (the slot may still hold an
+ * older log), 0 when complete, > 0 when the slot was overwritten by a newer log
+ */
+static int32_t newLogFollowAge( newlog_t * pnewlog, uint64_t pos ) {
+    return (int32_t)( pnewlog->log[pos % NEWLOG_MAX_LOGS].seq - STAMP_DONE( pos ) );
+}
+
+/**
+ * \brief Checks if there is something to deliver at <pos>: a complete slot, or one that got lost
+ */
+static int newLogFollowReady( newlog_t * pnewlog, uint64_t pos ) {
+    uint64_t wr = newLogCursor( &pnewlog->wr );
+    if ( pos >= wr ) return 0;
+    if ( pos + NEWLOG_MAX_LOGS < wr ) return 1;
+    return ( newLogFollowAge( pnewlog, pos ) >= 0 );
+}
+
+/**
+ * \brief Follows the Log module: blocks until there are logs after <cursor> or until
+ * <msec> passed, then calls <cb> for each new log and advances the cursor.
+ * Logs that were overwritten before they could be read are skipped.
+ * \param from Only deliver logs from this source, NEWLOG_FROM_NONE for all
+ * \param cursor Read cursor (in/out), from newLogFollowStart(), or 0 for the oldest log
+ * \param msec Maximum time to block, 0 to poll
+ * \param cb Call-back function
+ * \returns Number of logs delivered, -1 on error
+ */
+int newLogFollow( int from, uint64_t * cursor, int msec, newlogCb_t cb ) {
+    if ( cursor && cb && ( newLogSharedMemory || newLogOpen() ) ) {
+        newlog_t * pnewlog = (newlog_t *)newLogSharedMemory;
+        
+        if ( msec > 0 && !newLogFollowReady( pnewlog, *cursor ) ) {
+            struct timespec deadline, now, ts;
+            clock_gettime( CLOCK_MONOTONIC, &deadline );
+            deadline.tv_sec  += msec / 1000;
+            deadline.tv_nsec += ( msec % 1000 ) * 1000000;
+            if ( deadline.tv_nsec >= 1000000000 ) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            
+            __sync_fetch_and_add( &pnewlog->waiters, 1 );
+            for ( ;; ) {
+                uint32_t seq = pnewlog->wakeseq;
+                if ( newLogFollowReady( pnewlog, *cursor ) ) break;
+                
+                clock_gettime( CLOCK_MONOTONIC, &now );
+                ts.tv_sec  = deadline.tv_sec  - now.tv_sec;
+                ts.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+                if ( ts.tv_nsec < 0 ) {
+                    ts.tv_sec--;
+                    ts.tv_nsec += 1000000000;
+                }
+                if ( ts.tv_sec < 0 ) break;
+                
+                syscall( SYS_futex, &pnewlog->wakeseq, FUTEX_WAIT, seq, &ts, NULL, 0 );
+            }
+            __sync_fetch_and_sub( &pnewlog->waiters, 1 );
+        }
+        
+        uint64_t wr   = newLogCursor( &pnewlog->wr );
+        uint64_t base = newLogCursor( &pnewlog->base );
+        uint64_t pos  = *cursor;
+        int cnt = 0, ok = 1;
+        onelog_t l;
+        
+        if ( pos < base ) pos = base;
+        if ( pos + NEWLOG_MAX_LOGS < wr ) pos = wr - NEWLOG_MAX_LOGS;
+        
+        for ( ; pos < wr && ok; pos++ ) {
+            // Claimed but not yet complete: continue here next time
+            if ( newLogFollowAge( pnewlog, pos ) < 0 ) break;
+            // Overwritten, before or while reading
+            if ( !newLogRead( pnewlog, pos, &l ) ) continue;
+            if ( from == NEWLOG_FROM_NONE || l.from == from ) {
+                ok = cb( (int)( pos % NEWLOG_MAX_LOGS ), &l );
+                cnt++;
+            }
+        }
+        
+        *cursor = pos;
+        return( cnt );
     }
     return -1;
 }
 
+// ------------------------------------------------------------------
+// Spooler
+// ------------------------------------------------------------------
+
+static char spoolFilename[256];
+static int  spoolMaxSize  = 0;
+static int  spoolMaxFiles = 0;
+static volatile int spoolRunning = 0;
+static pthread_t spoolThread;
+static int  spoolFd   = -1;
+static long spoolSize = 0;
+static int  spoolLen  = 0;
+static char * spoolBuffer = NULL;
+
+// Guards starting and stopping the spooler, and the file of filelog()
+static pthread_mutex_t spoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE * filelogFile = NULL;
+static char   filelogName[256];
+
+// Note: the spooler buffers on a plain fd and not in stdio, so that forked
+// children that exit() do not flush a copy of its pending lines
+
+static void spoolFlush( void ) {
+    int done = 0;
+    while ( spoolFd >= 0 && done < spoolLen ) {
+        int n = write( spoolFd, spoolBuffer + done, spoolLen - done );
+        if ( n < 0 ) {
+            if ( errno == EINTR ) continue;
+            break;
+        }
+        done += n;
+    }
+    spoolLen = 0;
+}
+
+/**
+ * \brief Opens the spool file, after rotating it when it is full
+ * \returns 1 on success, 0 on error
+ */
+static int spoolOpen( void ) {
+    if ( spoolFd >= 0 && spoolSize < spoolMaxSize ) return 1;
+    
+    if ( spoolFd >= 0 ) {
+        char from[300], to[300];
+        int i;
+        spoolFlush();
+        close( spoolFd );
+        for ( i=spoolMaxFiles-1; i>0; i-- ) {
+            sprintf( from, "%s.%d", spoolFilename, i );
+            sprintf( to,   "%s.%d", spoolFilename, i+1 );
+            rename( from, to );
+        }
+        sprintf( to, "%s.1", spoolFilename );
+        rename( spoolFilename, to );
+    }
+    
+    if ( ( spoolFd = open( spoolFilename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 ) ) >= 0 ) {
+        spoolSize = lseek( spoolFd, 0, SEEK_END );
+        return 1;
+    }
+    printf( "Error opening log spool file %s\n", spoolFilename );
+    return 0;
+}
+
+static int spoolCb( int i, onelog_t * l ) {
+    if ( spoolOpen() ) {
+        char timestr[40];
+        time_t clk = l->ts;
+        struct tm tm;
+        strftime( timestr, sizeof( timestr ), "%Y-%m-%d %H:%M:%S", localtime_r( &clk, &tm ) );
+        
+        if ( spoolLen > SPOOL_BUFFER_SIZE - ( NEWLOG_MAX_TEXT + 80 ) ) spoolFlush();
+        
+        int n = snprintf( spoolBuffer + spoolLen, SPOOL_BUFFER_SIZE - spoolLen, "%s - %s : %s\n", timestr,
+                          ( l->from >= 0 && l->from <= NEWLOG_FROM_TEST ) ? logNames[l->from] : "?",
+                          l->text );
+        if ( n > SPOOL_BUFFER_SIZE - spoolLen ) n = SPOOL_BUFFER_SIZE - spoolLen;
+        spoolLen  += n;
+        spoolSize += n;
+    }
+    return 1;
+}
+
+static void * spoolThreadFunc( void * arg ) {
+    uint64_t cursor = 0;    // Start with what is still in the ring
+    
+    while ( spoolRunning ) {
+        if ( newLogFollow( NEWLOG_FROM_NONE, &cursor, SPOOL_FLUSH_MSEC, spoolCb ) == 0 ) {
+            // Idle: make the file current
+            spoolFlush();
+        }
+    }
+    
+    spoolFlush();
+    if ( spoolFd >= 0 ) close( spoolFd );
+    spoolFd = -1;
+    return NULL;
+}
+
+/**
+ * \brief Starts a background thread that streams the Log module to <filename>.
+ * Writes are buffered and flushed when the log is idle. When the file exceeds
+ * <maxsize> bytes it is rotated to <filename>.1 .. <filename>.<maxfiles>.
+ * \returns 1 on success, 0 on error
+ */
+int newLogSpoolStart( char * filename, int maxsize, int maxfiles ) {
+    int ok = 0;
+    
+    pthread_mutex_lock( &spoolMutex );
+    if ( !spoolRunning && filename && ( newLogSharedMemory || newLogOpen() ) ) {
+        strncpy( spoolFilename, filename, sizeof( spoolFilename ) - 1 );
+        spoolMaxSize  = maxsize;
+        spoolMaxFiles = ( maxfiles > 0 ) ? maxfiles : 1;
+        
+        if ( spoolBuffer || ( spoolBuffer = malloc( SPOOL_BUFFER_SIZE ) ) != NULL ) {
+            spoolRunning = 1;
+            if ( pthread_create( &spoolThread, NULL, &spoolThreadFunc, NULL ) == 0 ) {
+                ok = 1;
+            } else {
+                printf( "Can't create log spool thread\n" );
+                spoolRunning = 0;
+            }
+        }
+    }
+    pthread_mutex_unlock( &spoolMutex );
+    return ok;
+}
+
+/**
+ * \brief Stops the log spooler and flushes its file, and closes the file of filelog()
+ */
+void newLogSpoolStop( void ) {
+    pthread_mutex_lock( &spoolMutex );
+    if ( spoolRunning ) {
+        spoolRunning = 0;
+        pthread_join( spoolThread, NULL );
+    }
+    if ( filelogFile ) {
+        fclose( filelogFile );
+        filelogFile = NULL;
+    }
+    pthread_mutex_unlock( &spoolMutex );
+}
+
 // ------------------------------------------------------------------
 // Low level logging
 // ------------------------------------------------------------------
 
 /**
- * \brief Log simply to file
+ * \brief Log simply to file. The file is kept open as long as the same filename is used.
+ * For continuous logging use the spooler (newLogSpoolStart) instead.
  * \returns 1 on success, 0 on error
  */
 int filelog( char * filename, char * text ) {    
     char timestr[40];
     time_t clk;
+    int ok = 0;
     clk = time( NULL );
     sprintf( timestr, "%s", ctime( &clk ) );
     timestr[ strlen( timestr ) - 1 ] = '\0';
     
     printf( "Logging %s to %s\n", text, filename );
     
-    FILE * f;
-    if ( ( f = fopen( filename, "a" ) ) != NULL ) {
-        fprintf( f, "%s - %d : %s\n", timestr, getpid(), text );
-        fclose( f );
-        return 1;
+    pthread_mutex_lock( &spoolMutex );
+    if ( filelogFile && strcmp( filelogName, filename ) != 0 ) {
+        fclose( filelogFile );
+        filelogFile = NULL;
     }
-    printf( "Error logging %s to %s\n", text, filename );
-    return 0;
+    if ( filelogFile || ( filelogFile = fopen( filename, "a" ) ) != NULL ) {
+        strncpy( filelogName, filename, sizeof( filelogName ) - 1 );
+        fprintf( filelogFile, "%s - %d : %s\n", timestr, getpid(), text );
+        fflush( filelogFile );
+        ok = 1;
+    }
+    pthread_mutex_unlock( &spoolMutex );
+    
+    if ( !ok ) printf( "Error logging %s to %s\n", text, filename );
+    return ok;
 }
 
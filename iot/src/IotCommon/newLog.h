@@ -9,6 +9,8 @@
  * \brief New Log - Based on shared memory
  */
 
+#include <stdint.h>
+
 #define NEWLOG_MAX_TEXT       98
 #define MAX_LOG_BUFFER        200
 
@@ -26,6 +28,34 @@ typedef enum {
     NEWLOG_FROM_TEST,                // 10    See logNames in .c file and in logs.js
 } newLogFrom;
 
+/** Static formats for newLogAddFmt(), see newLogFormats in .c file */
+typedef enum {
+    NEWLOG_FMT_TEXT = 0,             // Plain text record (newLogAdd)
+    NEWLOG_FMT_ANNOUNCE,             // "Announce %s"
+    NEWLOG_FMT_ACTUATOR,             // "Actuator %s"
+    NEWLOG_FMT_ACTUATOR_CMD,         // "Actuator %s %s"
+    NEWLOG_FMT_ACTUATOR_LVL,         // "Actuator %s %d"
+    NEWLOG_FMT_UI_HEAT,              // "UI %s: heat %d"
+    NEWLOG_FMT_UI_COOL,              // "UI %s: cool %d"
+    NEWLOG_FMT_SENSOR_TMP,           // "Sensor %s: tmp %d"
+    NEWLOG_FMT_SENSOR_HUM,           // "Sensor %s: hum %d"
+    NEWLOG_FMT_SENSOR_ALS,           // "Sensor %s: als %d"
+    NEWLOG_FMT_SENSOR_BAT,           // "Sensor %s: bat %d"
+    NEWLOG_FMT_SENSOR_BATL,          // "Sensor %s: batl %d"
+    NEWLOG_FMT_SENSOR_DATA,          // "Sensor %s type=%s data=%d"
+    NEWLOG_FMT_PLUG,                 // "Plug %d/%d"
+    NEWLOG_FMT_COMMAND,              // "Command: %s"
+    NEWLOG_FMT_CHANMASK,             // "Set channel mask to %s"
+    NEWLOG_FMT_CI_RESPONSE,          // "Response - %s"
+    NEWLOG_FMT_CI_SOCKET,            // "Socket - %s"
+    NEWLOG_FMT_CI_WRITE_FAILED,      // "Socket write failed(%s)"
+    NEWLOG_FMT_CI_OPEN_FAILED,       // "Error opening Control Interface socket %s/%s"
+    NEWLOG_FMT_CTRL_ERROR,           // "Ctrl error: %s"
+    NEWLOG_FMT_SENSOR_ERROR,         // "Sensor error: %s"
+    NEWLOG_FMT_DB_VERSION,           // "Incompatible database version: %d != %d"
+    NEWLOG_FMT_CNT
+} newLogFmt;
+
 typedef struct onelog {
     int from;
     int ts;
@@ -36,13 +66,19 @@ typedef int (*newlogCb_t)( int i, onelog_t * l );
     
 
 extern char * logNames[11];
-extern char logbuffer[MAX_LOG_BUFFER];
 
 int newLogAdd( newLogFrom from, char * text );
+int newLogAddFmt( newLogFrom from, newLogFmt fmt, ... );
 int newLogEmpty( void );
 int newLogGetIndex( void );
 int newLogLoop( int from, int startIndex, newlogCb_t cb );
 
+uint64_t newLogFollowStart( void );
+int newLogFollow( int from, uint64_t * cursor, int msec, newlogCb_t cb );
+
+int  newLogSpoolStart( char * filename, int maxsize, int maxfiles );
+void newLogSpoolStop( void );
+
 int filelog( char * filename, char * text );
 
 
@@ -15,6 +15,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <assert.h>
 
 #include "parsing.h"
 
@@ -26,12 +27,26 @@
 #define DEBUG_PRINTF(...)
 #endif /* PARSING_DEBUG */
 
+// With 30 names in 256 slots about one seed in six gives a collision-free
+// table, so 256 seeds practically always find one
+#define HASHSIZE           256    // Power of 2, well above MAXINTATTRS and MAXSTRINGATTRS
+#define HASHSEEDS          256    // Seeds to try for a collision-free table
+
 int numIntAttrs    = 0;
 int numStringAttrs = 0;
 
 t_intattr    parsingIntAttrs[MAXINTATTRS];
 t_stringattr parsingStringAttrs[MAXSTRINGATTRS];
 
+// Open addressing tables with indexes into the attribute arrays, -1 = empty
+static signed char intIndex[HASHSIZE];
+static signed char stringIndex[HASHSIZE];
+static unsigned int intSeed    = 0;
+static unsigned int stringSeed = 0;
+
+// parsingReset() just starts a new generation, values of older ones read as reset
+static unsigned int generation = 0;
+
 // -------------------------------------------------------------
 // String helpers
 // -------------------------------------------------------------
@@ -55,21 +70,97 @@ int isEmptyString( char * string ) {
 // Attributes
 // -------------------------------------------------------------
 
+// -------------------------------------------------------------
+// Hashing
+// -------------------------------------------------------------
+
+/**
+ * \brief FNV-1a hash of a name
+ */
+static int parsingHash( const char * name, unsigned int seed ) {
+    unsigned int h = 2166136261u ^ seed;
+    while ( *name ) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return( (int)( h & INT_MAX ) );
+}
+
+/**
+ * \brief Find the slot of <name> in a hash table (linear probing)
+ * \returns Index in the attribute array, or -1 when not found
+ */
+#define HASH_FIND( index, attrs, seed, name, result ) \
+    do { \
+        int h = parsingHash( name, seed ), s = h & ( HASHSIZE - 1 ), n; \
+        result = -1; \
+        for ( n=0; n<HASHSIZE && index[s] >= 0; n++ ) { \
+            if ( attrs[(int)index[s]].hash == h && \
+                 strcmp( attrs[(int)index[s]].name, name ) == 0 ) { \
+                result = index[s]; \
+                break; \
+            } \
+            s = ( s + 1 ) & ( HASHSIZE - 1 ); \
+        } \
+    } while ( 0 )
+
+/**
+ * \brief (Re)build a hash table. Tries seeds until every attribute lands in its own
+ * home slot (a perfect hash for the registered names), so lookups of registered
+ * names take one probe. The names are fixed at compile time, so a set without a
+ * perfect seed shows up at the first start.
+ */
+#define HASH_BUILD( index, attrs, num, seed ) \
+    do { \
+        int i, s, perfect = 0; \
+        unsigned int sd; \
+        for ( sd=0; sd<HASHSEEDS && !perfect; sd++ ) { \
+            perfect = 1; \
+            memset( index, -1, sizeof( index ) ); \
+            for ( i=0; i<num; i++ ) { \
+                attrs[i].hash = parsingHash( attrs[i].name, sd ); \
+                s = attrs[i].hash & ( HASHSIZE - 1 ); \
+                if ( index[s] >= 0 ) perfect = 0; \
+                while ( index[s] >= 0 ) s = ( s + 1 ) & ( HASHSIZE - 1 ); \
+                index[s] = i; \
+            } \
+            seed = sd; \
+        } \
+        DEBUG_PRINTF( "Hash table for %d attrs, seed %u\n", num, seed ); \
+        assert( perfect ); \
+    } while ( 0 )
+
+static int parsingFindInt( char * name ) {
+    int i;
+    if ( numIntAttrs == 0 ) return( -1 );
+    HASH_FIND( intIndex, parsingIntAttrs, intSeed, name, i );
+    if ( i >= 0 && parsingIntAttrs[i].gen != generation ) {
+        parsingIntAttrs[i].gen   = generation;
+        parsingIntAttrs[i].value = INT_MIN;
+    }
+    return( i );
+}
+
+static int parsingFindString( char * name ) {
+    int i;
+    if ( numStringAttrs == 0 ) return( -1 );
+    HASH_FIND( stringIndex, parsingStringAttrs, stringSeed, name, i );
+    if ( i >= 0 && parsingStringAttrs[i].gen != generation ) {
+        parsingStringAttrs[i].gen = generation;
+        emptyString( parsingStringAttrs[i].value );
+    }
+    return( i );
+}
+
 /**
  * \brief Check if an integer with name <name> already exists in the parser array
  * \param name Name of the integer to parse
  * \returns The index in the array when found, or -1 when not found
  */
 static int parsingExistsIntAttr( char * name ) {
-    int i;
-    for ( i=0; i<numIntAttrs; i++ ) {
-        if ( strcmp( parsingIntAttrs[i].name, name ) == 0 ) {
-            DEBUG_PRINTF( "INT %s exists (%d)\n", name, i );
-            return( i );
-        }
-    }
-    DEBUG_PRINTF( "INT %s is new\n", name );
-    return( -1 );
+    int i = parsingFindInt( name );
+    DEBUG_PRINTF( "INT %s %s (%d)\n", name, ( i >= 0 ) ? "exists" : "is new", i );
+    return( i );
 }
 
 /**
@@ -78,15 +169,9 @@ static int parsingExistsIntAttr( char * name ) {
  * \returns The index in the array when found, or -1 when not found
  */
 static int parsingExistsStringAttr( char * name ) {
-    int i;
-    for ( i=0; i<numStringAttrs; i++ ) {
-        if ( strcmp( parsingStringAttrs[i].name, name ) == 0 ) {
-            DEBUG_PRINTF( "STRING %s exists (%d)\n", name, i );
-            return( i );
-        }
-    }
-    DEBUG_PRINTF( "STRING %s is new\n", name );
-    return( -1 );
+    int i = parsingFindString( name );
+    DEBUG_PRINTF( "STRING %s %s (%d)\n", name, ( i >= 0 ) ? "exists" : "is new", i );
+    return( i );
 }
 
 // ------------------------------------------------------------------
@@ -102,8 +187,10 @@ int parsingAddIntAttr( char * name ) {
     DEBUG_PRINTF( "Add INT attr %s (%d)\n", name, numIntAttrs );
     if ( parsingExistsIntAttr( name ) < 0 ) {
         if ( numIntAttrs < MAXINTATTRS ) {
-            parsingIntAttrs[numIntAttrs].name = name;
+            parsingIntAttrs[numIntAttrs].name  = name;
+            parsingIntAttrs[numIntAttrs].gen   = generation;
             numIntAttrs++;
+            HASH_BUILD( intIndex, parsingIntAttrs, numIntAttrs, intSeed );
             return( 1 );
         } else {
             printf( "********** Error adding INT-attr %s\n", name );
@@ -124,7 +211,9 @@ int parsingAddStringAttr( char * name, int maxlen ) {
         if ( numStringAttrs < MAXSTRINGATTRS ) {
             parsingStringAttrs[numStringAttrs].name   = name;
             parsingStringAttrs[numStringAttrs].maxlen = maxlen;
+            parsingStringAttrs[numStringAttrs].gen    = generation;
             numStringAttrs++;
+            HASH_BUILD( stringIndex, parsingStringAttrs, numStringAttrs, stringSeed );
             return( 1 );
         } else {
             printf( "********** Error adding STRING-attr %s\n", name );
@@ -140,16 +229,11 @@ int parsingAddStringAttr( char * name, int maxlen ) {
 // ------------------------------------------------------------------
 
 /**
- * \brief Reset the parser (and the integer and string arrays)
+ * \brief Reset the parser (and the integer and string arrays).
+ * Values are not touched here, they are reset when first looked up in the new generation.
  */
 void parsingReset( void ) {
-    int i;
-    for ( i=0; i<numIntAttrs; i++ ) {
-         parsingIntAttrs[i].value = INT_MIN;
-    }
-    for ( i=0; i<numStringAttrs; i++ ) {
-         emptyString( parsingStringAttrs[i].value );
-    }
+    generation++;
 }
 
 // ------------------------------------------------------------------
@@ -163,13 +247,11 @@ void parsingReset( void ) {
  * \returns 1 on success, or 0 on error
  */
 int parsingIntAttr( char * name, int value ) {
-    int i;
-    for ( i=0; i<numIntAttrs; i++ ) {
-        if ( strcmp( parsingIntAttrs[i].name, name ) == 0 ) {
-            parsingIntAttrs[i].value = value;
-            DEBUG_PRINTF( "INT %s = %d\n", name, value );
-            return( 1 );
-        }
+    int i = parsingFindInt( name );
+    if ( i >= 0 ) {
+        parsingIntAttrs[i].value = value;
+        DEBUG_PRINTF( "INT %s = %d\n", name, value );
+        return( 1 );
     }
     return( 0 );
 }
@@ -181,17 +263,15 @@ int parsingIntAttr( char * name, int value ) {
  * \returns 1 on success, or 0 on error
  */
 int parsingStringAttr( char * name, char * value ) {
-    int i;
-    for ( i=0; i<numStringAttrs; i++ ) {
-        if ( strcmp( parsingStringAttrs[i].name, name ) == 0 ) {
-            if ( strlen( value ) <= parsingStringAttrs[i].maxlen ) {
-                strcpy( parsingStringAttrs[i].value, value );
-                DEBUG_PRINTF( "STRING %s = %s\n", name, value );
-                return( 1 );
-            } else {
-                printf( "********** Error: String value for %s too long\n",
-                     parsingStringAttrs[i].name );
-            }
+    int i = parsingFindString( name );
+    if ( i >= 0 ) {
+        if ( strlen( value ) <= parsingStringAttrs[i].maxlen ) {
+            strcpy( parsingStringAttrs[i].value, value );
+            DEBUG_PRINTF( "STRING %s = %s\n", name, value );
+            return( 1 );
+        } else {
+            printf( "********** Error: String value for %s too long\n",
+                 parsingStringAttrs[i].name );
         }
     }
     return( 0 );
@@ -207,13 +287,8 @@ int parsingStringAttr( char * name, char * value ) {
  * \return The value for the integer or INT_MIN when the integer was not found/parsed
  */
 int parsingGetIntAttr( char * name ) {
-    int i;
-    for ( i=0; i<numIntAttrs; i++ ) {
-        if ( strcmp( parsingIntAttrs[i].name, name ) == 0 ) {
-            return( parsingIntAttrs[i].value );
-        }
-    }
-    return( INT_MIN );
+    int i = parsingFindInt( name );
+    return( ( i >= 0 ) ? parsingIntAttrs[i].value : INT_MIN );
 }
 
 /**
@@ -222,13 +297,8 @@ int parsingGetIntAttr( char * name ) {
  * \return The value for the string or NULL when the string was not found/parsed
  */
 char * parsingGetStringAttr( char * name ) {
-    int i;
-    for ( i=0; i<numStringAttrs; i++ ) {
-        if ( strcmp( parsingStringAttrs[i].name, name ) == 0 ) {
-            return( parsingStringAttrs[i].value );
-        }
-    }
-    return( NULL );
+    int i = parsingFindString( name );
+    return( ( i >= 0 ) ? parsingStringAttrs[i].value : NULL );
 }
 
 /**
@@ -237,15 +307,9 @@ char * parsingGetStringAttr( char * name ) {
  * \return The value for the string or NULL when the string was not found/parsed or was empty
  */
 char * parsingGetStringAttr0( char * name ) {
-    int i;
-    for ( i=0; i<numStringAttrs; i++ ) {
-        if ( strcmp( parsingStringAttrs[i].name, name ) == 0 ) {
-            if ( parsingStringAttrs[i].value[0] != '\0' ) {
-                return( parsingStringAttrs[i].value );
-            } else {
-                return( NULL );
-            }
-        }
+    int i = parsingFindString( name );
+    if ( i >= 0 && parsingStringAttrs[i].value[0] != '\0' ) {
+        return( parsingStringAttrs[i].value );
     }
     return( NULL );
 }
@@ -15,12 +15,14 @@
 typedef struct intattr {
     char * name;
     int  hash;
+    unsigned int gen;    // Value is only valid when equal to the parsing generation
     int  value;
 } t_intattr;
 
 typedef struct stringattr {
     char * name;
     int  hash;
+    unsigned int gen;
     int  maxlen;
     char value[MAXSTRINGVALUE+2];
 } t_stringattr;
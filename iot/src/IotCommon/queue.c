@@ -104,20 +104,32 @@ int queueOpen( queueKey key, int forwrite ) {
  */
 int queueWrite( int queue, char * message ) {
 
-    msgbuf_t SEND_BUFFER;
-
     // int len = strlen( message ) + 1;     // Inclusive '\0'
     int len = strlen( message );
 
     DEBUG_PRINTF( "QW (%d): %s", len, message );
 
+    return( queueWriteBinary( queue, message, len ) );
+}
+
+/**
+ * \brief Write a binary message (see iotMsg.h) into a queue
+ * \param queue Handle to the queue
+ * \param data Message data, may contain '\0' characters
+ * \param len Length of the message data
+ * \returns 1 on success, or 0 on error (and sets the global iotError)
+ */
+int queueWriteBinary( int queue, const char * data, int len ) {
+
+    msgbuf_t SEND_BUFFER;
+
     if ( len > ( MAXMESSAGESIZE - 2 ) ) {
         iotError = IOT_ERROR_QUEUE_BUFSIZE;
         return( 0 );
     }
 
     SEND_BUFFER.mtype = 1;
-    strcpy( SEND_BUFFER.mdata, message );
+    memcpy( SEND_BUFFER.mdata, data, len );
 
 #ifdef QUEUE_DEBUG_DUMP
     dump( SEND_BUFFER.mdata, len );
@@ -157,8 +169,8 @@ int queueRead( int queue, char * message, int size ) {
         if ( len >= size ) {
             len = size - 1;
         }
-        RECEIVE_BUFFER.mdata[len] = '\0';
-        strcpy( message, RECEIVE_BUFFER.mdata );
+        memcpy( message, RECEIVE_BUFFER.mdata, len );
+        message[len] = '\0';
     }
 
     DEBUG_PRINTF( "QR (%d): %s", len, message );
@@ -256,6 +268,23 @@ int queueWriteOneMessage( queueKey key, char * message ) {
     return( 0 );
 }
 
+/**
+ * \brief Write one binary message. Opens a queue, writes the message and closes queue again
+ * \param key Unique ID of the queue
+ * \param data Message data
+ * \param len Length of the message data
+ * \returns 1 on success, or 0 on error (and sets the global iotError)
+ */
+int queueWriteOneBinary( queueKey key, const char * data, int len ) {
+    int queue = -1;
+    if ( ( queue = queueOpen( key, 1 ) ) != -1 ) {
+        int ok = queueWriteBinary( queue, data, len );
+        queueClose( queue );
+        return( ok );
+    }
+    return( 0 );
+}
+
 // -------------------------------------------------------------
 // Get the number of messages in a queue (non destructive)
 // -------------------------------------------------------------
@@ -18,10 +18,12 @@ typedef enum {
 
 int  queueOpen( queueKey key, int forwrite );
 int  queueWrite( int queue, char * message );
+int  queueWriteBinary( int queue, const char * data, int len );
 int  queueRead( int queue, char * message, int size );
 int  queueReadWithMsecTimeout( int queue, char * message, int size, int msec );
 
 int  queueWriteOneMessage( queueKey key, char * message );
+int  queueWriteOneBinary( queueKey key, const char * data, int len );
 int  queueGetNumMessages( int queue );
 
 void queueClose( int queue );
@@ -174,8 +174,7 @@ static void zcbHandleAnnounce( char * mac, char * devstr, char * ty ) {
     }
 
     // printf( "Joined %s, %s = %d\n", mac, devstr, dev );
-    sprintf( logbuffer, "Announce %s", devstr );
-    newLogAdd( NEWLOG_FROM_ZCB_OUT, logbuffer );
+    newLogAddFmt( NEWLOG_FROM_ZCB_OUT, NEWLOG_FMT_ANNOUNCE, devstr );
 
     newdb_zcb_t sNode;
     newdb_dev_t device;
@@ -222,10 +221,9 @@ static void zcbHandleAnnounce( char * mac, char * devstr, char * ty ) {
  */
 static void zcbHandleActuator( char * mac, int sid, char * cmd, int lvl ) {
 
-    if ( cmd ) sprintf( logbuffer, "Actuator %s %s", mac, cmd );
-    else if ( lvl >= 0 ) sprintf( logbuffer, "Actuator %s %d", mac, lvl );
-    else sprintf( logbuffer, "Actuator %s", mac );
-    newLogAdd( NEWLOG_FROM_ZCB_OUT, logbuffer );
+    if ( cmd ) newLogAddFmt( NEWLOG_FROM_ZCB_OUT, NEWLOG_FMT_ACTUATOR_CMD, mac, cmd );
+    else if ( lvl >= 0 ) newLogAddFmt( NEWLOG_FROM_ZCB_OUT, NEWLOG_FMT_ACTUATOR_LVL, mac, lvl );
+    else newLogAddFmt( NEWLOG_FROM_ZCB_OUT, NEWLOG_FMT_ACTUATOR, mac );
 
     newdb_dev_t device;
     if ( newDbGetDevice( mac, &device ) ) {
@@ -248,8 +246,7 @@ static void zcbHandleUI( char * mac, int heat, int cool ) {
     newdb_dev_t device;
     if ( newDbGetDevice( mac, &device ) ) {
         if ( heat != INT_MIN ) {
-            sprintf( logbuffer, "UI %s: heat %d", mac, heat );
-            newLogAdd( NEWLOG_FROM_ZCB_OUT, logbuffer );
+            newLogAddFmt( NEWLOG_FROM_ZCB_OUT, NEWLOG_FMT_UI_HEAT, mac, heat );
         
             if ( !( device.flags & FLAG_UI_IGNORENEXT_HEAT ) ) {
                 device.heat = heat;
@@ -258,8 +255,7 @@ static void zcbHandleUI( char * mac, int heat, int cool ) {
             }
         }
         if ( cool != INT_MIN ) {
-            sprintf( logbuffer, "UI %s: cool %d", mac, cool );
-            newLogAdd( NEWLOG_FROM_ZCB_OUT, logbuffer );
+            newLogAddFmt( NEWLOG_FROM_ZCB_OUT, NEWLOG_FMT_UI_COOL, mac, cool );
         
             if ( !( device.flags & FLAG_UI_IGNORENEXT_COOL ) ) {
                 device.cool = cool;
@@ -281,28 +277,29 @@ static void zcbHandleUI( char * mac, int heat, int cool ) {
  */
 static void zcbHandleSensor( char * mac, int tmp, int hum, int als, int bat, int batl ) {
 
-    sprintf( logbuffer, "Sensor %s: tmp %d", mac, tmp );
+    newLogFmt fmt = NEWLOG_FMT_SENSOR_TMP;
+    int val = tmp;
 
     newdb_dev_t device;
     if ( newDbGetDevice( mac, &device ) ) {
         if ( tmp  >= 0 ) {
-            sprintf( logbuffer, "Sensor %s: tmp %d", mac, tmp );
+            fmt = NEWLOG_FMT_SENSOR_TMP; val = tmp;
             device.tmp = tmp;
         }
         if ( hum  >= 0 ) {
-            sprintf( logbuffer, "Sensor %s: hum %d", mac, hum );
+            fmt = NEWLOG_FMT_SENSOR_HUM; val = hum;
             device.hum = hum;
         }
         if ( als  >= 0 ) {
-            sprintf( logbuffer, "Sensor %s: als %d", mac, als );
+            fmt = NEWLOG_FMT_SENSOR_ALS; val = als;
             device.als = als;
         }
         if ( bat  >= 0 ) {
-            sprintf( logbuffer, "Sensor %s: bat %d", mac, bat );
+            fmt = NEWLOG_FMT_SENSOR_BAT; val = bat;
             device.bat = bat;
         }
         if ( batl >= 0 ) {
-            sprintf( logbuffer, "Sensor %s: batl %d", mac, batl );
+            fmt = NEWLOG_FMT_SENSOR_BATL; val = batl;
             device.batl = batl;
         }
         device.flags |= FLAG_DEV_JOINED;
@@ -315,7 +312,7 @@ static void zcbHandleSensor( char * mac, int tmp, int hum, int als, int bat, int
         queueWriteOneMessage( QUEUE_KEY_DBP, message );
     }
  
-     newLogAdd( NEWLOG_FROM_ZCB_OUT, logbuffer );
+     newLogAddFmt( NEWLOG_FROM_ZCB_OUT, fmt, mac, val );
  }
 
 // -------------------------------------------------------------
@@ -672,8 +669,7 @@ static void handlePlugData( uint64_t u64IEEEAddress ) {
         eInstDemand = (eInstantaneousDemand * eMultiplier * 1000) / eDivisor; // now in Watt
         if ( (int)eInstDemand < 0 ) eInstDemand = 0;
         
-        sprintf( logbuffer, "Plug %d/%d", (int)eInstDemand, (int)eSumDeliv );
-        newLogAdd( NEWLOG_FROM_ZCB_OUT, logbuffer );
+        newLogAddFmt( NEWLOG_FROM_ZCB_OUT, NEWLOG_FMT_PLUG, (int)eInstDemand, (int)eSumDeliv );
 
         // Add to dB (no auto-insert)
         newdb_dev_t device;
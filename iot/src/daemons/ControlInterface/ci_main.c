@@ -24,6 +24,8 @@
 #include <limits.h>
 #include <time.h>
 #include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
 
 #include "parsing.h"
 #include "json.h"
@@ -63,6 +65,9 @@
 
 #define MAXCHILDREN   10
 
+#define LOG_SPOOL_SIZE      ( 256 * 1024 )
+#define LOG_SPOOL_FILES     4
+
 // -------------------------------------------------------------
 // Globals
 // -------------------------------------------------------------
@@ -73,9 +78,12 @@ int globalClientSocketHandle;
 // Globals, local
 // -------------------------------------------------------------
 
-static int running = 1;
+static volatile int running = 1;
 static int parent  = 1;
 
+// Written by the signal handler to stop the main loop, which cleans up
+static int quitPipe[2] = { -1, -1 };
+
 static pid_t children[MAXCHILDREN];
 
 static char socketHost[80];
@@ -123,7 +131,8 @@ static void killAllChildren( void ) {
     DEBUG_PRINTF( "Kill all children\n" );
     int i;
     for ( i=0; i<MAXCHILDREN; i++ ) {
-        kill( children[i], SIGKILL );
+        // Pid 0 would be our own process group
+        if ( children[i] != (pid_t)0 ) kill( children[i], SIGKILL );
     }
 }
 
@@ -158,15 +167,13 @@ void sendResponse( char * jsonResponseString ) {
         DEBUG_PRINTF( "jsonResponse = %s, globalSocket = %d\n",
                jsonResponseString, globalClientSocketHandle );
 #ifdef MAIN_DEBUG
-        sprintf( logbuffer, "Response - %s", jsonResponseString );
-        newLogAdd( NEWLOG_FROM_CONTROL_INTERFACE, logbuffer );
+        newLogAddFmt( NEWLOG_FROM_CONTROL_INTERFACE, NEWLOG_FMT_CI_RESPONSE, jsonResponseString );
 #endif
         if ( socketWrite( globalClientSocketHandle,
                      jsonResponseString, strlen(jsonResponseString) ) < 0 ) {
             if ( errno != EPIPE ) {   // Broken pipe
-                sprintf( logbuffer, "Socket write failed(%s)",
-                         strerror(errno));
-                newLogAdd( NEWLOG_FROM_CONTROL_INTERFACE, logbuffer );
+                newLogAddFmt( NEWLOG_FROM_CONTROL_INTERFACE, NEWLOG_FMT_CI_WRITE_FAILED,
+                              strerror(errno) );
             }
         }
     }
@@ -190,8 +197,7 @@ static void ci_onObjectComplete(char * name) {
     char * jsonResponseString = NULL;
     int ret, error = IOT_ERROR_NONE;
     
-    sprintf( logbuffer, "Command: %s", name );
-    newLogAdd( NEWLOG_FROM_CONTROL_INTERFACE, logbuffer );
+    newLogAddFmt( NEWLOG_FROM_CONTROL_INTERFACE, NEWLOG_FMT_COMMAND, name );
 
     if ( strcmp( name, "dbget" ) == 0 ) {             // From phone
         if ( !dbgetHandle() ) {
@@ -326,12 +332,9 @@ static void handleClient( int socketHandle ) {
             //          socketInputBuffer, len );
             dump( socketInputBuffer, len );
 #endif
-            sprintf( logbuffer, "Socket - %s", socketInputBuffer );
-            newLogAdd( NEWLOG_FROM_CONTROL_INTERFACE, logbuffer );
+            newLogAddFmt( NEWLOG_FROM_CONTROL_INTERFACE, NEWLOG_FMT_CI_SOCKET, socketInputBuffer );
             
-            for ( i=0; i<len; i++ ) {
-                jsonEat( socketInputBuffer[i] );
-            }
+            jsonEatBuffer( socketInputBuffer, len );
         }
     }
 
@@ -376,10 +379,16 @@ static void vQuitSignalHandler (int sig) {
     case SIGKILL:
         DEBUG_PRINTF("Switch off (%d)\n", parent);
         running = 0;
-        if ( parent ) {
-            killAllChildren();
+        if ( !parent ) {
+            _exit(0);
+        }
+        // Only async-signal-safe calls here, the main loop does the rest
+        killAllChildren();
+        if ( quitPipe[1] >= 0 ) {
+            int saved = errno;
+            if ( write( quitPipe[1], "q", 1 ) < 0 ) {}
+            errno = saved;
         }
-        exit(0);
         break;
     case SIGCHLD:
         while ( ( pid = waitpid( -1, &status, WNOHANG ) ) > 0 ) {
@@ -404,7 +413,8 @@ static void vQuitSignalHandler (int sig) {
  * Each client gets its own (forked) child process to handle the commands.
  * When there are too many clients, then the oldest one is killed (could be a hangup).
  * \param argc Number of command-line parameters
- * \param argv Parameter list (-h = help, -H <ip> is IP address, -P <port> = TCP port, -c = empty DB and exit immediately)
+ * \param argv Parameter list (-h = help, -H <ip> is IP address, -P <port> = TCP port, -c = empty DB and exit immediately,
+ *             -L <file> = spool the shared log to <file>)
  */
 
 int main( int argc, char * argv[] ) {
@@ -413,6 +423,11 @@ int main( int argc, char * argv[] ) {
     
     initChildren();
 
+    if ( pipe( quitPipe ) == 0 ) {
+        fcntl( quitPipe[0], F_SETFL, O_NONBLOCK );
+        fcntl( quitPipe[1], F_SETFL, O_NONBLOCK );
+    }
+
     // Install signal handlers
     signal(SIGTERM, vQuitSignalHandler);
     signal(SIGINT,  vQuitSignalHandler);
@@ -423,11 +438,11 @@ int main( int argc, char * argv[] ) {
     strcpy( socketHost, SOCKET_HOST );
     strcpy( socketPort, SOCKET_PORT );
 
-    while ( ( opt = getopt( argc, argv, "hH:P:c" ) ) != -1 ) {
+    while ( ( opt = getopt( argc, argv, "hH:P:cL:" ) ) != -1 ) {
         switch ( opt ) {
         case 'h':
-            printf( "Usage: ci [-H host] [-P port] [-c]\n\n");
-            exit(0);
+            printf( "Usage: ci [-H host] [-P port] [-c] [-L logfile]\n\n");
+            _exit(0);
         case 'H':
             strcpy( socketHost, optarg );
             break;
@@ -444,6 +459,9 @@ int main( int argc, char * argv[] ) {
             newDbClose();
             exit( 0 );
             break;
+        case 'L':
+            newLogSpoolStart( optarg, LOG_SPOOL_SIZE, LOG_SPOOL_FILES );
+            break;
         }
     }
 
@@ -503,6 +521,12 @@ int main( int argc, char * argv[] ) {
 
             iotError = IOT_ERROR_NONE;
 
+            // Wait for a client or a quit signal
+            struct pollfd fds[2] = { { serverSocketHandle, POLLIN, 0 }, { quitPipe[0], POLLIN, 0 } };
+            if ( poll( fds, 2, -1 ) < 0 || !( fds[0].revents & POLLIN ) ) {
+                continue;
+            }
+
             int clientSocketHandle = socketAccept( serverSocketHandle );
             // printf( "Sockethandle = %d\n", clientSocketHandle );
             if ( clientSocketHandle >= 0 ) {
@@ -519,6 +543,9 @@ int main( int argc, char * argv[] ) {
                         // Child
                         parent = 0;
                         errno  = 0;
+                        close( quitPipe[0] );
+                        close( quitPipe[1] );
+                        quitPipe[0] = quitPipe[1] = -1;
                         printf( "+++ Client %d - %d\n", getpid(), errno );
                         socketClose( serverSocketHandle );
                         handleClient( clientSocketHandle );
@@ -567,7 +594,7 @@ int main( int argc, char * argv[] ) {
 
             if ( skip++ > 10 ) {
                 skip = 0;
-                checkOpenFiles( 5 );   // STDIN,STDOUT,STDERR,ServerSocket,DB
+                checkOpenFiles( 7 );   // STDIN,STDOUT,STDERR,QuitPipe(2),ServerSocket,DB
             }
         }
 
@@ -575,14 +602,14 @@ int main( int argc, char * argv[] ) {
         socketClose( serverSocketHandle );
 
     } else {
-        sprintf( logbuffer, "Error opening Control Interface socket %s/%s",
-                 socketHost, socketPort );
-        newLogAdd( NEWLOG_FROM_CONTROL_INTERFACE, logbuffer );
+        newLogAddFmt( NEWLOG_FROM_CONTROL_INTERFACE, NEWLOG_FMT_CI_OPEN_FAILED,
+                      socketHost, socketPort );
     }
     
     newDbClose();
 
     newLogAdd( NEWLOG_FROM_CONTROL_INTERFACE, "Exit" );
+    newLogSpoolStop();
     
     return( 0 );
 }
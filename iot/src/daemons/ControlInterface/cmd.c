@@ -276,8 +276,7 @@ int cmdHandle( void ) {
         if ( strval != NULL ) {
             DEBUG_PRINTF( "Command chanmask, val = %s\n", strval );
 
-            sprintf( logbuffer, "Set channel mask to %s", strval );
-            newLogAdd( NEWLOG_FROM_CONTROL_INTERFACE, logbuffer );
+            newLogAddFmt( NEWLOG_FROM_CONTROL_INTERFACE, NEWLOG_FMT_CHANMASK, strval );
             newDbSystemSaveIntval( "chanmask", AtoiHex( strval ) );
 
             message = jsonCmdSetChannelMask( strval );
@@ -28,6 +28,8 @@
 #include "atoi.h"
 #include "newDb.h"
 #include "queue.h"
+#include "json.h"
+#include "iotMsg.h"
 #include "jsonCreate.h"
 #include "parsing.h"
 #include "strtoupper.h"
@@ -94,6 +96,7 @@ static void ctrlDump( void ) {
  */
 
 int ctrlHandle( void ) {
+    iotMsg_t msg;
     iotError = IOT_ERROR_NONE;
 
 #ifdef CTRL_DEBUG
@@ -156,8 +159,8 @@ int ctrlHandle( void ) {
                     changed = 1;
 
                     // Write to ZCB
-                    queueWriteOneMessage( QUEUE_KEY_ZCB_IN,
-                                            jsonPlugCmd( mac, cmd ) );
+                    iotMsgQueueWriteOne( QUEUE_KEY_ZCB_IN,
+                            iotMsgPlugCmd( &msg, mac, cmd ) );
                 }
                 break;
 
@@ -190,8 +193,8 @@ int ctrlHandle( void ) {
                 }
                 if ( changed ) {
                     // Write to ZCB
-                    queueWriteOneMessage( QUEUE_KEY_ZCB_IN,
-                            jsonLampToZigbee( mac, cmd, lvl, rgb, kelvin ) );
+                    iotMsgQueueWriteOne( QUEUE_KEY_ZCB_IN,
+                            iotMsgLampToZigbee( &msg, mac, cmd, lvl, rgb, kelvin ) );
                 }
                 break;
             }
@@ -223,17 +226,16 @@ int ctrlHandle( void ) {
 	
 	// YB essai
 	  // Write to ZCB
-                    queueWriteOneMessage( QUEUE_KEY_ZCB_IN,
-                                            jsonPlugCmd( mac, "on" ) );
+                    iotMsgQueueWriteOne( QUEUE_KEY_ZCB_IN,
+                            iotMsgPlugCmd( &msg, mac, "on" ) );
     //  printf( "NO MAC " );
     //  iotError = IOT_ERROR_NO_MAC;
 	iotError = IOT_ERROR_NONE; 
     }
 
     if ( iotError != IOT_ERROR_NONE ) {
-      sprintf( logbuffer, "Ctrl error: %s", iotErrorString() );
-      printf( logbuffer );
-      newLogAdd( NEWLOG_FROM_CONTROL_INTERFACE, logbuffer );
+      printf( "Ctrl error: %s", iotErrorString() );
+      newLogAddFmt( NEWLOG_FROM_CONTROL_INTERFACE, NEWLOG_FMT_CTRL_ERROR, iotErrorString() );
     }
 
     return( iotError == IOT_ERROR_NONE );
@@ -19,6 +19,8 @@
 #include "iotError.h"
 #include "parsing.h"
 #include "queue.h"
+#include "json.h"
+#include "iotMsg.h"
 #include "jsonCreate.h"
 #include "grp.h"
 
@@ -103,8 +105,9 @@ int grpHandle( void ) {
         ( scn != NULL ) ? scn : "NULL", scnid,
         ( cmd != NULL ) ? cmd : "NULL", lvl, rgb, kelvin, xcr, ycr );
 
-    queueWriteOneMessage( QUEUE_KEY_ZCB_IN,
-            jsonGroup( grpid, scn, scnid, cmd, lvl, rgb, kelvin, xcr, ycr ) );
+    iotMsg_t msg;
+    iotMsgQueueWriteOne( QUEUE_KEY_ZCB_IN,
+            iotMsgGroup( &msg, grpid, scn, scnid, cmd, lvl, rgb, kelvin, xcr, ycr ) );
 
     return( iotError == IOT_ERROR_NONE );
 }
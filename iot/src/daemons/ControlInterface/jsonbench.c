@@ -0,0 +1,330 @@
+// ------------------------------------------------------------------
+// JSON benchmark
+// ------------------------------------------------------------------
+// Measures the throughput of the JSON stream parser
+// ------------------------------------------------------------------
+// Part of gateway_zigbee, licensed under the GNU GPL v3 (see LICENSE)
+// ------------------------------------------------------------------
+
+/** \addtogroup ci
+ * \file
+ * \brief JSON benchmark
+ *
+ * Feeds a stream of typical Control Interface messages to the JSON
+ * stream parser, once character by character with jsonParserEat() and
+ * once in socket sized blocks with jsonParserEatBuffer(), and reports
+ * the throughput of both. Both runs must deliver the same callbacks.
+ *
+ * Then builds plug messages with jsonPlug() and with the strcat based
+ * constructors it replaced, and reports the time per message. Both must
+ * give the same text, and a parsed message must be built back unchanged.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "json.h"
+#include "jsonCreate.h"
+
+// ------------------------------------------------------------------
+// Macros
+// ------------------------------------------------------------------
+
+#define BENCH_DEFAULT_MB     8
+#define BENCH_DEFAULT_CHUNK  1024
+#define BENCH_DEFAULT_BUILDS 1000000
+
+#define REF_MAXJSONMESSAGE   500
+#define REF_MAXNAMEVALUE     160
+
+// ------------------------------------------------------------------
+// Typing
+// ------------------------------------------------------------------
+
+typedef struct {
+    unsigned int callbacks;
+    unsigned int errors;
+    unsigned int sum;           // Checksum over names and values, in order
+} benchResult_t;
+
+// ------------------------------------------------------------------
+// Stream
+// ------------------------------------------------------------------
+
+static const char * benchMessages[] = {
+    "{\"cmd\":\"lmp\",\"mac\":\"00158D0000000001\",\"lvl\":128}\n",
+    "{\"cmd\":\"lmp\",\"mac\":\"00158D0000000002\",\"rgb\":\"FF8800\",\"kelvin\":2700}\n",
+    "{\"cmd\":\"plg\",\"mac\":\"00158D0000000003\",\"cmd\":\"on\"}\n",
+    "{\"sensor\":{\"mac\":\"00158D0000000004\",\"tmp\":-2300,\"hum\":4512,\"bat\":87}}\n",
+    "{\"sensor\":[\"t\":-23000,\"h\":+35]}\n",
+    "{\"dev\":{\"mac\":\"00158D0000000005\",\"ty\":\"col\",\"nm\":\"Living room\"}}\n",
+};
+
+static char * benchStream( int size, int * len ) {
+    char * stream = malloc( size + 256 );
+    int n = sizeof( benchMessages ) / sizeof( benchMessages[0] );
+    int i = 0;
+
+    *len = 0;
+    if ( stream ) {
+        while ( *len < size ) {
+            int l = strlen( benchMessages[i % n] );
+            memcpy( stream + *len, benchMessages[i % n], l );
+            *len += l;
+            i++;
+        }
+    }
+    return( stream );
+}
+
+// ------------------------------------------------------------------
+// Callbacks
+// ------------------------------------------------------------------
+
+static void benchHash( benchResult_t * result, const char * s ) {
+    result->callbacks++;
+    while ( s && *s ) result->sum = result->sum * 31 + (unsigned char)*s++;
+}
+
+static void onError( void * user, int error, char * errtext, char * lastchars ) {
+    ((benchResult_t *)user)->errors++;
+}
+
+static void onName( void * user, char * name ) {
+    benchHash( (benchResult_t *)user, name );
+}
+
+static void onString( void * user, char * name, char * value ) {
+    benchHash( (benchResult_t *)user, name );
+    benchHash( (benchResult_t *)user, value );
+}
+
+static void onInteger( void * user, char * name, int value ) {
+    benchHash( (benchResult_t *)user, name );
+    ((benchResult_t *)user)->sum += value;
+}
+
+static const json_callbacks_t benchCallbacks = {
+    onError,
+    onName,
+    onName,
+    onName,
+    onName,
+    onString,
+    onInteger
+};
+
+// ------------------------------------------------------------------
+// Runs
+// ------------------------------------------------------------------
+
+static double benchNow( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return( ts.tv_sec + ts.tv_nsec / 1e9 );
+}
+
+static double benchRun( const char * stream, int len, int chunk, benchResult_t * result ) {
+    json_parser_t * parser = jsonParserCreate();
+    double start;
+    int i;
+
+    memset( result, 0, sizeof( benchResult_t ) );
+    jsonParserSetCallbacks( parser, &benchCallbacks, result );
+
+    start = benchNow();
+    if ( chunk == 0 ) {
+        for ( i=0; i<len; i++ ) jsonParserEat( parser, stream[i] );
+    } else {
+        for ( i=0; i<len; i+=chunk ) {
+            jsonParserEatBuffer( parser, stream + i, ( len - i < chunk ) ? len - i : chunk );
+        }
+    }
+    start = benchNow() - start;
+
+    jsonParserDestroy( parser );
+    return( start );
+}
+
+static void benchReport( const char * name, int len, double secs, benchResult_t * result ) {
+    printf( "%-12s %8.1f MB/s  %8.0f callbacks/ms  (%u callbacks, %u errors, sum %08x)\n",
+            name, len / secs / 1e6, result->callbacks / secs / 1e3,
+            result->callbacks, result->errors, result->sum );
+}
+
+// ------------------------------------------------------------------
+// Builder
+// ------------------------------------------------------------------
+
+// Reference: the strcat based constructors jsonCreate.c used before
+static char refMessage[REF_MAXJSONMESSAGE+2];
+
+static void refCatString( char * string ) {
+    if ( ( strlen( refMessage ) + strlen( string ) ) < REF_MAXJSONMESSAGE ) {
+        strcat( refMessage, string );
+    }
+}
+
+static void refCatName( char * name ) {
+    char buf[REF_MAXNAMEVALUE+2];
+    sprintf( buf, "\"%s\"", name );
+    refCatString( buf );
+}
+
+static void refCatNameValueInt( char * name, int value ) {
+    char buf[REF_MAXNAMEVALUE+2];
+    sprintf( buf, "\"%s\":%d", name, value );
+    refCatString( buf );
+}
+
+static void refCatNameValueString( char * name, char * value ) {
+    char buf[REF_MAXNAMEVALUE+2];
+    sprintf( buf, "\"%s\":\"%s\"", name, value );
+    refCatString( buf );
+}
+
+static char * refPlug( int id, char * mac, char * nm, int rm, char * cmd, int act, int sum, int h24 ) {
+    refMessage[0] = '\0';
+    refCatName( "plg" );
+    refCatString( " : { " );
+    refCatNameValueInt( "id", id );
+    refCatString( ", " );
+    refCatNameValueString( "mac", mac );
+    refCatString( ", " );
+    refCatNameValueString( "nm", nm );
+    refCatString( ", " );
+    refCatNameValueInt( "rm", rm );
+    refCatString( ", " );
+    refCatNameValueString( "cmd", cmd );
+    refCatString( ", " );
+    refCatNameValueInt( "act", act );
+    refCatString( ", " );
+    refCatNameValueInt( "sum", sum );
+    refCatString( ", " );
+    refCatNameValueInt( "h24", h24 );
+    refCatString( " }\n" );
+    return( refMessage );
+}
+
+static char * newPlug( int id, char * mac, char * nm, int rm, char * cmd, int act, int sum, int h24 ) {
+    return( jsonPlug( id, mac, nm, rm, cmd, act, sum, h24, -1, -1 ) );
+}
+
+typedef char * (*benchPlug_t)( int id, char * mac, char * nm, int rm, char * cmd, int act, int sum, int h24 );
+
+static double benchBuild( benchPlug_t plug, int count, unsigned int * sum ) {
+    double start = benchNow();
+    int i;
+
+    *sum = 0;
+    for ( i=0; i<count; i++ ) {
+        char * msg = plug( i & 0xFF, "00158D0000000003", "Kitchen plug", 3, "on", i, 1234567, 890 );
+        *sum = *sum * 31 + (unsigned char)msg[ i % 64 ] + strlen( msg );
+    }
+    return( ( benchNow() - start ) / count );
+}
+
+// Round trip: a name as the parser delivers it, escapes included
+static char roundTripName[128];
+
+static void onRoundTripString( void * user, char * name, char * value ) {
+    if ( strcmp( name, "nm" ) == 0 ) {
+        strncpy( roundTripName, value, sizeof( roundTripName ) - 1 );
+    }
+}
+
+static const json_callbacks_t roundTripCallbacks = {
+    NULL, NULL, NULL, NULL, NULL, onRoundTripString, NULL
+};
+
+static int benchRoundTrip( void ) {
+    const char * in = "{\"plg\" : { \"id\":1, \"mac\":\"00158D0000000003\", "
+                      "\"nm\":\"Joe \\\"big\\\" \\\\ plug\\/1\", \"rm\":3, "
+                      "\"cmd\":\"on\", \"act\":0, \"sum\":0, \"h24\":0 }\n";
+    json_parser_t * parser = jsonParserCreate();
+    char * out;
+
+    jsonParserSetCallbacks( parser, &roundTripCallbacks, NULL );
+    jsonParserEatBuffer( parser, in, strlen( in ) );
+    jsonParserDestroy( parser );
+
+    out = newPlug( 1, "00158D0000000003", roundTripName, 3, "on", 0, 0, 0 );
+    return( strstr( in, "\"nm\"" ) && strstr( out, "\"nm\"" ) &&
+            strncmp( strstr( in, "\"nm\"" ), strstr( out, "\"nm\"" ),
+                     strstr( in, ", \"rm\"" ) - strstr( in, "\"nm\"" ) ) == 0 );
+}
+
+// ------------------------------------------------------------------
+// Main
+// ------------------------------------------------------------------
+
+static void usage( char * name ) {
+    printf( "Usage: %s [options]\n", name );
+    printf( "  -m <MB>     Size of the message stream (default %d)\n", BENCH_DEFAULT_MB );
+    printf( "  -c <bytes>  Block size for jsonParserEatBuffer (default %d)\n", BENCH_DEFAULT_CHUNK );
+    printf( "  -b <count>  Number of messages to build (default %d)\n", BENCH_DEFAULT_BUILDS );
+}
+
+int main( int argc, char * argv[] ) {
+    int mb = BENCH_DEFAULT_MB, chunk = BENCH_DEFAULT_CHUNK, builds = BENCH_DEFAULT_BUILDS;
+    benchResult_t perChar, bulk;
+    double secsChar, secsBulk, secsRef, secsNew;
+    unsigned int sumRef, sumNew;
+    char * stream;
+    int len, opt;
+
+    while ( ( opt = getopt( argc, argv, "hm:c:b:" ) ) != -1 ) {
+        switch ( opt ) {
+        case 'm': mb    = atoi( optarg ); break;
+        case 'c': chunk = atoi( optarg ); break;
+        case 'b': builds = atoi( optarg ); break;
+        default:  usage( argv[0] ); exit( 0 );
+        }
+    }
+    if ( mb < 1 ) mb = 1;
+    if ( chunk < 1 ) chunk = 1;
+    if ( builds < 1 ) builds = 1;
+
+    if ( ( stream = benchStream( mb * 1000000, &len ) ) == NULL ) {
+        printf( "Out of memory\n" );
+        return( 1 );
+    }
+
+    printf( "Parsing %d bytes of messages\n", len );
+    secsChar = benchRun( stream, len, 0, &perChar );
+    benchReport( "jsonEat", len, secsChar, &perChar );
+    secsBulk = benchRun( stream, len, chunk, &bulk );
+    benchReport( "jsonEatBuf", len, secsBulk, &bulk );
+
+    free( stream );
+
+    if ( perChar.callbacks != bulk.callbacks || perChar.sum != bulk.sum ) {
+        printf( "Callbacks differ\n" );
+        return( 1 );
+    }
+    printf( "Speed-up %.2fx\n", secsChar / secsBulk );
+
+    printf( "Building %d plug messages\n", builds );
+    secsRef = benchBuild( refPlug, builds, &sumRef );
+    printf( "%-12s %8.0f ns/message\n", "strcat", secsRef * 1e9 );
+    secsNew = benchBuild( newPlug, builds, &sumNew );
+    printf( "%-12s %8.0f ns/message\n", "jsonPlug", secsNew * 1e9 );
+
+    if ( sumRef != sumNew ) {
+        printf( "Messages differ\n" );
+        return( 1 );
+    }
+    if ( !benchRoundTrip() ) {
+        printf( "Parsed name not built back unchanged\n" );
+        return( 1 );
+    }
+    printf( "Speed-up %.2fx\n", secsRef / secsNew );
+    return( 0 );
+}
+
+// ------------------------------------------------------------------
+// End of file
+// ------------------------------------------------------------------
@@ -21,6 +21,8 @@
 #include "atoi.h"
 #include "parsing.h"
 #include "queue.h"
+#include "json.h"
+#include "iotMsg.h"
 #include "jsonCreate.h"
 #include "lmp.h"
 
@@ -103,8 +105,9 @@ int lmpHandle( void ) {
         scnid );
 
     if ( grp || ( grpid > 0 ) || scn || ( scnid > 0 ) ) {
-        queueWriteOneMessage( QUEUE_KEY_ZCB_IN,
-                              jsonLampGroup( mac, grp, grpid, scn, scnid ) );
+        iotMsg_t msg;
+        iotMsgQueueWriteOne( QUEUE_KEY_ZCB_IN,
+                iotMsgLampGroup( &msg, mac, grp, grpid, scn, scnid ) );
     }
 
     return( iotError == IOT_ERROR_NONE );
@@ -0,0 +1,175 @@
+// ------------------------------------------------------------------
+// New Log test
+// ------------------------------------------------------------------
+// Checks that a follower of the Log module misses no logs
+// ------------------------------------------------------------------
+// Part of gateway_zigbee, licensed under the GNU GPL v3 (see LICENSE)
+// ------------------------------------------------------------------
+
+/** \addtogroup ci
+ * \file
+ * \brief New Log test
+ *
+ * Several writer threads add numbered logs to the Log module while one
+ * thread follows it with newLogFollow(). Some logs are longer than
+ * NEWLOG_MAX_TEXT and take up to TEST_MAX_PARTS slots, each part numbered.
+ * The writers are held back so that the ring never laps the follower, so
+ * every part must be delivered, in order per writer. Reports the number
+ * of missing and duplicate parts.
+ *
+ * Uses NEWLOG_FROM_TEST, so it can run next to the daemons.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "newLog.h"
+
+// ------------------------------------------------------------------
+// Macros
+// ------------------------------------------------------------------
+
+#define TEST_DEFAULT_WRITERS  4
+#define TEST_DEFAULT_LOGS     200000
+#define TEST_MAX_WRITERS      16
+#define TEST_MAX_PARTS        3
+
+// Maximum number of logs ahead of the follower, well within the ring
+#define TEST_MAX_AHEAD        40
+
+#define TEST_FOLLOW_MSEC      100
+
+// ------------------------------------------------------------------
+// Global variables
+// ------------------------------------------------------------------
+
+static int numWriters = TEST_DEFAULT_WRITERS;
+static int numLogs    = TEST_DEFAULT_LOGS;
+
+static volatile unsigned int written   = 0;
+static volatile unsigned int delivered = 0;
+
+static unsigned int expected[TEST_MAX_WRITERS];   // Next part per writer
+static volatile unsigned int missing = 0;
+static unsigned int duplicates = 0;
+static unsigned int foreign    = 0;
+
+// ------------------------------------------------------------------
+// Threads
+// ------------------------------------------------------------------
+
+// Log <i> of a writer takes 1 to TEST_MAX_PARTS slots
+static int testParts( int i ) {
+    return( 1 + i % TEST_MAX_PARTS );
+}
+
+static void * writerThread( void * arg ) {
+    int w = (int)(long)arg;
+    char text[TEST_MAX_PARTS * NEWLOG_MAX_TEXT + 2];
+    int i, p, n = 0;
+
+    for ( i=0; i<numLogs; i++ ) {
+        int parts = testParts( i );
+        while ( (int)( written - delivered - missing ) >= TEST_MAX_AHEAD ) sched_yield();
+        __sync_fetch_and_add( &written, parts );
+
+        // Every part but the last is padded to exactly one slot
+        text[0] = '\0';
+        for ( p=0; p<parts; p++ ) {
+            int len = strlen( text );
+            sprintf( text + len, "newlogtest %d %d", w, n++ );
+            if ( p < parts - 1 ) {
+                int pad = strlen( text );
+                memset( text + pad, '.', len + NEWLOG_MAX_TEXT - pad );
+                text[len + NEWLOG_MAX_TEXT] = '\0';
+            }
+        }
+        newLogAdd( NEWLOG_FROM_TEST, text );
+    }
+    return( NULL );
+}
+
+static int followCb( int i, onelog_t * l ) {
+    unsigned int n;
+    int w;
+
+    if ( sscanf( l->text, "newlogtest %d %u", &w, &n ) != 2 || w < 0 || w >= numWriters ) {
+        // Some other test program
+        foreign++;
+        return( 1 );
+    }
+    if ( n > expected[w] ) {
+        missing += n - expected[w];
+    } else if ( n < expected[w] ) {
+        duplicates++;
+    }
+    if ( n >= expected[w] ) expected[w] = n + 1;
+    __sync_fetch_and_add( &delivered, 1 );
+    return( 1 );
+}
+
+// ------------------------------------------------------------------
+// Main
+// ------------------------------------------------------------------
+
+static void usage( char * name ) {
+    printf( "Usage: %s [options]\n", name );
+    printf( "  -w <count>  Number of writer threads (default %d, max %d)\n",
+            TEST_DEFAULT_WRITERS, TEST_MAX_WRITERS );
+    printf( "  -n <count>  Number of logs per writer (default %d)\n", TEST_DEFAULT_LOGS );
+}
+
+int main( int argc, char * argv[] ) {
+    pthread_t writers[TEST_MAX_WRITERS];
+    unsigned int perWriter = 0, total;
+    uint64_t cursor;
+    int opt, w, i, done;
+
+    while ( ( opt = getopt( argc, argv, "hw:n:" ) ) != -1 ) {
+        switch ( opt ) {
+        case 'w': numWriters = atoi( optarg ); break;
+        case 'n': numLogs    = atoi( optarg ); break;
+        default:  usage( argv[0] ); exit( 0 );
+        }
+    }
+    if ( numWriters < 1 ) numWriters = 1;
+    if ( numWriters > TEST_MAX_WRITERS ) numWriters = TEST_MAX_WRITERS;
+    if ( numLogs < 1 ) numLogs = 1;
+    for ( i=0; i<numLogs; i++ ) perWriter += testParts( i );
+    total = numWriters * perWriter;
+
+    // Opens the Log module before the writers start
+    cursor = newLogFollowStart();
+
+    printf( "Following %u parts from %d writers\n", total, numWriters );
+    for ( w=0; w<numWriters; w++ ) {
+        pthread_create( &writers[w], NULL, writerThread, (void *)(long)w );
+    }
+
+    // Stops when all logs are accounted for, or when nothing comes any more
+    done = 0;
+    while ( delivered + missing < total && done < 10 ) {
+        if ( newLogFollow( NEWLOG_FROM_TEST, &cursor, TEST_FOLLOW_MSEC, followCb ) > 0 ) {
+            done = 0;
+        } else if ( written == total ) {
+            done++;
+        }
+    }
+
+    for ( w=0; w<numWriters; w++ ) {
+        pthread_join( writers[w], NULL );
+        if ( expected[w] < perWriter ) missing += perWriter - expected[w];
+    }
+
+    printf( "Delivered %u, missing %u, duplicates %u (other %u)\n",
+            delivered, missing, duplicates, foreign );
+    return( ( delivered == total && missing == 0 && duplicates == 0 ) ? 0 : 1 );
+}
+
+// ------------------------------------------------------------------
+// End of file
+// ------------------------------------------------------------------
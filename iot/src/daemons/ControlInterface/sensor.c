@@ -118,8 +118,7 @@ int sensorHandle( void ) {
 
     if ( error != IOT_ERROR_NONE ) {
       iotError = error;
-      sprintf( logbuffer, "Sensor error: %s", iotErrorString() );
-      newLogAdd( NEWLOG_FROM_CONTROL_INTERFACE, logbuffer );
+      newLogAddFmt( NEWLOG_FROM_CONTROL_INTERFACE, NEWLOG_FMT_SENSOR_ERROR, iotErrorString() );
     }
 
     return( iotError == IOT_ERROR_NONE );
@@ -38,6 +38,7 @@
 
 #include "queue.h"
 #include "json.h"
+#include "iotMsg.h"
 #include "jsonCreate.h"
 #include "strtoupper.h"
 #include "newLog.h"
@@ -84,47 +85,60 @@ static int currentSensor  = 0;
 // Topo response Parsing
 // -------------------------------------------------------------
 
-static int topoOk;
-static int errcode;
+typedef struct {
+    int topoOk;
+    int errcode;
+} topo_response_t;
 
-static void tr_onError(int error, char * errtext, char * lastchars) {
+static void tr_onError(void * user, int error, char * errtext, char * lastchars) {
     printf("onError( %d, %s ) @ %s\n", error, errtext, lastchars);
 }
 
-static void tr_onObjectStart(char * name) {
+static void tr_onObjectStart(void * user, char * name) {
     // printf("onObjectStart( %s )\n", name);
-    errcode = INT_MAX;
+    ((topo_response_t *)user)->errcode = INT_MAX;
 }
 
-static void tr_onObjectComplete(char * name) {
+static void tr_onObjectComplete(void * user, char * name) {
+    topo_response_t * rsp = (topo_response_t *)user;
     // printf("onObjectComplete( %s )\n", name);
     if ( strcmp( name, "tprsp" ) == 0 ) {
-        if ( errcode == 0 ) {
-            topoOk = 1;
+        if ( rsp->errcode == 0 ) {
+            rsp->topoOk = 1;
         } else {
-            topoOk = 0;
+            rsp->topoOk = 0;
         }
     }
 }
 
-static void tr_onArrayStart(char * name) {
+static void tr_onArrayStart(void * user, char * name) {
     DEBUG_PRINTF("onArrayStart( %s )\n", name);
 }
 
-static void tr_onArrayComplete(char * name) {
+static void tr_onArrayComplete(void * user, char * name) {
     DEBUG_PRINTF("onArrayComplete( %s )\n", name);
 }
 
-static void tr_onString(char * name, char * value) {
+static void tr_onString(void * user, char * name, char * value) {
     DEBUG_PRINTF("onString( %s, %s )\n", name, value);
 }
 
-static void tr_onInteger(char * name, int value) {
+static void tr_onInteger(void * user, char * name, int value) {
     if ( strcmp( name, "errcode" ) == 0 ) {
-        errcode = value;
+        ((topo_response_t *)user)->errcode = value;
     }
 }
 
+static const json_callbacks_t topoResponseCallbacks = {
+    tr_onError,
+    tr_onObjectStart,
+    tr_onObjectComplete,
+    tr_onArrayStart,
+    tr_onArrayComplete,
+    tr_onString,
+    tr_onInteger
+};
+
 // -------------------------------------------------------------
 // TOPO UPLOAD LOCK
 // -------------------------------------------------------------
@@ -192,17 +206,14 @@ static int uploadTopo( void ) {
     if ( ( zcbQueue = queueOpen( QUEUE_KEY_ZCB_IN, 1 ) ) != -1 ) {
         if ( ( controlQueue = queueOpen( QUEUE_KEY_CONTROL_INTERFACE, 0 ) ) != -1 ) {
 
-            jsonSelectNext();
-
-            // Install JSON parser helpers for the topo responses
-            jsonSetOnError(tr_onError);
-            jsonSetOnObjectStart(tr_onObjectStart);
-            jsonSetOnObjectComplete(tr_onObjectComplete);
-            jsonSetOnArrayStart(tr_onArrayStart);
-            jsonSetOnArrayComplete(tr_onArrayComplete);
-            jsonSetOnString(tr_onString);
-            jsonSetOnInteger(tr_onInteger);
-            jsonReset();
+            // Own JSON parser for the topo responses
+            topo_response_t rsp;
+            json_parser_t * parser = jsonParserCreate();
+            if ( parser == NULL ) {
+                error = IOT_ERROR_TOPO_TIMEOUT;
+            } else {
+                jsonParserSetCallbacks( parser, &topoResponseCallbacks, &rsp );
+            }
 
             // Generate JSON strings describing the database
             DEBUG_PRINTF( "Generate Topo string (%d)\n", getpid() );
@@ -229,15 +240,15 @@ static int uploadTopo( void ) {
             for ( i=0; ((i<numTopoStrings) && (error==IOT_ERROR_NONE)); i++ ) {
 
                 if ( ( wait = topoAckWaits[i] ) ) {
-                    topoOk  = 0;
-                    errcode = INT_MAX;
+                    rsp.topoOk  = 0;
+                    rsp.errcode = INT_MAX;
                     retries = MAX_RETRIES;
 
                     do {
                         error = IOT_ERROR_NONE;            
                         
                         // Write the topo command
-                        queueWrite( zcbQueue, topoStrings[i] );
+                        iotMsgQueueWriteJson( zcbQueue, topoStrings[i] );
 
 #ifdef TIMING_DEBUG
                         gettimeofday( &now, NULL );
@@ -265,13 +276,8 @@ static int uploadTopo( void ) {
                             error = IOT_ERROR_TOPO_TIMEOUT;
                         } else {
 
-                            DEBUG_PRINTF( "NumBytes = %d: ", numBytes );
-                            int i;
-                            for ( i=0; i<numBytes; i++ ) {
-                                DEBUG_PRINTF( "%c", queueInputBuffer[i] );
-                                jsonEat( queueInputBuffer[i] );
-                            }
-                            DEBUG_PRINTF( "\n" );
+                            DEBUG_PRINTF( "NumBytes = %d: %.*s\n", numBytes, numBytes, queueInputBuffer );
+                            jsonParserEatBuffer( parser, queueInputBuffer, numBytes );
                         }
 
 #ifdef TIMING_DEBUG
@@ -284,15 +290,15 @@ static int uploadTopo( void ) {
                         printf( "TOPO loop 3: Elapsed REAL time: %.2f seconds (%.2f ~ %d)\n\n", elapsed, delta, wait );
 #endif
                     // Repeat when no response received for max 'retries' times
-                    } while ( ( errcode == INT_MAX ) && ( --retries > 0 ) );
+                    } while ( ( rsp.errcode == INT_MAX ) && ( --retries > 0 ) );
 
                     if ( retries != MAX_RETRIES ) {
                         printf( "\n==========> #retries = %d, errcode = %d\n\n",
-                            MAX_RETRIES - retries, errcode );
+                            MAX_RETRIES - retries, rsp.errcode );
                     }
 
                     // topoOk will be set if a correct response was parsed
-                    if ( topoOk ) {
+                    if ( rsp.topoOk ) {
                         DEBUG_PRINTF( "Topo line acknowledged\n" );
 
                         // Addressed manager is alive and gave ack: set JOINED
@@ -312,7 +318,7 @@ static int uploadTopo( void ) {
 
                 } else {
                     // No ack needed, just write the topo command
-                    queueWrite( zcbQueue, topoStrings[i] );
+                    iotMsgQueueWriteJson( zcbQueue, topoStrings[i] );
                 }
 
                 if ( error != IOT_ERROR_NONE ) {
@@ -321,7 +327,7 @@ static int uploadTopo( void ) {
                 }
             }
 
-            jsonSelectPrev();
+            jsonParserDestroy( parser );
 
             queueClose( controlQueue );
 
@@ -51,6 +51,7 @@
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
+#include <poll.h>
 
 #include "iotSleep.h"
 #include "Serial.h"
@@ -232,46 +233,6 @@ teSerial_Status eSerial_Read(unsigned char *data)
     return E_SERIAL_OK;
 }
 
-teSerial_Status eSerial_Write(const unsigned char data)
-{
-    int err, attempts = 0;
-    
-    // DEBUG_PRINTF( "TX 0x%02x\n", data);
-    
-    err = write(serial_fd,&data,1);
-    if (err < 0)
-    {
-        if (errno == EAGAIN)
-        {
-            for (attempts = 0; attempts <= 5; attempts++)
-            {
-                DEBUG_PRINTF( "Serial Write Error (%s), retrying..\n", strerror(errno));
-                IOT_MSLEEP(1);
-                err = write(serial_fd,&data,1);
-                if (err < 0) 
-                {
-                    if ((errno == EAGAIN) && (attempts == 5))
-                    {
-                        DEBUG_PRINTF( "Error writing to module after %d attempts(%s)\n", attempts, strerror(errno));
-                        exit(-1);
-                    }
-                }
-                else
-                {
-                    break;
-                }
-            }
-        }
-        else
-        {
-            DEBUG_PRINTF( "Error writing to module(%s)\n", strerror(errno));
-            exit(-1);
-        }
-    }
-    return E_SERIAL_OK;
-}
-
-
 teSerial_Status eSerial_ReadBuffer(unsigned char *data, uint32_t *count)
 {
     int res;
@@ -298,39 +259,52 @@ teSerial_Status eSerial_ReadBuffer(unsigned char *data, uint32_t *count)
 }
 
 
+/** Longest time a write waits for the port to accept more data */
+#define SERIAL_WRITE_TIMEOUT_MS 1000
+
 teSerial_Status eSerial_WriteBuffer(unsigned char *data, uint32_t count)
 {
-    int attempts = 0;
-    //printf("send char %d\n", data);
-    int total_sent_bytes = 0, sent_bytes = 0;
+    uint32_t total_sent_bytes = 0;
+    int sent_bytes;
     
     while (total_sent_bytes < count)
     {
         sent_bytes = write(serial_fd, &data[total_sent_bytes], count - total_sent_bytes);
-        if (sent_bytes <= 0)
+        if (sent_bytes < 0)
         {
-            if (errno == EAGAIN)
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            else if (errno == EAGAIN)
             {
-                DEBUG_PRINTF( "Serial Write Error (%s), retrying..\n", strerror(errno));
-                if (++attempts >= 5)
+                /* Output buffer full, wait until the port drains */
+                struct pollfd pfd;
+                int res;
+                
+                pfd.fd     = serial_fd;
+                pfd.events = POLLOUT;
+                do
+                {
+                    res = poll(&pfd, 1, SERIAL_WRITE_TIMEOUT_MS);
+                } while ((res < 0) && (errno == EINTR));
+                
+                if (res <= 0)
                 {
-                    DEBUG_PRINTF( "Error writing to module(%s)\n", strerror(errno));
+                    DEBUG_PRINTF( "Error writing to module, port blocked(%s)\n", (res == 0) ? "timeout" : strerror(errno));
                     return E_SERIAL_ERROR;
                 }
-                IOT_MSLEEP(1);
             }
             else
             {
                 DEBUG_PRINTF( "Error writing to module(%s)\n", strerror(errno));
-                return -1;
+                return E_SERIAL_ERROR;
             }
         }
         else
         {
-            attempts = 0;
             total_sent_bytes += sent_bytes;
         }
     }
     return E_SERIAL_OK;
 }
-
@@ -83,7 +83,6 @@ typedef enum
 
 teSerial_Status eSerial_Init(char *name, uint32_t baud, int *piserial_fd);
 teSerial_Status eSerial_Read(unsigned char *data);
-teSerial_Status eSerial_Write(const unsigned char data);
 
 teSerial_Status eSerial_ReadBuffer(unsigned char *data, uint32_t *count);
 teSerial_Status eSerial_WriteBuffer(unsigned char *data, uint32_t count);
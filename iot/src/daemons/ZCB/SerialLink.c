@@ -52,6 +52,7 @@
 #include <errno.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "SerialLink.h"
@@ -76,9 +77,58 @@
 
 #define SL_MAX_MESSAGE_LENGTH 256
 
-#define SL_MAX_MESSAGE_QUEUES 3
+/** Worst case size of an escaped frame: start, fully escaped header, payload and CRC, end */
+#define SL_MAX_FRAME_LENGTH (2 + 2 * (5 + SL_MAX_MESSAGE_LENGTH))
 
-#define SL_MAX_CALLBACK_QUEUES 3
+/** Size of the receive buffer, holds several frames so that one read() drains a burst */
+#define SL_RX_BUFFER_SIZE 4096
+
+/** Number of threads that can wait for a message at the same time */
+#define SL_MAX_MESSAGE_QUEUES 8
+
+/** Number of hash buckets for the message waiters, a power of 2 */
+#define SL_WAITER_BUCKETS 16
+
+/** Status type of a status waiter that takes the status to any message */
+#define SL_ANY_STATUS_TYPE 0xFFFF
+
+/** Number of callbacks that can be queued for each callback worker */
+#define SL_MAX_CALLBACK_QUEUES 8
+
+/** Size of the table of message handlers, indexed by the low bits of the message type */
+#define SL_HANDLER_TABLE_SIZE 512
+
+/** Payload size of the small callback buffers, most reports fit */
+#define SL_SMALL_MESSAGE_LENGTH 48
+
+/** Number of preallocated callback buffers of each size */
+#define SL_CALLBACK_BUFFERS (SL_CALLBACK_WORKERS * SL_MAX_CALLBACK_QUEUES)
+
+/** Callback buffer pools */
+#define SL_POOL_SMALL   0
+#define SL_POOL_LARGE   1
+#define SL_POOL_HEAP    2           /**< Pools were empty, buffer is malloc'ed */
+
+/** Number of commands that can be tracked at the same time */
+#define SL_MAX_COMMANDS 16
+
+/** Default number of commands that may wait for their status at the same time */
+#define SL_DEFAULT_COMMAND_WINDOW 4
+
+/** Time the control bridge has to return the status of a command (ms) */
+#define SL_STATUS_TIMEOUT 500
+
+/** Commands of the transmit burst that only interactive commands may use */
+#define SL_TX_RESERVE 2
+
+/** Places of the command window that only interactive commands may use */
+#define SL_WINDOW_RESERVE 1
+
+/** stdio buffer of the capture file, records are written to disk in blocks of this size */
+#define SL_CAPTURE_BUFFER_SIZE 65536
+
+/** Longest time records stay in the capture buffer, so that a killed process leaves a usable capture (us) */
+#define SL_CAPTURE_FLUSH_INTERVAL 1000000
 
 #if DEBUG_SERIALLINK
 #define DEBUG_PRINTF(...) printf(__VA_ARGS__)
@@ -96,18 +146,6 @@ typedef enum
     TRUE,    
 } bool;
 
-typedef enum
-{
-    E_STATE_RX_WAIT_START,
-    E_STATE_RX_WAIT_TYPEMSB,
-    E_STATE_RX_WAIT_TYPELSB,
-    E_STATE_RX_WAIT_LENMSB,
-    E_STATE_RX_WAIT_LENLSB,
-    E_STATE_RX_WAIT_CRC,
-    E_STATE_RX_WAIT_DATA,
-} teSL_RxState;
-
-
 /** Forward definition of callback function entry */
 struct _tsSL_CallbackEntry;
 
@@ -121,15 +159,154 @@ typedef struct _tsSL_CallbackEntry
 } tsSL_CallbackEntry;
 
 
+/** State of a command slot */
+typedef enum
+{
+    E_SL_COMMAND_FREE,
+    E_SL_COMMAND_RESERVED,      /**< Slot taken, frame not sent yet */
+    E_SL_COMMAND_SENT,          /**< Waiting for the status */
+    E_SL_COMMAND_DONE,          /**< Status known, waiting for eSL_CommandWait() */
+} teSL_CommandState;
+
+
+/** A command sent to the control bridge */
+typedef struct
+{
+    teSL_CommandState       eState;
+    uint16_t                u16Type;        /**< Type of the command */
+    uint32_t                u32Serial;      /**< Order in which the command was sent */
+    struct timespec         sDeadline;      /**< When the status is considered lost */
+    uint64_t                u64Sent;        /**< When the command was sent (us) */
+    int                     iWaited;        /**< A handle is held, keep the status for eSL_CommandWait() */
+    teSL_Status             eStatus;        /**< Status returned by the control bridge */
+    uint8_t                 u8SequenceNo;   /**< Sequence number of the outgoing message */
+    tprSL_StatusCallback    prCallback;     /**< User supplied callback function for the status */
+    void                    *pvUser;        /**< User supplied data for the callback function */
+} tsSL_Command;
+
+
+/** A thread waiting in eSL_MessageWait() */
+typedef struct
+{
+    uint16_t                u16Type;        /**< Type of message waited for, 0 when the slot is free */
+    uint16_t                u16StatusType;  /**< For status messages: type of message the status is to */
+    int8_t                  i8Next;         /**< Next waiter in the same bucket, or in the free list */
+    int                     iDone;          /**< Message has been delivered */
+    uint16_t                u16Length;
+    uint8_t                 *pu8Message;
+    pthread_cond_t          cond_data_available;
+} tsSL_Waiter;
+
+
+/** Status callback to make once the command mutex has been released */
+typedef struct
+{
+    tprSL_StatusCallback    prCallback;
+    void                    *pvUser;
+    uint16_t                u16Type;
+    teSL_Status             eStatus;
+    uint8_t                 u8SequenceNo;
+} tsSL_Completion;
+
+
 /** Structure used to contain a message */
 typedef struct
 {
     uint16_t u16Type;
     uint16_t u16Length;
-    uint8_t  au8Message[SL_MAX_MESSAGE_LENGTH];
+    uint8_t  au8Message[SL_MAX_MESSAGE_LENGTH + 1];    /**< Room to terminate log strings */
 } tsSL_Message;
 
 
+/** Structure passed to callback handler thread, taken from the callback buffer pools */
+typedef struct _tsCallbackThreadData
+{
+    tprSL_MessageCallback   prCallback;     /**< User supplied callback function for this message type */
+    void *                  pvUser;         /**< User supplied data for the callback function */
+    uint16_t                u16Type;        /**< Type of the received message */
+    uint16_t                u16Length;      /**< Length of the received message */
+    uint8_t                 u8Pool;         /**< Pool the buffer belongs to */
+    uint64_t                u64Queued;      /**< When the message was queued (us) */
+    struct _tsCallbackThreadData *psNext;   /**< Next free buffer in the pool, or next in the overflow list */
+    uint8_t                 au8Message[];   /**< The received message, zero terminated */
+} tsCallbackThreadData;
+
+
+/** Message handler for one message type */
+typedef struct
+{
+    uint16_t                u16Type;
+    tprSL_MessageCallback   prCallback;     /**< NULL when no type with these low bits has a handler */
+    void                    *pvUser;
+    int8_t                  i8AddressOffset;/**< Offset of the short address in the message, -1 if none */
+} tsSL_Handler;
+
+
+/** Thread running callbacks for a share of the devices.
+ *  The reader never blocks on the queue: when it is full, messages go to the
+ *  overflow list, and the worker moves them to the queue as it makes room.
+ *  Handlers that wait for a command status can then never stall the reader.
+ */
+typedef struct
+{
+    tsUtilsQueue            sQueue;
+    tsUtilsThread           sThread;
+    pthread_mutex_t         mOverflow;      /**< Protects the overflow list and the order of queueing */
+    tsCallbackThreadData    *psOverflowHead;
+    tsCallbackThreadData    *psOverflowTail;
+    uint32_t                u32Overflowed;  /**< Messages that found the queue full */
+    uint32_t                u32Depth;       /**< Callbacks queued now */
+    uint32_t                u32MaxDepth;
+    uint32_t                u32Handled;
+    uint64_t                u64Latency;     /**< Total time from queueing to callback return (us) */
+    uint32_t                u32MaxLatency;
+} tsSL_Worker;
+
+
+/** Where message types carry the short address of the device they are from.
+ *  Callbacks for one device run in order on one worker.
+ */
+static const struct
+{
+    uint16_t    u16Type;
+    uint8_t     u8Offset;
+} asSL_AddressOffset[] =
+{
+    { E_SL_MSG_DEVICE_ANNOUNCE,             0 },    /* Short address first */
+    { E_SL_MSG_READ_ATTRIBUTE_RESPONSE,     1 },    /* After the sequence number */
+    { E_SL_MSG_ATTRIBUTE_REPORT,            1 },
+    { E_SL_MSG_MATCH_DESCRIPTOR_RESPONSE,   2 },    /* After sequence number and status */
+    { E_SL_MSG_SIMPLE_DESCRIPTOR_RESPONSE,  2 },
+    { E_SL_MSG_ACTIVE_ENDPOINT_RESPONSE,    2 },
+};
+
+
+/** Priority class of the commands that are not interactive.
+ *  Everything else a user could be waiting for.
+ */
+static const struct
+{
+    uint16_t        u16Type;
+    teSL_Priority   ePriority;
+} asSL_Priority[] =
+{
+    { E_SL_MSG_NETWORK_ADDRESS_REQUEST,             E_SL_PRIORITY_INTERVIEW },
+    { E_SL_MSG_IEEE_ADDRESS_REQUEST,                E_SL_PRIORITY_INTERVIEW },
+    { E_SL_MSG_NODE_DESCRIPTOR_REQUEST,             E_SL_PRIORITY_INTERVIEW },
+    { E_SL_MSG_SIMPLE_DESCRIPTOR_REQUEST,           E_SL_PRIORITY_INTERVIEW },
+    { E_SL_MSG_POWER_DESCRIPTOR_REQUEST,            E_SL_PRIORITY_INTERVIEW },
+    { E_SL_MSG_ACTIVE_ENDPOINT_REQUEST,             E_SL_PRIORITY_INTERVIEW },
+    { E_SL_MSG_MATCH_DESCRIPTOR_REQUEST,            E_SL_PRIORITY_INTERVIEW },
+    { E_SL_MSG_READ_ATTRIBUTE_REQUEST,              E_SL_PRIORITY_INTERVIEW },
+    { E_SL_MSG_ATTRIBUTE_DISCOVERY_REQUEST,         E_SL_PRIORITY_INTERVIEW },
+    { E_SL_MSG_BIND,                                E_SL_PRIORITY_REPORTING },
+    { E_SL_MSG_UNBIND,                              E_SL_PRIORITY_REPORTING },
+    { E_SL_MSG_CONFIG_REPORTING_REQUEST,            E_SL_PRIORITY_REPORTING },
+    { E_SL_MSG_MANAGEMENT_LQI_REQUEST,              E_SL_PRIORITY_MAINTENANCE },
+    { E_SL_MSG_MANAGEMENT_NETWORK_UPDATE_REQUEST,   E_SL_PRIORITY_MAINTENANCE },
+};
+
+
 /** Structure of data for the serial link */
 typedef struct
 {
@@ -145,38 +322,106 @@ typedef struct
         pthread_mutex_t         mutex;
 #endif /* WIN32 */
         tsSL_CallbackEntry      *psListHead;
+        /** First handler of each type, rebuilt from the list when it changes */
+        tsSL_Handler            asHandler[SL_HANDLER_TABLE_SIZE];
     } sCallbacks;
     
-    tsUtilsQueue sCallbackQueue;
-    tsUtilsThread sCallbackThread;
+    /** Preallocated buffers for the callback handler thread */
+    struct
+    {
+        pthread_mutex_t         mutex;
+        tsCallbackThreadData    *apsFree[SL_POOL_HEAP];
+    } sCallbackPool;
+    
+    /** Callback workers, messages without a short address all go to the first */
+    tsSL_Worker asWorker[SL_CALLBACK_WORKERS];
     
-    // Array of listeners for messages
-    // eSL_MessageWait uses this array to wait on incoming messages.
+    /** Threads waiting for messages in eSL_MessageWait().
+     *  Waiters are chained per hash of (message type, status type) in the
+     *  order they started waiting, all under one mutex.
+     */
     struct 
     {
-        uint16_t u16Type;
-        uint16_t u16Length;
-        uint8_t *pu8Message;
-#ifndef WIN32
-        pthread_mutex_t mutex;
-        pthread_cond_t cond_data_available;
-#else
+        pthread_mutex_t     mutex;
+        tsSL_Waiter         asWaiter[SL_MAX_MESSAGE_QUEUES];
+        int8_t              ai8Bucket[SL_WAITER_BUCKETS];   /**< First waiter per bucket, -1 if none */
+        int8_t              i8Free;                         /**< First free waiter, -1 if none */
+    } sWaiters;
     
-#endif /* WIN32 */
-    } asReaderMessageQueue[SL_MAX_MESSAGE_QUEUES];
+    /** Link statistics */
+    struct
+    {
+        pthread_mutex_t     mutex;
+        tsSL_Stats          sCounters;
+    } sStats;
 
     
     tsUtilsThread sSerialReader;
+    
+    /** Bytes read from the serial port that have not been decoded yet.
+     *  Only touched by the reader thread.
+     */
+    struct
+    {
+        uint8_t  au8Buffer[SL_RX_BUFFER_SIZE];
+        uint32_t u32Head;                       /**< First byte not yet decoded */
+        uint32_t u32Tail;                       /**< End of the valid data */
+    } sRxBuffer;
+    
+    /** Escaped frame being transmitted, protected by mutex */
+    uint8_t au8TxBuffer[SL_MAX_FRAME_LENGTH];
+    
+    /** Commands waiting for their status.
+     *  Lock order is mutex before sCommands.mutex.
+     */
+    struct
+    {
+        pthread_mutex_t     mutex;
+        pthread_cond_t      cond_changed;   /**< A command completed or a slot was released */
+        tsSL_Command        asCommand[SL_MAX_COMMANDS];
+        int                 iWindow;        /**< Maximum number of commands in flight */
+        int                 iInFlight;      /**< Commands reserved or sent */
+        uint32_t            u32Serial;      /**< Serial of the last command sent */
+        uint32_t            u32TxInterval;  /**< Time between commands at the transmit rate (us), 0 for no limit */
+        uint32_t            u32TxBurst;     /**< Commands that may be sent back to back */
+        uint64_t            u64TxDue;       /**< Theoretical time of the next command at the transmit rate (us) */
+        struct
+        {
+            uint32_t        u32Sent;
+            uint32_t        u32Dropped;
+            uint32_t        u32Queued;      /**< Commands in eSL_SendCommand() waiting to be sent */
+            uint32_t        u32MaxQueued;
+            uint64_t        u64Wait;        /**< Total time from the call to sending (us) */
+            uint32_t        u32MaxWait;
+        } asClass[E_SL_PRIORITY_CLASSES];
+    } sCommands;
+    
+    /** Capture of the serial traffic */
+    struct
+    {
+        pthread_mutex_t     mutex;
+        FILE                *psFile;        /**< NULL when not capturing */
+        uint64_t            u64Start;       /**< When the capture started (us) */
+        uint64_t            u64Flushed;     /**< When the buffer was last written to disk (us) */
+    } sCapture;
+    
+    /** Capture replayed instead of reading the serial port.
+     *  Only touched by the reader thread, apart from iStarted.
+     */
+    struct
+    {
+        FILE                *psFile;        /**< NULL when reading the serial port */
+        uint32_t            u32Speed;       /**< Speed up, 0 for no delays */
+        volatile int        iStarted;       /**< Host has sent a message, start feeding */
+        int                 iFinished;
+        uint64_t            u64Start;       /**< When the capture would have started (us) */
+        uint32_t            u32Remaining;   /**< Bytes of the current record still to feed */
+        uint32_t            u32Blocks;
+        uint64_t            u64Bytes;
+    } sReplay;
 } tsSerialLink;
 
 
-/** Structure allocated and passed to callback handler thread */
-typedef struct
-{
-    tsSL_Message            sMessage;       /** The received message */ 
-    tprSL_MessageCallback   prCallback;     /**< User supplied callback function for this message type */
-    void *                  pvUser;         /**< User supplied data for the callback function */
-} tsCallbackThreadData;
 
 
 
@@ -187,16 +432,50 @@ typedef struct
 
 static uint8_t u8SL_CalculateCRC(uint16_t u16Type, uint16_t u16Length, uint8_t *pu8Data);
 
-static int iSL_TxByte(bool bSpecialCharacter, uint8_t u8Data);
+static int iSL_TxByte(uint8_t *pu8Frame, uint8_t u8Data);
 
-static bool bSL_RxByte(uint8_t *pu8Data);
+static bool bSL_RxFill(void);
+static bool bSL_ReplayFill(void);
+static void vSL_CaptureWrite(teSL_CaptureDirection eDirection, uint8_t *pu8Data, uint32_t u32Length);
+static void vSL_CaptureFlush(uint64_t u64Now);
+static void vSL_CaptureTick(void);
+static teSL_Status eSL_DecodeFrame(uint16_t *pu16Type, uint16_t *pu16Length, uint16_t u16MaxLength, uint8_t *pu8Message);
 
 static teSL_Status eSL_WriteMessage(uint16_t u16Type, uint16_t u16Length, uint8_t *pu8Data);
 static teSL_Status eSL_ReadMessage(uint16_t *pu16Type, uint16_t *pu16Length, uint16_t u16MaxLength, uint8_t *pu8Message);
 
+static void vSL_TimeoutAfter(struct timespec *psTimeout, uint32_t u32Milliseconds);
+static bool bSL_TimeBefore(const struct timespec *psA, const struct timespec *psB);
+static tsSL_Command *psSL_ReserveCommand(teSL_Priority ePriority, uint32_t *pu32TokenWait);
+static int iSL_ClassWindow(teSL_Priority ePriority);
+static void vSL_CompleteCommand(tsSL_Command *psCommand, teSL_Status eStatus, uint8_t u8SequenceNo, tsSL_Completion *psCompletion);
+static void vSL_CallCompletion(tsSL_Completion *psCompletion);
+static bool bSL_CommandStatus(tsSL_Message *psMessage);
+static void vSL_ExpireCommands(void);
+
+static void vSL_CountEvent(uint32_t *pu32Counter);
+static void vSL_CountFrame(bool bTx, uint16_t u16Type, uint16_t u16Length, uint32_t u32FrameLength);
+static void vSL_CountStatus(tsSL_Command *psCommand, bool bArrived);
+static tsSL_TypeStats *psSL_TypeStats(uint16_t u16Type);
+
+static uint8_t u8SL_WaiterBucket(uint16_t u16Type, uint16_t u16StatusType);
+static void vSL_UnlinkWaiter(int8_t i8Waiter);
+
+static void vSL_RebuildHandlers(void);
+static teSL_Status eSL_CreatePool(uint8_t u8Pool, uint16_t u16MaxLength);
+static tsCallbackThreadData *psSL_AllocCallbackData(uint16_t u16Length);
+static void vSL_FreeCallbackData(tsCallbackThreadData *psCallbackData);
+
+static teSL_Status eSL_Start(void);
 static void *pvReaderThread(tsUtilsThread *psThreadInfo);
 
+static int8_t i8SL_AddressOffset(uint16_t u16Type);
+static teSL_Priority eSL_CommandPriority(uint16_t u16Type);
+static uint64_t u64SL_Microseconds(void);
+
 static void *pvCallbackHandlerThread(tsUtilsThread *psThreadInfo);
+static void vSL_QueueCallback(tsSL_Worker *psWorker, tsCallbackThreadData *psCallbackData);
+static void vSL_RefillQueue(tsSL_Worker *psWorker);
 
 
 /****************************************************************************/
@@ -211,6 +490,9 @@ extern int verbosity;
 
 static tsSerialLink sSerialLink;
 
+/** When the message being handled on this callback thread was queued (us), 0 elsewhere */
+static __thread uint64_t u64HandlingQueued = 0;
+
 /****************************************************************************/
 /***        Exported Functions                                            ***/
 /****************************************************************************/
@@ -218,52 +500,42 @@ static tsSerialLink sSerialLink;
 
 teSL_Status eSL_Init(char *cpSerialDevice, uint32_t u32BaudRate)
 {
-    int i;
-    
     if (eSerial_Init(cpSerialDevice, u32BaudRate, &sSerialLink.iSerialFd) != E_SERIAL_OK)
     {
         return E_SL_ERROR_SERIAL;
     }
     
-    /* Initialise serial link mutex */
-    pthread_mutex_init(&sSerialLink.mutex, NULL);
-    
-    /* Initialise message callbacks */
-    pthread_mutex_init(&sSerialLink.sCallbacks.mutex, NULL);
-    sSerialLink.sCallbacks.psListHead = NULL;
+    sSerialLink.sReplay.psFile = NULL;
     
-    /* Initialise message wait queue */
-    for (i = 0; i < SL_MAX_MESSAGE_QUEUES; i++)
-    {
-        pthread_mutex_init(&sSerialLink.asReaderMessageQueue[i].mutex, NULL);
-        pthread_cond_init(&sSerialLink.asReaderMessageQueue[i].cond_data_available, NULL);
-        sSerialLink.asReaderMessageQueue[i].u16Type = 0;
-    }
+    return eSL_Start();
+}
+
+
+teSL_Status eSL_InitReplay(char *cpCaptureFile, uint32_t u32Speed)
+{
+    tsSL_CaptureHeader sHeader;
+    FILE *psFile;
     
-    /* Initialise callback queue */
-    if (eUtils_QueueCreate(&sSerialLink.sCallbackQueue, SL_MAX_CALLBACK_QUEUES, 0) != E_UTILS_OK)
+    psFile = fopen(cpCaptureFile, "rb");
+    if (!psFile)
     {
-        DEBUG_PRINTF( "Error creating callback queue\n");
+        printf( "Could not open capture %s (%s)\n", cpCaptureFile, strerror(errno));
         return E_SL_ERROR;
     }
-    
-    /* Start the callback handler thread */
-    sSerialLink.sCallbackThread.pvThreadData = &sSerialLink;
-    if (eUtils_ThreadStart(pvCallbackHandlerThread, &sSerialLink.sCallbackThread, E_THREAD_JOINABLE) != E_UTILS_OK)
+    if ((fread(&sHeader, sizeof(sHeader), 1, psFile) != 1) ||
+        (sHeader.u32Magic != SL_CAPTURE_MAGIC) || (sHeader.u16Version != SL_CAPTURE_VERSION))
     {
-        DEBUG_PRINTF( "Failed to start callback handler thread");
+        printf( "%s is not a serial link capture\n", cpCaptureFile);
+        fclose(psFile);
         return E_SL_ERROR;
     }
     
-    /* Start the serial reader thread */
-    sSerialLink.sSerialReader.pvThreadData = &sSerialLink;
-    if (eUtils_ThreadStart(pvReaderThread, &sSerialLink.sSerialReader, E_THREAD_JOINABLE) != E_UTILS_OK)
-    {
-        DEBUG_PRINTF( "Failed to start serial reader thread");
-        return E_SL_ERROR;
-    }
+    memset(&sSerialLink.sReplay, 0, sizeof(sSerialLink.sReplay));
+    sSerialLink.sReplay.psFile   = psFile;
+    sSerialLink.sReplay.u32Speed = u32Speed;
+    sSerialLink.iSerialFd        = -1;
     
-    return E_SL_OK;
+    return eSL_Start();
 }
 
 
@@ -276,548 +548,1810 @@ teSL_Status eSL_Destroy(void)
         eSL_RemoveListener(sSerialLink.sCallbacks.psListHead->u16Type, sSerialLink.sCallbacks.psListHead->prCallback);
     }
     
+    eSL_CaptureStop();
+    
     return E_SL_OK;
 }
 
 
-teSL_Status eSL_SendMessage(uint16_t u16Type, uint16_t u16Length, void *pvMessage, uint8_t *pu8SequenceNo)
+teSL_Status eSL_CaptureStart(char *cpFileName)
 {
-    teSL_Status eStatus;
+    tsSL_CaptureHeader sHeader;
+    struct timeval sNow;
+    FILE *psFile;
     
-    /* Make sure there is only one thread sending messages to the node at a time. */
-    pthread_mutex_lock(&sSerialLink.mutex);
-    
-// printf( "a: 0x%04x - %d\n", u16Type, u16Length );
-// dump( (char *)pvMessage, u16Length );
-    eStatus = eSL_WriteMessage(u16Type, u16Length, (uint8_t *)pvMessage);
+    psFile = fopen(cpFileName, "wb");
+    if (!psFile)
+    {
+        printf( "Could not open capture %s (%s)\n", cpFileName, strerror(errno));
+        return E_SL_ERROR;
+    }
+    setvbuf(psFile, NULL, _IOFBF, SL_CAPTURE_BUFFER_SIZE);
     
-    if (eStatus == E_SL_OK)
+    gettimeofday(&sNow, NULL);
+    sHeader.u32Magic     = SL_CAPTURE_MAGIC;
+    sHeader.u16Version   = SL_CAPTURE_VERSION;
+    sHeader.u16Reserved  = 0;
+    sHeader.u64StartTime = (uint64_t)sNow.tv_sec * 1000000 + sNow.tv_usec;
+    if (fwrite(&sHeader, sizeof(sHeader), 1, psFile) != 1)
     {
-// printf( "b\n" );
-        /* Command sent successfully */
-
-        uint16_t    u16Length;
-        tsSL_Msg_Status sStatus;
-        tsSL_Msg_Status *psStatus = &sStatus;
+        fclose(psFile);
+        return E_SL_ERROR;
+    }
+    
+    eSL_CaptureStop();
+    
+    pthread_mutex_lock(&sSerialLink.sCapture.mutex);
+    sSerialLink.sCapture.psFile     = psFile;
+    sSerialLink.sCapture.u64Start   = u64SL_Microseconds();
+    sSerialLink.sCapture.u64Flushed = sSerialLink.sCapture.u64Start;
+    pthread_mutex_unlock(&sSerialLink.sCapture.mutex);
+    
+    return E_SL_OK;
+}
 
-        sStatus.u16MessageType = u16Type;
 
-        /* Expect a status response within 500ms */
-        eStatus = eSL_MessageWait(E_SL_MSG_STATUS, 500, &u16Length, (void**)&psStatus);
-// printf( "c\n" );
-        
-        if (eStatus == E_SL_OK)
-        {
-// printf( "d\n" );
-            DBG_vPrintf(DBG_SERIALLINK, "Status: %d, Sequence %d\n", psStatus->eStatus, psStatus->u8SequenceNo);
-            eStatus = psStatus->eStatus;
-            if (eStatus == E_SL_OK)
-            {
-                if (pu8SequenceNo)
-                {
-                    *pu8SequenceNo = psStatus->u8SequenceNo;
-                }
-            }
-            free(psStatus);
-        } else {
-            printf("*** eSL_SendMessage : error 0x%2x\n", eStatus);
-        }
+teSL_Status eSL_CaptureStop(void)
+{
+    pthread_mutex_lock(&sSerialLink.sCapture.mutex);
+    if (sSerialLink.sCapture.psFile)
+    {
+        fclose(sSerialLink.sCapture.psFile);
+        sSerialLink.sCapture.psFile = NULL;
     }
-    pthread_mutex_unlock(&sSerialLink.mutex);
-// printf( "f\n" );
-    return eStatus;
+    pthread_mutex_unlock(&sSerialLink.sCapture.mutex);
+    
+    return E_SL_OK;
 }
 
 
-teSL_Status eSL_SendMessageNoWait(uint16_t u16Type, uint16_t u16Length, void *pvMessage, uint8_t *pu8SequenceNo)
+teSL_Status eSL_SendMessage(uint16_t u16Type, uint16_t u16Length, void *pvMessage, uint8_t *pu8SequenceNo)
 {
+    tsSL_CommandHandle sHandle;
     teSL_Status eStatus;
     
-    /* Make sure there is only one thread sending messages to the node at a time. */
-    pthread_mutex_lock(&sSerialLink.mutex);
-    
-//printf( "a: 0x%02x - %d\n", u16Type, u16Length );
-//dump( (char *)pvMessage, u16Length );
-    eStatus = eSL_WriteMessage(u16Type, u16Length, (uint8_t *)pvMessage);
-    
-    pthread_mutex_unlock(&sSerialLink.mutex);
-// printf( "b\n" );
+    eStatus = eSL_SendCommand(u16Type, u16Length, pvMessage, NULL, NULL, &sHandle);
+    if (eStatus == E_SL_OK)
+    {
+        /* Expect a status response within 500ms */
+        eStatus = eSL_CommandWait(&sHandle, SL_STATUS_TIMEOUT, pu8SequenceNo);
+        if (eStatus == E_SL_NOMESSAGE)
+        {
+            printf("*** eSL_SendMessage : error 0x%2x\n", eStatus);
+        }
+    }
     return eStatus;
 }
 
 
-teSL_Status eSL_MessageWait(uint16_t u16Type, uint32_t u32WaitTimeout, uint16_t *pu16Length, void **ppvMessage)
+teSL_Status eSL_SendCommand(uint16_t u16Type, uint16_t u16Length, void *pvMessage,
+                            tprSL_StatusCallback prCallback, void *pvUser, tsSL_CommandHandle *psHandle)
 {
+    tsSL_Command *psCommand;
+    struct timespec sGiveUp, sWake;
+    teSL_Priority ePriority = eSL_CommandPriority(u16Type);
+    uint64_t u64Called = u64SL_Microseconds();
+    uint32_t u32Serial, u32TokenWait, u32Wait;
+    teSL_Status eStatus;
     int i;
-    tsSerialLink *psSerialLink = &sSerialLink;
     
-    for (i = 0; i < SL_MAX_MESSAGE_QUEUES; i++)
+    /* Wait for our turn, room in the command window and the transmit rate */
+    vSL_TimeoutAfter(&sGiveUp, 2 * SL_STATUS_TIMEOUT);
+    pthread_mutex_lock(&sSerialLink.sCommands.mutex);
+    if (++sSerialLink.sCommands.asClass[ePriority].u32Queued > sSerialLink.sCommands.asClass[ePriority].u32MaxQueued)
     {
-        DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Locking queue %d mutex\n", i);
-        pthread_mutex_lock(&psSerialLink->asReaderMessageQueue[i].mutex);
-        DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Acquired queue %d mutex\n", i);
-    
-        if (psSerialLink->asReaderMessageQueue[i].u16Type == 0)
+        sSerialLink.sCommands.asClass[ePriority].u32MaxQueued = sSerialLink.sCommands.asClass[ePriority].u32Queued;
+    }
+    while ((psCommand = psSL_ReserveCommand(ePriority, &u32TokenWait)) == NULL)
+    {
+        if (u32TokenWait)
         {
-            struct timeval sNow;
-            struct timespec sTimeout;
-            
-            DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Found free slot %d to wait for message 0x%04X\n", i, u16Type);
+            /* Held back by the rate, nothing is stuck */
+            vSL_TimeoutAfter(&sWake, u32TokenWait);
+            pthread_cond_timedwait(&sSerialLink.sCommands.cond_changed, &sSerialLink.sCommands.mutex, &sWake);
+            vSL_TimeoutAfter(&sGiveUp, 2 * SL_STATUS_TIMEOUT);
+            continue;
+        }
         
-            psSerialLink->asReaderMessageQueue[i].u16Type = u16Type;
-            
-            if (u16Type == E_SL_MSG_STATUS)
+        vSL_TimeoutAfter(&sWake, SL_STATUS_TIMEOUT / 5);
+        if (pthread_cond_timedwait(&sSerialLink.sCommands.cond_changed, &sSerialLink.sCommands.mutex, &sWake) == ETIMEDOUT)
+        {
+            if (sSerialLink.sCommands.iInFlight < iSL_ClassWindow(ePriority))
             {
-                psSerialLink->asReaderMessageQueue[i].pu8Message = *ppvMessage;
+                /* Behind a higher class that is held back by the rate */
+                vSL_TimeoutAfter(&sGiveUp, 2 * SL_STATUS_TIMEOUT);
+                continue;
             }
-
-            memset(&sNow, 0, sizeof(struct timeval));
-            gettimeofday(&sNow, NULL);
-            sTimeout.tv_sec = sNow.tv_sec + (u32WaitTimeout/1000);
-            sTimeout.tv_nsec = (sNow.tv_usec + ((u32WaitTimeout % 1000) * 1000)) * 1000;
-            if (sTimeout.tv_nsec > 1000000000)
+            
+            /* Statuses may have been lost, make room */
+            pthread_mutex_unlock(&sSerialLink.sCommands.mutex);
+            vSL_ExpireCommands();
+            pthread_mutex_lock(&sSerialLink.sCommands.mutex);
+            if (ePriority == E_SL_PRIORITY_INTERACTIVE)
             {
-                sTimeout.tv_sec++;
-                sTimeout.tv_nsec -= 1000000000;
+                /* A user command is never dropped, expired commands make room for it */
+                continue;
             }
-            DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Time now    %lu s, %lu ns\n", sNow.tv_sec, sNow.tv_usec * 1000);
-            DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Wait until  %lu s, %lu ns\n", sTimeout.tv_sec, sTimeout.tv_nsec);
-
-            switch (pthread_cond_timedwait(&psSerialLink->asReaderMessageQueue[i].cond_data_available, &psSerialLink->asReaderMessageQueue[i].mutex, &sTimeout))
+            if (!bSL_TimeBefore(&sWake, &sGiveUp))
             {
-                case (0):
-                    DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Got message type 0x%04x, length %d\n", 
-                                psSerialLink->asReaderMessageQueue[i].u16Type, 
-                                psSerialLink->asReaderMessageQueue[i].u16Length);
-                    *pu16Length = psSerialLink->asReaderMessageQueue[i].u16Length;
-                    *ppvMessage = psSerialLink->asReaderMessageQueue[i].pu8Message;
-                    
-                    /* Reset queue for next user */
-                    psSerialLink->asReaderMessageQueue[i].u16Type = 0;
-                    pthread_mutex_unlock(&psSerialLink->asReaderMessageQueue[i].mutex);
-                    return E_SL_OK;
-                
-                case (ETIMEDOUT):
-                    DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Timed out\n");
-                    /* Reset queue for next user */
-                    psSerialLink->asReaderMessageQueue[i].u16Type = 0;
-                    pthread_mutex_unlock(&psSerialLink->asReaderMessageQueue[i].mutex);
-                    return E_SL_NOMESSAGE;
-                    break;
-                
-                default:
-                    /* Reset queue for next user */
-                    psSerialLink->asReaderMessageQueue[i].u16Type = 0;
-                    pthread_mutex_unlock(&psSerialLink->asReaderMessageQueue[i].mutex);
-                    return E_SL_ERROR;
+                DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Command window stuck, dropping 0x%04X\n", u16Type);
+                sSerialLink.sCommands.asClass[ePriority].u32Queued--;
+                sSerialLink.sCommands.asClass[ePriority].u32Dropped++;
+                pthread_cond_broadcast(&sSerialLink.sCommands.cond_changed);
+                pthread_mutex_unlock(&sSerialLink.sCommands.mutex);
+                vSL_CountEvent(&sSerialLink.sStats.sCounters.u32WindowFull);
+                return E_SL_ERROR;
             }
         }
-        else
+    }
+    
+    u32Wait = (uint32_t)(u64SL_Microseconds() - u64Called);
+    sSerialLink.sCommands.asClass[ePriority].u32Queued--;
+    sSerialLink.sCommands.asClass[ePriority].u32Sent++;
+    sSerialLink.sCommands.asClass[ePriority].u64Wait += u32Wait;
+    if (u32Wait > sSerialLink.sCommands.asClass[ePriority].u32MaxWait)
+    {
+        sSerialLink.sCommands.asClass[ePriority].u32MaxWait = u32Wait;
+    }
+    for (i = ePriority + 1; i < E_SL_PRIORITY_CLASSES; i++)
+    {
+        if (sSerialLink.sCommands.asClass[i].u32Queued)
         {
-            pthread_mutex_unlock(&psSerialLink->asReaderMessageQueue[i].mutex);
+            /* Lower classes may have been waiting for us */
+            pthread_cond_broadcast(&sSerialLink.sCommands.cond_changed);
+            break;
         }
     }
-    DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Error, no free queue slots\n");
-    return E_SL_ERROR;
-}
-
-
-teSL_Status eSL_AddListener(uint16_t u16Type, tprSL_MessageCallback prCallback, void *pvUser)
-{
-    tsSL_CallbackEntry *psCurrentEntry;
-    tsSL_CallbackEntry *psNewEntry;
     
-    DBG_vPrintf(DBG_SERIALLINK_CB, "Register handler %p for message type 0x%04x\n", prCallback, u16Type);
+    psCommand->u16Type    = u16Type;
+    psCommand->iWaited    = (psHandle != NULL);
+    psCommand->prCallback = prCallback;
+    psCommand->pvUser     = pvUser;
+    pthread_mutex_unlock(&sSerialLink.sCommands.mutex);
     
-    psNewEntry = malloc(sizeof(tsSL_CallbackEntry));
-    if (!psNewEntry)
-    {
-        return E_SL_ERROR_NOMEM;
-    }
+    /* Make sure there is only one thread sending messages to the node at a time,
+     * and that commands are numbered in the order they go out. */
+    pthread_mutex_lock(&sSerialLink.mutex);
     
-    psNewEntry->u16Type     = u16Type;
-    psNewEntry->prCallback  = prCallback;
-    psNewEntry->pvUser      = pvUser;
-    psNewEntry->psNext      = NULL;
+    pthread_mutex_lock(&sSerialLink.sCommands.mutex);
+    u32Serial = ++sSerialLink.sCommands.u32Serial;
+    psCommand->u32Serial = u32Serial;
+    psCommand->eState    = E_SL_COMMAND_SENT;
+    psCommand->u64Sent   = u64SL_Microseconds();
+    vSL_TimeoutAfter(&psCommand->sDeadline, SL_STATUS_TIMEOUT);
+    pthread_mutex_unlock(&sSerialLink.sCommands.mutex);
     
-    pthread_mutex_lock(&sSerialLink.sCallbacks.mutex);
-    if (sSerialLink.sCallbacks.psListHead == NULL)
-    {
-        /* Insert at start of list */
-        sSerialLink.sCallbacks.psListHead = psNewEntry;
-    }
-    else
+    eStatus = eSL_WriteMessage(u16Type, u16Length, (uint8_t *)pvMessage);
+    
+    pthread_mutex_unlock(&sSerialLink.mutex);
+    
+    if (eStatus != E_SL_OK)
     {
-        /* Insert at end of list */
-        psCurrentEntry = sSerialLink.sCallbacks.psListHead;
-        while (psCurrentEntry->psNext)
+        /* Nothing will come back for this one */
+        pthread_mutex_lock(&sSerialLink.sCommands.mutex);
+        if ((psCommand->eState == E_SL_COMMAND_SENT) && (psCommand->u32Serial == u32Serial))
         {
-            psCurrentEntry = psCurrentEntry->psNext;
+            psCommand->eState = E_SL_COMMAND_FREE;
+            sSerialLink.sCommands.iInFlight--;
+            pthread_cond_broadcast(&sSerialLink.sCommands.cond_changed);
         }
-        
-        psCurrentEntry->psNext = psNewEntry;
+        pthread_mutex_unlock(&sSerialLink.sCommands.mutex);
+        return eStatus;
+    }
+    
+    if (psHandle)
+    {
+        psHandle->u16Type   = u16Type;
+        psHandle->u8Slot    = psCommand - sSerialLink.sCommands.asCommand;
+        psHandle->u32Serial = u32Serial;
     }
-    pthread_mutex_unlock(&sSerialLink.sCallbacks.mutex);
     return E_SL_OK;
 }
 
 
-teSL_Status eSL_RemoveListener(uint16_t u16Type, tprSL_MessageCallback prCallback)
+teSL_Status eSL_CommandWait(tsSL_CommandHandle *psHandle, uint32_t u32WaitTimeout, uint8_t *pu8SequenceNo)
 {
-    tsSL_CallbackEntry *psCurrentEntry;
-    tsSL_CallbackEntry *psOldEntry = NULL;
+    tsSL_Command *psCommand;
+    tsSL_Completion sCompletion;
+    struct timespec sTimeout;
+    teSL_Status eStatus;
     
-    DBG_vPrintf(DBG_SERIALLINK_CB, "Remove handler %p for message type 0x%04x\n", prCallback, u16Type);
+    if (psHandle->u8Slot >= SL_MAX_COMMANDS)
+    {
+        return E_SL_ERROR;
+    }
+    psCommand = &sSerialLink.sCommands.asCommand[psHandle->u8Slot];
+    sCompletion.prCallback = NULL;
     
-    pthread_mutex_lock(&sSerialLink.sCallbacks.mutex);
+    vSL_TimeoutAfter(&sTimeout, u32WaitTimeout);
+    pthread_mutex_lock(&sSerialLink.sCommands.mutex);
     
-    if (sSerialLink.sCallbacks.psListHead->prCallback == prCallback)
+    if ((psCommand->u32Serial != psHandle->u32Serial) || !psCommand->iWaited ||
+        (psCommand->eState == E_SL_COMMAND_FREE))
     {
-        /* Start of the list */
-        psOldEntry = sSerialLink.sCallbacks.psListHead;
-        sSerialLink.sCallbacks.psListHead = psOldEntry->psNext;
+        pthread_mutex_unlock(&sSerialLink.sCommands.mutex);
+        return E_SL_ERROR;
     }
-    else
+    
+    while (psCommand->eState == E_SL_COMMAND_SENT)
     {
-        psCurrentEntry = sSerialLink.sCallbacks.psListHead;
-        while (psCurrentEntry->psNext)
+        bool bCommandDeadline = bSL_TimeBefore(&psCommand->sDeadline, &sTimeout);
+        
+        if (pthread_cond_timedwait(&sSerialLink.sCommands.cond_changed, &sSerialLink.sCommands.mutex, 
+                                   bCommandDeadline ? &psCommand->sDeadline : &sTimeout) == ETIMEDOUT)
         {
-            if (psCurrentEntry->psNext->prCallback == prCallback)
+            if (psCommand->eState != E_SL_COMMAND_SENT)
+            {
+                break;
+            }
+            if (bCommandDeadline)
+            {
+                DBG_vPrintf(DBG_SERIALLINK_QUEUE, "No status for command 0x%04X\n", psCommand->u16Type);
+                vSL_CountStatus(psCommand, FALSE);
+                vSL_CompleteCommand(psCommand, E_SL_NOMESSAGE, 0, &sCompletion);
+            }
+            else
             {
-                psOldEntry = psCurrentEntry->psNext;
-                psCurrentEntry->psNext = psCurrentEntry->psNext->psNext;
                 break;
             }
         }
     }
-    pthread_mutex_unlock(&sSerialLink.sCallbacks.mutex);
     
-    if (!psOldEntry)
+    if (psCommand->eState == E_SL_COMMAND_DONE)
+    {
+        eStatus = psCommand->eStatus;
+        if (pu8SequenceNo && (eStatus == E_SL_OK))
+        {
+            *pu8SequenceNo = psCommand->u8SequenceNo;
+        }
+        psCommand->eState = E_SL_COMMAND_FREE;
+        pthread_cond_broadcast(&sSerialLink.sCommands.cond_changed);
+    }
+    else
+    {
+        /* Caller gives up, the status is dropped when it arrives */
+        psCommand->iWaited = 0;
+        eStatus = E_SL_NOMESSAGE;
+    }
+    pthread_mutex_unlock(&sSerialLink.sCommands.mutex);
+    
+    vSL_CallCompletion(&sCompletion);
+    return eStatus;
+}
+
+
+void vSL_SetCommandWindow(int iWindow)
+{
+    if (iWindow < 1)
+    {
+        iWindow = 1;
+    }
+    else if (iWindow > SL_MAX_COMMANDS)
+    {
+        iWindow = SL_MAX_COMMANDS;
+    }
+    
+    pthread_mutex_lock(&sSerialLink.sCommands.mutex);
+    sSerialLink.sCommands.iWindow = iWindow;
+    pthread_cond_broadcast(&sSerialLink.sCommands.cond_changed);
+    pthread_mutex_unlock(&sSerialLink.sCommands.mutex);
+}
+
+
+void vSL_SetTxRate(uint32_t u32Rate, uint32_t u32Burst)
+{
+    pthread_mutex_lock(&sSerialLink.sCommands.mutex);
+    sSerialLink.sCommands.u32TxInterval = u32Rate ? 1000000 / u32Rate : 0;
+    sSerialLink.sCommands.u32TxBurst    = u32Burst ? u32Burst : 1;
+    pthread_cond_broadcast(&sSerialLink.sCommands.cond_changed);
+    pthread_mutex_unlock(&sSerialLink.sCommands.mutex);
+}
+
+
+teSL_Status eSL_SendMessageNoWait(uint16_t u16Type, uint16_t u16Length, void *pvMessage, uint8_t *pu8SequenceNo)
+{
+    /* Scheduled like any other command, the status is dropped when it arrives */
+    return eSL_SendCommand(u16Type, u16Length, pvMessage, NULL, NULL, NULL);
+}
+
+
+teSL_Status eSL_MessageWait(uint16_t u16Type, uint32_t u32WaitTimeout, uint16_t *pu16Length, void **ppvMessage)
+{
+    tsSL_Waiter *psWaiter;
+    struct timespec sTimeout;
+    int8_t *pi8Link;
+    int8_t i8Waiter;
+    teSL_Status eStatus = E_SL_OK;
+    
+    vSL_TimeoutAfter(&sTimeout, u32WaitTimeout);
+    
+    pthread_mutex_lock(&sSerialLink.sWaiters.mutex);
+    
+    i8Waiter = sSerialLink.sWaiters.i8Free;
+    if (i8Waiter < 0)
+    {
+        pthread_mutex_unlock(&sSerialLink.sWaiters.mutex);
+        DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Error, no free queue slots\n");
+        vSL_CountEvent(&sSerialLink.sStats.sCounters.u32WaiterFull);
+        return E_SL_ERROR;
+    }
+    psWaiter = &sSerialLink.sWaiters.asWaiter[i8Waiter];
+    sSerialLink.sWaiters.i8Free = psWaiter->i8Next;
+    
+    psWaiter->u16Type       = u16Type;
+    psWaiter->u16StatusType = SL_ANY_STATUS_TYPE;
+    psWaiter->i8Next        = -1;
+    psWaiter->iDone         = 0;
+    psWaiter->u16Length     = 0;
+    psWaiter->pu8Message    = NULL;
+    if ((u16Type == E_SL_MSG_STATUS) && *ppvMessage)
+    {
+        /* Only the status to this type of message */
+        psWaiter->u16StatusType = ((tsSL_Msg_Status *)*ppvMessage)->u16MessageType;
+    }
+    
+    /* Append to the bucket, so waiters for the same message are served in order */
+    for (pi8Link = &sSerialLink.sWaiters.ai8Bucket[u8SL_WaiterBucket(u16Type, psWaiter->u16StatusType)];
+         *pi8Link >= 0;
+         pi8Link = &sSerialLink.sWaiters.asWaiter[(int)*pi8Link].i8Next);
+    *pi8Link = i8Waiter;
+    
+    DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Waiter %d waits for message 0x%04X\n", i8Waiter, u16Type);
+    
+    while (!psWaiter->iDone)
+    {
+        int iResult = pthread_cond_timedwait(&psWaiter->cond_data_available, &sSerialLink.sWaiters.mutex, &sTimeout);
+        if (psWaiter->iDone)
+        {
+            break;
+        }
+        if (iResult == ETIMEDOUT)
+        {
+            DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Timed out\n");
+            eStatus = E_SL_NOMESSAGE;
+            break;
+        }
+        else if (iResult != 0)
+        {
+            eStatus = E_SL_ERROR;
+            break;
+        }
+    }
+    
+    if (psWaiter->iDone)
+    {
+        /* Delivered and already unlinked by eSL_MessageQueue() */
+        if (psWaiter->pu8Message)
+        {
+            DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Got message type 0x%04x, length %d\n", u16Type, psWaiter->u16Length);
+            *pu16Length = psWaiter->u16Length;
+            *ppvMessage = psWaiter->pu8Message;
+            eStatus = E_SL_OK;
+        }
+        else
+        {
+            /* Reader thread stopped */
+            eStatus = E_SL_NOMESSAGE;
+        }
+    }
+    else
+    {
+        vSL_UnlinkWaiter(i8Waiter);
+    }
+    
+    /* Reset slot for next user */
+    psWaiter->u16Type = 0;
+    psWaiter->i8Next  = sSerialLink.sWaiters.i8Free;
+    sSerialLink.sWaiters.i8Free = i8Waiter;
+    
+    pthread_mutex_unlock(&sSerialLink.sWaiters.mutex);
+    return eStatus;
+}
+
+
+uint32_t u32SL_MessageAge(void)
+{
+    if (u64HandlingQueued == 0)
+    {
+        return 0;
+    }
+    return (uint32_t)(u64SL_Microseconds() - u64HandlingQueued);
+}
+
+
+void vSL_GetStats(tsSL_Stats *psStats)
+{
+    int i;
+    
+    pthread_mutex_lock(&sSerialLink.sStats.mutex);
+    *psStats = sSerialLink.sStats.sCounters;
+    pthread_mutex_unlock(&sSerialLink.sStats.mutex);
+    
+    pthread_mutex_lock(&sSerialLink.sCommands.mutex);
+    for (i = 0; i < E_SL_PRIORITY_CLASSES; i++)
+    {
+        tsSL_ClassStats *psClass = &psStats->asClass[i];
+        
+        psClass->u32Sent      = sSerialLink.sCommands.asClass[i].u32Sent;
+        psClass->u32Dropped   = sSerialLink.sCommands.asClass[i].u32Dropped;
+        psClass->u32Queued    = sSerialLink.sCommands.asClass[i].u32Queued;
+        psClass->u32MaxQueued = sSerialLink.sCommands.asClass[i].u32MaxQueued;
+        psClass->u32AvgWait   = psClass->u32Sent ? (uint32_t)(sSerialLink.sCommands.asClass[i].u64Wait / psClass->u32Sent) : 0;
+        psClass->u32MaxWait   = sSerialLink.sCommands.asClass[i].u32MaxWait;
+    }
+    pthread_mutex_unlock(&sSerialLink.sCommands.mutex);
+    
+    /* Worker figures are only read here, a torn snapshot is good enough */
+    for (i = 0; i < SL_CALLBACK_WORKERS; i++)
+    {
+        tsSL_Worker *psWorker = &sSerialLink.asWorker[i];
+        
+        psStats->asWorker[i].u32Depth      = psWorker->u32Depth;
+        psStats->asWorker[i].u32MaxDepth   = psWorker->u32MaxDepth;
+        psStats->asWorker[i].u32Overflowed = psWorker->u32Overflowed;
+        psStats->asWorker[i].u32Handled    = psWorker->u32Handled;
+        psStats->asWorker[i].u32AvgLatency = psWorker->u32Handled ? (uint32_t)(psWorker->u64Latency / psWorker->u32Handled) : 0;
+        psStats->asWorker[i].u32MaxLatency = psWorker->u32MaxLatency;
+    }
+}
+
+
+teSL_Status eSL_AddListener(uint16_t u16Type, tprSL_MessageCallback prCallback, void *pvUser)
+{
+    tsSL_CallbackEntry *psCurrentEntry;
+    tsSL_CallbackEntry *psNewEntry;
+    
+    DBG_vPrintf(DBG_SERIALLINK_CB, "Register handler %p for message type 0x%04x\n", prCallback, u16Type);
+    
+    psNewEntry = malloc(sizeof(tsSL_CallbackEntry));
+    if (!psNewEntry)
+    {
+        return E_SL_ERROR_NOMEM;
+    }
+    
+    psNewEntry->u16Type     = u16Type;
+    psNewEntry->prCallback  = prCallback;
+    psNewEntry->pvUser      = pvUser;
+    psNewEntry->psNext      = NULL;
+    
+    pthread_mutex_lock(&sSerialLink.sCallbacks.mutex);
+    if (sSerialLink.sCallbacks.psListHead == NULL)
+    {
+        /* Insert at start of list */
+        sSerialLink.sCallbacks.psListHead = psNewEntry;
+    }
+    else
+    {
+        /* Insert at end of list */
+        psCurrentEntry = sSerialLink.sCallbacks.psListHead;
+        while (psCurrentEntry->psNext)
+        {
+            psCurrentEntry = psCurrentEntry->psNext;
+        }
+        
+        psCurrentEntry->psNext = psNewEntry;
+    }
+    vSL_RebuildHandlers();
+    pthread_mutex_unlock(&sSerialLink.sCallbacks.mutex);
+    return E_SL_OK;
+}
+
+
+teSL_Status eSL_RemoveListener(uint16_t u16Type, tprSL_MessageCallback prCallback)
+{
+    tsSL_CallbackEntry *psCurrentEntry;
+    tsSL_CallbackEntry *psOldEntry = NULL;
+    
+    DBG_vPrintf(DBG_SERIALLINK_CB, "Remove handler %p for message type 0x%04x\n", prCallback, u16Type);
+    
+    pthread_mutex_lock(&sSerialLink.sCallbacks.mutex);
+    
+    if (sSerialLink.sCallbacks.psListHead == NULL)
+    {
+        /* Empty list */
+    }
+    else if (sSerialLink.sCallbacks.psListHead->prCallback == prCallback)
+    {
+        /* Start of the list */
+        psOldEntry = sSerialLink.sCallbacks.psListHead;
+        sSerialLink.sCallbacks.psListHead = psOldEntry->psNext;
+    }
+    else
+    {
+        psCurrentEntry = sSerialLink.sCallbacks.psListHead;
+        while (psCurrentEntry->psNext)
+        {
+            if (psCurrentEntry->psNext->prCallback == prCallback)
+            {
+                psOldEntry = psCurrentEntry->psNext;
+                psCurrentEntry->psNext = psCurrentEntry->psNext->psNext;
+                break;
+            }
+            psCurrentEntry = psCurrentEntry->psNext;
+        }
+    }
+    vSL_RebuildHandlers();
+    pthread_mutex_unlock(&sSerialLink.sCallbacks.mutex);
+    
+    if (!psOldEntry)
     {
         DBG_vPrintf(DBG_SERIALLINK_CB, "Entry not found\n");
         return E_SL_ERROR;
     }
     
-    /* Free removed entry from list */
-    free(psOldEntry);
-    return E_SL_OK;
+    /* Free removed entry from list */
+    free(psOldEntry);
+    return E_SL_OK;
+}
+
+
+/****************************************************************************/
+/***        Local Functions                                               ***/
+/****************************************************************************/
+
+/****************************************************************************
+*
+* NAME: eSL_Start
+*
+* DESCRIPTION:
+* Set up the serial link state and start the reader and callback threads,
+* once the data source (serial port or capture) is open.
+*
+****************************************************************************/
+static teSL_Status eSL_Start(void)
+{
+    int i;
+    
+    /* Not capturing */
+    pthread_mutex_init(&sSerialLink.sCapture.mutex, NULL);
+    sSerialLink.sCapture.psFile = NULL;
+    
+    /* Start with an empty receive buffer */
+    sSerialLink.sRxBuffer.u32Head = 0;
+    sSerialLink.sRxBuffer.u32Tail = 0;
+    
+    /* Initialise serial link mutex */
+    pthread_mutex_init(&sSerialLink.mutex, NULL);
+    
+    /* Initialise command tracking */
+    pthread_mutex_init(&sSerialLink.sCommands.mutex, NULL);
+    pthread_cond_init(&sSerialLink.sCommands.cond_changed, NULL);
+    memset(sSerialLink.sCommands.asCommand, 0, sizeof(sSerialLink.sCommands.asCommand));
+    sSerialLink.sCommands.iWindow   = SL_DEFAULT_COMMAND_WINDOW;
+    sSerialLink.sCommands.iInFlight = 0;
+    sSerialLink.sCommands.u32Serial = 0;
+    sSerialLink.sCommands.u32TxInterval = 0;
+    sSerialLink.sCommands.u32TxBurst    = 1;
+    sSerialLink.sCommands.u64TxDue      = 0;
+    memset(sSerialLink.sCommands.asClass, 0, sizeof(sSerialLink.sCommands.asClass));
+    
+    /* Initialise message callbacks */
+    pthread_mutex_init(&sSerialLink.sCallbacks.mutex, NULL);
+    sSerialLink.sCallbacks.psListHead = NULL;
+    memset(sSerialLink.sCallbacks.asHandler, 0, sizeof(sSerialLink.sCallbacks.asHandler));
+    
+    /* Preallocate the callback buffers */
+    pthread_mutex_init(&sSerialLink.sCallbackPool.mutex, NULL);
+    if ((eSL_CreatePool(SL_POOL_SMALL, SL_SMALL_MESSAGE_LENGTH) != E_SL_OK) ||
+        (eSL_CreatePool(SL_POOL_LARGE, SL_MAX_MESSAGE_LENGTH) != E_SL_OK))
+    {
+        DEBUG_PRINTF( "Error creating callback buffers\n");
+        return E_SL_ERROR_NOMEM;
+    }
+    
+    /* Initialise message wait queue */
+    pthread_mutex_init(&sSerialLink.sWaiters.mutex, NULL);
+    for (i = 0; i < SL_MAX_MESSAGE_QUEUES; i++)
+    {
+        pthread_cond_init(&sSerialLink.sWaiters.asWaiter[i].cond_data_available, NULL);
+        sSerialLink.sWaiters.asWaiter[i].u16Type = 0;
+        sSerialLink.sWaiters.asWaiter[i].i8Next  = (i + 1 < SL_MAX_MESSAGE_QUEUES) ? i + 1 : -1;
+    }
+    sSerialLink.sWaiters.i8Free = 0;
+    for (i = 0; i < SL_WAITER_BUCKETS; i++)
+    {
+        sSerialLink.sWaiters.ai8Bucket[i] = -1;
+    }
+    
+    /* Initialise link statistics */
+    pthread_mutex_init(&sSerialLink.sStats.mutex, NULL);
+    memset(&sSerialLink.sStats.sCounters, 0, sizeof(tsSL_Stats));
+    
+    for (i = 0; i < SL_CALLBACK_WORKERS; i++)
+    {
+        tsSL_Worker *psWorker = &sSerialLink.asWorker[i];
+        
+        memset(psWorker, 0, sizeof(tsSL_Worker));
+        pthread_mutex_init(&psWorker->mOverflow, NULL);
+        
+        /* Initialise callback queue, the reader must never block on it */
+        if (eUtils_QueueCreate(&psWorker->sQueue, SL_MAX_CALLBACK_QUEUES, UTILS_QUEUE_NONBLOCK_INPUT) != E_UTILS_OK)
+        {
+            DEBUG_PRINTF( "Error creating callback queue\n");
+            return E_SL_ERROR;
+        }
+        
+        /* Start the callback handler thread */
+        psWorker->sThread.pvThreadData = psWorker;
+        if (eUtils_ThreadStart(pvCallbackHandlerThread, &psWorker->sThread, E_THREAD_JOINABLE) != E_UTILS_OK)
+        {
+            DEBUG_PRINTF( "Failed to start callback handler thread");
+            return E_SL_ERROR;
+        }
+    }
+    
+    /* Start the serial reader thread */
+    sSerialLink.sSerialReader.pvThreadData = &sSerialLink;
+    if (eUtils_ThreadStart(pvReaderThread, &sSerialLink.sSerialReader, E_THREAD_JOINABLE) != E_UTILS_OK)
+    {
+        DEBUG_PRINTF( "Failed to start serial reader thread");
+        return E_SL_ERROR;
+    }
+    
+    return E_SL_OK;
+}
+
+
+
+/****************************************************************************
+*
+* NAME: eSL_ReadMessage
+*
+* DESCRIPTION:
+* Return the next valid frame from the receive buffer, reading more data
+* from the serial port when the buffer holds no complete frame.
+*
+* RETURNS:
+* E_SL_OK when a message was received, E_SL_NOMESSAGE when the read failed
+****************************************************************************/
+static teSL_Status eSL_ReadMessage(uint16_t *pu16Type, uint16_t *pu16Length, uint16_t u16MaxLength, uint8_t *pu8Message)
+{
+    while (eSL_DecodeFrame(pu16Type, pu16Length, u16MaxLength, pu8Message) != E_SL_OK)
+    {
+        if (!bSL_RxFill())
+        {
+            return E_SL_NOMESSAGE;
+        }
+    }
+    return E_SL_OK;
+}
+
+
+/****************************************************************************
+*
+* NAME: eSL_DecodeFrame
+*
+* DESCRIPTION:
+* Scan the receive buffer for a START ... END span, unescape it in place
+* and check the CRC. Bytes in front of the frame and invalid frames are
+* dropped. A START inside a frame restarts it, like the byte-wise decoder did.
+*
+* RETURNS:
+* E_SL_OK when a message was decoded, E_SL_NOMESSAGE when more data is needed
+****************************************************************************/
+static teSL_Status eSL_DecodeFrame(uint16_t *pu16Type, uint16_t *pu16Length, uint16_t u16MaxLength, uint8_t *pu8Message)
+{
+    uint8_t *pu8Buffer = sSerialLink.sRxBuffer.au8Buffer;
+    
+    while (sSerialLink.sRxBuffer.u32Head < sSerialLink.sRxBuffer.u32Tail)
+    {
+        uint8_t *pu8Start, *pu8End, *pu8Restart, *pu8In, *pu8Out;
+        uint32_t u32Available = sSerialLink.sRxBuffer.u32Tail - sSerialLink.sRxBuffer.u32Head;
+        uint32_t u32Decoded;
+        uint16_t u16Length;
+        uint8_t u8CRC;
+        
+        pu8Start = memchr(&pu8Buffer[sSerialLink.sRxBuffer.u32Head], SL_START_CHAR, u32Available);
+        if (!pu8Start)
+        {
+            /* Nothing but noise */
+            sSerialLink.sRxBuffer.u32Head = sSerialLink.sRxBuffer.u32Tail;
+            break;
+        }
+        sSerialLink.sRxBuffer.u32Head = pu8Start - pu8Buffer;
+        u32Available = sSerialLink.sRxBuffer.u32Tail - sSerialLink.sRxBuffer.u32Head;
+        
+        pu8End = memchr(pu8Start + 1, SL_END_CHAR, u32Available - 1);
+        if (!pu8End)
+        {
+            if (u32Available > SL_MAX_FRAME_LENGTH)
+            {
+                /* No end in sight, look for the next start */
+                DBG_vPrintf(DBG_SERIALLINK_COMMS, "Frame too long\n");
+                vSL_CountEvent(&sSerialLink.sStats.sCounters.u32LengthErrors);
+                sSerialLink.sRxBuffer.u32Head++;
+                continue;
+            }
+            /* Partial frame, wait for the rest */
+            break;
+        }
+        
+        /* The frame is consumed whatever its contents */
+        sSerialLink.sRxBuffer.u32Head = pu8End + 1 - pu8Buffer;
+        
+        /* Restart at the last start character in front of the end */
+        for (pu8Restart = pu8End - 1; pu8Restart > pu8Start; pu8Restart--)
+        {
+            if (*pu8Restart == SL_START_CHAR)
+            {
+                DBG_vPrintf(DBG_SERIALLINK_COMMS, "RX Restart\n");
+                pu8Start = pu8Restart;
+                break;
+            }
+        }
+        
+        /* Unescape in place */
+        pu8Out = pu8Start + 1;
+        for (pu8In = pu8Start + 1; pu8In < pu8End; pu8In++)
+        {
+            if (*pu8In == SL_ESC_CHAR)
+            {
+                if (++pu8In == pu8End)
+                {
+                    break;
+                }
+                *pu8Out++ = *pu8In ^ 0x10;
+            }
+            else
+            {
+                *pu8Out++ = *pu8In;
+            }
+        }
+        u32Decoded = pu8Out - (pu8Start + 1);
+        pu8In = pu8Start + 1;
+        
+        /* Type (2), length (2) and CRC (1) are always there */
+        if (u32Decoded < 5)
+        {
+            DBG_vPrintf(DBG_SERIALLINK_COMMS, "Frame too short\n");
+            vSL_CountEvent(&sSerialLink.sStats.sCounters.u32LengthErrors);
+            continue;
+        }
+        
+        u16Length = ((uint16_t)pu8In[2] << 8) | pu8In[3];
+        if ((u16Length > u16MaxLength) || (u16Length > u32Decoded - 5))
+        {
+            DBG_vPrintf(DBG_SERIALLINK_COMMS, "Length %d invalid\n", u16Length);
+            vSL_CountEvent(&sSerialLink.sStats.sCounters.u32LengthErrors);
+            continue;
+        }
+        
+        *pu16Type   = ((uint16_t)pu8In[0] << 8) | pu8In[1];
+        *pu16Length = u16Length;
+        u8CRC       = pu8In[4];
+        memcpy(pu8Message, &pu8In[5], u16Length);
+        
+        if (u8CRC != u8SL_CalculateCRC(*pu16Type, *pu16Length, pu8Message))
+        {
+            DBG_vPrintf(DBG_SERIALLINK_COMMS, "CRC BAD\n");
+            vSL_CountEvent(&sSerialLink.sStats.sCounters.u32CrcErrors);
+            continue;
+        }
+        
+#if DBG_SERIALLINK
+        {
+            int i;
+            DBG_vPrintf(DBG_SERIALLINK, "RX Message type 0x%04x length %d: { ", *pu16Type, *pu16Length);
+            for (i = 0; i < *pu16Length; i++)
+            {
+                printf("0x%02x ", pu8Message[i]);
+            }
+            printf("}\n");
+        }
+#endif /* DBG_SERIALLINK */
+        vSL_CountFrame(FALSE, *pu16Type, *pu16Length, pu8End + 1 - pu8Start);
+        return E_SL_OK;
+    }
+    return E_SL_NOMESSAGE;
+}
+
+
+/****************************************************************************
+*
+* NAME: vSL_WriteRawMessage
+*
+* DESCRIPTION:
+*
+* PARAMETERS: Name        RW  Usage
+*
+* RETURNS:
+* void
+****************************************************************************/
+static teSL_Status eSL_WriteMessage(uint16_t u16Type, uint16_t u16Length, uint8_t *pu8Data)
+{
+    int n;
+    uint8_t u8CRC;
+    uint8_t *pu8Frame;
+
+    if (u16Length > SL_MAX_MESSAGE_LENGTH)
+    {
+        DBG_vPrintf(DBG_SERIALLINK_COMMS, "Message too long (%d)\n", u16Length);
+        return E_SL_ERROR;
+    }
+
+    u8CRC = u8SL_CalculateCRC(u16Type, u16Length, pu8Data);
+
+    DBG_vPrintf(DBG_SERIALLINK_COMMS, "(%d, %d, %02x)\n", u16Type, u16Length, u8CRC);
+
+    if (verbosity >= 10)
+    {
+        char acBuffer[4096];
+        int iPosition = 0, i;
+        
+        iPosition = sprintf(&acBuffer[iPosition], "Host->Node 0x%04X (Length % 4d)", u16Type, u16Length);
+        for (i = 0; i < u16Length; i++)
+        {
+            iPosition += sprintf(&acBuffer[iPosition], " 0x%02X", pu8Data[i]);
+        }
+        DEBUG_PRINTF( "%s", acBuffer);
+    }
+    
+    /* Assemble the escaped frame and send it in one go */
+    pu8Frame = sSerialLink.au8TxBuffer;
+    *pu8Frame++ = SL_START_CHAR;
+
+    /* Message type */
+    pu8Frame += iSL_TxByte(pu8Frame, (u16Type >> 8) & 0xff);
+    pu8Frame += iSL_TxByte(pu8Frame, (u16Type >> 0) & 0xff);
+
+    /* Message length */
+    pu8Frame += iSL_TxByte(pu8Frame, (u16Length >> 8) & 0xff);
+    pu8Frame += iSL_TxByte(pu8Frame, (u16Length >> 0) & 0xff);
+
+    /* Message checksum */
+    pu8Frame += iSL_TxByte(pu8Frame, u8CRC);
+
+    /* Message payload */  
+    for(n = 0; n < u16Length; n++)
+    {       
+        pu8Frame += iSL_TxByte(pu8Frame, pu8Data[n]);
+    }
+
+    *pu8Frame++ = SL_END_CHAR;
+
+    vSL_CaptureWrite(E_SL_CAPTURE_TX, sSerialLink.au8TxBuffer, pu8Frame - sSerialLink.au8TxBuffer);
+    
+    if (sSerialLink.sReplay.psFile)
+    {
+        /* Nobody to send to, the capture has the answers */
+        sSerialLink.sReplay.iStarted = 1;
+        return E_SL_OK;
+    }
+
+    if (eSerial_WriteBuffer(sSerialLink.au8TxBuffer, pu8Frame - sSerialLink.au8TxBuffer) != E_SERIAL_OK)
+    {
+        return E_SL_ERROR_SERIAL;
+    }
+    vSL_CountFrame(TRUE, u16Type, u16Length, pu8Frame - sSerialLink.au8TxBuffer);
+    return E_SL_OK;
+}
+
+static uint8_t u8SL_CalculateCRC(uint16_t u16Type, uint16_t u16Length, uint8_t *pu8Data)
+{
+    int n;
+    uint8_t u8CRC = 0;
+
+    u8CRC ^= (u16Type >> 8) & 0xff;
+    u8CRC ^= (u16Type >> 0) & 0xff;
+    
+    u8CRC ^= (u16Length >> 8) & 0xff;
+    u8CRC ^= (u16Length >> 0) & 0xff;
+
+    for(n = 0; n < u16Length; n++)
+    {
+        u8CRC ^= pu8Data[n];
+    }
+    return(u8CRC);
+}
+
+/****************************************************************************
+*
+* NAME: iSL_TxByte
+*
+* DESCRIPTION:
+* Put a byte into the frame being assembled, escaping it when it could
+* be taken for one of the framing characters.
+*
+* PARAMETERS:  Name                RW  Usage
+*              pu8Frame            W   Where to put the (escaped) byte
+*              u8Data              R   Byte to send
+*
+* RETURNS:
+* Number of bytes used in the frame
+****************************************************************************/
+static int iSL_TxByte(uint8_t *pu8Frame, uint8_t u8Data)
+{
+    if (u8Data < 0x10)
+    {
+        pu8Frame[0] = SL_ESC_CHAR;
+        pu8Frame[1] = u8Data ^ 0x10;
+        return 2;
+    }
+    pu8Frame[0] = u8Data;
+    return 1;
+}
+
+
+/****************************************************************************
+*
+* NAME: bSL_RxFill
+*
+* DESCRIPTION:
+* Move the undecoded bytes to the front of the receive buffer and append
+* whatever the serial port has available, in a single read.
+*
+* RETURNS:
+* TRUE when data was added to the buffer
+****************************************************************************/
+static bool bSL_RxFill(void)
+{
+    uint32_t u32Count;
+    
+    if (sSerialLink.sRxBuffer.u32Head > 0)
+    {
+        sSerialLink.sRxBuffer.u32Tail -= sSerialLink.sRxBuffer.u32Head;
+        memmove(sSerialLink.sRxBuffer.au8Buffer, 
+                &sSerialLink.sRxBuffer.au8Buffer[sSerialLink.sRxBuffer.u32Head], 
+                sSerialLink.sRxBuffer.u32Tail);
+        sSerialLink.sRxBuffer.u32Head = 0;
+    }
+    
+    if (sSerialLink.sReplay.psFile)
+    {
+        return bSL_ReplayFill();
+    }
+    
+    u32Count = SL_RX_BUFFER_SIZE - sSerialLink.sRxBuffer.u32Tail;
+    if (eSerial_ReadBuffer(&sSerialLink.sRxBuffer.au8Buffer[sSerialLink.sRxBuffer.u32Tail], &u32Count) != E_SERIAL_OK)
+    {
+        return FALSE;
+    }
+    DBG_vPrintf(DBG_SERIALLINK_COMMS, "RX %d bytes\n", u32Count);
+    vSL_CaptureWrite(E_SL_CAPTURE_RX, &sSerialLink.sRxBuffer.au8Buffer[sSerialLink.sRxBuffer.u32Tail], u32Count);
+    sSerialLink.sRxBuffer.u32Tail += u32Count;
+    return TRUE;
+}
+
+
+/****************************************************************************
+*
+* NAME: bSL_ReplayFill
+*
+* DESCRIPTION:
+* Append the next received block of the capture being replayed to the
+* receive buffer, at the time it was received divided by the speed up.
+* Blocks sent by the host are skipped.
+*
+* RETURNS:
+* TRUE when data was added to the buffer
+****************************************************************************/
+static bool bSL_ReplayFill(void)
+{
+    FILE *psFile = sSerialLink.sReplay.psFile;
+    uint32_t u32Count;
+    
+    if (!sSerialLink.sReplay.iStarted)
+    {
+        IOT_MSLEEP(10);
+        return FALSE;
+    }
+    
+    while (sSerialLink.sReplay.u32Remaining == 0)
+    {
+        tsSL_CaptureRecord sRecord;
+        
+        if (fread(&sRecord, sizeof(sRecord), 1, psFile) != 1)
+        {
+            if (!sSerialLink.sReplay.iFinished)
+            {
+                printf( "Replay finished: %u blocks, %llu bytes in %llu ms\n",
+                        sSerialLink.sReplay.u32Blocks, (unsigned long long)sSerialLink.sReplay.u64Bytes,
+                        (unsigned long long)(u64SL_Microseconds() - sSerialLink.sReplay.u64Start) / 1000);
+                sSerialLink.sReplay.iFinished = 1;
+            }
+            IOT_MSLEEP(100);
+            return FALSE;
+        }
+        if (sRecord.u8Direction != E_SL_CAPTURE_RX)
+        {
+            fseek(psFile, sRecord.u16Length, SEEK_CUR);
+            continue;
+        }
+        
+        if (sSerialLink.sReplay.u32Speed)
+        {
+            uint64_t u64Due, u64Now = u64SL_Microseconds();
+            
+            if (sSerialLink.sReplay.u32Blocks == 0)
+            {
+                /* The first block is due now */
+                sSerialLink.sReplay.u64Start = u64Now - sRecord.u64Time / sSerialLink.sReplay.u32Speed;
+            }
+            u64Due = sSerialLink.sReplay.u64Start + sRecord.u64Time / sSerialLink.sReplay.u32Speed;
+            if (u64Due > u64Now)
+            {
+                usleep(u64Due - u64Now);
+            }
+        }
+        else if (sSerialLink.sReplay.u32Blocks == 0)
+        {
+            sSerialLink.sReplay.u64Start = u64SL_Microseconds();
+        }
+        sSerialLink.sReplay.u32Remaining = sRecord.u16Length;
+        sSerialLink.sReplay.u32Blocks++;
+    }
+    
+    /* A block may be fed in parts when the buffer holds the start of a frame */
+    u32Count = SL_RX_BUFFER_SIZE - sSerialLink.sRxBuffer.u32Tail;
+    if (u32Count > sSerialLink.sReplay.u32Remaining)
+    {
+        u32Count = sSerialLink.sReplay.u32Remaining;
+    }
+    if (fread(&sSerialLink.sRxBuffer.au8Buffer[sSerialLink.sRxBuffer.u32Tail], 1, u32Count, psFile) != u32Count)
+    {
+        /* Truncated capture */
+        sSerialLink.sReplay.u32Remaining = 0;
+        return FALSE;
+    }
+    sSerialLink.sReplay.u32Remaining -= u32Count;
+    sSerialLink.sReplay.u64Bytes     += u32Count;
+    sSerialLink.sRxBuffer.u32Tail    += u32Count;
+    return TRUE;
 }
 
 
-/****************************************************************************/
-/***        Local Functions                                               ***/
-/****************************************************************************/
+/****************************************************************************
+*
+* NAME: vSL_CaptureWrite
+*
+* DESCRIPTION:
+* Append a block of raw serial data to the capture file, if capturing.
+*
+****************************************************************************/
+static void vSL_CaptureWrite(teSL_CaptureDirection eDirection, uint8_t *pu8Data, uint32_t u32Length)
+{
+    tsSL_CaptureRecord sRecord;
+    uint64_t u64Now;
+    
+    if (!sSerialLink.sCapture.psFile)
+    {
+        return;
+    }
+    
+    pthread_mutex_lock(&sSerialLink.sCapture.mutex);
+    if (sSerialLink.sCapture.psFile)
+    {
+        u64Now = u64SL_Microseconds();
+        sRecord.u64Time     = u64Now - sSerialLink.sCapture.u64Start;
+        sRecord.u8Direction = eDirection;
+        sRecord.u16Length   = u32Length;
+        fwrite(&sRecord, sizeof(sRecord), 1, sSerialLink.sCapture.psFile);
+        fwrite(pu8Data, 1, u32Length, sSerialLink.sCapture.psFile);
+        vSL_CaptureFlush(u64Now);
+    }
+    pthread_mutex_unlock(&sSerialLink.sCapture.mutex);
+}
 
 
-static teSL_Status eSL_ReadMessage(uint16_t *pu16Type, uint16_t *pu16Length, uint16_t u16MaxLength, uint8_t *pu8Message)
+/****************************************************************************
+*
+* NAME: vSL_CaptureFlush
+*
+* DESCRIPTION:
+* Write the buffered capture records to disk when the last write is more
+* than SL_CAPTURE_FLUSH_INTERVAL ago. Called with the capture mutex held.
+*
+****************************************************************************/
+static void vSL_CaptureFlush(uint64_t u64Now)
 {
+    if (u64Now - sSerialLink.sCapture.u64Flushed >= SL_CAPTURE_FLUSH_INTERVAL)
+    {
+        fflush(sSerialLink.sCapture.psFile);
+        sSerialLink.sCapture.u64Flushed = u64Now;
+    }
+}
 
-    static teSL_RxState eRxState = E_STATE_RX_WAIT_START;
-    static uint8_t u8CRC;
-    uint8_t u8Data;
-    static uint16_t u16Bytes;
-    static bool bInEsc = FALSE;
 
-    while(bSL_RxByte(&u8Data))
+/****************************************************************************
+*
+* NAME: vSL_CaptureTick
+*
+* DESCRIPTION:
+* Flush the capture file while the link is idle, so that the last records
+* do not stay buffered until the next one arrives.
+*
+****************************************************************************/
+static void vSL_CaptureTick(void)
+{
+    if (!sSerialLink.sCapture.psFile)
     {
-        DBG_vPrintf(DBG_SERIALLINK_COMMS, "0x%02x\n", u8Data);
-        switch(u8Data)
-        {
+        return;
+    }
+    
+    pthread_mutex_lock(&sSerialLink.sCapture.mutex);
+    if (sSerialLink.sCapture.psFile)
+    {
+        vSL_CaptureFlush(u64SL_Microseconds());
+    }
+    pthread_mutex_unlock(&sSerialLink.sCapture.mutex);
+}
 
-        case SL_START_CHAR:
-            u16Bytes = 0;
-            bInEsc = FALSE;
-            DBG_vPrintf(DBG_SERIALLINK_COMMS, "RX Start\n");
-            eRxState = E_STATE_RX_WAIT_TYPEMSB;
-            break;
 
-        case SL_ESC_CHAR:
-            DBG_vPrintf(DBG_SERIALLINK_COMMS, "Got ESC\n");
-            bInEsc = TRUE;
-            break;
+/****************************************************************************
+*
+* NAME: vSL_TimeoutAfter
+*
+* DESCRIPTION:
+* Absolute time, as used by pthread_cond_timedwait, a number of ms from now.
+*
+****************************************************************************/
+static void vSL_TimeoutAfter(struct timespec *psTimeout, uint32_t u32Milliseconds)
+{
+    struct timeval sNow;
+    
+    gettimeofday(&sNow, NULL);
+    psTimeout->tv_sec  = sNow.tv_sec + (u32Milliseconds / 1000);
+    psTimeout->tv_nsec = (sNow.tv_usec + ((u32Milliseconds % 1000) * 1000)) * 1000;
+    if (psTimeout->tv_nsec >= 1000000000)
+    {
+        psTimeout->tv_sec++;
+        psTimeout->tv_nsec -= 1000000000;
+    }
+}
+
+
+static bool bSL_TimeBefore(const struct timespec *psA, const struct timespec *psB)
+{
+    if (psA->tv_sec != psB->tv_sec)
+    {
+        return (psA->tv_sec < psB->tv_sec) ? TRUE : FALSE;
+    }
+    return (psA->tv_nsec < psB->tv_nsec) ? TRUE : FALSE;
+}
+
+
+/****************************************************************************
+*
+* NAME: iSL_ClassWindow
+*
+* DESCRIPTION:
+* Number of commands in flight below which a command of the given class may
+* take a place in the window. Classes below interactive leave
+* SL_WINDOW_RESERVE places free, unless the window is not larger than that.
+* Called with the command mutex held.
+*
+* RETURNS:
+* The window of the class
+****************************************************************************/
+static int iSL_ClassWindow(teSL_Priority ePriority)
+{
+    int iWindow = sSerialLink.sCommands.iWindow;
+    
+    if ((ePriority != E_SL_PRIORITY_INTERACTIVE) && (iWindow > SL_WINDOW_RESERVE))
+    {
+        iWindow -= SL_WINDOW_RESERVE;
+    }
+    return iWindow;
+}
 
-        case SL_END_CHAR:
-            DBG_vPrintf(DBG_SERIALLINK_COMMS, "Got END\n");
-            
-            if(*pu16Length > u16MaxLength)
-            {
-                /* Sanity check length before attempting to CRC the message */
-                DBG_vPrintf(DBG_SERIALLINK_COMMS, "Length > MaxLength\n");
-                eRxState = E_STATE_RX_WAIT_START;
-                break;
-            }
-            
-            if(u8CRC == u8SL_CalculateCRC(*pu16Type, *pu16Length, pu8Message))
-            {
-#if DBG_SERIALLINK
-                int i;
-                DBG_vPrintf(DBG_SERIALLINK, "RX Message type 0x%04x length %d: { ", *pu16Type, *pu16Length);
-                for (i = 0; i < *pu16Length; i++)
-                {
-                    printf("0x%02x ", pu8Message[i]);
-                }
-                printf("}\n");
-#endif /* DBG_SERIALLINK */
-                
-                eRxState = E_STATE_RX_WAIT_START;
-                return E_SL_OK;
-            }
-            DBG_vPrintf(DBG_SERIALLINK_COMMS, "CRC BAD\n");
-            break;
 
-        default:
-            if(bInEsc)
+/****************************************************************************
+*
+* NAME: psSL_ReserveCommand
+*
+* DESCRIPTION:
+* Take a free command slot for a command of the given class, if no higher
+* class is waiting, the command window allows and the transmit rate allows.
+* The rate is a token bucket kept as the theoretical time of the next
+* command: a command may go when that is no further ahead than the burst.
+* Classes below interactive get a burst of SL_TX_RESERVE less, and a window
+* of SL_WINDOW_RESERVE less, so that a window filled with commands of a
+* device that does not answer never holds back a user.
+* Called with the command mutex held.
+*
+* RETURNS:
+* The reserved slot, NULL when the command has to wait. *pu32TokenWait is
+* then the time until the rate allows it (ms), or 0 for waiting on the window
+* or a higher class.
+****************************************************************************/
+static tsSL_Command *psSL_ReserveCommand(teSL_Priority ePriority, uint32_t *pu32TokenWait)
+{
+    uint64_t u64Now = 0, u64Due = 0;
+    int i;
+    
+    *pu32TokenWait = 0;
+    
+    for (i = 0; i < ePriority; i++)
+    {
+        if (sSerialLink.sCommands.asClass[i].u32Queued)
+        {
+            return NULL;
+        }
+    }
+    
+    if (sSerialLink.sCommands.iInFlight >= iSL_ClassWindow(ePriority))
+    {
+        return NULL;
+    }
+    
+    if (sSerialLink.sCommands.u32TxInterval)
+    {
+        uint32_t u32Burst = sSerialLink.sCommands.u32TxBurst;
+        uint64_t u64Limit;
+        
+        if (ePriority != E_SL_PRIORITY_INTERACTIVE)
+        {
+            u32Burst = (u32Burst > SL_TX_RESERVE) ? u32Burst - SL_TX_RESERVE : 1;
+        }
+        
+        u64Now   = u64SL_Microseconds();
+        u64Due   = (sSerialLink.sCommands.u64TxDue > u64Now) ? sSerialLink.sCommands.u64TxDue : u64Now;
+        u64Due  += sSerialLink.sCommands.u32TxInterval;
+        u64Limit = u64Now + (uint64_t)u32Burst * sSerialLink.sCommands.u32TxInterval;
+        if (u64Due > u64Limit)
+        {
+            *pu32TokenWait = (uint32_t)((u64Due - u64Limit + 999) / 1000);
+            return NULL;
+        }
+    }
+    
+    for (i = 0; i < SL_MAX_COMMANDS; i++)
+    {
+        tsSL_Command *psCommand = &sSerialLink.sCommands.asCommand[i];
+        
+        if (psCommand->eState == E_SL_COMMAND_FREE)
+        {
+            psCommand->eState = E_SL_COMMAND_RESERVED;
+            sSerialLink.sCommands.iInFlight++;
+            if (sSerialLink.sCommands.u32TxInterval)
             {
-                u8Data ^= 0x10;
-                bInEsc = FALSE;
+                sSerialLink.sCommands.u64TxDue = u64Due;
             }
+            return psCommand;
+        }
+    }
+    return NULL;
+}
 
-            switch(eRxState)
-            {
 
-                case E_STATE_RX_WAIT_START:
-                    break;
-                    
+/****************************************************************************
+*
+* NAME: vSL_CompleteCommand
+*
+* DESCRIPTION:
+* Record the status of a sent command and release its place in the window.
+* The status callback, if any, is returned in psCompletion to be made
+* once the command mutex has been released.
+* Called with the command mutex held.
+*
+****************************************************************************/
+static void vSL_CompleteCommand(tsSL_Command *psCommand, teSL_Status eStatus, uint8_t u8SequenceNo, tsSL_Completion *psCompletion)
+{
+    psCompletion->prCallback   = psCommand->prCallback;
+    psCompletion->pvUser       = psCommand->pvUser;
+    psCompletion->u16Type      = psCommand->u16Type;
+    psCompletion->eStatus      = eStatus;
+    psCompletion->u8SequenceNo = u8SequenceNo;
+    
+    psCommand->eStatus      = eStatus;
+    psCommand->u8SequenceNo = u8SequenceNo;
+    psCommand->eState       = psCommand->iWaited ? E_SL_COMMAND_DONE : E_SL_COMMAND_FREE;
+    
+    sSerialLink.sCommands.iInFlight--;
+    pthread_cond_broadcast(&sSerialLink.sCommands.cond_changed);
+}
 
-                case E_STATE_RX_WAIT_TYPEMSB:
-                    *pu16Type = (uint16_t)u8Data << 8;
-                    eRxState++;
-                    break;
 
-                case E_STATE_RX_WAIT_TYPELSB:
-                    *pu16Type += (uint16_t)u8Data;
-                    eRxState++;
-                    break;
+static void vSL_CallCompletion(tsSL_Completion *psCompletion)
+{
+    if (psCompletion->prCallback)
+    {
+        psCompletion->prCallback(psCompletion->pvUser, psCompletion->u16Type, 
+                                 psCompletion->eStatus, psCompletion->u8SequenceNo);
+    }
+}
 
-                case E_STATE_RX_WAIT_LENMSB:
-                    *pu16Length = (uint16_t)u8Data << 8;
-                    eRxState++;
-                    break;
 
-                case E_STATE_RX_WAIT_LENLSB:
-                    *pu16Length += (uint16_t)u8Data;
-                    DBG_vPrintf(DBG_SERIALLINK_COMMS, "Length %d\n", *pu16Length);
-                    if(*pu16Length > u16MaxLength)
-                    {
-                        DBG_vPrintf(DBG_SERIALLINK_COMMS, "Length > MaxLength\n");
-                        eRxState = E_STATE_RX_WAIT_START;
-                    }
-                    else
-                    {
-                        eRxState++;
-                    }
-                    break;
+/****************************************************************************
+*
+* NAME: bSL_CommandStatus
+*
+* DESCRIPTION:
+* Hand a status message to the oldest sent command of the type it is
+* status to. The control bridge handles commands in order.
+*
+* RETURNS:
+* TRUE when the status belonged to a sent command
+****************************************************************************/
+static bool bSL_CommandStatus(tsSL_Message *psMessage)
+{
+    tsSL_Msg_Status *psStatus = (tsSL_Msg_Status *)psMessage->au8Message;
+    tsSL_Command *psOldest = NULL;
+    tsSL_Completion sCompletion;
+    uint16_t u16Type;
+    int i;
+    
+    if (psMessage->u16Length < sizeof(tsSL_Msg_Status))
+    {
+        return FALSE;
+    }
+    u16Type = ntohs(psStatus->u16MessageType);
+    
+    pthread_mutex_lock(&sSerialLink.sCommands.mutex);
+    for (i = 0; i < SL_MAX_COMMANDS; i++)
+    {
+        tsSL_Command *psCommand = &sSerialLink.sCommands.asCommand[i];
+        
+        if ((psCommand->eState == E_SL_COMMAND_SENT) && (psCommand->u16Type == u16Type))
+        {
+            if (!psOldest || ((int32_t)(psCommand->u32Serial - psOldest->u32Serial) < 0))
+            {
+                psOldest = psCommand;
+            }
+        }
+    }
+    
+    if (!psOldest)
+    {
+        pthread_mutex_unlock(&sSerialLink.sCommands.mutex);
+        return FALSE;
+    }
+    
+    DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Status %d, sequence %d for command 0x%04X\n", 
+                psStatus->eStatus, psStatus->u8SequenceNo, u16Type);
+    vSL_CountStatus(psOldest, TRUE);
+    vSL_CompleteCommand(psOldest, (teSL_Status)psStatus->eStatus, psStatus->u8SequenceNo, &sCompletion);
+    pthread_mutex_unlock(&sSerialLink.sCommands.mutex);
+    
+    vSL_CallCompletion(&sCompletion);
+    return TRUE;
+}
 
-                case E_STATE_RX_WAIT_CRC:
-                    DBG_vPrintf(DBG_SERIALLINK_COMMS, "CRC %02x\n", u8Data);
-                    u8CRC = u8Data;
-                    eRxState++;
-                    break;
 
-                case E_STATE_RX_WAIT_DATA:
-                    if(u16Bytes < *pu16Length)
-                    {
-                        DBG_vPrintf(DBG_SERIALLINK_COMMS, "Data\n");
-                        pu8Message[u16Bytes++] = u8Data;
-                    }
-                    break;
+/****************************************************************************
+*
+* NAME: vSL_ExpireCommands
+*
+* DESCRIPTION:
+* Complete the sent commands whose status did not arrive in time.
+*
+****************************************************************************/
+static void vSL_ExpireCommands(void)
+{
+    tsSL_Completion asCompletion[SL_MAX_COMMANDS];
+    struct timespec sNow;
+    int i, iExpired = 0;
+    
+    vSL_TimeoutAfter(&sNow, 0);
+    
+    pthread_mutex_lock(&sSerialLink.sCommands.mutex);
+    for (i = 0; i < SL_MAX_COMMANDS; i++)
+    {
+        tsSL_Command *psCommand = &sSerialLink.sCommands.asCommand[i];
+        
+        if ((psCommand->eState == E_SL_COMMAND_SENT) && !bSL_TimeBefore(&sNow, &psCommand->sDeadline))
+        {
+            DBG_vPrintf(DBG_SERIALLINK_QUEUE, "No status for command 0x%04X\n", psCommand->u16Type);
+            vSL_CountStatus(psCommand, FALSE);
+            vSL_CompleteCommand(psCommand, E_SL_NOMESSAGE, 0, &asCompletion[iExpired++]);
+        }
+    }
+    pthread_mutex_unlock(&sSerialLink.sCommands.mutex);
+    
+    for (i = 0; i < iExpired; i++)
+    {
+        vSL_CallCompletion(&asCompletion[i]);
+    }
+}
+
+
+/****************************************************************************
+*
+* NAME: vSL_CountEvent
+*
+* DESCRIPTION:
+* Count one occurrence of a link event in the statistics.
+*
+****************************************************************************/
+static void vSL_CountEvent(uint32_t *pu32Counter)
+{
+    pthread_mutex_lock(&sSerialLink.sStats.mutex);
+    (*pu32Counter)++;
+    pthread_mutex_unlock(&sSerialLink.sStats.mutex);
+}
 
-                default:
-                    DBG_vPrintf(DBG_SERIALLINK_COMMS, "Unknown state\n");
-                    eRxState = E_STATE_RX_WAIT_START;
-            }
-            break;
 
+/****************************************************************************
+*
+* NAME: vSL_CountFrame
+*
+* DESCRIPTION:
+* Count a frame received (bTx FALSE) or sent (bTx TRUE) in the totals
+* and in the traffic of its message type.
+*
+* PARAMETERS:  Name                RW  Usage
+*              u16Length           R   Length of the payload
+*              u32FrameLength      R   Length of the frame on the wire
+*
+****************************************************************************/
+static void vSL_CountFrame(bool bTx, uint16_t u16Type, uint16_t u16Length, uint32_t u32FrameLength)
+{
+    tsSL_Stats *psStats = &sSerialLink.sStats.sCounters;
+    tsSL_TypeStats *psType;
+    
+    pthread_mutex_lock(&sSerialLink.sStats.mutex);
+    psType = psSL_TypeStats(u16Type);
+    if (bTx)
+    {
+        psStats->u32TxFrames++;
+        psStats->u64TxBytes += u32FrameLength;
+        if (psType)
+        {
+            psType->u32TxFrames++;
+            psType->u64TxBytes += u16Length;
         }
-
     }
-
-    return E_SL_NOMESSAGE;
+    else
+    {
+        psStats->u32RxFrames++;
+        psStats->u64RxBytes += u32FrameLength;
+        if (psType)
+        {
+            psType->u32RxFrames++;
+            psType->u64RxBytes += u16Length;
+        }
+    }
+    pthread_mutex_unlock(&sSerialLink.sStats.mutex);
 }
 
 
 /****************************************************************************
 *
-* NAME: vSL_WriteRawMessage
+* NAME: vSL_CountStatus
 *
 * DESCRIPTION:
+* Count the status of a sent command in the latency histogram, or as a
+* timeout when it did not arrive. Called with the command mutex held.
 *
-* PARAMETERS: Name        RW  Usage
+****************************************************************************/
+static void vSL_CountStatus(tsSL_Command *psCommand, bool bArrived)
+{
+    tsSL_Stats *psStats = &sSerialLink.sStats.sCounters;
+    uint32_t u32Latency, u32Milliseconds;
+    int iBucket = 0;
+    
+    if (!bArrived)
+    {
+        vSL_CountEvent(&psStats->u32StatusTimeouts);
+        return;
+    }
+    
+    u32Latency = (uint32_t)(u64SL_Microseconds() - psCommand->u64Sent);
+    for (u32Milliseconds = u32Latency / 1000; u32Milliseconds && (iBucket < SL_LATENCY_BUCKETS - 1); u32Milliseconds >>= 1)
+    {
+        iBucket++;
+    }
+    
+    pthread_mutex_lock(&sSerialLink.sStats.mutex);
+    psStats->au32Latency[iBucket]++;
+    psStats->u64LatencyTotal += u32Latency;
+    if (u32Latency > psStats->u32MaxLatency)
+    {
+        psStats->u32MaxLatency = u32Latency;
+    }
+    pthread_mutex_unlock(&sSerialLink.sStats.mutex);
+}
+
+
+/****************************************************************************
+*
+* NAME: psSL_TypeStats
+*
+* DESCRIPTION:
+* Find the traffic entry of a message type, taking a free one for a type
+* not seen before. Called with the statistics mutex held.
 *
 * RETURNS:
-* void
+* The entry, NULL when all entries are taken by other types
 ****************************************************************************/
-static teSL_Status eSL_WriteMessage(uint16_t u16Type, uint16_t u16Length, uint8_t *pu8Data)
+static tsSL_TypeStats *psSL_TypeStats(uint16_t u16Type)
 {
-    int n;
-    uint8_t u8CRC;
-
-    u8CRC = u8SL_CalculateCRC(u16Type, u16Length, pu8Data);
+    tsSL_TypeStats *asType = sSerialLink.sStats.sCounters.asType;
+    uint32_t u32Slot = ((uint32_t)u16Type * 0x9E3779B1) >> 16;
+    int i;
+    
+    for (i = 0; i < SL_STATS_TYPES; i++)
+    {
+        tsSL_TypeStats *psType = &asType[(u32Slot + i) % SL_STATS_TYPES];
+        
+        if (psType->u16Type == u16Type)
+        {
+            return psType;
+        }
+        if (psType->u16Type == 0)
+        {
+            psType->u16Type = u16Type;
+            return psType;
+        }
+    }
+    return NULL;
+}
 
-    DBG_vPrintf(DBG_SERIALLINK_COMMS, "(%d, %d, %02x)\n", u16Type, u16Length, u8CRC);
 
-    if (verbosity >= 10)
+/****************************************************************************
+*
+* NAME: vSL_RebuildHandlers
+*
+* DESCRIPTION:
+* Fill the handler table from the list of callbacks: the first callback
+* registered for a type handles it. Types that share the low bits of
+* another type with a handler are looked up in the list.
+* Called with the callbacks mutex held.
+*
+****************************************************************************/
+static void vSL_RebuildHandlers(void)
+{
+    tsSL_CallbackEntry *psEntry;
+    
+    memset(sSerialLink.sCallbacks.asHandler, 0, sizeof(sSerialLink.sCallbacks.asHandler));
+    
+    for (psEntry = sSerialLink.sCallbacks.psListHead; psEntry; psEntry = psEntry->psNext)
     {
-        char acBuffer[4096];
-        int iPosition = 0, i;
+        tsSL_Handler *psHandler = &sSerialLink.sCallbacks.asHandler[psEntry->u16Type & (SL_HANDLER_TABLE_SIZE - 1)];
         
-        iPosition = sprintf(&acBuffer[iPosition], "Host->Node 0x%04X (Length % 4d)", u16Type, u16Length);
-        for (i = 0; i < u16Length; i++)
+        if (psHandler->prCallback == NULL)
         {
-            iPosition += sprintf(&acBuffer[iPosition], " 0x%02X", pu8Data[i]);
+            psHandler->u16Type         = psEntry->u16Type;
+            psHandler->prCallback      = psEntry->prCallback;
+            psHandler->pvUser          = psEntry->pvUser;
+            psHandler->i8AddressOffset = i8SL_AddressOffset(psEntry->u16Type);
         }
-        DEBUG_PRINTF( "%s", acBuffer);
     }
-    
-    /* Send start character */
-    if (iSL_TxByte(TRUE, SL_START_CHAR) < 0) return E_SL_ERROR;
+}
 
-    /* Send message type */
-    if (iSL_TxByte(FALSE, (u16Type >> 8) & 0xff) < 0) return E_SL_ERROR;
-    if (iSL_TxByte(FALSE, (u16Type >> 0) & 0xff) < 0) return E_SL_ERROR;
 
-    /* Send message length */
-    if (iSL_TxByte(FALSE, (u16Length >> 8) & 0xff) < 0) return E_SL_ERROR;
-    if (iSL_TxByte(FALSE, (u16Length >> 0) & 0xff) < 0) return E_SL_ERROR;
+static int8_t i8SL_AddressOffset(uint16_t u16Type)
+{
+    int i;
+    
+    for (i = 0; i < sizeof(asSL_AddressOffset) / sizeof(asSL_AddressOffset[0]); i++)
+    {
+        if (asSL_AddressOffset[i].u16Type == u16Type)
+        {
+            return asSL_AddressOffset[i].u8Offset;
+        }
+    }
+    return -1;
+}
 
-    /* Send message checksum */
-    if (iSL_TxByte(FALSE, u8CRC) < 0) return E_SL_ERROR;
 
-    /* Send message payload */  
-    for(n = 0; n < u16Length; n++)
-    {       
-        if (iSL_TxByte(FALSE, pu8Data[n]) < 0) return E_SL_ERROR;
+static teSL_Priority eSL_CommandPriority(uint16_t u16Type)
+{
+    int i;
+    
+    for (i = 0; i < sizeof(asSL_Priority) / sizeof(asSL_Priority[0]); i++)
+    {
+        if (asSL_Priority[i].u16Type == u16Type)
+        {
+            return asSL_Priority[i].ePriority;
+        }
     }
+    return E_SL_PRIORITY_INTERACTIVE;
+}
 
-    /* Send end character */
-    if (iSL_TxByte(TRUE, SL_END_CHAR) < 0) return E_SL_ERROR;
 
-    return E_SL_OK;
+static uint64_t u64SL_Microseconds(void)
+{
+    struct timespec sNow;
+    
+    clock_gettime(CLOCK_MONOTONIC, &sNow);
+    return (uint64_t)sNow.tv_sec * 1000000 + sNow.tv_nsec / 1000;
 }
 
-static uint8_t u8SL_CalculateCRC(uint16_t u16Type, uint16_t u16Length, uint8_t *pu8Data)
-{
-    int n;
-    uint8_t u8CRC = 0;
 
-    u8CRC ^= (u16Type >> 8) & 0xff;
-    u8CRC ^= (u16Type >> 0) & 0xff;
+/****************************************************************************
+*
+* NAME: eSL_CreatePool
+*
+* DESCRIPTION:
+* Allocate one slab of callback buffers for messages up to u16MaxLength.
+*
+****************************************************************************/
+static teSL_Status eSL_CreatePool(uint8_t u8Pool, uint16_t u16MaxLength)
+{
+    /* Keep every buffer pointer aligned */
+    size_t uSize = (sizeof(tsCallbackThreadData) + u16MaxLength + 1 + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    uint8_t *pu8Slab;
+    int i;
     
-    u8CRC ^= (u16Length >> 8) & 0xff;
-    u8CRC ^= (u16Length >> 0) & 0xff;
-
-    for(n = 0; n < u16Length; n++)
+    pu8Slab = malloc(uSize * SL_CALLBACK_BUFFERS);
+    if (!pu8Slab)
     {
-        u8CRC ^= pu8Data[n];
+        return E_SL_ERROR_NOMEM;
     }
-    return(u8CRC);
+    
+    sSerialLink.sCallbackPool.apsFree[u8Pool] = NULL;
+    for (i = 0; i < SL_CALLBACK_BUFFERS; i++)
+    {
+        tsCallbackThreadData *psCallbackData = (tsCallbackThreadData *)&pu8Slab[i * uSize];
+        
+        psCallbackData->u8Pool = u8Pool;
+        psCallbackData->psNext = sSerialLink.sCallbackPool.apsFree[u8Pool];
+        sSerialLink.sCallbackPool.apsFree[u8Pool] = psCallbackData;
+    }
+    return E_SL_OK;
 }
 
+
 /****************************************************************************
 *
-* NAME: vSL_TxByte
+* NAME: psSL_AllocCallbackData
 *
 * DESCRIPTION:
-*
-* PARAMETERS:  Name                RW  Usage
+* Take a callback buffer big enough for the message from the pools,
+* falling back to the heap when they are exhausted.
 *
 * RETURNS:
-* void
+* The buffer, NULL when out of memory
 ****************************************************************************/
-static int iSL_TxByte(bool bSpecialCharacter, uint8_t u8Data)
+static tsCallbackThreadData *psSL_AllocCallbackData(uint16_t u16Length)
 {
-    if(!bSpecialCharacter && (u8Data < 0x10))
+    tsCallbackThreadData *psCallbackData;
+    uint8_t u8Pool = (u16Length <= SL_SMALL_MESSAGE_LENGTH) ? SL_POOL_SMALL : SL_POOL_LARGE;
+    
+    pthread_mutex_lock(&sSerialLink.sCallbackPool.mutex);
+    psCallbackData = sSerialLink.sCallbackPool.apsFree[u8Pool];
+    if (!psCallbackData && (u8Pool == SL_POOL_SMALL))
     {
-        u8Data ^= 0x10;
-
-        if (eSerial_Write(SL_ESC_CHAR) != E_SERIAL_OK) return -1;
-        //DBG_vPrintf(DBG_SERIALLINK_COMMS, " 0x%02x", SL_ESC_CHAR);
+        /* A large buffer does as well */
+        psCallbackData = sSerialLink.sCallbackPool.apsFree[SL_POOL_LARGE];
+    }
+    if (psCallbackData)
+    {
+        sSerialLink.sCallbackPool.apsFree[psCallbackData->u8Pool] = psCallbackData->psNext;
+    }
+    pthread_mutex_unlock(&sSerialLink.sCallbackPool.mutex);
+    
+    if (!psCallbackData)
+    {
+        DBG_vPrintf(DBG_SERIALLINK_CB, "Callback buffers exhausted\n");
+        psCallbackData = malloc(sizeof(tsCallbackThreadData) + u16Length + 1);
+        if (psCallbackData)
+        {
+            psCallbackData->u8Pool = SL_POOL_HEAP;
+        }
     }
-    //DBG_vPrintf(DBG_SERIALLINK_COMMS, " 0x%02x", u8Data);
+    return psCallbackData;
+}
 
-    return eSerial_Write(u8Data);
+
+static void vSL_FreeCallbackData(tsCallbackThreadData *psCallbackData)
+{
+    if (psCallbackData->u8Pool == SL_POOL_HEAP)
+    {
+        free(psCallbackData);
+        return;
+    }
+    
+    pthread_mutex_lock(&sSerialLink.sCallbackPool.mutex);
+    psCallbackData->psNext = sSerialLink.sCallbackPool.apsFree[psCallbackData->u8Pool];
+    sSerialLink.sCallbackPool.apsFree[psCallbackData->u8Pool] = psCallbackData;
+    pthread_mutex_unlock(&sSerialLink.sCallbackPool.mutex);
 }
 
 
 /****************************************************************************
 *
-* NAME: bSL_RxByte
+* NAME: u8SL_WaiterBucket
 *
 * DESCRIPTION:
+* Hash bucket for the waiters of a message type and, for status messages,
+* the type of message the status is to.
 *
-* PARAMETERS:  Name                RW  Usage
+****************************************************************************/
+static uint8_t u8SL_WaiterBucket(uint16_t u16Type, uint16_t u16StatusType)
+{
+    uint32_t u32Hash = ((uint32_t)u16Type << 16) | u16StatusType;
+    
+    u32Hash *= 0x9E3779B1;
+    return (u32Hash >> 24) & (SL_WAITER_BUCKETS - 1);
+}
+
+
+/****************************************************************************
+*
+* NAME: vSL_UnlinkWaiter
+*
+* DESCRIPTION:
+* Remove a waiter from its bucket. Called with the waiters mutex held.
 *
-* RETURNS:
-* void
 ****************************************************************************/
-static bool bSL_RxByte(uint8_t *pu8Data)
+static void vSL_UnlinkWaiter(int8_t i8Waiter)
 {
-    if (eSerial_Read(pu8Data) == E_SERIAL_OK)
-    {
-        return TRUE;
-    }
-    else
+    tsSL_Waiter *psWaiter = &sSerialLink.sWaiters.asWaiter[(int)i8Waiter];
+    int8_t *pi8Link = &sSerialLink.sWaiters.ai8Bucket[u8SL_WaiterBucket(psWaiter->u16Type, psWaiter->u16StatusType)];
+    
+    while (*pi8Link >= 0)
     {
-        return FALSE;
+        if (*pi8Link == i8Waiter)
+        {
+            *pi8Link = psWaiter->i8Next;
+            psWaiter->i8Next = -1;
+            return;
+        }
+        pi8Link = &sSerialLink.sWaiters.asWaiter[(int)*pi8Link].i8Next;
     }
 }
 
 
+/****************************************************************************
+*
+* NAME: eSL_MessageQueue
+*
+* DESCRIPTION:
+* Hand a received message to the first thread waiting for it. A status
+* goes to a waiter for the status to its message type before a waiter for
+* any status.
+*
+* RETURNS:
+* E_SL_OK when a waiter took the message, E_SL_NOMESSAGE when there is none
+****************************************************************************/
 static teSL_Status eSL_MessageQueue(tsSerialLink *psSerialLink, uint16_t u16Type, uint16_t u16Length, uint8_t *pu8Message)
 {
+    uint16_t au16StatusType[2] = { SL_ANY_STATUS_TYPE, SL_ANY_STATUS_TYPE };
+    tsSL_Waiter *psWaiter;
+    uint8_t *pu8MessageCopy;
+    int8_t i8Waiter = -1;
     int i;
-    for (i = 0; i < SL_MAX_MESSAGE_QUEUES; i++)
+    
+    if ((u16Type == E_SL_MSG_STATUS) && (u16Length >= sizeof(tsSL_Msg_Status)))
     {
-        pthread_mutex_lock(&psSerialLink->asReaderMessageQueue[i].mutex);
-
-        if (psSerialLink->asReaderMessageQueue[i].u16Type == u16Type)
+        au16StatusType[0] = ntohs(((tsSL_Msg_Status *)pu8Message)->u16MessageType);
+    }
+    
+    pthread_mutex_lock(&psSerialLink->sWaiters.mutex);
+    for (i = 0; (i < 2) && (i8Waiter < 0); i++)
+    {
+        for (i8Waiter = psSerialLink->sWaiters.ai8Bucket[u8SL_WaiterBucket(u16Type, au16StatusType[i])];
+             i8Waiter >= 0;
+             i8Waiter = psSerialLink->sWaiters.asWaiter[(int)i8Waiter].i8Next)
         {
-            DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Found listener for message type 0x%04x in slot %d\n", u16Type, i);
-            
-            if (u16Type == E_SL_MSG_STATUS)
-            {
-                tsSL_Msg_Status *psRxStatus = (tsSL_Msg_Status*)pu8Message;
-                tsSL_Msg_Status *psWaitStatus = (tsSL_Msg_Status*)psSerialLink->asReaderMessageQueue[i].pu8Message;
-                
-                /* Also check the type of the message that this is status to. */
-                if (psWaitStatus)
-                {
-                    DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Status listener for message type 0x%04X, rx 0x%04X\n", psWaitStatus->u16MessageType, ntohs(psRxStatus->u16MessageType));
-                    
-                    if (psWaitStatus->u16MessageType != ntohs(psRxStatus->u16MessageType))
-                    {
-                        DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Not the status listener for this message\n");
-                        pthread_mutex_unlock(&psSerialLink->asReaderMessageQueue[i].mutex);
-                        continue;
-                    }
-                }
-            }
-            
-            uint8_t  *pu8MessageCopy = malloc(u16Length);
-            if (!pu8MessageCopy)
+            psWaiter = &psSerialLink->sWaiters.asWaiter[(int)i8Waiter];
+            if ((psWaiter->u16Type == u16Type) && (psWaiter->u16StatusType == au16StatusType[i]))
             {
-                printf( "Memory allocation failure");
-                return E_SL_ERROR_NOMEM;
+                break;
             }
-            memcpy(pu8MessageCopy, pu8Message, u16Length);
-            
-            
-            psSerialLink->asReaderMessageQueue[i].u16Length = u16Length;
-            psSerialLink->asReaderMessageQueue[i].pu8Message = pu8MessageCopy;
-
-            /* Signal data available */
-            DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Unlocking queue %d mutex\n", i);
-            pthread_mutex_unlock(&psSerialLink->asReaderMessageQueue[i].mutex);
-            pthread_cond_broadcast(&psSerialLink->asReaderMessageQueue[i].cond_data_available);
-            return E_SL_OK;
-        }
-        else
-        {
-            pthread_mutex_unlock(&psSerialLink->asReaderMessageQueue[i].mutex);
         }
     }
-    DBG_vPrintf(DBG_SERIALLINK_QUEUE, "No listeners for message type 0x%04X\n", u16Type);
-    return E_SL_NOMESSAGE;
+    
+    if (i8Waiter < 0)
+    {
+        pthread_mutex_unlock(&psSerialLink->sWaiters.mutex);
+        DBG_vPrintf(DBG_SERIALLINK_QUEUE, "No listeners for message type 0x%04X\n", u16Type);
+        return E_SL_NOMESSAGE;
+    }
+    psWaiter = &psSerialLink->sWaiters.asWaiter[(int)i8Waiter];
+    
+    DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Found listener for message type 0x%04x in slot %d\n", u16Type, i8Waiter);
+    
+    pu8MessageCopy = malloc(u16Length);
+    if (!pu8MessageCopy)
+    {
+        pthread_mutex_unlock(&psSerialLink->sWaiters.mutex);
+        printf( "Memory allocation failure");
+        return E_SL_ERROR_NOMEM;
+    }
+    memcpy(pu8MessageCopy, pu8Message, u16Length);
+    
+    vSL_UnlinkWaiter(i8Waiter);
+    psWaiter->u16Length  = u16Length;
+    psWaiter->pu8Message = pu8MessageCopy;
+    psWaiter->iDone      = 1;
+    
+    /* Signal data available */
+    pthread_cond_signal(&psWaiter->cond_data_available);
+    pthread_mutex_unlock(&psSerialLink->sWaiters.mutex);
+    return E_SL_OK;
 }
 
 
@@ -833,11 +2367,6 @@ static void *pvReaderThread(tsUtilsThread *psThreadInfo)
 
     while (psThreadInfo->eState == E_THREAD_RUNNING)
     {
-        /* Initialise buffer */
-        memset(&sMessage, 0, sizeof(tsSL_Message));
-        /* Initialise length to large value so CRC is skipped if end received */
-        sMessage.u16Length = 0xFFFF;
-        
         if (eSL_ReadMessage(&sMessage.u16Type, &sMessage.u16Length, SL_MAX_MESSAGE_LENGTH, sMessage.au8Message) == E_SL_OK)
         {
             iHandled = 0;
@@ -866,6 +2395,11 @@ static void *pvReaderThread(tsUtilsThread *psThreadInfo)
 #endif
                 iHandled = 1; /* Message handled by logger */
             }
+            else if ((sMessage.u16Type == E_SL_MSG_STATUS) && bSL_CommandStatus(&sMessage))
+            {
+                DBG_vPrintf(DBG_SERIALLINK_QUEUE, "Status handed to command\n");
+                iHandled = 1;
+            }
             else
             {
                 // See if any threads are waiting for this message
@@ -895,60 +2429,95 @@ static void *pvReaderThread(tsUtilsThread *psThreadInfo)
             }
 
             {
-                // Search for callback handlers for this message type
-                tsSL_CallbackEntry *psCurrentEntry;
-                /* Search through list of registered callbacks */
-                pthread_mutex_lock(&psSerialLink->sCallbacks.mutex);
+                // Look up the callback handler for this message type
+                tsSL_Handler sHandler;
                 
-                for (psCurrentEntry = psSerialLink->sCallbacks.psListHead; psCurrentEntry; psCurrentEntry = psCurrentEntry->psNext)
+                pthread_mutex_lock(&psSerialLink->sCallbacks.mutex);
+                sHandler = psSerialLink->sCallbacks.asHandler[sMessage.u16Type & (SL_HANDLER_TABLE_SIZE - 1)];
+                if (sHandler.prCallback && (sHandler.u16Type != sMessage.u16Type))
                 {
-                    if (psCurrentEntry->u16Type == sMessage.u16Type)
+                    /* Another type with the same low bits, search the list */
+                    tsSL_CallbackEntry *psCurrentEntry;
+                    
+                    sHandler.prCallback = NULL;
+                    for (psCurrentEntry = psSerialLink->sCallbacks.psListHead; psCurrentEntry; psCurrentEntry = psCurrentEntry->psNext)
                     {
-                        tsCallbackThreadData *psCallbackData;
-                        DBG_vPrintf(DBG_SERIALLINK_CB, "Found callback routine %p for message 0x%04x\n", psCurrentEntry->prCallback, sMessage.u16Type);
-                        
-                        // Put the message into the queue for the callback handler thread
-                        psCallbackData = malloc(sizeof(tsCallbackThreadData));
-                        if (!psCallbackData)
+                        if (psCurrentEntry->u16Type == sMessage.u16Type)
                         {
-                            printf( "Memory allocation error\n");
+                            sHandler.prCallback      = psCurrentEntry->prCallback;
+                            sHandler.pvUser          = psCurrentEntry->pvUser;
+                            sHandler.i8AddressOffset = i8SL_AddressOffset(sMessage.u16Type);
+                            break; // just a single callback for each message type
                         }
-                        else
+                    }
+                }
+                pthread_mutex_unlock(&psSerialLink->sCallbacks.mutex);
+                
+                if (sHandler.prCallback)
+                {
+                    tsSL_Worker *psWorker = &psSerialLink->asWorker[0];
+                    tsCallbackThreadData *psCallbackData;
+                    
+                    if ((sHandler.i8AddressOffset >= 0) && (sMessage.u16Length >= sHandler.i8AddressOffset + 2))
+                    {
+                        /* Keep the messages of one device in order on one worker */
+                        uint16_t u16ShortAddress = ((uint16_t)sMessage.au8Message[(int)sHandler.i8AddressOffset] << 8) |
+                                                   sMessage.au8Message[sHandler.i8AddressOffset + 1];
+                        psWorker = &psSerialLink->asWorker[u16ShortAddress % SL_CALLBACK_WORKERS];
+                    }
+                    DBG_vPrintf(DBG_SERIALLINK_CB, "Found callback routine %p for message 0x%04x\n", sHandler.prCallback, sMessage.u16Type);
+                    
+                    // Put the message into the queue for the callback handler thread
+                    psCallbackData = psSL_AllocCallbackData(sMessage.u16Length);
+                    if (!psCallbackData)
+                    {
+                        printf( "Memory allocation error\n");
+                    }
+                    else
+                    {
+                        psCallbackData->prCallback = sHandler.prCallback;
+                        psCallbackData->pvUser     = sHandler.pvUser;
+                        psCallbackData->u16Type    = sMessage.u16Type;
+                        psCallbackData->u16Length  = sMessage.u16Length;
+                        memcpy(psCallbackData->au8Message, sMessage.au8Message, sMessage.u16Length);
+                        psCallbackData->au8Message[sMessage.u16Length] = '\0';
+                        psCallbackData->u64Queued  = u64SL_Microseconds();
+                        
+                        uint32_t u32Depth = __sync_add_and_fetch(&psWorker->u32Depth, 1);
+                        if (u32Depth > psWorker->u32MaxDepth)
                         {
-                            memcpy(&psCallbackData->sMessage, &sMessage, sizeof(tsSL_Message));
-                            psCallbackData->prCallback = psCurrentEntry->prCallback;
-                            psCallbackData->pvUser = psCurrentEntry->pvUser;
-                            
-                            if (eUtils_QueueQueue(&psSerialLink->sCallbackQueue, psCallbackData) == E_UTILS_OK)
-                            {
-                                iHandled = 1;
-                            }
-                            else
-                            {
-                                DEBUG_PRINTF( "Failed to queue message for callback\n");
-                                free(psCallbackData);
-                            }
+                            psWorker->u32MaxDepth = u32Depth;
                         }
-                        break; // just a single callback for each message type
+                        
+                        vSL_QueueCallback(psWorker, psCallbackData);
+                        iHandled = 1;
                     }
                 }
-                pthread_mutex_unlock(&sSerialLink.sCallbacks.mutex);
             }
             if (!iHandled)
             {
                 DEBUG_PRINTF( "Message 0x%04X was not handled\n", sMessage.u16Type);
+                vSL_CountEvent(&psSerialLink->sStats.sCounters.u32NoWaiter);
             }
         }
     }
     
     {
+        /* Release all waiters empty handed */
         int i;
-        for (i = 0; i < SL_MAX_MESSAGE_QUEUES; i++)
+        pthread_mutex_lock(&psSerialLink->sWaiters.mutex);
+        for (i = 0; i < SL_WAITER_BUCKETS; i++)
         {
-            psSerialLink->asReaderMessageQueue[i].u16Length  = 0;
-            psSerialLink->asReaderMessageQueue[i].pu8Message = NULL;
-            pthread_cond_broadcast(&psSerialLink->asReaderMessageQueue[i].cond_data_available);
+            while (psSerialLink->sWaiters.ai8Bucket[i] >= 0)
+            {
+                tsSL_Waiter *psWaiter = &psSerialLink->sWaiters.asWaiter[(int)psSerialLink->sWaiters.ai8Bucket[i]];
+                
+                vSL_UnlinkWaiter(psSerialLink->sWaiters.ai8Bucket[i]);
+                psWaiter->iDone = 1;
+                pthread_cond_signal(&psWaiter->cond_data_available);
+            }
         }
+        pthread_mutex_unlock(&psSerialLink->sWaiters.mutex);
     }
     
     DBG_vPrintf(DBG_SERIALLINK, "Exit reader thread\n");
@@ -959,11 +2528,52 @@ static void *pvReaderThread(tsUtilsThread *psThreadInfo)
 }
 
 
+/** Queue a message for a worker without blocking. While older messages wait
+ *  in the overflow list, newer ones are appended there too, to keep the order.
+ */
+static void vSL_QueueCallback(tsSL_Worker *psWorker, tsCallbackThreadData *psCallbackData)
+{
+    pthread_mutex_lock(&psWorker->mOverflow);
+    if (psWorker->psOverflowHead || (eUtils_QueueQueue(&psWorker->sQueue, psCallbackData) != E_UTILS_OK))
+    {
+        psCallbackData->psNext = NULL;
+        if (psWorker->psOverflowTail)
+        {
+            psWorker->psOverflowTail->psNext = psCallbackData;
+        }
+        else
+        {
+            psWorker->psOverflowHead = psCallbackData;
+        }
+        psWorker->psOverflowTail = psCallbackData;
+        psWorker->u32Overflowed++;
+    }
+    pthread_mutex_unlock(&psWorker->mOverflow);
+}
+
+
+/** Move messages from the overflow list to the queue of a worker, as far as there is room */
+static void vSL_RefillQueue(tsSL_Worker *psWorker)
+{
+    pthread_mutex_lock(&psWorker->mOverflow);
+    while (psWorker->psOverflowHead &&
+           (eUtils_QueueQueue(&psWorker->sQueue, psWorker->psOverflowHead) == E_UTILS_OK))
+    {
+        psWorker->psOverflowHead = psWorker->psOverflowHead->psNext;
+    }
+    if (!psWorker->psOverflowHead)
+    {
+        psWorker->psOverflowTail = NULL;
+    }
+    pthread_mutex_unlock(&psWorker->mOverflow);
+}
+
+
 static void *pvCallbackHandlerThread(tsUtilsThread *psThreadInfo)
 {
-    tsSerialLink *psSerialLink = (tsSerialLink *)psThreadInfo->pvThreadData;
+    tsSL_Worker *psWorker = (tsSL_Worker *)psThreadInfo->pvThreadData;
 
-    DBG_vPrintf(DBG_SERIALLINK_CB, "Starting callback thread\n");
+    DBG_vPrintf(DBG_SERIALLINK_CB, "Starting callback thread %d\n", (int)(psWorker - sSerialLink.asWorker));
     
     psThreadInfo->eState = E_THREAD_RUNNING;
     
@@ -971,16 +2581,41 @@ static void *pvCallbackHandlerThread(tsUtilsThread *psThreadInfo)
     {
         tsCallbackThreadData *psCallbackData;
         
-        // int stat = eUtils_QueueDequeue(&psSerialLink->sCallbackQueue, (void**)&psCallbackData);
-        int stat = eUtils_QueueDequeueTimed(&psSerialLink->sCallbackQueue, 2000, (void**)&psCallbackData);
+        if (psWorker == &sSerialLink.asWorker[0])
+        {
+            /* Complete the commands that nobody is waiting on when their status is lost */
+            vSL_ExpireCommands();
+            
+            /* Write out capture records also when nothing else arrives */
+            vSL_CaptureTick();
+        }
+        
+        // int stat = eUtils_QueueDequeue(&psWorker->sQueue, (void**)&psCallbackData);
+        int stat = eUtils_QueueDequeueTimed(&psWorker->sQueue, SL_STATUS_TIMEOUT, (void**)&psCallbackData);
         if (stat == E_UTILS_OK)
         {
+            vSL_RefillQueue(psWorker);
+            
             DBG_vPrintf(DBG_SERIALLINK_CB, "++++++++++++++++++++++ Calling callback\n" );   // RH
-            DBG_vPrintf(DBG_SERIALLINK_CB, "Calling callback %p for message 0x%04X\n", psCallbackData->prCallback, psCallbackData->sMessage.u16Type);
+            DBG_vPrintf(DBG_SERIALLINK_CB, "Calling callback %p for message 0x%04X\n", psCallbackData->prCallback, psCallbackData->u16Type);
             
-            psCallbackData->prCallback(psCallbackData->pvUser, psCallbackData->sMessage.u16Length, psCallbackData->sMessage.au8Message);
+            u64HandlingQueued = psCallbackData->u64Queued;
+            psCallbackData->prCallback(psCallbackData->pvUser, psCallbackData->u16Length, psCallbackData->au8Message);
+            u64HandlingQueued = 0;
+            
+            {
+                uint32_t u32Latency = (uint32_t)(u64SL_Microseconds() - psCallbackData->u64Queued);
+                
+                __sync_sub_and_fetch(&psWorker->u32Depth, 1);
+                psWorker->u32Handled++;
+                psWorker->u64Latency += u32Latency;
+                if (u32Latency > psWorker->u32MaxLatency)
+                {
+                    psWorker->u32MaxLatency = u32Latency;
+                }
+            }
             
-            free(psCallbackData);
+            vSL_FreeCallbackData(psCallbackData);
             DBG_vPrintf(DBG_SERIALLINK_CB, "++++++++++++++++++++++ Callback ready\n" );   // RH
         } else if ( stat == E_UTILS_ERROR_TIMEOUT ) {
             // printf( "CB heartbeat\n" );
@@ -58,6 +58,10 @@ extern "C" {
 
 #define PACKED __attribute__((__packed__))
 
+/** Number of threads running message callbacks. Callbacks for messages from
+ *  one device (by short address) run in order on the same thread. */
+#define SL_CALLBACK_WORKERS 4
+
 /****************************************************************************/
 /***        Type Definitions                                              ***/
 /****************************************************************************/
@@ -333,6 +337,137 @@ typedef struct
 typedef void (*tprSL_MessageCallback)(void *pvUser, uint16_t u16Length, void *pvMessage);
 
 
+/** Callback function type for the completion of a command sent with eSL_SendCommand().
+ *  Called from the serial link threads, so it must not block or send commands itself.
+ *  \param pvUser           User supplied data passed to eSL_SendCommand()
+ *  \param u16Type          Type of the command
+ *  \param eStatus          Status returned by the control bridge, E_SL_NOMESSAGE if none arrived in time
+ *  \param u8SequenceNo     Sequence number of the outgoing message (when eStatus is E_SL_OK)
+ *  \return Nothing
+ */
+typedef void (*tprSL_StatusCallback)(void *pvUser, uint16_t u16Type, teSL_Status eStatus, uint8_t u8SequenceNo);
+
+
+/** Statistics of a callback worker */
+typedef struct
+{
+    uint32_t    u32Depth;       /**< Callbacks queued now */
+    uint32_t    u32MaxDepth;    /**< Most callbacks queued at once */
+    uint32_t    u32Overflowed;  /**< Callbacks that found the queue full and waited in the overflow list */
+    uint32_t    u32Handled;     /**< Callbacks run */
+    uint32_t    u32AvgLatency;  /**< Average time from queueing to callback return (us) */
+    uint32_t    u32MaxLatency;  /**< Longest time from queueing to callback return (us) */
+} tsSL_WorkerStats;
+
+
+/** Number of message types counted separately, types beyond that only count in the totals */
+#define SL_STATS_TYPES 64
+
+/** Number of buckets of the command status latency histogram. Bucket 0 counts
+ *  latencies under 1 ms, bucket n those from 2^(n-1) up to 2^n ms, and the last
+ *  bucket everything longer.
+ */
+#define SL_LATENCY_BUCKETS 11
+
+
+/** Traffic of one message type */
+typedef struct
+{
+    uint16_t    u16Type;        /**< Message type, 0 for an unused entry */
+    uint32_t    u32RxFrames;
+    uint32_t    u32TxFrames;
+    uint64_t    u64RxBytes;     /**< Payload bytes received */
+    uint64_t    u64TxBytes;     /**< Payload bytes sent */
+} tsSL_TypeStats;
+
+
+/** Priority classes of the commands sent to the control bridge, highest first.
+ *  A command is held back while a command of a higher class waits to go out.
+ */
+typedef enum
+{
+    E_SL_PRIORITY_INTERACTIVE,      /**< Device control on behalf of a user */
+    E_SL_PRIORITY_INTERVIEW,        /**< Address, descriptor and attribute requests */
+    E_SL_PRIORITY_REPORTING,        /**< Binding and report configuration */
+    E_SL_PRIORITY_MAINTENANCE,      /**< Neighbour table and network polling */
+    E_SL_PRIORITY_CLASSES,
+} teSL_Priority;
+
+
+/** Scheduling of one priority class */
+typedef struct
+{
+    uint32_t    u32Sent;        /**< Commands sent */
+    uint32_t    u32Dropped;     /**< Commands dropped because the command window stayed full, never interactive */
+    uint32_t    u32Queued;      /**< Commands waiting to be sent now */
+    uint32_t    u32MaxQueued;   /**< Most commands waiting at once */
+    uint32_t    u32AvgWait;     /**< Average time from the call to sending (us) */
+    uint32_t    u32MaxWait;     /**< Longest time from the call to sending (us) */
+} tsSL_ClassStats;
+
+
+/** Serial link statistics */
+typedef struct
+{
+    uint32_t    u32RxFrames;    /**< Valid frames received */
+    uint32_t    u32TxFrames;    /**< Frames sent */
+    uint64_t    u64RxBytes;     /**< Bytes read from the port, framing and escapes included */
+    uint64_t    u64TxBytes;     /**< Bytes written to the port, framing and escapes included */
+    uint32_t    u32CrcErrors;   /**< Frames dropped for a bad checksum */
+    uint32_t    u32LengthErrors;/**< Frames dropped for a length that does not fit */
+    uint32_t    u32NoWaiter;    /**< Messages dropped because nobody waited for or listened to them */
+    uint32_t    u32StatusTimeouts; /**< Commands whose status did not arrive in time */
+    uint32_t    u32WaiterFull;  /**< eSL_MessageWait() calls refused for lack of a waiter slot */
+    uint32_t    u32WindowFull;  /**< Commands dropped because the command window stayed full */
+    uint32_t    au32Latency[SL_LATENCY_BUCKETS];    /**< Histogram of send to status latency */
+    uint64_t    u64LatencyTotal;/**< Sum of the send to status latencies (us) */
+    uint32_t    u32MaxLatency;  /**< Longest send to status latency (us) */
+    tsSL_TypeStats asType[SL_STATS_TYPES];
+    tsSL_WorkerStats asWorker[SL_CALLBACK_WORKERS];
+    tsSL_ClassStats asClass[E_SL_PRIORITY_CLASSES];
+} tsSL_Stats;
+
+
+/** Capture file identification, "SLCP" */
+#define SL_CAPTURE_MAGIC    0x50434C53
+#define SL_CAPTURE_VERSION  1
+
+/** Start of a capture file. Fields are in host byte order. */
+typedef struct
+{
+    uint32_t    u32Magic;       /**< SL_CAPTURE_MAGIC */
+    uint16_t    u16Version;     /**< SL_CAPTURE_VERSION */
+    uint16_t    u16Reserved;
+    uint64_t    u64StartTime;   /**< Wall clock time the capture started (us since the epoch) */
+} PACKED tsSL_CaptureHeader;
+
+
+/** Direction of a captured block */
+typedef enum
+{
+    E_SL_CAPTURE_RX,            /**< Bytes as read from the serial port */
+    E_SL_CAPTURE_TX,            /**< Frame as written to the serial port */
+} teSL_CaptureDirection;
+
+
+/** A captured block, followed by u16Length raw (escaped) bytes */
+typedef struct
+{
+    uint64_t    u64Time;        /**< Time since the start of the capture (us) */
+    uint8_t     u8Direction;    /**< teSL_CaptureDirection */
+    uint16_t    u16Length;
+} PACKED tsSL_CaptureRecord;
+
+
+/** Handle to a command sent with eSL_SendCommand(), to be passed to eSL_CommandWait() */
+typedef struct
+{
+    uint16_t    u16Type;        /**< Type of the command */
+    uint8_t     u8Slot;         /**< Command slot in the serial link */
+    uint32_t    u32Serial;      /**< Order in which the command was sent */
+} tsSL_CommandHandle;
+
+
 
 /****************************************************************************/
 /***        Local Function Prototypes                                     ***/
@@ -352,9 +487,29 @@ typedef void (*tprSL_MessageCallback)(void *pvUser, uint16_t u16Length, void *pv
 
 teSL_Status eSL_Init(char *cpSerialDevice, uint32_t u32BaudRate);
 
+/** Initialise the serial link to read from a capture file instead of a serial port.
+ *  The received bytes of the capture are fed to the frame decoder once the host
+ *  has sent its first message; messages sent by the host are dropped.
+ *  \param cpCaptureFile    File written by eSL_CaptureStart()
+ *  \param u32Speed         1 for the original timing, N to replay N times faster, 0 for no delays
+ *  \return E_SL_OK on success
+ */
+teSL_Status eSL_InitReplay(char *cpCaptureFile, uint32_t u32Speed);
+
 teSL_Status eSL_Destroy(void);
 
 
+/** Start writing the raw bytes read from and written to the serial port, with
+ *  timestamps, to a capture file. See tsSL_CaptureHeader and tsSL_CaptureRecord.
+ *  \param cpFileName       File to (over)write
+ *  \return E_SL_OK on success
+ */
+teSL_Status eSL_CaptureStart(char *cpFileName);
+
+/** Flush and close the capture file */
+teSL_Status eSL_CaptureStop(void);
+
+
 /** Send a command message to the serial device.
  *  This also listens for the returned Status message.
  *  If one is received, the status for the message is returned, otherwise
@@ -368,6 +523,54 @@ teSL_Status eSL_SendMessage(uint16_t u16Type, uint16_t u16Length, void *pvMessag
 teSL_Status eSL_SendMessageNoWait(uint16_t u16Type, uint16_t u16Length, void *pvMessage, uint8_t *pu8SequenceNo);
 
 
+/** Send a command message without waiting for its status.
+ *  Up to the command window of commands can wait for their status at the same
+ *  time, the call blocks while the window is full, while a command of a higher
+ *  priority class waits, or while the transmit rate is used up. The priority
+ *  class follows from the message type. The control bridge
+ *  returns the statuses in order, they are matched to the oldest outstanding
+ *  command of the same type. Part of the window is kept for interactive
+ *  commands, which wait until expired commands make room. Commands of the
+ *  other classes are dropped when the window stays full.
+ *  \param u16Type          Type of message to send
+ *  \param u16Length        Message length
+ *  \param pvMessage        Message data buffer
+ *  \param prCallback       Function to call with the status. May be NULL.
+ *  \param pvUser           User supplied data for the callback function
+ *  \param psHandle         Location to receive the handle for eSL_CommandWait(). May be NULL.
+ *                          When given, eSL_CommandWait() must be called to release the command.
+ *  \return E_SL_OK when the command has been sent
+ */
+teSL_Status eSL_SendCommand(uint16_t u16Type, uint16_t u16Length, void *pvMessage,
+                            tprSL_StatusCallback prCallback, void *pvUser, tsSL_CommandHandle *psHandle);
+
+
+/** Wait for the status of a command sent with eSL_SendCommand() and release it.
+ *  \param psHandle         Handle returned by eSL_SendCommand()
+ *  \param u32WaitTimeout   Maximum time to wait for the status (ms)
+ *  \param pu8SequenceNo    Pointer to location to receive the outgoing sequence number. May be NULL.
+ *  \return Status returned by the control bridge, E_SL_NOMESSAGE if none arrived in time
+ */
+teSL_Status eSL_CommandWait(tsSL_CommandHandle *psHandle, uint32_t u32WaitTimeout, uint8_t *pu8SequenceNo);
+
+
+/** Set the number of commands that may wait for their status at the same time.
+ *  A window of 1 sends one command at a time.
+ *  \param iWindow          Number of commands in flight
+ */
+void vSL_SetCommandWindow(int iWindow);
+
+
+/** Limit the rate at which commands are sent to the control bridge, which
+ *  turns most of them into radio frames. Up to u32Burst commands go out at once,
+ *  after that u32Rate per second. Commands that are not interactive leave
+ *  a few of the burst to interactive ones.
+ *  \param u32Rate          Commands per second, 0 for no limit
+ *  \param u32Burst         Commands that may be sent back to back
+ */
+void vSL_SetTxRate(uint32_t u32Rate, uint32_t u32Burst);
+
+
 /** Wait for a message of the given type to be received from the serial device
  *  \param u16Type          Type of message to wait for
  *  \param u32WaitTimeout   Maximum time to wait for messages (ms)
@@ -380,9 +583,22 @@ teSL_Status eSL_SendMessageNoWait(uint16_t u16Type, uint16_t u16Length, void *pv
 teSL_Status eSL_MessageWait(uint16_t u16Type, uint32_t u32WaitTimeout, uint16_t *pu16Length, void **ppvMessage);
 
 
+/** Get a copy of the serial link statistics
+ *  \param psStats          Location to receive the statistics
+ */
+void vSL_GetStats(tsSL_Stats *psStats);
+
+
+/** Time since the message being handled was read from the serial port
+ *  \return Microseconds, 0 when not called from a listener callback
+ */
+uint32_t u32SL_MessageAge(void);
+
+
 /** Add a callback function for a particular message type
- *  The callback function will be called in the context of a new thread that exists 
- *  only to service the incoming message and will subsequently be destroyed.
+ *  The callback function will be called in the context of one of SL_CALLBACK_WORKERS
+ *  callback threads. Messages from the same device (short address) are handled in
+ *  order on one thread, messages without a short address all on the first thread.
  *  Multiple callbacks for a given message type may be registered.
  *  \param u16Type          Type of message to register a handler for
  *  \param prCallback       Callback function to be called when a message of this type arrives.
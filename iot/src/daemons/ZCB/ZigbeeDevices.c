@@ -54,6 +54,9 @@ extern void announceDevice(
 
 #define ZD_DEBUG(...) printf(__VA_ARGS__)
 
+/* Interview documents are built in a per-thread arena instead of one malloc per node */
+#define ZD_ARENA_SIZE 16384
+
 #define NULL_DEVICE {NULL, 0, NULL}
 
 static tsZDDevice asZigbeeDeviceTable [] =
@@ -290,7 +293,7 @@ ZDPopulateClusters(
   {
     /* Look up for cluster ID */
     uint16_t u16Id= ntohs(*pu16ClusterId);
-    for (psCluster = &(asZigbeeClusters[0]); psCluster != NULL; psCluster++ )
+    for (psCluster = &(asZigbeeClusters[0]); psCluster->szName != NULL; psCluster++ )
     {
       if (psCluster->u16Id == u16Id)
       {
@@ -302,10 +305,10 @@ ZDPopulateClusters(
       }
     }
     /* If cluster is not recognized (private/reserved Id) */
-    if (psCluster == NULL)
+    if (psCluster->szName == NULL)
     {
       /* Use its ID in hex as name */
-      char szHexClusterId[sizeof(uint16_t)+1];
+      char szHexClusterId[2*sizeof(uint16_t)+1];
       sprintf(szHexClusterId, "%04x", u16Id);
       cJSON * psJsonCluster = cJSON_CreateObject();
       cJSON_AddNumberToObject(psJsonCluster, szHexClusterId, u16Id);
@@ -315,6 +318,9 @@ ZDPopulateClusters(
 }
 
 /*!
+ * Builds the device description document. Not registered as listener:
+ * the daemon handles the response in ZCB_HandleSimpleDescriptorResponse
+ * (zcb.c), which fills fixed newDb records and allocates nothing.
  *
  * @param pvUser    (not used) pointer to Cookie from callback caller
  * @param u16Length (In) Message length
@@ -338,8 +344,12 @@ void ZDSimpleDescResp(
   uint16_t u16ShortAddress  = ntohs(psMessage->u16ShortAddress);
   uint16_t u16DeviceID      = ntohs(psMessage->u16DeviceID);
 
+  static __thread char acArena[ZD_ARENA_SIZE];
+  cJSON_Arena sArena;
+
   /* TODO : check if dev already exists */
-  /* Create Device */
+  /* Create Device (released at once by cJSON_ArenaEnd) */
+  cJSON_ArenaBegin(&sArena, acArena, sizeof(acArena));
   cJSON * psJsonDesc = cJSON_CreateObject();
   cJSON * psInputClusterList = cJSON_CreateArray();
   cJSON * psOutputClusterList = cJSON_CreateArray();
@@ -359,7 +369,7 @@ void ZDSimpleDescResp(
   }
 
   /* If device is not recognized (private/reserved Id) */
-  if (psDevice == NULL)
+  if (psDevice->szDomain == NULL)
   {
     /* Just set its ID as a string */
     // cJSON_AddIntToObject(psJsonDesc, "Device", (int) u16DeviceID);
@@ -375,7 +385,13 @@ void ZDSimpleDescResp(
   ZDPopulateClusters(psInputClusterList, psInputClusters);
   cJSON_AddItemToObjectCS(psJsonDesc, "outputClusters", psOutputClusterList);
   ZDPopulateClusters(psOutputClusterList, psOutputClusters);
-  /* TODO : store the JSON somewhere */
+  /* TODO : store the JSON somewhere (serialize it before cJSON_ArenaEnd) */
+  if (sArena.failed)
+  {
+    ZD_DEBUG( "Device 0x%04x description exceeded the arena (%d allocations on the heap)\n",
+        u16ShortAddress, (int)sArena.failed );
+  }
+  cJSON_ArenaEnd(&sArena);
 
   /* For each cluster, request supported attributes */
   ZDAttrDiscReq(psMessage);
@@ -27,6 +27,7 @@
 #include "dump.h"
 #include "newLog.h"
 #include "cmd.h"
+#include "scanner.h"
 
 #define CMD_DEBUG  1
 
@@ -47,9 +48,9 @@ extern int writeControl( char * cmd );
 // Attributes
 // ------------------------------------------------------------------
     
-#define NUMINTATTRS  6
+#define NUMINTATTRS  8
 static char * intAttrs[NUMINTATTRS] = { "reset", "startnwk",
-    "erase", "getversion", "getpermit", "duration" };
+    "erase", "getversion", "getpermit", "duration", "linkstats", "neighbours" };
 
 #define NUMSTRINGATTRS  6
 static char * stringAttrs[NUMSTRINGATTRS] = {
@@ -449,6 +450,18 @@ int cmdHandle( void ) {
         }
     }
 
+    int linkstats = parsingGetIntAttr( "linkstats" );
+    if ( linkstats >= 0 ) {
+        printf( "LinkStats command %d\n", linkstats );
+        zcbLogLinkStats();
+    }
+
+    int neighbours = parsingGetIntAttr( "neighbours" );
+    if ( neighbours >= 0 ) {
+        printf( "Neighbours command %d\n", neighbours );
+        scannerLog();
+    }
+
     int getpermit = parsingGetIntAttr( "getpermit" );
     if ( getpermit >= 0 ) {
         printf( "GetPermit command %d\n", getpermit );
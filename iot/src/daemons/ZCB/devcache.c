@@ -0,0 +1,559 @@
+// ------------------------------------------------------------------
+// Device cache
+// ------------------------------------------------------------------
+// iot_zb's own copy of the device values it reports, written
+// behind to the IoT database
+// ------------------------------------------------------------------
+// Part of gateway_zigbee, licensed under the GNU GPL v3 (see LICENSE)
+// ------------------------------------------------------------------
+
+/** \addtogroup zb
+ * \file
+ * \brief Device cache with write-behind to the IoT database
+ *
+ * Attribute reports are handled on the SerialLink callback threads. They
+ * used to read and write the device's database row for every report. Now
+ * they only update this cache and the changed fields are written to the
+ * database from the event loop, DEVCACHE_FLUSH_DELAY ms after the first
+ * change, for all devices in one database access.
+ *
+ * Only the fields that iot_zb reports (see devcacheField_t) are written,
+ * on top of the row as it is in the database, so names, rooms and flags
+ * set by the other daemons are kept. The other daemons also write some of
+ * these fields, e.g. the Control Interface sets cmd and lvl. A reported
+ * value is therefore compared with the row itself when it is written, not
+ * with an earlier copy, and rows in which nothing changed are left alone.
+ *
+ * The cache also maps short addresses to IEEE addresses, which otherwise
+ * is a database lookup per report. It grows with the network, starting at
+ * DEVCACHE_MIN_DEVICES entries.
+ *
+ * The callback threads must not set the loop's timers: the first change
+ * kicks an event, and the loop arms the flush timer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "newDb.h"
+#include "newLog.h"
+#include "nibbles.h"
+#include "plugUsage.h"
+#include "zcb.h"
+#include "SerialLink.h"
+#include "evloop.h"
+#include "devcache.h"
+
+// ------------------------------------------------------------------
+// Macros
+// ------------------------------------------------------------------
+
+/*#define DEVCACHE_DEBUG*/
+
+#ifdef DEVCACHE_DEBUG
+#define DEBUG_PRINTF(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_PRINTF(...)
+#endif /* DEVCACHE_DEBUG */
+
+// Entries allocated at the first device, doubled when full
+#define DEVCACHE_MIN_DEVICES  32
+
+// Time between the first change and writing it to the database (ms)
+#define DEVCACHE_FLUSH_DELAY  250
+
+// A device that is not in the database is looked up again after this (s)
+#define DEVCACHE_RECHECK      10
+
+// Pending work besides the fields
+#define DEVCACHE_JOINED       ( 1 << DEVCACHE_FIELDS )
+#define DEVCACHE_PLUGHIST     ( 1 << ( DEVCACHE_FIELDS + 1 ) )
+
+// ------------------------------------------------------------------
+// Typing
+// ------------------------------------------------------------------
+
+typedef enum {
+    DEVCACHE_FREE,
+    DEVCACHE_UNKNOWN,       // Short address known, not looked up yet
+    DEVCACHE_PRESENT,
+    DEVCACHE_ABSENT,
+} devcacheState_t;
+
+typedef struct {
+    devcacheState_t state;
+    char     mac[LEN_MAC_NIBBLE+2];
+    uint16_t saddr;             // 0xFFFF when unknown
+    int      checked;           // Last database lookup
+    int      dirty;             // Fields to write, bit per devcacheField_t
+    uint64_t dirtySince;        // When the oldest of these was read from the serial port (us)
+    int      found;             // Flushing: row was written
+    char     ty[LEN_TY+2];
+    char     cmd[LEN_CMD+2];
+    int      values[DEVCACHE_FIELDS];
+} devcacheEntry_t;
+
+// ------------------------------------------------------------------
+// Globals
+// ------------------------------------------------------------------
+
+static pthread_mutex_t devcacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static devcacheEntry_t * entries = NULL;
+static int               numEntries = 0;    // Allocated
+static int               flushEvent = -1;
+static int               flushTimer = -1;
+static int               pending = 0;       // Entries with dirty fields
+
+// Entries being flushed, only used by the event loop
+static devcacheEntry_t * flushing = NULL;
+static int               sizeFlushing = 0;  // Allocated
+static int               numFlushing = 0;
+static int             numUnchanged = 0;
+
+static struct {
+    uint32_t updates;       // Values reported
+    uint32_t unchanged;     // ... of which the database already had
+    uint32_t lookups;       // Database reads
+    uint32_t flushes;
+    uint32_t written;       // Rows written
+
+    // From the serial port to the database, since the previous log
+    uint32_t latencyCount;
+    uint64_t latencyTotal;  // us
+    uint32_t latencyMax;    // us
+} stats;
+
+// ------------------------------------------------------------------
+// Entries
+// ------------------------------------------------------------------
+
+// Doubles the entries. Called with the mutex held
+static devcacheEntry_t * devcacheGrow( void ) {
+    int size = numEntries ? 2 * numEntries : DEVCACHE_MIN_DEVICES;
+    devcacheEntry_t * grown = realloc( entries, size * sizeof( devcacheEntry_t ) );
+    int first = numEntries;
+
+    if ( !grown ) {
+        printf( "Device cache could not grow to %d devices\n", size );
+        return( NULL );
+    }
+    // All DEVCACHE_FREE
+    memset( &grown[first], 0, ( size - first ) * sizeof( devcacheEntry_t ) );
+    entries    = grown;
+    numEntries = size;
+    DEBUG_PRINTF( "Device cache grown to %d devices\n", size );
+    return( &entries[first] );
+}
+
+// Called with the mutex held
+static devcacheEntry_t * devcacheFind( char * mac, int create ) {
+    devcacheEntry_t * free = NULL;
+    int i;
+
+    for ( i=0; i<numEntries; i++ ) {
+        if ( entries[i].state == DEVCACHE_FREE ) {
+            if ( !free ) free = &entries[i];
+        } else if ( strcmp( entries[i].mac, mac ) == 0 ) {
+            return( &entries[i] );
+        }
+    }
+
+    if ( !create ) {
+        return( NULL );
+    }
+    if ( !free ) {
+        free = devcacheGrow();
+    }
+    if ( !free ) {
+        // Out of memory: reuse an entry without pending changes, preferably of a device that is not in the database
+        for ( i=0; i<numEntries; i++ ) {
+            if ( !entries[i].dirty && ( !free || entries[i].state == DEVCACHE_ABSENT ) ) {
+                free = &entries[i];
+            }
+        }
+        if ( !free ) return( NULL );
+    }
+
+    memset( free, 0, sizeof( devcacheEntry_t ) );
+    free->state = DEVCACHE_UNKNOWN;
+    free->saddr = 0xFFFF;
+    newDbStrNcpy( free->mac, mac, LEN_MAC_NIBBLE );
+    return( free );
+}
+
+static uint64_t devcacheMicroseconds( void ) {
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return( (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000 );
+}
+
+// Called with the mutex held
+static void devcacheMarkDirty( devcacheEntry_t * entry, int fields ) {
+    if ( !entry->dirty ) {
+        // Count from when the report was read, the same clock as SerialLink
+        entry->dirtySince = devcacheMicroseconds() - u32SL_MessageAge();
+        if ( pending++ == 0 ) {
+            evloopKick( flushEvent );
+        }
+    }
+    entry->dirty |= fields;
+}
+
+// Finds the entry of a device in the database, reading its row if needed. Called with the mutex held
+static devcacheEntry_t * devcacheLookup( char * mac ) {
+    devcacheEntry_t * entry = devcacheFind( mac, 1 );
+    int now = (int)time( NULL );
+
+    if ( entry && ( entry->state == DEVCACHE_UNKNOWN ||
+                  ( entry->state == DEVCACHE_ABSENT && now - entry->checked >= DEVCACHE_RECHECK ) ) ) {
+        newdb_dev_t device;
+
+        stats.lookups++;
+        entry->checked = now;
+        if ( newDbGetDevice( mac, &device ) ) {
+            entry->state = DEVCACHE_PRESENT;
+            newDbStrNcpy( entry->ty, device.ty, LEN_TY );
+            // A report marks the device as joined
+            if ( !( device.flags & FLAG_DEV_JOINED ) ) {
+                devcacheMarkDirty( entry, DEVCACHE_JOINED );
+            }
+        } else {
+            DEBUG_PRINTF( "Device %s not in the database\n", mac );
+            entry->state = DEVCACHE_ABSENT;
+        }
+    }
+    return( ( entry && entry->state == DEVCACHE_PRESENT ) ? entry : NULL );
+}
+
+// ------------------------------------------------------------------
+// Short addresses
+// ------------------------------------------------------------------
+
+/**
+ * \brief Remembers the short address of a node, e.g. when it joins
+ */
+void devcacheSetNode( uint16_t saddr, uint64_t mac ) {
+    char nibbles[LEN_MAC_NIBBLE+2];
+    devcacheEntry_t * entry;
+    int i;
+
+    u642nibblestr( mac, nibbles );
+    pthread_mutex_lock( &devcacheMutex );
+    // The short address may have belonged to another node
+    for ( i=0; i<numEntries; i++ ) {
+        if ( entries[i].state != DEVCACHE_FREE && entries[i].saddr == saddr ) {
+            entries[i].saddr = 0xFFFF;
+        }
+    }
+    if ( ( entry = devcacheFind( nibbles, 1 ) ) != NULL ) {
+        entry->saddr = saddr;
+    }
+    pthread_mutex_unlock( &devcacheMutex );
+}
+
+/**
+ * \brief Gets the IEEE address of a node
+ * \returns IEEE address, 0 when unknown
+ */
+uint64_t devcacheGetExtendedAddress( uint16_t saddr ) {
+    uint64_t mac = 0;
+    int i;
+
+    pthread_mutex_lock( &devcacheMutex );
+    for ( i=0; i<numEntries && !mac; i++ ) {
+        if ( entries[i].state != DEVCACHE_FREE && entries[i].saddr == saddr ) {
+            mac = nibblestr2u64( entries[i].mac );
+        }
+    }
+    pthread_mutex_unlock( &devcacheMutex );
+
+    if ( !mac ) {
+        __sync_add_and_fetch( &stats.lookups, 1 );
+        if ( ( mac = zcbNodeGetExtendedAddress( saddr ) ) != 0 ) {
+            devcacheSetNode( saddr, mac );
+        }
+    }
+    return( mac );
+}
+
+/**
+ * \brief Makes the cache read the device's row again at its next report,
+ * e.g. after it was added to the database
+ */
+void devcacheForget( char * mac ) {
+    devcacheEntry_t * entry;
+
+    pthread_mutex_lock( &devcacheMutex );
+    if ( ( entry = devcacheFind( mac, 0 ) ) != NULL && !entry->dirty ) {
+        entry->state = DEVCACHE_UNKNOWN;
+    }
+    pthread_mutex_unlock( &devcacheMutex );
+}
+
+// ------------------------------------------------------------------
+// Values
+// ------------------------------------------------------------------
+
+/**
+ * \brief Sets a device value, to be written to the database later. Like before,
+ * devices are not added to the database.
+ * \returns 1 when the device is in the database, 0 when not
+ */
+int devcacheSet( char * mac, devcacheField_t field, int value ) {
+    devcacheEntry_t * entry;
+
+    pthread_mutex_lock( &devcacheMutex );
+    stats.updates++;
+    if ( ( entry = devcacheLookup( mac ) ) != NULL ) {
+        entry->values[field] = value;
+        devcacheMarkDirty( entry, 1 << field );
+    }
+    pthread_mutex_unlock( &devcacheMutex );
+    return( entry != NULL );
+}
+
+/**
+ * \brief Sets a device's command (e.g. "on"), see devcacheSet()
+ */
+int devcacheSetCmd( char * mac, char * cmd ) {
+    devcacheEntry_t * entry;
+
+    pthread_mutex_lock( &devcacheMutex );
+    stats.updates++;
+    if ( ( entry = devcacheLookup( mac ) ) != NULL ) {
+        newDbStrNcpy( entry->cmd, cmd, LEN_CMD );
+        devcacheMarkDirty( entry, 1 << DEVCACHE_CMD );
+    }
+    pthread_mutex_unlock( &devcacheMutex );
+    return( entry != NULL );
+}
+
+/**
+ * \brief Sets a plug's summation (Wh) and adds it to the plug history
+ */
+int devcacheSetPlugHist( char * mac, int sum ) {
+    devcacheEntry_t * entry;
+
+    pthread_mutex_lock( &devcacheMutex );
+    if ( ( entry = devcacheLookup( mac ) ) != NULL ) {
+        entry->values[DEVCACHE_SUM] = sum;
+        devcacheMarkDirty( entry, ( 1 << DEVCACHE_SUM ) | DEVCACHE_PLUGHIST );
+    }
+    pthread_mutex_unlock( &devcacheMutex );
+    return( entry != NULL );
+}
+
+/**
+ * \brief Gets a device's type
+ * \param ty Buffer of LEN_TY+2 chars
+ * \returns 1 when the device is in the database, 0 when not
+ */
+int devcacheGetTy( char * mac, char * ty ) {
+    devcacheEntry_t * entry;
+
+    pthread_mutex_lock( &devcacheMutex );
+    if ( ( entry = devcacheLookup( mac ) ) != NULL ) {
+        strcpy( ty, entry->ty );
+    }
+    pthread_mutex_unlock( &devcacheMutex );
+    return( entry != NULL );
+}
+
+// ------------------------------------------------------------------
+// Write-behind
+// ------------------------------------------------------------------
+
+// Writes a value into the row when it differs. Called from devcacheUpdateCb()
+static int devcacheMerge( devcacheEntry_t * entry, devcacheField_t field, int * value ) {
+    if ( !( entry->dirty & ( 1 << field ) ) ) {
+        return( 0 );
+    }
+    if ( *value == entry->values[field] ) {
+        numUnchanged++;
+        return( 0 );
+    }
+    *value = entry->values[field];
+    return( 1 );
+}
+
+static int devcacheUpdateCb( newdb_dev_t * pdev ) {
+    int i;
+
+    for ( i=0; i<numFlushing; i++ ) {
+        devcacheEntry_t * entry = &flushing[i];
+        if ( entry->dirty && strcmp( entry->mac, pdev->mac ) == 0 ) {
+            int changed = 0;
+            if ( entry->dirty & ( 1 << DEVCACHE_CMD ) ) {
+                if ( strncmp( pdev->cmd, entry->cmd, LEN_CMD ) != 0 ) {
+                    newDbStrNcpy( pdev->cmd, entry->cmd, LEN_CMD );
+                    changed = 1;
+                } else {
+                    numUnchanged++;
+                }
+            }
+            changed |= devcacheMerge( entry, DEVCACHE_LVL,  &pdev->lvl );
+            changed |= devcacheMerge( entry, DEVCACHE_TMP,  &pdev->tmp );
+            changed |= devcacheMerge( entry, DEVCACHE_HUM,  &pdev->hum );
+            changed |= devcacheMerge( entry, DEVCACHE_ALS,  &pdev->als );
+            changed |= devcacheMerge( entry, DEVCACHE_BAT,  &pdev->bat );
+            changed |= devcacheMerge( entry, DEVCACHE_BATL, &pdev->batl );
+            changed |= devcacheMerge( entry, DEVCACHE_PRS,  &pdev->prs );
+            changed |= devcacheMerge( entry, DEVCACHE_ACT,  &pdev->act );
+            changed |= devcacheMerge( entry, DEVCACHE_SUM,  &pdev->sum );
+            if ( !( pdev->flags & FLAG_DEV_JOINED ) ) {
+                pdev->flags |= FLAG_DEV_JOINED;
+                changed = 1;
+            }
+            entry->found = 1;
+            return( changed );
+        }
+    }
+    return( 0 );
+}
+
+/**
+ * \brief Writes the changed values to the database. Called from the event loop.
+ * \returns Number of devices written
+ */
+int devcacheFlush( void ) {
+    static int cleanupCnt = 0;
+    uint32_t latency, latencyMax = 0;
+    uint64_t latencyTotal = 0, flushed;
+    int i, written, now, found = 0;
+
+    // Take the changes, so that reports can go on while the database is written
+    pthread_mutex_lock( &devcacheMutex );
+    if ( sizeFlushing < numEntries ) {
+        devcacheEntry_t * grown = realloc( flushing, numEntries * sizeof( devcacheEntry_t ) );
+        if ( grown ) {
+            flushing     = grown;
+            sizeFlushing = numEntries;
+        }
+    }
+    numFlushing = 0;
+    pending = 0;
+    for ( i=0; i<numEntries; i++ ) {
+        if ( !entries[i].dirty ) {
+            continue;
+        }
+        if ( numFlushing < sizeFlushing ) {
+            flushing[numFlushing] = entries[i];
+            flushing[numFlushing++].found = 0;
+            entries[i].dirty = 0;
+        } else {
+            // Out of memory: left for the next flush
+            pending++;
+        }
+    }
+    if ( pending ) {
+        evloopKick( flushEvent );
+    }
+    numUnchanged = 0;
+    pthread_mutex_unlock( &devcacheMutex );
+
+    if ( numFlushing == 0 ) {
+        return( 0 );
+    }
+
+    written = newDbUpdateDevices( devcacheUpdateCb );
+    now = (int)time( NULL );
+    flushed = devcacheMicroseconds();
+
+    for ( i=0; i<numFlushing; i++ ) {
+        devcacheEntry_t * entry = &flushing[i];
+
+        if ( !entry->found ) {
+            // Removed from the database in the meantime
+            DEBUG_PRINTF( "Device %s was removed from the database\n", entry->mac );
+            pthread_mutex_lock( &devcacheMutex );
+            devcacheEntry_t * current = devcacheFind( entry->mac, 0 );
+            if ( current ) {
+                current->state   = DEVCACHE_ABSENT;
+                current->checked = now;
+                current->dirty   = 0;
+            }
+            pthread_mutex_unlock( &devcacheMutex );
+            continue;
+        }
+
+        latency = (uint32_t)( flushed - entry->dirtySince );
+        latencyTotal += latency;
+        if ( latency > latencyMax ) latencyMax = latency;
+        found++;
+
+        if ( entry->dirty & DEVCACHE_PLUGHIST ) {
+            newdb_plughist_t plughist;
+            if ( newDbGetMatchingOrNewPlugHist( entry->mac, now/60, &plughist ) ) {
+                plughist.sum = entry->values[DEVCACHE_SUM];
+                newDbSetPlugHist( &plughist );
+
+                // Clean history entries older than one day
+                if ( cleanupCnt-- < 0 ) {
+                    if ( plugHistoryCleanup( entry->mac, now ) ) {
+                        cleanupCnt = 25;
+                    }
+                }
+            }
+        }
+    }
+
+    pthread_mutex_lock( &devcacheMutex );
+    stats.flushes++;
+    stats.written += written;
+    stats.unchanged += numUnchanged;
+    stats.latencyCount += found;
+    stats.latencyTotal += latencyTotal;
+    if ( latencyMax > stats.latencyMax ) stats.latencyMax = latencyMax;
+    pthread_mutex_unlock( &devcacheMutex );
+
+    DEBUG_PRINTF( "Flushed %d devices\n", written );
+    return( written );
+}
+
+static void devcacheOnTimer( void * user, uint32_t expirations ) {
+    devcacheFlush();
+}
+
+// A callback thread made the first change since the previous flush
+static void devcacheOnChange( void * user, uint32_t kicks ) {
+    evloopSetTimer( flushTimer, DEVCACHE_FLUSH_DELAY, 0 );
+}
+
+/**
+ * \brief Creates the flush timer and its event. To be called after evloopInit(),
+ * before the SerialLink threads are started
+ */
+void devcacheInit( void ) {
+    flushTimer = evloopAddTimer( devcacheOnTimer, NULL );
+    flushEvent = evloopAddEvent( devcacheOnChange, NULL );
+}
+
+/**
+ * \brief Logs the cache counters, and the time from the serial port to the
+ * database since the previous log
+ */
+void devcacheLog( void ) {
+    char line[NEWLOG_MAX_TEXT+2];
+    char latency[NEWLOG_MAX_TEXT+2];
+
+    pthread_mutex_lock( &devcacheMutex );
+    snprintf( line, sizeof( line ), "Cache: %u updates (%u unchanged), %u lookups, %u flushes, %u rows written",
+        stats.updates, stats.unchanged, stats.lookups, stats.flushes, stats.written );
+    snprintf( latency, sizeof( latency ), "Cache: %u devices to db avg %u max %u us",
+        stats.latencyCount,
+        stats.latencyCount ? (unsigned)( stats.latencyTotal / stats.latencyCount ) : 0, stats.latencyMax );
+    stats.latencyCount = 0;
+    stats.latencyTotal = 0;
+    stats.latencyMax   = 0;
+    pthread_mutex_unlock( &devcacheMutex );
+    printf( "%s\n%s\n", line, latency );
+    newLogAdd( NEWLOG_FROM_ZCB_OUT, line );
+    newLogAdd( NEWLOG_FROM_ZCB_OUT, latency );
+}
+
+// ------------------------------------------------------------------
+// End of file
+// ------------------------------------------------------------------
@@ -0,0 +1,39 @@
+// ------------------------------------------------------------------
+// Device cache - include file
+// ------------------------------------------------------------------
+// Part of gateway_zigbee, licensed under the GNU GPL v3 (see LICENSE)
+// ------------------------------------------------------------------
+
+#include <stdint.h>
+
+/** Device table fields reported by iot_zb */
+typedef enum {
+    DEVCACHE_CMD,
+    DEVCACHE_LVL,
+    DEVCACHE_TMP,
+    DEVCACHE_HUM,
+    DEVCACHE_ALS,
+    DEVCACHE_BAT,
+    DEVCACHE_BATL,
+    DEVCACHE_PRS,
+    DEVCACHE_ACT,
+    DEVCACHE_SUM,
+    DEVCACHE_FIELDS
+} devcacheField_t;
+
+void     devcacheInit( void );
+int      devcacheFlush( void );
+void     devcacheLog( void );
+
+void     devcacheSetNode( uint16_t saddr, uint64_t mac );
+uint64_t devcacheGetExtendedAddress( uint16_t saddr );
+void     devcacheForget( char * mac );
+
+int      devcacheSet( char * mac, devcacheField_t field, int value );
+int      devcacheSetCmd( char * mac, char * cmd );
+int      devcacheSetPlugHist( char * mac, int sum );
+int      devcacheGetTy( char * mac, char * ty );
+
+// ------------------------------------------------------------------
+// END OF FILE
+// ------------------------------------------------------------------
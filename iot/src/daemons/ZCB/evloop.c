@@ -0,0 +1,467 @@
+// ------------------------------------------------------------------
+// Event loop
+// ------------------------------------------------------------------
+// One epoll loop for the main thread: file descriptors, timers,
+// signals and the incoming message queue
+// ------------------------------------------------------------------
+// Part of gateway_zigbee, licensed under the GNU GPL v3 (see LICENSE)
+// ------------------------------------------------------------------
+
+/** \addtogroup zb
+ * \file
+ * \brief Event loop
+ *
+ * Timers are timerfds and signals signalfds, so the loop only wakes up
+ * when there is something to do. The sources are only set up from the
+ * loop's thread, so other threads must not touch timers: they kick an
+ * event (an eventfd) instead, and its callback runs on the loop. SysV message queues cannot be waited on
+ * with epoll: a thread blocks in msgrcv() instead, puts the messages in
+ * a small ring and kicks an eventfd. When the ring is full that thread
+ * stops reading and the messages stay in the queue.
+ *
+ * The serial port is not on the loop. Commands are sent from the loop's
+ * queue callback, and the serial link API blocks until the control
+ * bridge answers: eSL_SendCommand() waits for room in the command window
+ * and for the status, eSL_MessageWait() for the response. Those arrive
+ * through the SerialLink reader thread, so reading the port on the loop
+ * thread would deadlock on the first command.
+ *
+ * So the loop only replaces the polling of the main thread. It does not
+ * take handoffs out of the serial path: a frame still goes from the reader
+ * thread to a callback worker, and a queue message from the queue thread
+ * through the ring to the loop.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "queue.h"
+#include "iotSleep.h"
+#include "evloop.h"
+
+// ------------------------------------------------------------------
+// Macros
+// ------------------------------------------------------------------
+
+/*#define EVLOOP_DEBUG*/
+
+#ifdef EVLOOP_DEBUG
+#define DEBUG_PRINTF(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_PRINTF(...)
+#endif /* EVLOOP_DEBUG */
+
+#define EVLOOP_MAX_SOURCES    16
+#define EVLOOP_MAX_EVENTS     8
+
+// Queue messages read ahead of the loop
+#define EVLOOP_QUEUE_SLOTS    16
+
+// ------------------------------------------------------------------
+// Typing
+// ------------------------------------------------------------------
+
+typedef enum {
+    EVLOOP_FD,
+    EVLOOP_SIGNAL,
+    EVLOOP_TIMER,
+    EVLOOP_EVENT,
+    EVLOOP_QUEUE,
+} evloopKind_t;
+
+typedef struct {
+    evloopKind_t        kind;
+    int                 fd;
+    evloopCallback      cb;
+    evloopQueueCallback queueCb;
+    void              * user;
+} evloopSource_t;
+
+// ------------------------------------------------------------------
+// Globals
+// ------------------------------------------------------------------
+
+static int             epollFd = -1;
+static volatile int    stopped = 0;
+static evloopSource_t  sources[EVLOOP_MAX_SOURCES];
+static int             numSources = 0;
+static evloopStats_t   loopStats;
+
+// Only one queue: the one the daemon reads its commands from
+static struct {
+    int             source;         // -1 if none
+    int             queue;
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t  space;
+    int             head;
+    int             count;
+    int             len[EVLOOP_QUEUE_SLOTS];
+    char            data[EVLOOP_QUEUE_SLOTS][MAXMESSAGESIZE+2];
+} ring = { .source = -1, .mutex = PTHREAD_MUTEX_INITIALIZER, .space = PTHREAD_COND_INITIALIZER };
+
+// ------------------------------------------------------------------
+// Sources
+// ------------------------------------------------------------------
+
+static int evloopAddSource( evloopKind_t kind, int fd, evloopCallback cb,
+                            evloopQueueCallback queueCb, void * user, uint32_t events ) {
+    struct epoll_event ev;
+
+    if ( epollFd < 0 || numSources >= EVLOOP_MAX_SOURCES ) {
+        return( -1 );
+    }
+
+    memset( &ev, 0, sizeof( ev ) );
+    ev.events   = events;
+    ev.data.u32 = numSources;
+    if ( epoll_ctl( epollFd, EPOLL_CTL_ADD, fd, &ev ) < 0 ) {
+        printf( "Could not add fd %d to the event loop (%s)\n", fd, strerror( errno ) );
+        return( -1 );
+    }
+
+    sources[numSources].kind    = kind;
+    sources[numSources].fd      = fd;
+    sources[numSources].cb      = cb;
+    sources[numSources].queueCb = queueCb;
+    sources[numSources].user    = user;
+    return( numSources++ );
+}
+
+/**
+ * \brief Watches a file descriptor
+ * \param fd File descriptor
+ * \param events epoll events, e.g. EPOLLIN
+ * \param cb Called from the loop with the events that occurred
+ * \returns Source number, -1 on error
+ */
+int evloopAddFd( int fd, uint32_t events, evloopCallback cb, void * user ) {
+    return( evloopAddSource( EVLOOP_FD, fd, cb, NULL, user, events ) );
+}
+
+/**
+ * \brief Handles a signal in the loop instead of in a signal handler.
+ * The signal is blocked in the calling thread, so this must be called
+ * before any other thread is started.
+ * \param sig Signal number
+ * \param cb Called from the loop with the signal number
+ * \returns Source number, -1 on error
+ */
+int evloopAddSignal( int sig, evloopCallback cb, void * user ) {
+    sigset_t mask;
+    int fd, source;
+
+    sigemptyset( &mask );
+    sigaddset( &mask, sig );
+    pthread_sigmask( SIG_BLOCK, &mask, NULL );
+
+    if ( ( fd = signalfd( -1, &mask, SFD_NONBLOCK | SFD_CLOEXEC ) ) < 0 ) {
+        printf( "Could not create signalfd (%s)\n", strerror( errno ) );
+        return( -1 );
+    }
+    if ( ( source = evloopAddSource( EVLOOP_SIGNAL, fd, cb, NULL, user, EPOLLIN ) ) < 0 ) {
+        close( fd );
+    }
+    return( source );
+}
+
+/**
+ * \brief Creates a timer, see evloopSetTimer()
+ * \param cb Called from the loop with the number of expirations
+ * \returns Timer, -1 on error
+ */
+int evloopAddTimer( evloopCallback cb, void * user ) {
+    int fd, source;
+
+    if ( ( fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC ) ) < 0 ) {
+        printf( "Could not create timerfd (%s)\n", strerror( errno ) );
+        return( -1 );
+    }
+    if ( ( source = evloopAddSource( EVLOOP_TIMER, fd, cb, NULL, user, EPOLLIN ) ) < 0 ) {
+        close( fd );
+    }
+    return( source );
+}
+
+/**
+ * \brief (Re)arms or disarms a timer. Only from the loop's thread, see evloopKick()
+ * \param timer Timer returned by evloopAddTimer()
+ * \param msec Time to the first expiration, < 0 to disarm
+ * \param periodMsec Time between the following expirations, 0 for a one-shot timer
+ */
+void evloopSetTimer( int timer, int msec, int periodMsec ) {
+    struct itimerspec its;
+
+    if ( timer < 0 || timer >= numSources || sources[timer].kind != EVLOOP_TIMER ) {
+        return;
+    }
+
+    memset( &its, 0, sizeof( its ) );
+    if ( msec >= 0 ) {
+        its.it_value.tv_sec     = msec / 1000;
+        its.it_value.tv_nsec    = ( msec % 1000 ) * 1000000;
+        if ( msec == 0 ) its.it_value.tv_nsec = 1;     // Zero would disarm
+        its.it_interval.tv_sec  = periodMsec / 1000;
+        its.it_interval.tv_nsec = ( periodMsec % 1000 ) * 1000000;
+    }
+    timerfd_settime( sources[timer].fd, 0, &its, NULL );
+}
+
+/**
+ * \brief Creates an event, for other threads to wake up the loop with evloopKick()
+ * \param cb Called from the loop with the number of kicks since the previous call
+ * \returns Event, -1 on error
+ */
+int evloopAddEvent( evloopCallback cb, void * user ) {
+    int fd, source;
+
+    if ( ( fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) < 0 ) {
+        printf( "Could not create eventfd (%s)\n", strerror( errno ) );
+        return( -1 );
+    }
+    if ( ( source = evloopAddSource( EVLOOP_EVENT, fd, cb, NULL, user, EPOLLIN ) ) < 0 ) {
+        close( fd );
+    }
+    return( source );
+}
+
+/**
+ * \brief Kicks an event. May be called from any thread started after the
+ * event was added, e.g. the SerialLink callback workers.
+ * \param event Event returned by evloopAddEvent()
+ */
+void evloopKick( int event ) {
+    uint64_t one = 1;
+
+    // Not checked against numSources, which the loop's thread may be changing
+    if ( event < 0 || event >= EVLOOP_MAX_SOURCES ) {
+        return;
+    }
+    if ( write( sources[event].fd, &one, sizeof( one ) ) < 0 ) {
+        printf( "Could not signal the event loop (%s)\n", strerror( errno ) );
+    }
+}
+
+// ------------------------------------------------------------------
+// Queue
+// ------------------------------------------------------------------
+
+static void evloopUnlock( void * mutex ) {
+    pthread_mutex_unlock( (pthread_mutex_t *)mutex );
+}
+
+static void * evloopQueueThread( void * arg ) {
+    char message[MAXMESSAGESIZE+2];
+    uint64_t one = 1;
+    int len;
+
+    while ( 1 ) {
+        if ( ( len = queueRead( ring.queue, message, sizeof( message ) ) ) < 0 ) {
+            IOT_MSLEEP( 1000 );
+            continue;
+        }
+
+        pthread_mutex_lock( &ring.mutex );
+        pthread_cleanup_push( evloopUnlock, &ring.mutex );
+        while ( ring.count >= EVLOOP_QUEUE_SLOTS ) {
+            pthread_cond_wait( &ring.space, &ring.mutex );
+        }
+        int slot = ( ring.head + ring.count ) % EVLOOP_QUEUE_SLOTS;
+        memcpy( ring.data[slot], message, len + 1 );
+        ring.len[slot] = len;
+        ring.count++;
+        pthread_cleanup_pop( 1 );
+
+        if ( write( sources[ring.source].fd, &one, sizeof( one ) ) < 0 ) {
+            printf( "Could not signal the event loop (%s)\n", strerror( errno ) );
+        }
+    }
+    return( NULL );
+}
+
+/**
+ * \brief Reads a message queue and hands the messages to the loop.
+ * Only one queue is supported.
+ * \param queue Queue opened for reading with queueOpen()
+ * \param cb Called from the loop for every message
+ * \returns Source number, -1 on error
+ */
+int evloopAddQueue( int queue, evloopQueueCallback cb, void * user ) {
+    int fd;
+
+    if ( ring.source >= 0 ) {
+        return( -1 );
+    }
+    if ( ( fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) < 0 ) {
+        printf( "Could not create eventfd (%s)\n", strerror( errno ) );
+        return( -1 );
+    }
+    if ( ( ring.source = evloopAddSource( EVLOOP_QUEUE, fd, NULL, cb, user, EPOLLIN ) ) < 0 ) {
+        close( fd );
+        return( -1 );
+    }
+
+    ring.queue = queue;
+    ring.head  = 0;
+    ring.count = 0;
+    if ( pthread_create( &ring.thread, NULL, evloopQueueThread, NULL ) != 0 ) {
+        printf( "Could not start the queue reader\n" );
+        return( -1 );
+    }
+    return( ring.source );
+}
+
+static void evloopDrainQueue( evloopSource_t * source ) {
+    char message[MAXMESSAGESIZE+2];
+    int len;
+
+    pthread_mutex_lock( &ring.mutex );
+    if ( ring.count > loopStats.maxPending ) loopStats.maxPending = ring.count;
+    while ( ring.count > 0 && !stopped ) {
+        len = ring.len[ring.head];
+        memcpy( message, ring.data[ring.head], len + 1 );
+        ring.head = ( ring.head + 1 ) % EVLOOP_QUEUE_SLOTS;
+        ring.count--;
+        pthread_cond_signal( &ring.space );
+        pthread_mutex_unlock( &ring.mutex );
+
+        loopStats.messages++;
+        source->queueCb( source->user, message, len );
+
+        pthread_mutex_lock( &ring.mutex );
+    }
+    pthread_mutex_unlock( &ring.mutex );
+}
+
+// ------------------------------------------------------------------
+// Loop
+// ------------------------------------------------------------------
+
+/**
+ * \brief Creates the loop
+ * \returns 0 on success, -1 on error
+ */
+int evloopInit( void ) {
+    if ( ( epollFd = epoll_create1( EPOLL_CLOEXEC ) ) < 0 ) {
+        printf( "Could not create the event loop (%s)\n", strerror( errno ) );
+        return( -1 );
+    }
+    return( 0 );
+}
+
+static void evloopDispatch( evloopSource_t * source, uint32_t events ) {
+    struct signalfd_siginfo info;
+    uint64_t count;
+
+    switch ( source->kind ) {
+    case EVLOOP_FD:
+        source->cb( source->user, events );
+        break;
+
+    case EVLOOP_SIGNAL:
+        while ( read( source->fd, &info, sizeof( info ) ) == sizeof( info ) ) {
+            DEBUG_PRINTF( "Got signal %d\n", info.ssi_signo );
+            source->cb( source->user, info.ssi_signo );
+        }
+        break;
+
+    case EVLOOP_TIMER:
+    case EVLOOP_EVENT:
+        if ( read( source->fd, &count, sizeof( count ) ) == sizeof( count ) ) {
+            source->cb( source->user, (uint32_t)count );
+        }
+        break;
+
+    case EVLOOP_QUEUE:
+        if ( read( source->fd, &count, sizeof( count ) ) == sizeof( count ) ) {
+            evloopDrainQueue( source );
+        }
+        break;
+    }
+    loopStats.events++;
+}
+
+/**
+ * \brief Runs the loop
+ * \param msec Time to run, -1 to run until evloopStop()
+ * \returns 0 when stopped, 1 when the time ran out
+ */
+int evloopRun( int msec ) {
+    struct epoll_event events[EVLOOP_MAX_EVENTS];
+    struct timespec now;
+    int64_t deadline = 0;
+    int i, n, timeout = msec;
+
+    if ( msec >= 0 ) {
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        deadline = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000 + msec;
+    }
+
+    while ( !stopped ) {
+        n = epoll_wait( epollFd, events, EVLOOP_MAX_EVENTS, timeout );
+        if ( n < 0 && errno != EINTR ) {
+            printf( "Event loop error (%s)\n", strerror( errno ) );
+            return( 0 );
+        }
+        for ( i=0; i<n && !stopped; i++ ) {
+            evloopDispatch( &sources[events[i].data.u32], events[i].events );
+        }
+
+        if ( msec >= 0 ) {
+            clock_gettime( CLOCK_MONOTONIC, &now );
+            timeout = (int)( deadline - ( (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000 ) );
+            if ( timeout <= 0 ) return( 1 );
+        }
+    }
+    return( 0 );
+}
+
+/**
+ * \brief Makes evloopRun() return, now and for good. May be called from a callback.
+ */
+void evloopStop( void ) {
+    stopped = 1;
+}
+
+/**
+ * \brief Stops the queue reader and closes everything
+ */
+void evloopDestroy( void ) {
+    int i;
+
+    if ( ring.source >= 0 ) {
+        pthread_cancel( ring.thread );
+        pthread_join( ring.thread, NULL );
+        ring.source = -1;
+    }
+    for ( i=0; i<numSources; i++ ) {
+        close( sources[i].fd );
+    }
+    numSources = 0;
+    if ( epollFd >= 0 ) {
+        close( epollFd );
+        epollFd = -1;
+    }
+}
+
+/**
+ * \brief Gets the loop counters, only from the loop's own thread
+ */
+void evloopGetStats( evloopStats_t * stats ) {
+    *stats = loopStats;
+}
+
+// ------------------------------------------------------------------
+// End of file
+// ------------------------------------------------------------------
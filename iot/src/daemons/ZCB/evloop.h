@@ -0,0 +1,41 @@
+// ------------------------------------------------------------------
+// Event loop - include file
+// ------------------------------------------------------------------
+// Part of gateway_zigbee, licensed under the GNU GPL v3 (see LICENSE)
+// ------------------------------------------------------------------
+
+#include <stdint.h>
+
+/** Called from the loop: for a file descriptor with the epoll events, for a timer
+ *  with the number of expirations, for a signal with the signal number, for an
+ *  event with the number of kicks */
+typedef void (*evloopCallback)( void * user, uint32_t value );
+
+/** Called from the loop for every message read from a queue */
+typedef void (*evloopQueueCallback)( void * user, char * message, int len );
+
+typedef struct {
+    uint32_t    events;         // Callbacks made
+    uint32_t    messages;       // Queue messages handled
+    uint32_t    maxPending;     // Most queue messages waiting for the loop at once
+} evloopStats_t;
+
+int  evloopInit( void );
+void evloopDestroy( void );
+
+int  evloopAddFd( int fd, uint32_t events, evloopCallback cb, void * user );
+int  evloopAddSignal( int sig, evloopCallback cb, void * user );
+int  evloopAddTimer( evloopCallback cb, void * user );
+void evloopSetTimer( int timer, int msec, int periodMsec );
+int  evloopAddEvent( evloopCallback cb, void * user );
+void evloopKick( int event );
+int  evloopAddQueue( int queue, evloopQueueCallback cb, void * user );
+
+int  evloopRun( int msec );
+void evloopStop( void );
+
+void evloopGetStats( evloopStats_t * stats );
+
+// ------------------------------------------------------------------
+// END OF FILE
+// ------------------------------------------------------------------
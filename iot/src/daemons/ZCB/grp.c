@@ -97,6 +97,7 @@ void grpHandle( void ) {
                 int sid = parsingGetIntAttr( "scnid" );
                 if ( sid >= 0 ) {
                     printf( "Group scn %s, %d\n", scn, sid );
+                    lmpgrp_FlushTarget( 0xFFFF, gid );
                     eZCB_RecallScene( 0xFFFF, gid, sid );
                 }
             } else if ( strcmp( scn, "remall" ) == 0 ) {
@@ -112,14 +113,14 @@ void grpHandle( void ) {
             // In JSON we specify level from 0-100
             // In Zigbee, however, level has to be specified from 0-255
             lvl = ( lvl * 255 ) / 100;
-            lmpgrp_MoveToLevel( 0xFFFF, gid, lvl, 5 );
+            lmpgrp_SetLevel( 0xFFFF, gid, lvl, 5 );
         }
 
         int xcr = parsingGetIntAttr( "xcr" );
         int ycr = parsingGetIntAttr( "ycr" );
         if ( xcr >= 0 && ycr >= 0 ) {
             printf( "Group color %d, %d\n", xcr, ycr );
-            lmpgrp_MoveToColour( 0xFFFF, gid, xcr, ycr, 5 );
+            lmpgrp_SetColour( 0xFFFF, gid, xcr, ycr, 5 );
         }
     }
 }
@@ -109,7 +109,7 @@ void lmpHandle( void ) {
                 // In JSON we specify level from 0-100
                 // In Zigbee, however, level has to be specified from 0-255
                 lvl = ( lvl * 255 ) / 100;
-                lmpgrp_MoveToLevel( u16ShortAddress, 0, lvl, 5 );
+                lmpgrp_SetLevel( u16ShortAddress, 0, lvl, 5 );
             }
 
             int xcr = parsingGetIntAttr( "xcr" );
@@ -117,14 +117,14 @@ void lmpHandle( void ) {
             if ( xcr >= 0 && ycr >= 0 ) {
                 DEBUG_PRINTF( "Lamp color %d, %d\n", xcr, ycr );
 
-                lmpgrp_MoveToColour( u16ShortAddress, 0, xcr, ycr, 5 );
+                lmpgrp_SetColour( u16ShortAddress, 0, xcr, ycr, 5 );
             }
             
             int kelvin = parsingGetIntAttr( "kelvin" );
             if ( kelvin > 0 ) {
                 DEBUG_PRINTF( "Lamp kelvin %d\n", kelvin );
 		// According to Zigbee, the temp is 1000000/kelvin
-                lmpgrp_MoveToColourTemperature( u16ShortAddress, 0, 1000000 / kelvin, 5 );
+                lmpgrp_SetColourTemperature( u16ShortAddress, 0, 1000000 / kelvin, 5 );
 	    }
 
             char * grp = parsingGetStringAttr0( "grp" );
@@ -168,6 +168,7 @@ void lmpHandle( void ) {
                             eZCB_StoreScene( u16ShortAddress, gid, sid );
                         } else if ( strcmp( scn, "recall" ) == 0 ) {
                             DEBUG_PRINTF( "Scene: recall scene %d for group 0x%04x\n", sid, gid );
+                            lmpgrp_FlushTarget( u16ShortAddress, 0 );
                             eZCB_RecallScene( u16ShortAddress, gid, sid );
                         }
                     }
@@ -10,8 +10,12 @@
  * \brief Lamp/group helpers
  */
 
+#include <stdio.h>
+#include <time.h>
+
 #include "zcb.h"
 #include "SerialLink.h"
+#include "lmpgrp.h"
 
 // ------------------------------------------------------------------
 // Macros
@@ -25,6 +29,14 @@
 #define DEBUG_PRINTF(...)
 #endif /* LMPGRP_DEBUG */
 
+// Level and colour commands per lamp (or group) are coalesced within
+// this window (ms): the first goes out at once, of the ones that follow
+// only the last is sent when the window closes
+#define LMPGRP_COALESCE_WINDOW  200
+
+// Number of lamp/group and command kind combinations with an open window
+#define LMPGRP_COALESCE_SLOTS   32
+
 // ------------------------------------------------------------------
 // Message helper
 // ------------------------------------------------------------------
@@ -55,12 +67,27 @@ static void initDefaultHeader( void * mess,
 }
 
 // ------------------------------------------------------------------
-// Exported Functions
+// Send
 // ------------------------------------------------------------------
 
-teZcbStatus lmpgrp_OnOff(uint16_t u16ShortAddress, uint16_t u16GroupAddress, uint8_t u8Mode) {
+// Lamp and group commands wait for their status, so that the caller
+// gets the result from the control bridge. A lamp or group is one frame,
+// there is no fan-out to pace, and held values are coalesced before.
+
+static teZcbStatus lmpgrpSend( uint16_t u16Type, uint16_t u16Length, void * pvMessage ) {
     uint8_t u8SequenceNo;
     
+    if ( eSL_SendMessage( u16Type, u16Length, pvMessage, &u8SequenceNo ) != E_SL_OK ) {
+        return E_ZCB_COMMS_FAILED;
+    }
+    return E_ZCB_OK;
+}
+
+// ------------------------------------------------------------------
+// Exported Functions
+// ------------------------------------------------------------------
+
+teZcbStatus lmpgrp_OnOff(uint16_t u16ShortAddress, uint16_t u16GroupAddress, uint8_t u8Mode) {
     struct {
         uint8_t     u8TargetAddressMode;
         uint16_t    u16TargetAddress;
@@ -81,18 +108,15 @@ teZcbStatus lmpgrp_OnOff(uint16_t u16ShortAddress, uint16_t u16GroupAddress, uin
 
     sOnOffMessage.u8Mode = u8Mode;
     
-    if (eSL_SendMessage(E_SL_MSG_ONOFF, sizeof(sOnOffMessage), &sOnOffMessage, &u8SequenceNo) != E_SL_OK) {
-        return E_ZCB_COMMS_FAILED;
-    }
+    // Keep the order of the commands to this target
+    lmpgrp_FlushTarget( u16ShortAddress, u16GroupAddress );
     
-    return E_ZCB_OK;
+    return lmpgrpSend(E_SL_MSG_ONOFF, sizeof(sOnOffMessage), &sOnOffMessage);
 }
 
 
 teZcbStatus lmpgrp_MoveToLevel(uint16_t u16ShortAddress, uint16_t u16GroupAddress,
                                uint8_t u8Level, uint16_t u16TransitionTime) {
-    uint8_t             u8SequenceNo;
-    
     struct {
         uint8_t     u8TargetAddressMode;
         uint16_t    u16TargetAddress;
@@ -116,19 +140,12 @@ teZcbStatus lmpgrp_MoveToLevel(uint16_t u16ShortAddress, uint16_t u16GroupAddres
     sLevelMessage.u8Level               = u8Level;
     sLevelMessage.u16TransitionTime     = htons(u16TransitionTime);
     
-    if (eSL_SendMessage(E_SL_MSG_MOVE_TO_LEVEL_ONOFF, sizeof(sLevelMessage),
-                  &sLevelMessage, &u8SequenceNo) != E_SL_OK) {
-        return E_ZCB_COMMS_FAILED;
-    }
-    
-    return E_ZCB_OK;
+    return lmpgrpSend(E_SL_MSG_MOVE_TO_LEVEL_ONOFF, sizeof(sLevelMessage), &sLevelMessage);
 }
 
 
 teZcbStatus lmpgrp_MoveToHue(uint16_t u16ShortAddress, uint16_t u16GroupAddress,
                              uint8_t u8Hue, uint16_t u16TransitionTime) {
-    uint8_t             u8SequenceNo;
-    
     struct {
         uint8_t     u8TargetAddressMode;
         uint16_t    u16TargetAddress;
@@ -148,19 +165,12 @@ teZcbStatus lmpgrp_MoveToHue(uint16_t u16ShortAddress, uint16_t u16GroupAddress,
     sMoveToHueMessage.u8Direction         = 0;
     sMoveToHueMessage.u16TransitionTime   = htons(u16TransitionTime);
 
-    if (eSL_SendMessage(E_SL_MSG_MOVE_TO_HUE, sizeof(sMoveToHueMessage),
-              &sMoveToHueMessage, &u8SequenceNo) != E_SL_OK) {
-        return E_ZCB_COMMS_FAILED;
-    }
-    
-    return E_ZCB_OK;
+    return lmpgrpSend(E_SL_MSG_MOVE_TO_HUE, sizeof(sMoveToHueMessage), &sMoveToHueMessage);
 }
 
 
 teZcbStatus lmpgrp_MoveToSaturation(uint16_t u16ShortAddress, uint16_t u16GroupAddress,
                                     uint8_t u8Saturation, uint16_t u16TransitionTime) {
-    uint8_t             u8SequenceNo;
-    
     struct {
         uint8_t     u8TargetAddressMode;
         uint16_t    u16TargetAddress;
@@ -178,20 +188,13 @@ teZcbStatus lmpgrp_MoveToSaturation(uint16_t u16ShortAddress, uint16_t u16GroupA
     sMoveToSaturationMessage.u8Saturation        = u8Saturation;
     sMoveToSaturationMessage.u16TransitionTime   = htons(u16TransitionTime);
 
-    if (eSL_SendMessage(E_SL_MSG_MOVE_TO_SATURATION, sizeof(sMoveToSaturationMessage),
-             &sMoveToSaturationMessage, &u8SequenceNo) != E_SL_OK) {
-        return E_ZCB_COMMS_FAILED;
-    }
-    
-    return E_ZCB_OK;
+    return lmpgrpSend(E_SL_MSG_MOVE_TO_SATURATION, sizeof(sMoveToSaturationMessage), &sMoveToSaturationMessage);
 }
 
 
 
 teZcbStatus lmpgrp_MoveToHueSaturation(uint16_t u16ShortAddress, uint16_t u16GroupAddress,
                       uint8_t u8Hue, uint8_t u8Saturation, uint16_t u16TransitionTime) {
-    uint8_t             u8SequenceNo;
-    
     struct {
         uint8_t     u8TargetAddressMode;
         uint16_t    u16TargetAddress;
@@ -211,19 +214,12 @@ teZcbStatus lmpgrp_MoveToHueSaturation(uint16_t u16ShortAddress, uint16_t u16Gro
     sMoveToHueSaturationMessage.u8Saturation        = u8Saturation;
     sMoveToHueSaturationMessage.u16TransitionTime   = htons(u16TransitionTime);
 
-    if (eSL_SendMessage(E_SL_MSG_MOVE_TO_HUE_SATURATION, sizeof(sMoveToHueSaturationMessage),
-             &sMoveToHueSaturationMessage, &u8SequenceNo) != E_SL_OK) {
-        return E_ZCB_COMMS_FAILED;
-    }
-    
-    return E_ZCB_OK;
+    return lmpgrpSend(E_SL_MSG_MOVE_TO_HUE_SATURATION, sizeof(sMoveToHueSaturationMessage), &sMoveToHueSaturationMessage);
 }
 
 
 teZcbStatus lmpgrp_MoveToColour(uint16_t u16ShortAddress, uint16_t u16GroupAddress,
                                 uint16_t u16X, uint16_t u16Y, uint16_t u16TransitionTime) {
-    uint8_t             u8SequenceNo;
-    
     struct {
         uint8_t     u8TargetAddressMode;
         uint16_t    u16TargetAddress;
@@ -243,19 +239,12 @@ teZcbStatus lmpgrp_MoveToColour(uint16_t u16ShortAddress, uint16_t u16GroupAddre
     sMoveToColourMessage.u16Y                = htons(u16Y);
     sMoveToColourMessage.u16TransitionTime   = htons(u16TransitionTime);
 
-    if (eSL_SendMessage(E_SL_MSG_MOVE_TO_COLOUR, sizeof(sMoveToColourMessage),
-              &sMoveToColourMessage, &u8SequenceNo) != E_SL_OK) {
-        return E_ZCB_COMMS_FAILED;
-    }
-    
-    return E_ZCB_OK;
+    return lmpgrpSend(E_SL_MSG_MOVE_TO_COLOUR, sizeof(sMoveToColourMessage), &sMoveToColourMessage);
 }
 
 
 teZcbStatus lmpgrp_MoveToColourTemperature(uint16_t u16ShortAddress, uint16_t u16GroupAddress,
               uint16_t u16ColourTemperature, uint16_t u16TransitionTime) {
-    uint8_t             u8SequenceNo;
-    
     struct {
         uint8_t     u8TargetAddressMode;
         uint16_t    u16TargetAddress;
@@ -273,20 +262,13 @@ teZcbStatus lmpgrp_MoveToColourTemperature(uint16_t u16ShortAddress, uint16_t u1
     sMoveToColourTemperatureMessage.u16ColourTemperature    = htons(u16ColourTemperature);
     sMoveToColourTemperatureMessage.u16TransitionTime       = htons(u16TransitionTime);
 
-    if (eSL_SendMessage(E_SL_MSG_MOVE_TO_COLOUR_TEMPERATURE, sizeof(sMoveToColourTemperatureMessage),
-         &sMoveToColourTemperatureMessage, &u8SequenceNo) != E_SL_OK) {
-        return E_ZCB_COMMS_FAILED;
-    }
-    
-    return E_ZCB_OK;
+    return lmpgrpSend(E_SL_MSG_MOVE_TO_COLOUR_TEMPERATURE, sizeof(sMoveToColourTemperatureMessage), &sMoveToColourTemperatureMessage);
 }
 
 
 teZcbStatus lmpgrp_MoveColourTemperature(uint16_t u16ShortAddress, uint16_t u16GroupAddress,
                uint8_t u8Mode, uint16_t u16Rate,
                uint16_t u16ColourTemperatureMin, uint16_t u16ColourTemperatureMax) {
-    uint8_t             u8SequenceNo;
-    
     struct {
         uint8_t     u8TargetAddressMode;
         uint16_t    u16TargetAddress;
@@ -308,20 +290,13 @@ teZcbStatus lmpgrp_MoveColourTemperature(uint16_t u16ShortAddress, uint16_t u16G
     sMoveColourTemperatureMessage.u16ColourTemperatureMin   = htons(u16ColourTemperatureMin);
     sMoveColourTemperatureMessage.u16ColourTemperatureMax   = htons(u16ColourTemperatureMax);
     
-    if (eSL_SendMessage(E_SL_MSG_MOVE_COLOUR_TEMPERATURE, sizeof(sMoveColourTemperatureMessage),
-              &sMoveColourTemperatureMessage, &u8SequenceNo) != E_SL_OK) {
-        return E_ZCB_COMMS_FAILED;
-    }
-    
-    return E_ZCB_OK;
+    return lmpgrpSend(E_SL_MSG_MOVE_COLOUR_TEMPERATURE, sizeof(sMoveColourTemperatureMessage), &sMoveColourTemperatureMessage);
 }
 
 
 teZcbStatus lmpgrp_ColourLoopSet(uint16_t u16ShortAddress, uint16_t u16GroupAddress,
                uint8_t u8UpdateFlags, uint8_t u8Action, uint8_t u8Direction,
                uint16_t u16Time, uint16_t u16StartHue) {
-    uint8_t             u8SequenceNo;
-    
     struct {
         uint8_t     u8TargetAddressMode;
         uint16_t    u16TargetAddress;
@@ -345,12 +320,174 @@ teZcbStatus lmpgrp_ColourLoopSet(uint16_t u16ShortAddress, uint16_t u16GroupAddr
     sColourLoopSetMessage.u16Time                   = htons(u16Time);
     sColourLoopSetMessage.u16StartHue               = htons(u16StartHue);
     
-    if (eSL_SendMessage(E_SL_MSG_COLOUR_LOOP_SET, sizeof(sColourLoopSetMessage),
-            &sColourLoopSetMessage, &u8SequenceNo) != E_SL_OK) {
-        return E_ZCB_COMMS_FAILED;
+    return lmpgrpSend(E_SL_MSG_COLOUR_LOOP_SET, sizeof(sColourLoopSetMessage), &sColourLoopSetMessage);
+}
+
+
+// ------------------------------------------------------------------
+// Coalescing
+// ------------------------------------------------------------------
+
+// Dragging a dimmer or colour wheel in the app gives a stream of
+// values, while the radio only needs to carry the one the user ends on.
+// Colour (xy) and colour temperature are one kind: the last one wins.
+
+typedef enum {
+    COALESCE_LEVEL = 0,
+    COALESCE_COLOUR
+} coalesceKind;
+
+typedef struct {
+    uint16_t  shortAddress;
+    uint16_t  groupAddress;
+    int       kind;
+    int       held;          // A value waits for the window to close
+    uint16_t  type;          // Held command, E_SL_MSG_MOVE_TO_...
+    uint16_t  value1;
+    uint16_t  value2;
+    uint16_t  transitionTime;
+    int64_t   windowEnd;     // ms, 0 when the slot was never used
+} coalesceSlot_t;
+
+static coalesceSlot_t coalesceSlots[LMPGRP_COALESCE_SLOTS];
+
+static int64_t coalesceNow( void ) {
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return( (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000 );
+}
+
+static teZcbStatus coalesceSend( coalesceSlot_t * slot ) {
+    slot->held = 0;
+    switch ( slot->type ) {
+    case E_SL_MSG_MOVE_TO_LEVEL_ONOFF:
+        return( lmpgrp_MoveToLevel( slot->shortAddress, slot->groupAddress,
+                                    slot->value1, slot->transitionTime ) );
+    case E_SL_MSG_MOVE_TO_COLOUR:
+        return( lmpgrp_MoveToColour( slot->shortAddress, slot->groupAddress,
+                                     slot->value1, slot->value2, slot->transitionTime ) );
+    case E_SL_MSG_MOVE_TO_COLOUR_TEMPERATURE:
+        return( lmpgrp_MoveToColourTemperature( slot->shortAddress, slot->groupAddress,
+                                                slot->value1, slot->transitionTime ) );
     }
-    
-    return E_ZCB_OK;
+    return( E_ZCB_ERROR );
+}
+
+static teZcbStatus coalesce( uint16_t u16ShortAddress, uint16_t u16GroupAddress, int kind,
+                             uint16_t type, uint16_t value1, uint16_t value2,
+                             uint16_t u16TransitionTime ) {
+    coalesceSlot_t direct, * slot = NULL, * freeSlot = NULL;
+    int64_t now = coalesceNow();
+    int i;
+
+    for ( i=0; i<LMPGRP_COALESCE_SLOTS && !slot; i++ ) {
+        coalesceSlot_t * s = &coalesceSlots[i];
+        if ( s->windowEnd && s->shortAddress == u16ShortAddress &&
+             s->groupAddress == u16GroupAddress && s->kind == kind ) {
+            slot = s;
+        } else if ( !freeSlot && !s->held && s->windowEnd <= now ) {
+            freeSlot = s;
+        }
+    }
+
+    int open = ( slot && now < slot->windowEnd );
+    if ( open && slot->held ) {
+        DEBUG_PRINTF( "Command 0x%04x to 0x%04x/0x%04x superseded\n", slot->type,
+                      u16ShortAddress, u16GroupAddress );
+    }
+    if ( !slot ) slot = freeSlot;
+    if ( !slot ) slot = &direct;     // Too many at once, this one is not coalesced
+
+    slot->shortAddress   = u16ShortAddress;
+    slot->groupAddress   = u16GroupAddress;
+    slot->kind           = kind;
+    slot->type           = type;
+    slot->value1         = value1;
+    slot->value2         = value2;
+    slot->transitionTime = u16TransitionTime;
+
+    if ( open ) {
+        // Sent when the window closes, unless superseded before
+        slot->held = 1;
+        return( E_ZCB_OK );
+    }
+
+    // Send at once and open a window for what follows
+    slot->windowEnd = now + LMPGRP_COALESCE_WINDOW;
+    return( coalesceSend( slot ) );
+}
+
+/**
+ * \brief Sets the level of a lamp or group, coalesced with the levels that follow
+ * within LMPGRP_COALESCE_WINDOW. Parameters as lmpgrp_MoveToLevel().
+ */
+
+teZcbStatus lmpgrp_SetLevel(uint16_t u16ShortAddress, uint16_t u16GroupAddress,
+                            uint8_t u8Level, uint16_t u16TransitionTime) {
+    return( coalesce( u16ShortAddress, u16GroupAddress, COALESCE_LEVEL,
+                      E_SL_MSG_MOVE_TO_LEVEL_ONOFF, u8Level, 0, u16TransitionTime ) );
+}
+
+/**
+ * \brief Sets the colour of a lamp or group, coalesced with the colours and colour
+ * temperatures that follow within LMPGRP_COALESCE_WINDOW. Parameters as lmpgrp_MoveToColour().
+ */
+
+teZcbStatus lmpgrp_SetColour(uint16_t u16ShortAddress, uint16_t u16GroupAddress,
+                             uint16_t u16X, uint16_t u16Y, uint16_t u16TransitionTime) {
+    return( coalesce( u16ShortAddress, u16GroupAddress, COALESCE_COLOUR,
+                      E_SL_MSG_MOVE_TO_COLOUR, u16X, u16Y, u16TransitionTime ) );
+}
+
+/**
+ * \brief Sets the colour temperature of a lamp or group, coalesced like lmpgrp_SetColour().
+ * Parameters as lmpgrp_MoveToColourTemperature().
+ */
+
+teZcbStatus lmpgrp_SetColourTemperature(uint16_t u16ShortAddress, uint16_t u16GroupAddress,
+                                        uint16_t u16ColourTemperature, uint16_t u16TransitionTime) {
+    return( coalesce( u16ShortAddress, u16GroupAddress, COALESCE_COLOUR,
+                      E_SL_MSG_MOVE_TO_COLOUR_TEMPERATURE, u16ColourTemperature, 0, u16TransitionTime ) );
+}
+
+/**
+ * \brief Sends the held level and colour of a lamp or group now, so that a command that
+ * is not coalesced (on/off, scene recall) comes after them
+ */
+
+void lmpgrp_FlushTarget(uint16_t u16ShortAddress, uint16_t u16GroupAddress) {
+    int i;
+    for ( i=0; i<LMPGRP_COALESCE_SLOTS; i++ ) {
+        coalesceSlot_t * slot = &coalesceSlots[i];
+        if ( slot->held && slot->shortAddress == u16ShortAddress &&
+             slot->groupAddress == u16GroupAddress ) {
+            coalesceSend( slot );
+        }
+    }
+}
+
+/**
+ * \brief Sends the held values whose window has closed. To be called from the main loop.
+ * \retval Milliseconds until the next held value is due, -1 when none is held
+ */
+
+int lmpgrp_Flush( void ) {
+    int64_t now = coalesceNow();
+    int next = -1;
+    int i;
+    for ( i=0; i<LMPGRP_COALESCE_SLOTS; i++ ) {
+        coalesceSlot_t * slot = &coalesceSlots[i];
+        if ( slot->held ) {
+            if ( slot->windowEnd <= now ) {
+                // The value the user ended on, keep the window open for what follows
+                slot->windowEnd = now + LMPGRP_COALESCE_WINDOW;
+                coalesceSend( slot );
+            } else if ( next < 0 || slot->windowEnd - now < next ) {
+                next = (int)( slot->windowEnd - now );
+            }
+        }
+    }
+    return( next );
 }
 
 
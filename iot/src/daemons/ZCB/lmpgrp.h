@@ -34,6 +34,22 @@ teZcbStatus lmpgrp_ColourLoopSet(uint16_t u16ShortAddress, uint16_t u16GroupAddr
                uint8_t u8UpdateFlags, uint8_t u8Action, uint8_t u8Direction,
                uint16_t u16Time, uint16_t u16StartHue);
 
+// ------------------------------------------------------------------
+// Coalesced: for streams of values, e.g. from a slider in the app
+// ------------------------------------------------------------------
+
+teZcbStatus lmpgrp_SetLevel(uint16_t u16ShortAddress, uint16_t u16GroupAddress,
+                            uint8_t u8Level, uint16_t u16TransitionTime);
+
+teZcbStatus lmpgrp_SetColour(uint16_t u16ShortAddress, uint16_t u16GroupAddress,
+                             uint16_t u16X, uint16_t u16Y, uint16_t u16TransitionTime);
+
+teZcbStatus lmpgrp_SetColourTemperature(uint16_t u16ShortAddress, uint16_t u16GroupAddress,
+                                        uint16_t u16ColourTemperature, uint16_t u16TransitionTime);
+
+void lmpgrp_FlushTarget(uint16_t u16ShortAddress, uint16_t u16GroupAddress);
+int  lmpgrp_Flush( void );
+
 // ------------------------------------------------------------------
 // END OF FILE
 // ------------------------------------------------------------------
@@ -0,0 +1,290 @@
+// ------------------------------------------------------------------
+// Metering
+// ------------------------------------------------------------------
+// Per-device metering state
+// ------------------------------------------------------------------
+// Part of gateway_zigbee, licensed under the GNU GPL v3 (see LICENSE)
+// ------------------------------------------------------------------
+
+/** \addtogroup zb
+ * \file
+ * \brief Per-device metering state
+ *
+ * Plugs report their multiplier, divisor, unit and metering device type
+ * once, or only when asked, and after that only the values that change.
+ * These formatting attributes are kept per device, and saved to a small
+ * file when one changes, so that values can be converted to W and Wh
+ * as soon as they come in, also after a restart.
+ *
+ * The SerialLink callback threads get a copy of a device's state with
+ * meteringGet() and hand it back with meteringPut(). No thread holds on
+ * to an entry of the table, so an entry can be reused for another device
+ * at any time. The file is written from the event loop,
+ * METERING_SAVE_DELAY ms after the first change, not on the callback
+ * threads. Those kick an event for it, the loop arms the timer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "evloop.h"
+#include "metering.h"
+
+// ------------------------------------------------------------------
+// Macros
+// ------------------------------------------------------------------
+
+/*#define METERING_DEBUG*/
+
+#ifdef METERING_DEBUG
+#define DEBUG_PRINTF(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_PRINTF(...)
+#endif /* METERING_DEBUG */
+
+#ifdef TARGET_LINUX_PC
+#define METERING_FILEPATH     "/tmp/iot-test/usr/share/iot/"
+#else
+#define METERING_FILEPATH     "/usr/share/iot/"
+#endif
+
+#define METERING_FILENAME     METERING_FILEPATH "iot_zb_metering.db"
+#define METERING_FILENAME_TMP METERING_FILEPATH "iot_zb_metering.tmp"
+
+#define METERING_VERSION      1
+
+#define METERING_MAX_DEVICES  32
+
+// Time between the first change and saving the formats (ms)
+#define METERING_SAVE_DELAY   1000
+
+// ------------------------------------------------------------------
+// Typing
+// ------------------------------------------------------------------
+
+// What is saved of a device
+typedef struct {
+    uint64_t         mac;
+    uint16_t         saddr;
+    meteringFormat_t format;
+} meteringSaved_t;
+
+typedef struct {
+    int version;
+    int recordSize;
+    int numRecords;
+} meteringFileHeader_t;
+
+// ------------------------------------------------------------------
+// Globals
+// ------------------------------------------------------------------
+
+static pthread_mutex_t meteringMutex = PTHREAD_MUTEX_INITIALIZER;
+static meteringState_t meteringStates[METERING_MAX_DEVICES];
+static int             numMeteringStates = 0;
+static int             saveEvent = -1;
+static int             saveTimer = -1;
+static int             savePending = 0;
+
+// ------------------------------------------------------------------
+// File
+// ------------------------------------------------------------------
+
+static void meteringReset( meteringState_t * state, uint16_t saddr, uint64_t mac ) {
+    memset( state, 0, sizeof( meteringState_t ) );
+    state->saddr                = saddr;
+    state->mac                  = mac;
+    state->format.deviceType    = -1;
+    state->format.unitOfMeasure = -1;
+}
+
+// Called with the mutex held
+static void meteringSaveLater( void ) {
+    if ( savePending++ == 0 ) {
+        evloopKick( saveEvent );
+    }
+}
+
+/**
+ * \brief Saves the formats if they changed. Called from the event loop,
+ * and once more at exit
+ */
+void meteringSave( void ) {
+    meteringFileHeader_t header = { METERING_VERSION, sizeof( meteringSaved_t ), 0 };
+    meteringSaved_t saved[METERING_MAX_DEVICES];
+    FILE * fp;
+    int i, ok;
+
+    // Take a copy, so that reports can go on while the file is written
+    pthread_mutex_lock( &meteringMutex );
+    if ( !savePending ) {
+        pthread_mutex_unlock( &meteringMutex );
+        return;
+    }
+    savePending = 0;
+    memset( saved, 0, sizeof( saved ) );
+    for ( i=0; i<numMeteringStates; i++ ) {
+        saved[i].mac    = meteringStates[i].mac;
+        saved[i].saddr  = meteringStates[i].saddr;
+        saved[i].format = meteringStates[i].format;
+    }
+    header.numRecords = numMeteringStates;
+    pthread_mutex_unlock( &meteringMutex );
+
+    // Write a new file and move it over the old one, so that there always is a complete file
+    if ( ( fp = fopen( METERING_FILENAME_TMP, "wb" ) ) == NULL ) {
+        printf( "Could not save metering formats to %s\n", METERING_FILENAME_TMP );
+        return;
+    }
+    ok = ( fwrite( &header, sizeof( header ), 1, fp ) == 1 ) &&
+         ( fwrite( saved, sizeof( meteringSaved_t ), header.numRecords, fp ) == header.numRecords );
+    fflush( fp );
+    fsync( fileno( fp ) );
+    fclose( fp );
+
+    if ( !ok || rename( METERING_FILENAME_TMP, METERING_FILENAME ) != 0 ) {
+        printf( "Could not save metering formats to %s\n", METERING_FILENAME );
+        unlink( METERING_FILENAME_TMP );
+    }
+}
+
+static void meteringOnTimer( void * user, uint32_t expirations ) {
+    meteringSave();
+}
+
+// A callback thread made the first change since the previous save
+static void meteringOnChange( void * user, uint32_t kicks ) {
+    evloopSetTimer( saveTimer, METERING_SAVE_DELAY, 0 );
+}
+
+/**
+ * \brief Restores the metering formats of the devices seen before and
+ * creates the save timer and its event. To be called after evloopInit(),
+ * before the SerialLink threads are started
+ */
+void meteringInit( void ) {
+    meteringFileHeader_t header;
+    meteringSaved_t saved;
+    FILE * fp;
+    int i;
+
+    pthread_mutex_lock( &meteringMutex );
+    numMeteringStates = 0;
+
+    if ( ( fp = fopen( METERING_FILENAME, "rb" ) ) != NULL ) {
+        if ( fread( &header, sizeof( header ), 1, fp ) == 1 &&
+             header.version == METERING_VERSION &&
+             header.recordSize == sizeof( meteringSaved_t ) ) {
+            for ( i=0; i<header.numRecords && i<METERING_MAX_DEVICES; i++ ) {
+                if ( fread( &saved, sizeof( saved ), 1, fp ) != 1 ) break;
+                meteringState_t * state = &meteringStates[numMeteringStates++];
+                meteringReset( state, saved.saddr, saved.mac );
+                state->format = saved.format;
+            }
+        } else {
+            printf( "Ignoring metering formats in %s\n", METERING_FILENAME );
+        }
+        fclose( fp );
+    }
+
+    printf( "Metering formats of %d devices restored\n", numMeteringStates );
+    pthread_mutex_unlock( &meteringMutex );
+
+    saveTimer = evloopAddTimer( meteringOnTimer, NULL );
+    saveEvent = evloopAddEvent( meteringOnChange, NULL );
+}
+
+// ------------------------------------------------------------------
+// State
+// ------------------------------------------------------------------
+
+// Called with the mutex held
+static meteringState_t * meteringFind( uint64_t mac ) {
+    int i;
+
+    for ( i=0; i<numMeteringStates; i++ ) {
+        if ( meteringStates[i].mac == mac ) {
+            return( &meteringStates[i] );
+        }
+    }
+    return( NULL );
+}
+
+// Called with the mutex held
+static meteringState_t * meteringNew( uint16_t saddr, uint64_t mac ) {
+    meteringState_t * state;
+    int i, oldest = 0;
+
+    if ( numMeteringStates < METERING_MAX_DEVICES ) {
+        state = &meteringStates[numMeteringStates++];
+    } else {
+        // Forget the device that has not reported for the longest time
+        for ( i=1; i<numMeteringStates; i++ ) {
+            if ( meteringStates[i].lastSeen < meteringStates[oldest].lastSeen ) oldest = i;
+        }
+        state = &meteringStates[oldest];
+    }
+    meteringReset( state, saddr, mac );
+    return( state );
+}
+
+/**
+ * \brief Gets a copy of the metering state of a device, a new one if it
+ * has none. A device that rejoined with another short address keeps its state.
+ * \param saddr Short address
+ * \param mac IEEE address
+ * \param state Returns the device state, to be handed back with meteringPut()
+ */
+void meteringGet( uint16_t saddr, uint64_t mac, meteringState_t * state ) {
+    meteringState_t * entry;
+
+    pthread_mutex_lock( &meteringMutex );
+
+    if ( ( entry = meteringFind( mac ) ) == NULL ) {
+        entry = meteringNew( saddr, mac );
+    } else if ( entry->saddr != saddr ) {
+        DEBUG_PRINTF( "Metering: %016llx moved from 0x%04x to 0x%04x\n",
+            (unsigned long long)mac, entry->saddr, saddr );
+        entry->saddr = saddr;
+        meteringSaveLater();
+    }
+
+    entry->lastSeen = (int)time( NULL );
+    *state = *entry;
+    pthread_mutex_unlock( &meteringMutex );
+}
+
+/**
+ * \brief Stores the metering state of a device, and saves the formats
+ * later if they changed
+ * \param state Device state from meteringGet(), with the new values
+ */
+void meteringPut( meteringState_t * state ) {
+    meteringState_t * entry;
+    uint16_t saddr;
+
+    pthread_mutex_lock( &meteringMutex );
+
+    // The entry may have been reused for another device in the meantime
+    if ( ( entry = meteringFind( state->mac ) ) == NULL ) {
+        entry = meteringNew( state->saddr, state->mac );
+    }
+
+    if ( memcmp( &entry->format, &state->format, sizeof( meteringFormat_t ) ) != 0 ) {
+        meteringSaveLater();
+    }
+    // Keep the short address, the device may have moved since meteringGet()
+    saddr  = entry->saddr;
+    *entry = *state;
+    entry->saddr    = saddr;
+    entry->lastSeen = (int)time( NULL );
+    pthread_mutex_unlock( &meteringMutex );
+}
+
+// ------------------------------------------------------------------
+// End of file
+// ------------------------------------------------------------------
@@ -0,0 +1,53 @@
+// ------------------------------------------------------------------
+// Metering - include file
+// ------------------------------------------------------------------
+// Part of gateway_zigbee, licensed under the GNU GPL v3 (see LICENSE)
+// ------------------------------------------------------------------
+
+#include <stdint.h>
+
+/** How a device formats its metering values. Kept across restarts,
+ *  so devices only have to report these once. 0 is unknown, except
+ *  for the device type and unit, which use -1 */
+typedef struct {
+    // Simple metering
+    int deviceType;
+    int unitOfMeasure;
+    int multiplier;
+    int divisor;
+
+    // Electrical measurement
+    int acVoltageMultiplier;
+    int acVoltageDivisor;
+    int acCurrentMultiplier;
+    int acCurrentDivisor;
+    int acPowerMultiplier;
+    int acPowerDivisor;
+} meteringFormat_t;
+
+/** Per-device metering state, keyed by IEEE address */
+typedef struct {
+    uint16_t saddr;
+    uint64_t mac;
+    int      lastSeen;
+
+    meteringFormat_t format;
+
+    // Latest reported values
+    uint64_t summationDelivered;
+    int64_t  instantaneousDemand;
+    uint64_t acFrequency;
+    uint64_t rmsVoltage;
+    uint64_t rmsCurrent;
+    uint64_t activePower;
+    uint64_t powerFactor;
+} meteringState_t;
+
+void meteringInit( void );
+void meteringSave( void );
+void meteringGet( uint16_t saddr, uint64_t mac, meteringState_t * state );
+void meteringPut( meteringState_t * state );
+
+// ------------------------------------------------------------------
+// END OF FILE
+// ------------------------------------------------------------------
@@ -0,0 +1,584 @@
+// ------------------------------------------------------------------
+// Scanner
+// ------------------------------------------------------------------
+// Walks the neighbour tables of the coordinator and all routers in
+// the background and keeps the result in a cache
+// ------------------------------------------------------------------
+// Part of gateway_zigbee, licensed under the GNU GPL v3 (see LICENSE)
+// ------------------------------------------------------------------
+
+/** \addtogroup zb
+ * \file
+ * \brief Background topology scanner
+ *
+ * A thread of its own sends management LQI requests to the coordinator
+ * and to every router it learns about, a few at a time. The responses
+ * come in through a listener and are matched on sequence number, so the
+ * main loop never waits for them. Each router is scanned again when its
+ * time to live runs out: the time to live doubles while its table stays
+ * the same and drops back to the minimum when it changes. Nodes that
+ * are not in the database yet are added as if they announced themselves.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <endian.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "zcb.h"
+#include "SerialLink.h"
+#include "ZigbeeDevices.h"
+#include "newLog.h"
+#include "scanner.h"
+
+// ------------------------------------------------------------------
+// Macros
+// ------------------------------------------------------------------
+
+/*#define SCANNER_DEBUG*/
+
+#ifdef SCANNER_DEBUG
+#define DEBUG_PRINTF(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_PRINTF(...)
+#endif /* SCANNER_DEBUG */
+
+// Nodes kept in the cache, coordinator included
+#define SCANNER_MAX_NODES       256
+
+// Requests that may wait for their response at the same time
+#define SCANNER_PIPELINE        3
+
+// Minimum time between two requests (ms)
+#define SCANNER_GAP             250
+
+// Time a router has to return its response (ms)
+#define SCANNER_RESPONSE_TIMEOUT 3000
+
+// Time to live of a router's table (s): starts at the minimum,
+// doubles while the table does not change, up to the maximum
+#define SCANNER_TTL_MIN         120
+#define SCANNER_TTL_MAX         1920
+
+// First retry after a failed request (s), doubles per failure up to SCANNER_TTL_MAX
+#define SCANNER_RETRY           10
+
+// Nodes no table has listed for this long are dropped (s)
+#define SCANNER_STALE           ( 2 * SCANNER_TTL_MAX )
+
+#define SCANNER_COORDINATOR     0x0000
+
+// Neighbour table entry bitmap
+#define SCANNER_DEVICE_TYPE(b)  ( (b) & 0x03 )
+#define SCANNER_ROUTER          1
+
+// ------------------------------------------------------------------
+// Typing
+// ------------------------------------------------------------------
+
+typedef struct {
+    uint16_t    saddr;
+    uint64_t    mac;
+    int         router;         // Answers management LQI requests
+    int         check;          // Not compared with the database yet
+    uint8_t     lqi;            // As last reported by a neighbour
+    uint16_t    reportedBy;
+    uint64_t    seen;           // Last listed in a table (ms)
+    // Routers only
+    uint64_t    due;            // Next scan (ms)
+    int         ttl;            // Time to live of the table (s)
+    int         busy;           // Request outstanding
+    int         failures;
+    int         start;          // Next table index to request
+    int         entries;        // Table entries read so far
+    int         tables;         // Complete tables read
+    uint32_t    sum;            // Fingerprint of the table being read
+    uint32_t    prevSum;        // and of the last complete one
+} scanNode_t;
+
+typedef enum {
+    SCAN_REQ_FREE,
+    SCAN_REQ_STATUS,            // Sent, waiting for the status
+    SCAN_REQ_RESPONSE,          // Waiting for the response
+} scanReqState_t;
+
+typedef struct {
+    scanReqState_t state;
+    uint32_t    serial;
+    int         node;
+    uint8_t     seq;
+    uint64_t    sent;
+} scanRequest_t;
+
+typedef struct {
+    uint8_t     u8SequenceNo;
+    uint8_t     u8Status;
+    uint8_t     u8NeighbourTableSize;
+    uint8_t     u8TableEntries;
+    uint8_t     u8StartIndex;
+} __attribute__((__packed__)) scanLqiResponse_t;
+
+typedef struct {
+    uint16_t    u16ShortAddress;
+    uint64_t    u64PanID;
+    uint64_t    u64IEEEAddress;
+    uint8_t     u8Depth;
+    uint8_t     u8LQI;
+    uint8_t     u8Bitmap;
+} __attribute__((__packed__)) scanLqiEntry_t;
+
+// ------------------------------------------------------------------
+// Globals
+// ------------------------------------------------------------------
+
+static pthread_mutex_t scanMutex   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  scanChanged = PTHREAD_COND_INITIALIZER;
+static pthread_t       scanThread;
+static int             scanRunning = 0;
+
+static scanNode_t      nodes[SCANNER_MAX_NODES];
+static int             numNodes = 0;
+static scanRequest_t   requests[SCANNER_PIPELINE];
+static uint32_t        requestSerial = 0;
+
+static struct {
+    uint32_t    sent;
+    uint32_t    responses;
+    uint32_t    failures;
+    uint32_t    tables;         // Complete tables read
+    uint32_t    changed;        // of which differed from the previous
+} scanStats;
+
+// ------------------------------------------------------------------
+// Helpers
+// ------------------------------------------------------------------
+
+static uint64_t scanNow( void ) {
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void scanWaitUntil( uint64_t when ) {
+    uint64_t now = scanNow();
+    uint64_t ms  = ( when > now ) ? when - now : 0;
+    struct timeval tv;
+    struct timespec ts;
+
+    gettimeofday( &tv, NULL );
+    ts.tv_sec  = tv.tv_sec + ms / 1000;
+    ts.tv_nsec = tv.tv_usec * 1000 + ( ms % 1000 ) * 1000000;
+    if ( ts.tv_nsec >= 1000000000 ) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait( &scanChanged, &scanMutex, &ts );
+}
+
+static scanNode_t * scanFindNode( uint16_t saddr, uint64_t mac ) {
+    int i;
+    for ( i=0; i<numNodes; i++ ) {
+        if ( ( mac && nodes[i].mac == mac ) || ( !mac && nodes[i].saddr == saddr ) ) {
+            return( &nodes[i] );
+        }
+    }
+    return( NULL );
+}
+
+static void scanMakeRouter( scanNode_t * node, uint64_t now ) {
+    if ( !node->router ) {
+        node->router  = 1;
+        node->due     = now;
+        node->ttl     = SCANNER_TTL_MIN;
+        node->start   = 0;
+        node->entries = 0;
+        node->sum     = 0;
+    }
+}
+
+static void scanFailed( scanNode_t * node, uint64_t now ) {
+    int retry = SCANNER_RETRY;
+    int i;
+
+    for ( i=0; i<node->failures && retry < SCANNER_TTL_MAX; i++ ) retry *= 2;
+    if ( retry > SCANNER_TTL_MAX ) retry = SCANNER_TTL_MAX;
+
+    node->busy    = 0;
+    node->failures++;
+    node->start   = 0;
+    node->entries = 0;
+    node->sum     = 0;
+    node->due     = now + (uint64_t)retry * 1000;
+    scanStats.failures++;
+    DEBUG_PRINTF( "Scan of 0x%04x failed (%d), retry in %d s\n", node->saddr, node->failures, retry );
+}
+
+static void scanFreeRequest( scanRequest_t * req ) {
+    req->state = SCAN_REQ_FREE;
+    pthread_cond_signal( &scanChanged );
+}
+
+// ------------------------------------------------------------------
+// Status and response
+// ------------------------------------------------------------------
+
+/**
+ * \brief Status of a management LQI request, from the serial link reader thread.
+ * Always comes before the response.
+ */
+static void scanStatus( void * pvUser, uint16_t u16Type,
+                        teSL_Status eStatus, uint8_t u8SequenceNo ) {
+    uint32_t serial = (uint32_t)(uintptr_t)pvUser;
+    int i;
+
+    pthread_mutex_lock( &scanMutex );
+    for ( i=0; i<SCANNER_PIPELINE; i++ ) {
+        scanRequest_t * req = &requests[i];
+        if ( req->state == SCAN_REQ_STATUS && req->serial == serial ) {
+            if ( eStatus == E_SL_OK ) {
+                req->seq   = u8SequenceNo;
+                req->state = SCAN_REQ_RESPONSE;
+            } else {
+                scanFailed( &nodes[req->node], scanNow() );
+                scanFreeRequest( req );
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock( &scanMutex );
+}
+
+/**
+ * \brief Listener for management LQI responses: adds the neighbours to the cache
+ * and moves the router on to the next part of its table
+ */
+static void scanHandleResponse( void * pvUser, uint16_t u16Length, void * pvMessage ) {
+    scanLqiResponse_t * rsp = (scanLqiResponse_t *)pvMessage;
+    scanLqiEntry_t    * entry;
+    scanRequest_t     * req = NULL;
+    scanNode_t        * router;
+    uint64_t now = scanNow();
+    int i, entries;
+
+    if ( u16Length < sizeof( scanLqiResponse_t ) ) return;
+
+    pthread_mutex_lock( &scanMutex );
+    for ( i=0; i<SCANNER_PIPELINE; i++ ) {
+        if ( requests[i].state == SCAN_REQ_RESPONSE && requests[i].seq == rsp->u8SequenceNo ) {
+            req = &requests[i];
+            break;
+        }
+    }
+    if ( req == NULL ) {
+        DEBUG_PRINTF( "Unexpected LQI response, sequence %d\n", rsp->u8SequenceNo );
+        pthread_mutex_unlock( &scanMutex );
+        return;
+    }
+
+    router = &nodes[req->node];
+    router->seen = now;
+    scanStats.responses++;
+
+    if ( rsp->u8Status != CZD_NW_STATUS_SUCCESS ) {
+        DEBUG_PRINTF( "LQI response from 0x%04x: status 0x%02x\n", router->saddr, rsp->u8Status );
+        scanFailed( router, now );
+        scanFreeRequest( req );
+        pthread_mutex_unlock( &scanMutex );
+        return;
+    }
+
+    entries = rsp->u8TableEntries;
+    if ( entries > (int)( ( u16Length - sizeof( scanLqiResponse_t ) ) / sizeof( scanLqiEntry_t ) ) ) {
+        entries = (int)( ( u16Length - sizeof( scanLqiResponse_t ) ) / sizeof( scanLqiEntry_t ) );
+    }
+    entry = (scanLqiEntry_t *)( rsp + 1 );
+
+    for ( i=0; i<entries; i++, entry++ ) {
+        uint16_t saddr = ntohs( entry->u16ShortAddress );
+        uint64_t mac   = be64toh( entry->u64IEEEAddress );
+        scanNode_t * node;
+
+        if ( saddr >= 0xFFFA || mac == 0 ) {
+            /* Illegal short / IEEE address */
+            continue;
+        }
+        router->sum = router->sum * 31 + saddr + ( entry->u8Bitmap << 16 );
+
+        if ( saddr == SCANNER_COORDINATOR ) {
+            nodes[0].mac = mac;
+            continue;
+        }
+
+        node = scanFindNode( saddr, mac );
+        if ( node == NULL ) {
+            if ( numNodes >= SCANNER_MAX_NODES ) continue;
+            node = &nodes[numNodes++];
+            memset( node, 0, sizeof( scanNode_t ) );
+            node->mac   = mac;
+            node->saddr = saddr;
+            node->check = 1;
+            DEBUG_PRINTF( "New neighbour 0x%04x of 0x%04x\n", saddr, router->saddr );
+        } else if ( node->saddr != saddr ) {
+            node->saddr = saddr;
+            node->check = 1;
+        }
+        node->lqi        = entry->u8LQI;
+        node->reportedBy = router->saddr;
+        node->seen       = now;
+        if ( SCANNER_DEVICE_TYPE( entry->u8Bitmap ) == SCANNER_ROUTER ) {
+            scanMakeRouter( node, now );
+        }
+    }
+
+    router->busy     = 0;
+    router->failures = 0;
+    router->entries += entries;
+    if ( entries > 0 && rsp->u8StartIndex + entries < rsp->u8NeighbourTableSize ) {
+        // Ask for the rest straight away
+        router->start = rsp->u8StartIndex + entries;
+        router->due   = now;
+    } else {
+        // Complete, read it again when its time to live runs out
+        scanStats.tables++;
+        if ( router->tables++ > 0 && router->sum == router->prevSum ) {
+            if ( router->ttl < SCANNER_TTL_MAX ) router->ttl *= 2;
+        } else {
+            if ( router->tables > 1 ) scanStats.changed++;
+            router->ttl = SCANNER_TTL_MIN;
+        }
+        DEBUG_PRINTF( "Table of 0x%04x: %d entries, next in %d s\n", router->saddr, router->entries, router->ttl );
+        router->prevSum = router->sum;
+        router->sum     = 0;
+        router->start   = 0;
+        router->entries = 0;
+        router->due     = now + (uint64_t)router->ttl * 1000;
+    }
+    scanFreeRequest( req );
+    pthread_mutex_unlock( &scanMutex );
+}
+
+// ------------------------------------------------------------------
+// Thread
+// ------------------------------------------------------------------
+
+/**
+ * \brief Sends a request for the next part of a router's table.
+ * Called with the mutex held, releases it while sending.
+ */
+static void scanSend( int n, uint64_t now ) {
+    struct {
+        uint16_t    u16TargetAddress;
+        uint8_t     u8StartIndex;
+    } __attribute__((__packed__)) sRequest;
+    scanRequest_t * req = NULL;
+    uint32_t serial;
+    int i;
+
+    for ( i=0; i<SCANNER_PIPELINE && req == NULL; i++ ) {
+        if ( requests[i].state == SCAN_REQ_FREE ) req = &requests[i];
+    }
+    if ( req == NULL ) return;
+
+    serial = ++requestSerial;
+    req->state  = SCAN_REQ_STATUS;
+    req->serial = serial;
+    req->node   = n;
+    req->sent   = now;
+    nodes[n].busy = 1;
+    scanStats.sent++;
+
+    sRequest.u16TargetAddress = htons( nodes[n].saddr );
+    sRequest.u8StartIndex     = nodes[n].start;
+    DEBUG_PRINTF( "Send LQI request to 0x%04x for entries from %d\n", nodes[n].saddr, nodes[n].start );
+
+    pthread_mutex_unlock( &scanMutex );
+    teSL_Status eStatus = eSL_SendCommand( E_SL_MSG_MANAGEMENT_LQI_REQUEST, sizeof( sRequest ), &sRequest,
+                                           scanStatus, (void *)(uintptr_t)serial, NULL );
+    pthread_mutex_lock( &scanMutex );
+
+    if ( eStatus != E_SL_OK && req->state == SCAN_REQ_STATUS && req->serial == serial ) {
+        scanFailed( &nodes[n], scanNow() );
+        scanFreeRequest( req );
+    }
+}
+
+/**
+ * \brief Compares the new nodes with the database, outside the mutex.
+ * Called with the mutex held.
+ */
+static void scanCheckNodes( void ) {
+    int i;
+    for ( i=0; i<numNodes; i++ ) {
+        if ( nodes[i].check ) {
+            uint16_t saddr = nodes[i].saddr;
+            uint64_t mac   = nodes[i].mac;
+            nodes[i].check = 0;
+
+            pthread_mutex_unlock( &scanMutex );
+            zcbNewNeighbour( saddr, mac );
+            pthread_mutex_lock( &scanMutex );
+        }
+    }
+}
+
+/**
+ * \brief Drops the nodes no table has listed for a long time.
+ * Called with the mutex held, when no request is outstanding.
+ */
+static void scanPrune( uint64_t now ) {
+    int i = 1;      // Keep the coordinator
+    while ( i < numNodes ) {
+        if ( now - nodes[i].seen > (uint64_t)SCANNER_STALE * 1000 ) {
+            DEBUG_PRINTF( "Drop 0x%04x from the cache\n", nodes[i].saddr );
+            nodes[i] = nodes[--numNodes];
+        } else {
+            i++;
+        }
+    }
+}
+
+static void * scanMain( void * arg ) {
+    uint64_t nextSend = 0;
+
+    pthread_mutex_lock( &scanMutex );
+    while ( scanRunning ) {
+        uint64_t now  = scanNow();
+        uint64_t wake = now + 1000;
+        uint64_t nextDue = 0;
+        int i, busy = 0, next = -1;
+
+        for ( i=0; i<SCANNER_PIPELINE; i++ ) {
+            scanRequest_t * req = &requests[i];
+            if ( req->state == SCAN_REQ_FREE ) continue;
+            if ( now - req->sent >= SCANNER_RESPONSE_TIMEOUT ) {
+                DEBUG_PRINTF( "No LQI response from 0x%04x\n", nodes[req->node].saddr );
+                scanFailed( &nodes[req->node], now );
+                req->state = SCAN_REQ_FREE;
+            } else {
+                busy++;
+                if ( req->sent + SCANNER_RESPONSE_TIMEOUT < wake ) wake = req->sent + SCANNER_RESPONSE_TIMEOUT;
+            }
+        }
+
+        scanCheckNodes();
+        if ( busy == 0 ) scanPrune( now );
+
+        // Finish the tables that are half read first, then the most overdue
+        for ( i=0; i<numNodes; i++ ) {
+            if ( nodes[i].router && !nodes[i].busy ) {
+                uint64_t due = nodes[i].start ? 0 : nodes[i].due;
+                if ( next < 0 || due < nextDue ) {
+                    next    = i;
+                    nextDue = due;
+                }
+            }
+        }
+
+        if ( next >= 0 && busy < SCANNER_PIPELINE ) {
+            uint64_t when = ( nextDue > nextSend ) ? nextDue : nextSend;
+            if ( when <= now ) {
+                scanSend( next, now );
+                nextSend = now + SCANNER_GAP;
+                continue;
+            }
+            if ( when < wake ) wake = when;
+        }
+
+        scanWaitUntil( wake );
+    }
+    pthread_mutex_unlock( &scanMutex );
+    return( NULL );
+}
+
+// ------------------------------------------------------------------
+// Start / stop
+// ------------------------------------------------------------------
+
+/**
+ * \brief Starts scanning from the coordinator
+ * \returns 0 on success, -1 if the thread could not be started
+ */
+int scannerStart( void ) {
+    pthread_mutex_lock( &scanMutex );
+    memset( nodes, 0, sizeof( nodes ) );
+    memset( requests, 0, sizeof( requests ) );
+    numNodes = 1;
+    nodes[0].saddr = SCANNER_COORDINATOR;
+    scanMakeRouter( &nodes[0], scanNow() );
+    scanRunning = 1;
+    pthread_mutex_unlock( &scanMutex );
+
+    eSL_AddListener( E_SL_MSG_MANAGEMENT_LQI_RESPONSE, scanHandleResponse, NULL );
+
+    if ( pthread_create( &scanThread, NULL, scanMain, NULL ) != 0 ) {
+        printf( "Could not start the topology scanner\n" );
+        scanRunning = 0;
+        return( -1 );
+    }
+    return( 0 );
+}
+
+/**
+ * \brief Stops the scanner thread. Outstanding requests are dropped.
+ */
+void scannerStop( void ) {
+    pthread_mutex_lock( &scanMutex );
+    if ( !scanRunning ) {
+        pthread_mutex_unlock( &scanMutex );
+        return;
+    }
+    scanRunning = 0;
+    pthread_cond_signal( &scanChanged );
+    pthread_mutex_unlock( &scanMutex );
+
+    pthread_join( scanThread, NULL );
+}
+
+// ------------------------------------------------------------------
+// Log
+// ------------------------------------------------------------------
+
+/**
+ * \brief Logs a summary of the cache and prints the nodes
+ */
+void scannerLog( void ) {
+    char line[NEWLOG_MAX_TEXT+2];
+    uint64_t now;
+    int i, routers = 0;
+
+    pthread_mutex_lock( &scanMutex );
+    now = scanNow();
+    for ( i=0; i<numNodes; i++ ) {
+        if ( nodes[i].router ) routers++;
+    }
+
+    snprintf( line, sizeof( line ), "Scan: %d nodes, %d routers, %u req, %u rsp, %u fail, %u tables (%u changed)",
+        numNodes, routers, scanStats.sent, scanStats.responses, scanStats.failures,
+        scanStats.tables, scanStats.changed );
+    printf( "%s\n", line );
+    newLogAdd( NEWLOG_FROM_ZCB_OUT, line );
+
+    for ( i=0; i<numNodes; i++ ) {
+        scanNode_t * node = &nodes[i];
+        printf( "Scan 0x%04x %016llx: lqi %3d via 0x%04x, seen %llu s ago", node->saddr,
+            (unsigned long long)node->mac, node->lqi, node->reportedBy,
+            (unsigned long long)( ( now - node->seen ) / 1000 ) );
+        if ( node->router ) {
+            printf( ", router ttl %d s, next in %lld s%s", node->ttl,
+                (long long)( (int64_t)( node->due - now ) / 1000 ),
+                node->failures ? ", failing" : "" );
+        }
+        printf( "\n" );
+    }
+    pthread_mutex_unlock( &scanMutex );
+}
+
+// ------------------------------------------------------------------
+// End of file
+// ------------------------------------------------------------------
@@ -0,0 +1,13 @@
+// ------------------------------------------------------------------
+// Scanner - include file
+// ------------------------------------------------------------------
+// Part of gateway_zigbee, licensed under the GNU GPL v3 (see LICENSE)
+// ------------------------------------------------------------------
+
+int  scannerStart( void );
+void scannerStop( void );
+void scannerLog( void );
+
+// ------------------------------------------------------------------
+// END OF FILE
+// ------------------------------------------------------------------
@@ -28,6 +28,7 @@
 #include "plugUsage.h"
 #include "jsonCreate.h"
 #include "json.h"
+#include "iotMsg.h"
 #include "newLog.h"
 #include "dump.h"
 
@@ -43,6 +44,12 @@
 #include "ZigbeeDevices.h"
 #include "newDb.h"
 #include "zcb.h"
+#include "lmpgrp.h"
+#include "scanner.h"
+#include "metering.h"
+#include "devcache.h"
+#include "evloop.h"
+#include "SerialLink.h"
 
 // -------------------------------------------------------------
 // Macros
@@ -68,6 +75,8 @@
 
 #define CONTROL_PORT     "2001"
 
+#define LINKSTATS_PERIOD  600     // Seconds between serial link summaries in the log
+
 // -------------------------------------------------------------
 // Globals
 // -------------------------------------------------------------
@@ -81,24 +90,7 @@ volatile int   bRunning            = 1;
 // Globals, local
 // -------------------------------------------------------------
 
-static char inputBuffer[INPUTBUFFERLEN+2];
-static char mac_plug[LEN_MAC_NIBBLE+2];
-// -------------------------------------------------------------
-// Quit-Signal handler
-// -------------------------------------------------------------
-
-/** The signal handler just clears the running flag and re-enables itself. */
-static void vQuitSignalHandler (int sig)
-{
-    DEBUG_PRINTF( "Got signal %d\n", sig);
-    
-    /* Signal main loop to exit */
-    bRunning = 0;
-    
-    /* Re-enable signal handler */
-    signal (sig, vQuitSignalHandler);
-    return;
-}
+static int flushTimer = -1;
 
 // -------------------------------------------------------------
 // Send message to IoT queue
@@ -175,8 +167,7 @@ static void zcbHandleAnnounce( char * mac, char * devstr, char * ty ) {
     }
 
     printf( "YB Joined %s, %s = %d\n", mac, devstr, dev );
-    sprintf( logbuffer, "Announce %s", devstr );
-    newLogAdd( NEWLOG_FROM_ZCB_OUT, logbuffer );
+    newLogAddFmt( NEWLOG_FROM_ZCB_OUT, NEWLOG_FMT_ANNOUNCE, devstr );
 
     newdb_zcb_t sNode;
     newdb_dev_t device;
@@ -204,6 +195,8 @@ static void zcbHandleAnnounce( char * mac, char * devstr, char * ty ) {
         strcpy(device.cmd, sNode.info);
         newDbSetDevice( &device );
     }
+    // Reports are cached: make the cache read the new row
+    devcacheForget( mac );
 
     if ( dev == DEVICE_DEV_MANAGER ) {
         // When a new manager joins, then we re-send all topo data
@@ -217,22 +210,16 @@ static void zcbHandleAnnounce( char * mac, char * devstr, char * ty ) {
 // -------------------------------------------------------------
 
 /**
- * \brief Updates device cmd and level in the database (no autoinsert)
+ * \brief Updates device cmd and level in the database (no autoinsert, written behind)
  */
 static void zcbHandleActuator( char * mac, int sid, char * cmd, int lvl ) {
 
-    if ( cmd ) sprintf( logbuffer, "Actuator %s %s", mac, cmd );
-    else if ( lvl >= 0 ) sprintf( logbuffer, "Actuator %s %d", mac, lvl );
-    else sprintf( logbuffer, "Actuator %s", mac );
-    newLogAdd( NEWLOG_FROM_ZCB_OUT, logbuffer );
+    if ( cmd ) newLogAddFmt( NEWLOG_FROM_ZCB_OUT, NEWLOG_FMT_ACTUATOR_CMD, mac, cmd );
+    else if ( lvl >= 0 ) newLogAddFmt( NEWLOG_FROM_ZCB_OUT, NEWLOG_FMT_ACTUATOR_LVL, mac, lvl );
+    else newLogAddFmt( NEWLOG_FROM_ZCB_OUT, NEWLOG_FMT_ACTUATOR, mac );
 
-    newdb_dev_t device;
-    if ( newDbGetDevice( mac, &device ) ) {
-        if ( cmd ) newDbStrNcpy( device.cmd, cmd, LEN_CMD );
-        if ( lvl >= 0 ) device.lvl = lvl;
-        device.flags |= FLAG_DEV_JOINED;
-        newDbSetDevice( &device );
-    }
+    if ( cmd ) devcacheSetCmd( mac, cmd );
+    if ( lvl >= 0 ) devcacheSet( mac, DEVCACHE_LVL, lvl );
 }
 
 // -------------------------------------------------------------
@@ -247,8 +234,7 @@ static void zcbHandleUI( char * mac, int heat, int cool ) {
     newdb_dev_t device;
     if ( newDbGetDevice( mac, &device ) ) {
         if ( heat != INT_MIN ) {
-            sprintf( logbuffer, "UI %s: heat %d", mac, heat );
-            newLogAdd( NEWLOG_FROM_ZCB_OUT, logbuffer );
+            newLogAddFmt( NEWLOG_FROM_ZCB_OUT, NEWLOG_FMT_UI_HEAT, mac, heat );
         
             if ( !( device.flags & FLAG_UI_IGNORENEXT_HEAT ) ) {
                 device.heat = heat;
@@ -257,8 +243,7 @@ static void zcbHandleUI( char * mac, int heat, int cool ) {
             }
         }
         if ( cool != INT_MIN ) {
-            sprintf( logbuffer, "UI %s: cool %d", mac, cool );
-            newLogAdd( NEWLOG_FROM_ZCB_OUT, logbuffer );
+            newLogAddFmt( NEWLOG_FROM_ZCB_OUT, NEWLOG_FMT_UI_COOL, mac, cool );
         
             if ( !( device.flags & FLAG_UI_IGNORENEXT_COOL ) ) {
                 device.cool = cool;
@@ -276,61 +261,61 @@ static void zcbHandleUI( char * mac, int heat, int cool ) {
 // -------------------------------------------------------------
 
 /**
- * \brief Updates sensor device modalities in the database (no autoinsert). Also forward to DBP.
+ * \brief Updates sensor device modalities in the database (no autoinsert, written behind). Also forward to DBP.
  */
 static void zcbHandleSensor( char * mac, int tmp, int hum, int als, int bat, int batl ) {
 
-    sprintf( logbuffer, "Sensor %s: tmp %d", mac, tmp );
+    newLogFmt fmt = NEWLOG_FMT_SENSOR_TMP;
+    int val = tmp, known = 0;
 
-    newdb_dev_t device;
-    if ( newDbGetDevice( mac, &device ) ) {
-        if ( tmp  >= 0 ) {
-            sprintf( logbuffer, "Sensor %s: tmp %d", mac, tmp );
-            device.tmp = tmp;
-        }
-        if ( hum  >= 0 ) {
-            sprintf( logbuffer, "Sensor %s: hum %d", mac, hum );
-            device.hum = hum;
-        }
-        if ( als  >= 0 ) {
-            sprintf( logbuffer, "Sensor %s: als %d", mac, als );
-            device.als = als;
-        }
-        if ( bat  >= 0 ) {
-            sprintf( logbuffer, "Sensor %s: bat %d", mac, bat );
-            device.bat = bat;
-        }
-        if ( batl >= 0 ) {
-            sprintf( logbuffer, "Sensor %s: batl %d", mac, batl );
-            device.batl = batl;
-        }
-        device.flags |= FLAG_DEV_JOINED;
-        newDbSetDevice( &device );
+    if ( tmp  >= 0 ) {
+        fmt = NEWLOG_FMT_SENSOR_TMP; val = tmp;
+        known = devcacheSet( mac, DEVCACHE_TMP, tmp );
+    }
+    if ( hum  >= 0 ) {
+        fmt = NEWLOG_FMT_SENSOR_HUM; val = hum;
+        known = devcacheSet( mac, DEVCACHE_HUM, hum );
+    }
+    if ( als  >= 0 ) {
+        fmt = NEWLOG_FMT_SENSOR_ALS; val = als;
+        known = devcacheSet( mac, DEVCACHE_ALS, als );
+    }
+    if ( bat  >= 0 ) {
+        fmt = NEWLOG_FMT_SENSOR_BAT; val = bat;
+        known = devcacheSet( mac, DEVCACHE_BAT, bat );
+    }
+    if ( batl >= 0 ) {
+        fmt = NEWLOG_FMT_SENSOR_BATL; val = batl;
+        known = devcacheSet( mac, DEVCACHE_BATL, batl );
+    }
+
+    if ( known ) {
         
         // Tee to DBP
-        char * message = jsonSensor( -1, mac, NULL, -1, -1,
-                                    tmp, hum, -1, -1, bat, batl, als,
-                                    INT_MIN, INT_MIN, INT_MIN, -1 );
-        queueWriteOneMessage( QUEUE_KEY_DBP, message );
+        iotMsg_t msg;
+        iotMsgQueueWriteOne( QUEUE_KEY_DBP,
+                iotMsgSensor( &msg, -1, mac, NULL, -1, -1,
+                              tmp, hum, -1, -1, bat, batl, als,
+                              INT_MIN, INT_MIN, INT_MIN, -1 ) );
     }
  
-     newLogAdd( NEWLOG_FROM_ZCB_OUT, logbuffer );
+     newLogAddFmt( NEWLOG_FROM_ZCB_OUT, fmt, mac, val );
  }
 
 // -------------------------------------------------------------
 // Parsing
 // -------------------------------------------------------------
 
-static void zcb_onError(int error, char * errtext, char * lastchars) {
+static void zcb_onError(void * user, int error, char * errtext, char * lastchars) {
     printf("onError( %d, %s ) @ %s\n", error, errtext, lastchars);
 }
 
-static void zcb_onObjectStart(char * name) {
+static void zcb_onObjectStart(void * user, char * name) {
     DEBUG_PRINTF("onObjectStart( %s )\n", name);
     parsingReset();
 }
 
-static void zcb_onObjectComplete(char * name) {
+static void zcb_onObjectComplete(void * user, char * name) {
     DEBUG_PRINTF("onObjectComplete( %s )\n", name);
     if ( strcmp( name, "cmd" ) == 0 ) {
         cmdHandle();
@@ -351,24 +336,35 @@ static void zcb_onObjectComplete(char * name) {
     }
 }
 
-static void zcb_onArrayStart(char * name) {
+static void zcb_onArrayStart(void * user, char * name) {
     // printf("onArrayStart( %s )\n", name);
 }
 
-static void zcb_onArrayComplete(char * name) {
+static void zcb_onArrayComplete(void * user, char * name) {
     // printf("onArrayComplete( %s )\n", name);
 }
 
-static void zcb_onString(char * name, char * value) {
+static void zcb_onString(void * user, char * name, char * value) {
     DEBUG_PRINTF("onString( %s, %s )\n", name, value);
     parsingStringAttr( name, value );
 }
 
-static void zcb_onInteger(char * name, int value) {
+static void zcb_onInteger(void * user, char * name, int value) {
     DEBUG_PRINTF("onInteger( %s, %d )\n", name, value);
     parsingIntAttr( name, value );
 }
 
+// Used for both JSON text and binary (iotMsg) queue messages
+static const json_callbacks_t zcb_callbacks = {
+    zcb_onError,
+    zcb_onObjectStart,
+    zcb_onObjectComplete,
+    zcb_onArrayStart,
+    zcb_onArrayComplete,
+    zcb_onString,
+    zcb_onInteger
+};
+
 // ---------------------------------------------------------------------
 // Send update interval message to plug meters
 // ---------------------------------------------------------------------
@@ -583,7 +579,6 @@ void announceDevice(
         eZCB_SendBindCommand( u64IEEEAddress, E_ZB_CLUSTERID_ONOFF );
 		// modification du cluster , metering remplace par analog input
         eZCB_SendBindCommand( u64IEEEAddress, E_ZB_CLUSTERID_ANALOG_INPUT_BASIC );
-		strcpy(mac_plug,mac);
 		
 		// voir par la suite comment integrer cette fonction
        // SmartPlugUpdateIntervalMsg( u64IEEEAddress, 4 );	// was 2
@@ -666,18 +661,15 @@ sendOccupancy(
     int data )
 {
   char  mac[16+2];
-  newdb_dev_t device;
+  char  ty[LEN_TY+2];
 
   u642nibblestr(u64IEEEAddress, mac);
-  if (newDbGetDevice(mac, &device))
+  if (devcacheGetTy(mac, ty))
   {
-    sprintf(logbuffer, "Sensor %s type=%s data=%i", mac, device.ty, data);
-    newLogAdd(NEWLOG_FROM_ZCB_OUT, logbuffer);
-    DEBUG_PRINTF(logbuffer);
+    newLogAddFmt(NEWLOG_FROM_ZCB_OUT, NEWLOG_FMT_SENSOR_DATA, mac, ty, data);
+    DEBUG_PRINTF("Sensor %s type=%s data=%i", mac, ty, data);
 
-    device.prs = data;
-    device.flags |= FLAG_DEV_JOINED;
-    newDbSetDevice(&device);
+    devcacheSet(mac, DEVCACHE_PRS, data);
   }
 } // sendSensorMeasurement
 
@@ -757,34 +749,26 @@ static void sendHeatingSetpoint( uint64_t u64IEEEAddress, int data ) {
 // Send plugmeter messages to IoT
 // ------------------------------------------------------------------
 
-static uint64_t eSummationDelivered  = 0;
-static uint64_t eInstantaneousDemand = 0;
-static uint64_t eMeteringDeviceType  = -1;
-static uint64_t eUnitOfMeasure       = -1;
-static uint64_t eMultiplier          = 0;
-static uint64_t eDivisor             = 0;
-
-static void handlePlugData( uint64_t u64IEEEAddress ) {
+static void handlePlugData( uint64_t u64IEEEAddress, meteringState_t * meter ) {
     
-    static int cleanupCnt = 0;
     char  mac[16+2];
     u642nibblestr( u64IEEEAddress, mac );
     
     /* Check that this is an electricity meter */
-    if ((E_CLD_SM_MDT_ELECTRIC == eMeteringDeviceType) &&
-         ((E_CLD_SM_UOM_KILO_WATTS == eUnitOfMeasure) ||
-          (E_CLD_SM_UOM_KILO_WATTS_BCD == eUnitOfMeasure))) {
+    if ((E_CLD_SM_MDT_ELECTRIC == meter->format.deviceType) &&
+         ((E_CLD_SM_UOM_KILO_WATTS == meter->format.unitOfMeasure) ||
+          (E_CLD_SM_UOM_KILO_WATTS_BCD == meter->format.unitOfMeasure))) {
         uint64_t eSumDeliv = 0;
         int64_t  eInstDemand = 0;
 
         // Must have received multipler and divisor first before we start reporting
-        if (!eMultiplier) return;
-        if (!eDivisor)    return;
+        if (!meter->format.multiplier) return;
+        if (!meter->format.divisor)    return;
 
-        if (E_CLD_SM_UOM_KILO_WATTS_BCD == eUnitOfMeasure) {
+        if (E_CLD_SM_UOM_KILO_WATTS_BCD == meter->format.unitOfMeasure) {
             int i;
             for (i=0; i<(48/4); i++) {
-                uint8_t digit = (eSummationDelivered >> (i * 4)) & 0xF;
+                uint8_t digit = (meter->summationDelivered >> (i * 4)) & 0xF;
                 if (digit > 9) {
                     digit = 0;  // should never happen with BCD!!!
                 }
@@ -795,75 +779,42 @@ static void handlePlugData( uint64_t u64IEEEAddress ) {
                 }
             }
         } else {
-            eSumDeliv = eSummationDelivered;
+            eSumDeliv = meter->summationDelivered;
         }
 
-        eSumDeliv = (eSumDeliv * eMultiplier * 1000) / eDivisor; // now in Watt/hour
+        eSumDeliv = (eSumDeliv * meter->format.multiplier * 1000) / meter->format.divisor; // now in Watt/hour
         if ( (int)eSumDeliv < 0 ) eSumDeliv = 0;
         
-        eInstDemand = (eInstantaneousDemand * eMultiplier * 1000) / eDivisor; // now in Watt
+        eInstDemand = (meter->instantaneousDemand * meter->format.multiplier * 1000) / meter->format.divisor; // now in Watt
         if ( (int)eInstDemand < 0 ) eInstDemand = 0;
         
-        sprintf( logbuffer, "Plug %d/%d", (int)eInstDemand, (int)eSumDeliv );
-        newLogAdd( NEWLOG_FROM_ZCB_OUT, logbuffer );
-
-        // Add to dB (no auto-insert)
-        newdb_dev_t device;
-        if ( newDbGetDevice( mac, &device ) ) {
-            device.act = eInstDemand;
-            device.sum = eSumDeliv;
-            device.flags |= FLAG_DEV_JOINED;
-            newDbSetDevice( &device );
-        
-            int now = (int)time( NULL );
-        
-            newdb_plughist_t plughist;
-            if ( newDbGetMatchingOrNewPlugHist( mac, now/60, &plughist ) ) {
-                plughist.sum = eSumDeliv;
-                newDbSetPlugHist( &plughist );
-            
-                // Clean history entries older than one day
-                if ( cleanupCnt-- < 0 ) {
-                    if ( plugHistoryCleanup( mac, now ) ) {
-                        cleanupCnt = 25;
-                    }
-                }
-            }
+        newLogAddFmt( NEWLOG_FROM_ZCB_OUT, NEWLOG_FMT_PLUG, (int)eInstDemand, (int)eSumDeliv );
+
+        // Add to dB (no auto-insert), the plug history is written with it
+        if ( devcacheSet( mac, DEVCACHE_ACT, (int)eInstDemand ) ) {
+            devcacheSetPlugHist( mac, (int)eSumDeliv );
         }
     }
 }
 
-static uint64_t eAcFrequency         = 0;
-static uint64_t eRmsVoltage          = 0;
-static uint64_t eRmsCurrent          = 0;
-static uint64_t eActivePower         = 0;
-static uint64_t ePowerFactor         = 0;
-static uint64_t eAcVoltageMultiplier = 0;
-static uint64_t eAcVoltageDivisor    = 0;
-static uint64_t eAcCurrentMultiplier = 0;
-static uint64_t eAcCurrentDivisor    = 0;
-static uint64_t eAcPowerMultiplier   = 0;
-static uint64_t eAcPowerDivisor      = 0;
-
-static void handlePlugData2( uint64_t u64IEEEAddress ) {
-    char  mac[16+2];
-    u642nibblestr( u64IEEEAddress, mac );
+static void handlePlugData2( uint64_t u64IEEEAddress, meteringState_t * meter ) {
+    meteringFormat_t * format = &meter->format;
     /* Check that this is an electricity meter */
 
     // Must have received multiplers and divisors first before we start reporting
-    if (!eAcVoltageMultiplier) return;
-    if (!eAcCurrentMultiplier) return;
-    if (!eAcPowerMultiplier  ) return;
-    if (!eAcVoltageDivisor)    return;
-    if (!eAcCurrentDivisor)    return;
-    if (!eAcPowerDivisor)      return;
-
-    uint64_t voltage = ( eRmsVoltage  * eAcVoltageMultiplier ) / eAcVoltageDivisor;
-    uint64_t current = ( eRmsCurrent  * eAcCurrentMultiplier * 1000 ) / eAcCurrentDivisor;  // mA
-    uint64_t power   = ( eActivePower * eAcPowerMultiplier   ) / eAcPowerDivisor;
-
-    printf( "Plug details: %d Hz, %d V, %d mA, %d W\n",
-            (int)eAcFrequency, (int)voltage, (int)current, (int)power );
+    if (!format->acVoltageMultiplier) return;
+    if (!format->acCurrentMultiplier) return;
+    if (!format->acPowerMultiplier  ) return;
+    if (!format->acVoltageDivisor)    return;
+    if (!format->acCurrentDivisor)    return;
+    if (!format->acPowerDivisor)      return;
+
+    uint64_t voltage = ( meter->rmsVoltage  * format->acVoltageMultiplier ) / format->acVoltageDivisor;
+    uint64_t current = ( meter->rmsCurrent  * format->acCurrentMultiplier * 1000 ) / format->acCurrentDivisor;  // mA
+    uint64_t power   = ( meter->activePower * format->acPowerMultiplier   ) / format->acPowerDivisor;
+
+    printf( "Plug details %016llx: %d Hz, %d V, %d mA, %d W\n", (unsigned long long)u64IEEEAddress,
+            (int)meter->acFrequency, (int)voltage, (int)current, (int)power );
 }
 
 // ------------------------------------------------------------------
@@ -871,279 +822,500 @@ static void handlePlugData2( uint64_t u64IEEEAddress ) {
 // ------------------------------------------------------------------
 
 /**
- * \brief Handles an incoming attribute message
- * \param u16ShortAddress Short address of the device
- * \param u16ClusterID Cluster ID of the attribute
- * \param u16AttributeID Attribute ID
- * \param u64Data Data containes
+ * \brief Handles the on/off attributes of one report
  * \param u8Endpoint Originating endpoint
  */
-void handleAttribute( uint16_t u16ShortAddress,
-                      uint16_t u16ClusterID,
-                      uint16_t u16AttributeID,
-                      uint64_t u64Data,
-                      uint8_t  u8Endpoint ) {
+static void handleOnOff( uint64_t u64IEEEAddress, uint8_t u8Endpoint,
+                         tsZcbAttribute * psAttributes, int iNumAttributes ) {
+    tsZcbAttribute * psOnOff = NULL;
+    int i;
 
-    uint64_t u64IEEEAddress = 0;
+    for ( i=0; i<iNumAttributes; i++ ) {
+        switch ( psAttributes[i].u16AttributeID ) {
+        case E_ZB_ATTRIBUTEID_ONOFF_ONOFF:
+            psOnOff = &psAttributes[i];
+            break;
 
-    u64IEEEAddress = zcbNodeGetExtendedAddress( u16ShortAddress );
+        default:
+            printf( "Received attribute 0x%04x in ONOFF cluster\n", psAttributes[i].u16AttributeID );
+            break;
+        }
+    }
 
-    if ( u64IEEEAddress ) {
-        switch ( u16ClusterID ) {
+    if ( psOnOff ) sendActuatorOnOff( u64IEEEAddress, u8Endpoint, (int)psOnOff->u64Data );
+}
+
+/**
+ * \brief Handles the level control attributes of one report
+ */
+static void handleLevelControl( uint64_t u64IEEEAddress,
+                                tsZcbAttribute * psAttributes, int iNumAttributes ) {
+    tsZcbAttribute * psLevel = NULL;
+    int i;
 
-        case E_ZB_CLUSTERID_ONOFF:
-            switch ( u16AttributeID ) {
-            case E_ZB_ATTRIBUTEID_ONOFF_ONOFF:
-                sendActuatorOnOff( u64IEEEAddress, u8Endpoint, (int)u64Data );
-                break;
+    for ( i=0; i<iNumAttributes; i++ ) {
+        switch ( psAttributes[i].u16AttributeID ) {
+        case E_ZB_ATTRIBUTEID_LEVEL_CURRENTLEVEL:
+            psLevel = &psAttributes[i];
+            break;
 
-            default:
-                printf( "Received attribute 0x%04x in ONOFF cluster\n", u16AttributeID );
-                break;
-            }
+        default:
+            printf( "Received attribute 0x%04x in LEVEL CONTROL cluster\n", psAttributes[i].u16AttributeID );
             break;
+        }
+    }
 
-        case E_ZB_CLUSTERID_LEVEL_CONTROL:
-            switch ( u16AttributeID ) {
-            case E_ZB_ATTRIBUTEID_LEVEL_CURRENTLEVEL:
-                sendActuatorLevel( u64IEEEAddress, (int)u64Data );
-                break;
+    if ( psLevel ) sendActuatorLevel( u64IEEEAddress, (int)psLevel->u64Data );
+}
 
-            default:
-                printf( "Received attribute 0x%04x in LEVEL CONTROL cluster\n", u16AttributeID );
-                break;
-            }
+/**
+ * \brief Handles the thermostat attributes of one report
+ */
+static void handleThermostat( uint64_t u64IEEEAddress,
+                              tsZcbAttribute * psAttributes, int iNumAttributes ) {
+    tsZcbAttribute * psTemperature = NULL, * psCool = NULL, * psHeat = NULL;
+    int i;
+
+    for ( i=0; i<iNumAttributes; i++ ) {
+        switch ( psAttributes[i].u16AttributeID ) {
+        case E_ZB_ATTRIBUTEID_TSTAT_LOCALTEMPERATURE:
+            psTemperature = &psAttributes[i];
             break;
 
-        case E_ZB_CLUSTERID_THERMOSTAT:
-            switch ( u16AttributeID ) {
-            case E_ZB_ATTRIBUTEID_TSTAT_LOCALTEMPERATURE:
-                sendTemperature( u64IEEEAddress, (int)u64Data );
-                break;
-
-            case E_ZB_ATTRIBUTEID_TSTAT_OCCUPIEDCOOLSETPOINT:
-                sendCoolingSetpoint( u64IEEEAddress, (int)u64Data );
-                break;
-
-            case E_ZB_ATTRIBUTEID_TSTAT_OCCUPIEDHEATSETPOINT:
-                sendHeatingSetpoint( u64IEEEAddress, (int)u64Data );
-                break;
-
-            case E_ZB_ATTRIBUTEID_TSTAT_PICOOLINGDEMAND:
-            case E_ZB_ATTRIBUTEID_TSTAT_PIHEATINGDEMAND:
-            case E_ZB_ATTRIBUTEID_TSTAT_COLTROLSEQUENCEOFOPERATION:
-            case E_ZB_ATTRIBUTEID_TSTAT_SYSTEMMODE:
-                // Ignore
-                DEBUG_PRINTF( "Attribute 0x%02x ignored\n", 
-                        u16AttributeID );
-                break;
-
-            default:
-                DEBUG_PRINTF( "Received attribute 0x%04x in TSTAT cluster\n", 
-                        u16AttributeID );
-                break;
-            }
-        break;
+        case E_ZB_ATTRIBUTEID_TSTAT_OCCUPIEDCOOLSETPOINT:
+            psCool = &psAttributes[i];
+            break;
+
+        case E_ZB_ATTRIBUTEID_TSTAT_OCCUPIEDHEATSETPOINT:
+            psHeat = &psAttributes[i];
+            break;
 
-        case E_ZB_CLUSTERID_MEASUREMENTSENSING_ILLUM:
-		     switch ( u16AttributeID ) {
-            case E_ZB_ATTRIBUTEID_MS_ILLUM_MEASURED:			
-                sendIllumination( u64IEEEAddress, (int)u64Data );
-                break;
+        case E_ZB_ATTRIBUTEID_TSTAT_PICOOLINGDEMAND:
+        case E_ZB_ATTRIBUTEID_TSTAT_PIHEATINGDEMAND:
+        case E_ZB_ATTRIBUTEID_TSTAT_COLTROLSEQUENCEOFOPERATION:
+        case E_ZB_ATTRIBUTEID_TSTAT_SYSTEMMODE:
+            // Ignore
+            DEBUG_PRINTF( "Attribute 0x%02x ignored\n", 
+                    psAttributes[i].u16AttributeID );
+            break;
 
-            default:
-                DEBUG_PRINTF( "Received attribute 0x%04x in MS-Illum cluster\n", 
-                        u16AttributeID );
-                break;
-            }
+        default:
+            DEBUG_PRINTF( "Received attribute 0x%04x in TSTAT cluster\n", 
+                    psAttributes[i].u16AttributeID );
             break;
-			
-			
-		// YB analog input
-        case E_ZB_CLUSTERID_ANALOG_INPUT_BASIC:
-		    // on recupere la conso du smart plug
-            sendpowersmartplug( u64IEEEAddress, (int)u64Data );
-
-        break;		
-			
-        /* YB notre cluster */
-        case E_ZB_CLUSTERID_MEASUREMENTSENSING_TEMP:
-		  //  DEBUG_PRINTF( "YB Received attribute ID 0x%04x in MS-Temperature cluster\n", 
-         //               u16AttributeID );
-       
-            switch ( u16AttributeID ) {
-            case E_ZB_ATTRIBUTEID_MS_TEMP_MEASURED:
-			   // DEBUG_PRINTF( "YB send temperature \n");                     
-                sendTemperature( u64IEEEAddress, (int)u64Data );
-                break;
-
-            default:
-                DEBUG_PRINTF( "Received attribute 0x%04x in MS-Temperature cluster\n", 
-                        u16AttributeID );
-                break;
-            }
+        }
+    }
+
+    if ( psTemperature ) sendTemperature( u64IEEEAddress, (int)psTemperature->u64Data );
+    if ( psCool )        sendCoolingSetpoint( u64IEEEAddress, (int)psCool->u64Data );
+    if ( psHeat )        sendHeatingSetpoint( u64IEEEAddress, (int)psHeat->u64Data );
+}
+
+/**
+ * \brief Handles the illuminance measurement attributes of one report
+ */
+static void handleIllumination( uint64_t u64IEEEAddress,
+                                tsZcbAttribute * psAttributes, int iNumAttributes ) {
+    tsZcbAttribute * psMeasured = NULL;
+    int i;
+
+    for ( i=0; i<iNumAttributes; i++ ) {
+        switch ( psAttributes[i].u16AttributeID ) {
+        case E_ZB_ATTRIBUTEID_MS_ILLUM_MEASURED:
+            psMeasured = &psAttributes[i];
+            break;
+
+        default:
+            DEBUG_PRINTF( "Received attribute 0x%04x in MS-Illum cluster\n", 
+                    psAttributes[i].u16AttributeID );
             break;
+        }
+    }
 
-        case E_ZB_CLUSTERID_MEASUREMENTSENSING_HUM:
-            switch ( u16AttributeID ) {
-            case E_ZB_ATTRIBUTEID_MS_HUM_MEASURED:
-                sendHumidity( u64IEEEAddress, (int)u64Data );
-                break;
+    if ( psMeasured ) sendIllumination( u64IEEEAddress, (int)psMeasured->u64Data );
+}
 
-            default:
-                DEBUG_PRINTF( "Received attribute 0x%04x in MS-Humidity cluster\n", 
-                        u16AttributeID );
-                break;
-            }
+/**
+ * \brief Handles the temperature measurement attributes of one report
+ */
+static void handleTemperature( uint64_t u64IEEEAddress,
+                               tsZcbAttribute * psAttributes, int iNumAttributes ) {
+    tsZcbAttribute * psMeasured = NULL;
+    int i;
+
+    for ( i=0; i<iNumAttributes; i++ ) {
+        switch ( psAttributes[i].u16AttributeID ) {
+        case E_ZB_ATTRIBUTEID_MS_TEMP_MEASURED:
+            psMeasured = &psAttributes[i];
+            break;
+
+        default:
+            DEBUG_PRINTF( "Received attribute 0x%04x in MS-Temperature cluster\n", 
+                    psAttributes[i].u16AttributeID );
+            break;
+        }
+    }
+
+    if ( psMeasured ) sendTemperature( u64IEEEAddress, (int)psMeasured->u64Data );
+}
+
+/**
+ * \brief Handles the humidity measurement attributes of one report
+ */
+static void handleHumidity( uint64_t u64IEEEAddress,
+                            tsZcbAttribute * psAttributes, int iNumAttributes ) {
+    tsZcbAttribute * psMeasured = NULL;
+    int i;
+
+    for ( i=0; i<iNumAttributes; i++ ) {
+        switch ( psAttributes[i].u16AttributeID ) {
+        case E_ZB_ATTRIBUTEID_MS_HUM_MEASURED:
+            psMeasured = &psAttributes[i];
+            break;
+
+        default:
+            DEBUG_PRINTF( "Received attribute 0x%04x in MS-Humidity cluster\n", 
+                    psAttributes[i].u16AttributeID );
+            break;
+        }
+    }
+
+    if ( psMeasured ) sendHumidity( u64IEEEAddress, (int)psMeasured->u64Data );
+}
+
+/**
+ * \brief Handles the occupancy sensing attributes of one report
+ */
+static void handleOccupancy( uint64_t u64IEEEAddress,
+                             tsZcbAttribute * psAttributes, int iNumAttributes ) {
+    tsZcbAttribute * psOccupancy = NULL;
+    int i;
+
+    for ( i=0; i<iNumAttributes; i++ ) {
+        switch ( psAttributes[i].u16AttributeID ) {
+        case E_ZB_ATTRIBUTEID_MS_OCC_OCCUPANCY:
+            psOccupancy = &psAttributes[i];
             break;
 
+        default:
+            printf( "Received attribute 0x%04x in OCCUPANCY_SENSING cluster\n",
+                    psAttributes[i].u16AttributeID );
+            break;
+        }
+    }
 
+    if ( psOccupancy ) {
+        DEBUG_PRINTF( "Occupancy 0x%02x\n", (unsigned int)psOccupancy->u64Data );
+        sendOccupancy( u64IEEEAddress, (unsigned int)psOccupancy->u64Data );
+    }
+}
+
+/**
+ * \brief Logs the attributes of one report of a cluster that is not handled
+ * \param u16ClusterID Cluster ID of the attributes
+ */
+static void handleOther( uint16_t u16ClusterID,
+                         tsZcbAttribute * psAttributes, int iNumAttributes ) {
+    int i;
+
+    for ( i=0; i<iNumAttributes; i++ ) {
+        uint16_t u16AttributeID = psAttributes[i].u16AttributeID;
+
+        switch ( u16ClusterID ) {
         // YB lamp hue
         case E_ZB_CLUSTERID_ZLL_COMMISIONING :
-                DEBUG_PRINTF( "Received attribute 0x%04x in Commisionning ZLL cluster\n", 
-                        u16AttributeID );
-                break;
-
-        case E_ZB_CLUSTERID_SIMPLE_METERING:
-            // Note: this implementation assumes that E_ZB_ATTRIBUTEID_SM_INSTANTANEOUS_DEMAND is always sent
-            // by a plug and handled as the last attribute from the incoming Simple Metering message
-            switch ( u16AttributeID ) {
-            case E_ZB_ATTRIBUTEID_SM_METERING_DEVICE_TYPE:
-                DEBUG_PRINTF( "Device type 0x%04x\n", (int)u64Data );
-                eMeteringDeviceType = (int)u64Data;
-                break;
-
-            case E_ZB_ATTRIBUTEID_SM_UNIT_OF_MEASURE:
-                DEBUG_PRINTF( "Unit of measure 0x%04x\n", (int)u64Data );
-                eUnitOfMeasure = (int)u64Data;
-                break;
-
-            case E_ZB_ATTRIBUTEID_SM_MULTIPLIER:
-                DEBUG_PRINTF( "Mutltiplier 0x%04x\n", (int)u64Data );
-                eMultiplier = (int)u64Data;
-                break;
-
-            case E_ZB_ATTRIBUTEID_SM_DIVISOR:
-                DEBUG_PRINTF( "Divisor 0x%04x\n", (int)u64Data );
-                eDivisor = (int)u64Data;
-                break;
-
-            case E_ZB_ATTRIBUTEID_SM_CURRENT_SUMMATION_DELIVERED:
-                DEBUG_PRINTF( "Summation delivered 0x%04x\n", (int)u64Data );
-                eSummationDelivered = (int)u64Data;
-                break;
-
-            case E_ZB_ATTRIBUTEID_SM_INSTANTANEOUS_DEMAND:
-                DEBUG_PRINTF( "Instantaneous demand 0x%04x\n", (int)u64Data );
-                eInstantaneousDemand = (int)u64Data;
-                
-                // Assumption: All relevant attributes have been reported
-                handlePlugData(u64IEEEAddress);
-                break;
-
-            case E_ZB_ATTRIBUTEID_SM_SUMMATION_FORMATTING:
-                DEBUG_PRINTF( "Summation formatting 0x%04x\n", (int)u64Data );
-                break;
-
-            case E_ZB_ATTRIBUTEID_SM_STATUS:
-                DEBUG_PRINTF( "Status 0x%04x\n", (int)u64Data );
-                break;
-
-            default:
-                DEBUG_PRINTF( ">>>>>>> Received attribute 0x%04x in SimpleMetering cluster\n", 
-                        u16AttributeID );
-                break;
-            }
+            DEBUG_PRINTF( "Received attribute 0x%04x in Commisionning ZLL cluster\n", 
+                    u16AttributeID );
             break;
-            
-            
-        case E_ZB_CLUSTERID_ELECTRICAL_MEASUREMENT:
-            // Note: this implementation assumes that E_ZB_ATTRIBUTEID_EM_AC_POWER_DIVISOR is always sent
-            // by a plug and handled as the last attribute from the incoming Electrical Measurement message
-            switch ( u16AttributeID ) {
-            case E_ZB_ATTRIBUTEID_EM_MEASUREMENT_TYPE:
-                DEBUG_PRINTF( "Measurement type 0x%04x\n", (int)u64Data );
-                break;
-            case E_ZB_ATTRIBUTEID_EM_AC_FREQUENCY:
-                DEBUG_PRINTF( "AC frequency 0x%04x\n", (int)u64Data );
-                eAcFrequency = (int)u64Data;
-                break;
-            case E_ZB_ATTRIBUTEID_EM_RMS_VOLTAGE:
-                DEBUG_PRINTF( "RMS voltage 0x%04x\n", (int)u64Data );
-                eRmsVoltage = (int)u64Data;
-                break;
-            case E_ZB_ATTRIBUTEID_EM_RMS_CURRENT:
-                DEBUG_PRINTF( "RMS current 0x%04x\n", (int)u64Data );
-                eRmsCurrent = (int)u64Data;
-                break;
-            case E_ZB_ATTRIBUTEID_EM_ACTIVE_POWER:
-                DEBUG_PRINTF( "Active power 0x%04x\n", (int)u64Data );
-                eActivePower = (int)u64Data;
-                break;
-            case E_ZB_ATTRIBUTEID_EM_REACTIVE_POWER:
-                DEBUG_PRINTF( "Re-active power 0x%04x\n", (int)u64Data );
-                break;
-            case E_ZB_ATTRIBUTEID_EM_APPARANT_POWER:
-                DEBUG_PRINTF( "Apparent power 0x%04x\n", (int)u64Data );
-                break;
-            case E_ZB_ATTRIBUTEID_EM_POWER_FACTOR:
-                DEBUG_PRINTF( "Power factor 0x%04x\n", (int)u64Data );
-                ePowerFactor = (int)u64Data;
-                break;
-            case E_ZB_ATTRIBUTEID_EM_AC_VOLTAGE_MULTIPLIER:
-                DEBUG_PRINTF( "AC voltage multiplier 0x%04x\n", (int)u64Data );
-                eAcVoltageMultiplier = (int)u64Data;
-                break;
-            case E_ZB_ATTRIBUTEID_EM_AC_VOLTAGE_DIVISOR:
-                DEBUG_PRINTF( "AC voltage divisor 0x%04x\n", (int)u64Data );
-                eAcVoltageDivisor = (int)u64Data;
-                break;
-            case E_ZB_ATTRIBUTEID_EM_AC_CURRENT_MULTIPLIER:
-                DEBUG_PRINTF( "AC current multiplier 0x%04x\n", (int)u64Data );
-                eAcCurrentMultiplier = (int)u64Data;
-                break;
-            case E_ZB_ATTRIBUTEID_EM_AC_CURRENT_DIVISOR:
-                DEBUG_PRINTF( "AC current divisor 0x%04x\n", (int)u64Data );
-                eAcCurrentDivisor = (int)u64Data;
-                break;
-            case E_ZB_ATTRIBUTEID_EM_AC_POWER_MULTIPLIER:
-                DEBUG_PRINTF( "AC power multiplier 0x%04x\n", (int)u64Data );
-                eAcPowerMultiplier = (int)u64Data;
-                break;
-            case E_ZB_ATTRIBUTEID_EM_AC_POWER_DIVISOR:
-                DEBUG_PRINTF( "AC power divisor 0x%04x\n", (int)u64Data );
-                eAcPowerDivisor = (int)u64Data;
-
-                // Assumption: All relevant attributes have been reported
-                handlePlugData2( u64IEEEAddress );
-                break;
+
+        case E_ZB_CLUSTERID_BASIC:
+            if ( psAttributes[i].pu8String ) {
+                DEBUG_PRINTF( "Basic attribute 0x%04x: %.*s\n", u16AttributeID,
+                        (int)psAttributes[i].u64Data, (char *)psAttributes[i].pu8String );
+            } else {
+                DEBUG_PRINTF( "Basic attribute 0x%04x: 0x%llx\n", u16AttributeID,
+                        (unsigned long long)psAttributes[i].u64Data );
             }
             break;
 
+        default:
+            printf( "Received attribute 0x%04x in cluster 0x%04x\n", 
+                    u16AttributeID, u16ClusterID );
+            break;
+        }
+    }
+}
+
+/**
+ * \brief Handles the simple metering attributes of one report. The values
+ * are only converted once all of them are in, in whatever order they came
+ * \param meter Metering state of the device
+ */
+static void handleMetering( uint64_t u64IEEEAddress, meteringState_t * meter,
+                            tsZcbAttribute * psAttributes, int iNumAttributes ) {
+    meteringFormat_t * format = &meter->format;
+    int i, values = 0;
+
+    for ( i=0; i<iNumAttributes; i++ ) {
+        uint64_t u64Data = psAttributes[i].u64Data;
+
+        switch ( psAttributes[i].u16AttributeID ) {
+        case E_ZB_ATTRIBUTEID_SM_METERING_DEVICE_TYPE:
+            DEBUG_PRINTF( "Device type 0x%04x\n", (int)u64Data );
+            format->deviceType = (int)u64Data;
+            break;
+
+        case E_ZB_ATTRIBUTEID_SM_UNIT_OF_MEASURE:
+            DEBUG_PRINTF( "Unit of measure 0x%04x\n", (int)u64Data );
+            format->unitOfMeasure = (int)u64Data;
+            break;
+
+        case E_ZB_ATTRIBUTEID_SM_MULTIPLIER:
+            DEBUG_PRINTF( "Mutltiplier 0x%04x\n", (int)u64Data );
+            format->multiplier = (int)u64Data;
+            break;
+
+        case E_ZB_ATTRIBUTEID_SM_DIVISOR:
+            DEBUG_PRINTF( "Divisor 0x%04x\n", (int)u64Data );
+            format->divisor = (int)u64Data;
+            break;
+
+        case E_ZB_ATTRIBUTEID_SM_CURRENT_SUMMATION_DELIVERED:
+            DEBUG_PRINTF( "Summation delivered 0x%04x\n", (int)u64Data );
+            meter->summationDelivered = (int)u64Data;
+            values++;
+            break;
 
-           case E_ZB_CLUSTERID_OCCUPANCYSENSING:
-           {
-             switch ( u16AttributeID )
-             {
-               case E_ZB_ATTRIBUTEID_MS_OCC_OCCUPANCY:
-                 DEBUG_PRINTF( "Occupancy 0x%02x\n", (unsigned int)u64Data );
-                 sendOccupancy( u64IEEEAddress, (unsigned int)u64Data );
-                 break;
+        case E_ZB_ATTRIBUTEID_SM_INSTANTANEOUS_DEMAND:
+            DEBUG_PRINTF( "Instantaneous demand 0x%04x\n", (int)u64Data );
+            meter->instantaneousDemand = (int)u64Data;
+            values++;
+            break;
 
-             default:
-                 printf("Received attribute 0x%04x in OCCUPANCY_SENSING cluster\n",
-                     u16AttributeID);
-                 break;
-             }
-             break;
-           }
+        case E_ZB_ATTRIBUTEID_SM_SUMMATION_FORMATTING:
+            DEBUG_PRINTF( "Summation formatting 0x%04x\n", (int)u64Data );
+            break;
+
+        case E_ZB_ATTRIBUTEID_SM_STATUS:
+            DEBUG_PRINTF( "Status 0x%04x\n", (int)u64Data );
+            break;
 
         default:
-            printf( "Received attribute 0x%04x in cluster 0x%04x\n", 
-                    u16AttributeID, u16ClusterID );
+            DEBUG_PRINTF( ">>>>>>> Received attribute 0x%04x in SimpleMetering cluster\n", 
+                    psAttributes[i].u16AttributeID );
+            break;
+        }
+    }
+
+    if ( values ) handlePlugData( u64IEEEAddress, meter );
+}
+
+/**
+ * \brief Handles the electrical measurement attributes of one report
+ * \param meter Metering state of the device
+ */
+static void handleElectricalMeasurement( uint64_t u64IEEEAddress, meteringState_t * meter,
+                                         tsZcbAttribute * psAttributes, int iNumAttributes ) {
+    meteringFormat_t * format = &meter->format;
+    int i, values = 0;
+
+    for ( i=0; i<iNumAttributes; i++ ) {
+        uint64_t u64Data = psAttributes[i].u64Data;
+
+        switch ( psAttributes[i].u16AttributeID ) {
+        case E_ZB_ATTRIBUTEID_EM_MEASUREMENT_TYPE:
+            DEBUG_PRINTF( "Measurement type 0x%04x\n", (int)u64Data );
+            break;
+        case E_ZB_ATTRIBUTEID_EM_AC_FREQUENCY:
+            DEBUG_PRINTF( "AC frequency 0x%04x\n", (int)u64Data );
+            meter->acFrequency = (int)u64Data;
+            break;
+        case E_ZB_ATTRIBUTEID_EM_RMS_VOLTAGE:
+            DEBUG_PRINTF( "RMS voltage 0x%04x\n", (int)u64Data );
+            meter->rmsVoltage = (int)u64Data;
+            values++;
+            break;
+        case E_ZB_ATTRIBUTEID_EM_RMS_CURRENT:
+            DEBUG_PRINTF( "RMS current 0x%04x\n", (int)u64Data );
+            meter->rmsCurrent = (int)u64Data;
+            values++;
+            break;
+        case E_ZB_ATTRIBUTEID_EM_ACTIVE_POWER:
+            DEBUG_PRINTF( "Active power 0x%04x\n", (int)u64Data );
+            meter->activePower = (int)u64Data;
+            values++;
+            break;
+        case E_ZB_ATTRIBUTEID_EM_REACTIVE_POWER:
+            DEBUG_PRINTF( "Re-active power 0x%04x\n", (int)u64Data );
+            break;
+        case E_ZB_ATTRIBUTEID_EM_APPARANT_POWER:
+            DEBUG_PRINTF( "Apparent power 0x%04x\n", (int)u64Data );
+            break;
+        case E_ZB_ATTRIBUTEID_EM_POWER_FACTOR:
+            DEBUG_PRINTF( "Power factor 0x%04x\n", (int)u64Data );
+            meter->powerFactor = (int)u64Data;
+            break;
+        case E_ZB_ATTRIBUTEID_EM_AC_VOLTAGE_MULTIPLIER:
+            DEBUG_PRINTF( "AC voltage multiplier 0x%04x\n", (int)u64Data );
+            format->acVoltageMultiplier = (int)u64Data;
+            break;
+        case E_ZB_ATTRIBUTEID_EM_AC_VOLTAGE_DIVISOR:
+            DEBUG_PRINTF( "AC voltage divisor 0x%04x\n", (int)u64Data );
+            format->acVoltageDivisor = (int)u64Data;
+            break;
+        case E_ZB_ATTRIBUTEID_EM_AC_CURRENT_MULTIPLIER:
+            DEBUG_PRINTF( "AC current multiplier 0x%04x\n", (int)u64Data );
+            format->acCurrentMultiplier = (int)u64Data;
+            break;
+        case E_ZB_ATTRIBUTEID_EM_AC_CURRENT_DIVISOR:
+            DEBUG_PRINTF( "AC current divisor 0x%04x\n", (int)u64Data );
+            format->acCurrentDivisor = (int)u64Data;
+            break;
+        case E_ZB_ATTRIBUTEID_EM_AC_POWER_MULTIPLIER:
+            DEBUG_PRINTF( "AC power multiplier 0x%04x\n", (int)u64Data );
+            format->acPowerMultiplier = (int)u64Data;
+            break;
+        case E_ZB_ATTRIBUTEID_EM_AC_POWER_DIVISOR:
+            DEBUG_PRINTF( "AC power divisor 0x%04x\n", (int)u64Data );
+            format->acPowerDivisor = (int)u64Data;
             break;
         }
     }
+
+    if ( values ) handlePlugData2( u64IEEEAddress, meter );
+}
+
+/**
+ * \brief Handles all attributes of an incoming report at once, so that
+ * a report with several values results in a single update. Every cluster
+ * handler gets the whole report, and sends the last value of an attribute
+ * that comes more than once
+ * \param u16ShortAddress Short address of the device
+ * \param u16ClusterID Cluster ID of the attributes
+ * \param u8Endpoint Originating endpoint
+ * \param psAttributes Attribute IDs and data, in the order of the report
+ * \param iNumAttributes Number of attributes
+ */
+void handleAttributes( uint16_t u16ShortAddress,
+                       uint16_t u16ClusterID,
+                       uint8_t  u8Endpoint,
+                       tsZcbAttribute * psAttributes,
+                       int      iNumAttributes ) {
+
+    uint64_t u64IEEEAddress = devcacheGetExtendedAddress( u16ShortAddress );
+    meteringState_t meter;
+
+    if ( !u64IEEEAddress ) return;
+
+    switch ( u16ClusterID ) {
+    case E_ZB_CLUSTERID_SIMPLE_METERING:
+        // The formatting is kept per device, a plug only has to report it once
+        meteringGet( u16ShortAddress, u64IEEEAddress, &meter );
+        handleMetering( u64IEEEAddress, &meter, psAttributes, iNumAttributes );
+        meteringPut( &meter );
+        break;
+
+    case E_ZB_CLUSTERID_ELECTRICAL_MEASUREMENT:
+        meteringGet( u16ShortAddress, u64IEEEAddress, &meter );
+        handleElectricalMeasurement( u64IEEEAddress, &meter, psAttributes, iNumAttributes );
+        meteringPut( &meter );
+        break;
+
+    case E_ZB_CLUSTERID_ONOFF:
+        handleOnOff( u64IEEEAddress, u8Endpoint, psAttributes, iNumAttributes );
+        break;
+
+    case E_ZB_CLUSTERID_LEVEL_CONTROL:
+        handleLevelControl( u64IEEEAddress, psAttributes, iNumAttributes );
+        break;
+
+    case E_ZB_CLUSTERID_THERMOSTAT:
+        handleThermostat( u64IEEEAddress, psAttributes, iNumAttributes );
+        break;
+
+    case E_ZB_CLUSTERID_MEASUREMENTSENSING_ILLUM:
+        handleIllumination( u64IEEEAddress, psAttributes, iNumAttributes );
+        break;
+
+    // YB analog input: the power of the smart plug
+    case E_ZB_CLUSTERID_ANALOG_INPUT_BASIC:
+        if ( iNumAttributes > 0 ) {
+            sendpowersmartplug( u64IEEEAddress, (int)psAttributes[iNumAttributes-1].u64Data );
+        }
+        break;
+
+    case E_ZB_CLUSTERID_MEASUREMENTSENSING_TEMP:
+        handleTemperature( u64IEEEAddress, psAttributes, iNumAttributes );
+        break;
+
+    case E_ZB_CLUSTERID_MEASUREMENTSENSING_HUM:
+        handleHumidity( u64IEEEAddress, psAttributes, iNumAttributes );
+        break;
+
+    case E_ZB_CLUSTERID_OCCUPANCYSENSING:
+        handleOccupancy( u64IEEEAddress, psAttributes, iNumAttributes );
+        break;
+
+    default:
+        handleOther( u16ClusterID, psAttributes, iNumAttributes );
+        break;
+    }
+}
+
+// -------------------------------------------------------------
+// Event loop callbacks
+// -------------------------------------------------------------
+
+/** SIGINT/SIGTERM arrive through the event loop: clear the running flag and stop the loop. */
+static void onQuit( void * user, uint32_t sig )
+{
+    DEBUG_PRINTF( "Got signal %d\n", sig);
+
+    /* Signal main loop to exit */
+    bRunning = 0;
+    evloopStop();
+}
+
+/** Sends the coalesced lamp commands that are due and re-arms the timer for the next one */
+static void onFlush( void * user, uint32_t expirations )
+{
+    evloopSetTimer( flushTimer, lmpgrp_Flush(), 0 );
+}
+
+static void onLinkStats( void * user, uint32_t expirations )
+{
+    zcbLogLinkStats();
+}
+
+/** Handles one message from the ZCB-IN queue: binary IoT messages or a line of JSON */
+static void onQueueMessage( void * user, char * inputBuffer, int numBytes )
+{
+    json_parser_t * parser = (json_parser_t *)user;
+
+    if ( numBytes > 0 ) {
+#ifdef MAIN_DEBUG
+        dump( inputBuffer, numBytes );
+#endif
+
+        if ( iotMsgIsBinary( inputBuffer, numBytes ) ) {
+            // Binary messages are only turned into text for the log
+            char logBuffer[2*INPUTBUFFERLEN];
+            iotMsgToJson( inputBuffer, numBytes, logBuffer, sizeof( logBuffer ) );
+            newLogAdd( NEWLOG_FROM_ZCB_IN, logBuffer );
+
+            iotMsgDecode( inputBuffer, numBytes, &zcb_callbacks, NULL );
+        } else {
+            newLogAdd( NEWLOG_FROM_ZCB_IN, inputBuffer );
+
+            // Reset parser (each line is one command)
+            jsonParserReset( parser );
+
+            jsonParserEatBuffer( parser, inputBuffer, numBytes );
+        }
+    }
+
+    // Commands may have queued lamp updates
+    evloopSetTimer( flushTimer, lmpgrp_Flush(), 0 );
 }
 
 // ------------------------------------------------------------------
@@ -1158,18 +1330,49 @@ void handleAttribute( uint16_t u16ShortAddress,
  * initializes the JSON parsers,
  * and waits for incoming queue messages to parse and handle.
  * \param argc Number of command-line parameters
- * \param argv Parameter list (-h = help, -a = set auto-insert, -c = empty DB and exit immediately)
+ * \param argv Parameter list (-s <device> = serial port of the control bridge, default SERIAL_PORT,
+ * -c <file> = capture the serial traffic, -r <file> = replay a capture instead of using the serial port,
+ * -x <speed> = replay speed up, 0 = as fast as possible, default 1)
  */
 
 int main(int argc, char *argv[])
 {    
-    /* Install signal handlers */
-    signal(SIGTERM, vQuitSignalHandler);
-    signal(SIGINT, vQuitSignalHandler);
-    
+    char * szSerialPort = SERIAL_PORT;
+    char * szCapture    = NULL;
+    char * szReplay     = NULL;
+    int    replaySpeed  = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:c:r:x:")) != -1) {
+        switch (opt) {
+        case 's': szSerialPort = optarg;       break;
+        case 'c': szCapture    = optarg;       break;
+        case 'r': szReplay     = optarg;       break;
+        case 'x': replaySpeed  = atoi(optarg); break;
+        }
+    }
+
+    /* Signals are handled by the event loop. This blocks them, so it has to
+       happen before the serial link threads are started */
+    if ( evloopInit() < 0 ) {
+        return 1;
+    }
+    evloopAddSignal( SIGTERM, onQuit, NULL );
+    evloopAddSignal( SIGINT, onQuit, NULL );
+    devcacheInit();
+
     newDbOpen();
+    meteringInit();
      
-    if (eZCB_Init(SERIAL_PORT, SERIAL_BAUDRATE) != E_ZCB_OK) {
+    if (szReplay) {
+        if (eZCB_InitReplay(szReplay, replaySpeed) != E_ZCB_OK) {
+            goto finish;
+        }
+    } else if (eZCB_Init(szSerialPort, SERIAL_BAUDRATE) != E_ZCB_OK) {
+        goto finish;
+    }
+
+    if (szCapture && eSL_CaptureStart(szCapture) != E_SL_OK) {
         goto finish;
     }
 
@@ -1177,31 +1380,27 @@ int main(int argc, char *argv[])
         /* Keep attempting to connect to the control bridge */
         if (eZCB_EstablishComms() == E_ZCB_OK) {
             // Wait for initial messages from control bridge
-            if (IOT_SLEEP(2)) {
+            if ( !evloopRun( 2000 ) ) {
                 goto finish;
             }
-            
+
             break;
         }
+        // Pick up a quit signal between attempts
+        evloopRun( 0 );
+    }
+    if ( !bRunning ) {
+        goto finish;
     }
-
-    int i;
-    int numBytes = 0;
 
     newLogAdd( NEWLOG_FROM_ZCB_OUT, "ZCB-out started" );
     newLogAdd( NEWLOG_FROM_ZCB_IN, "ZCB-in started" );
 
     int zcbQueue;
-    if ( ( zcbQueue = queueOpen( QUEUE_KEY_ZCB_IN, 0 ) ) != -1 ) {
+    json_parser_t * parser = jsonParserCreate();
+    if ( parser && ( zcbQueue = queueOpen( QUEUE_KEY_ZCB_IN, 0 ) ) != -1 ) {
 
-        jsonSetOnError( zcb_onError );
-        jsonSetOnObjectStart( zcb_onObjectStart );
-        jsonSetOnObjectComplete( zcb_onObjectComplete );
-        jsonSetOnArrayStart( zcb_onArrayStart );
-        jsonSetOnArrayComplete( zcb_onArrayComplete );
-        jsonSetOnString( zcb_onString );
-        jsonSetOnInteger( zcb_onInteger );
-        jsonReset();
+        jsonParserSetCallbacks( parser, &zcb_callbacks, NULL );
 
         DEBUG_PRINTF( "Init parsers ...\n" );
 
@@ -1213,49 +1412,28 @@ int main(int argc, char *argv[])
         topoInit();
         tunnelInit();
 
-        printf( "Going to read from data queue endlessly...\n\n" );
-        
-        int start = 0;
-
-        while ( bRunning ) {
-            numBytes = queueReadWithMsecTimeout( zcbQueue,
-                              inputBuffer, INPUTBUFFERLEN, 4000 );
-            if ( numBytes > 0 ) {
-#ifdef MAIN_DEBUG
-                dump( inputBuffer, numBytes );
-#endif
+        // The topology is scanned in the background
+        scannerStart();
 
-                newLogAdd( NEWLOG_FROM_ZCB_IN, inputBuffer );
+        printf( "Going to read from data queue endlessly...\n\n" );
 
-                // Reset parser (each line is one command)
-                jsonReset();
+        // The loop does not own the serial port: serial RX stays on the
+        // SerialLink reader thread and workers, because the commands sent
+        // from onQueueMessage block until it delivers the bridge's status
+        // and response (see evloop.c)
+        flushTimer = evloopAddTimer( onFlush, NULL );
+        int linkStatsTimer = evloopAddTimer( onLinkStats, NULL );
+        evloopSetTimer( linkStatsTimer, LINKSTATS_PERIOD * 1000, LINKSTATS_PERIOD * 1000 );
 
-                for ( i=0; i<numBytes; i++ ) {
-                    jsonEat( inputBuffer[i] );
-                }
-            } else { 
-                // newLogAdd( NEWLOG_FROM_ZCB_IN, "ZCB-R heartbeat" );
-#if 1
-                int ret = eZCB_NeighbourTableRequest(start);
-                if ( ret >= 0 )
-                {
-                  /* Request is successful, ask for more */
-                  start = ret;
-                }
-                else
-                {
-                  /* Error, or empty list, or no more entry, or ... */
-                  /* restart from beginning */
-                  start = 0;
-                }
-#else           
-                eGetPermitJoining();
-#endif
-            }
+        if ( evloopAddQueue( zcbQueue, onQueueMessage, parser ) >= 0 ) {
+            evloopRun( -1 );
         }
 
+        scannerStop();
+
         // dispatchClose();
         queueClose( zcbQueue );
+        jsonParserDestroy( parser );
     } else {
         newLogAdd( NEWLOG_FROM_ZCB_IN, "Could not open ZCB queue" );
     }
@@ -1264,9 +1442,12 @@ int main(int argc, char *argv[])
     
     /* Clean up */
     eZCB_Finish();
+    devcacheFlush();
+    meteringSave();
     
 finish:
     DEBUG_PRINTF( "Exiting");
+    evloopDestroy();
     newDbClose();
     return 0;
 }
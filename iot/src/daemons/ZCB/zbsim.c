@@ -0,0 +1,879 @@
+// ------------------------------------------------------------------
+// ZCB simulator
+// ------------------------------------------------------------------
+// Part of gateway_zigbee, licensed under the GNU GPL v3 (see LICENSE)
+// ------------------------------------------------------------------
+
+/** \addtogroup zb
+ * \file
+ * \section zcbsim ZCB-JenOS simulator
+ * \brief Simulates a JN5169 control bridge on a pseudo-terminal, so that
+ * iot_zb can be run (and load tested) without hardware, e.g.:
+ *
+ *    iot_zbsim -l /tmp/ttyZCB -p 20 -L 20 -x 20 -r 10 &
+ *    iot_zb -s /tmp/ttyZCB
+ *
+ * The simulator answers every command with a status message and answers
+ * version, management LQI (for a tree of SIM_FANOUT children per router), simple descriptor, active endpoint, read
+ * attribute, bind and configure reporting requests. Once the host has sent its first command, the
+ * virtual plugs, lamps and Xiaomi sensors are announced and then report
+ * their attributes round-robin at the requested rate.
+ */
+
+#define _GNU_SOURCE             // posix_openpt(), cfmakeraw()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <endian.h>
+#include <arpa/inet.h>
+
+#include "SerialLink.h"
+#include "ZigbeeConstant.h"
+#include "ZigbeeDevices.h"
+#include "zcb.h"
+
+// -------------------------------------------------------------
+// Macros
+// -------------------------------------------------------------
+
+/*#define SIM_DEBUG*/
+
+#ifdef SIM_DEBUG
+#define DEBUG_PRINTF(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_PRINTF(...)
+#endif /* SIM_DEBUG */
+
+#define SIM_LINK              "/tmp/ttyZCB"
+#define SIM_VERSION           0x00030001     // Reported as r3.1
+#define SIM_PAN_ID            0x1234567887654321ULL
+#define SIM_IEEE_BASE         0x00158D0000000000ULL
+#define SIM_SHORT_BASE        0x1000
+#define SIM_MAX_DEVICES       1024
+#define SIM_LQI_ENTRIES       2              // Neighbours per LQI response
+#define SIM_FANOUT            8              // Children per router in the simulated tree
+
+#define SIM_START_CHAR        0x01
+#define SIM_ESC_CHAR          0x02
+#define SIM_END_CHAR          0x03
+#define SIM_MAX_MESSAGE       256
+#define SIM_MAX_FRAME         ( 2 + 2 * ( 5 + SIM_MAX_MESSAGE ) )
+
+#define SIM_WRITE_TIMEOUT_MS  1000
+#define SIM_RESPONSE_DELAY    20             // ms, radio round trip to a device
+#define SIM_MAX_PENDING       64
+#define SIM_STATS_INTERVAL    10             // Seconds
+
+#define SIM_DEVICEID_XIAOMI_HT  0x5F01       // Xiaomi temperature/humidity sensor
+
+#define ZCL_STATUS_UNSUPPORTED_ATTRIBUTE  0x86
+
+// -------------------------------------------------------------
+// Types
+// -------------------------------------------------------------
+
+typedef enum {
+    SIM_PLUG,
+    SIM_LAMP,
+    SIM_SENSOR
+} simKind;
+
+typedef struct simDevice {
+    simKind   kind;
+    uint16_t  u16ShortAddress;
+    uint64_t  u64IEEEAddress;
+    uint8_t   u8Endpoint;
+    uint8_t   u8SequenceNo;
+    int       step;            // Next attribute to report
+    int       described;       // Metering formatting or model reported
+    int       onoff;
+    int       level;
+    int       demand;
+    uint64_t  summation;
+    int       temperature;
+    int       humidity;
+} simDevice_t;
+
+typedef struct simMsg {
+    int       len;
+    uint8_t   data[SIM_MAX_MESSAGE];
+} simMsg_t;
+
+typedef struct simPending {
+    uint64_t  due;
+    uint16_t  type;
+    simMsg_t  msg;
+} simPending_t;
+
+// -------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------
+
+static volatile int bRunning = 1;
+
+static int masterFd = -1;
+static int slaveFd  = -1;
+
+static simDevice_t devices[SIM_MAX_DEVICES];
+static int numDevices = 0;
+
+static uint8_t u8SequenceNo = 0;
+static int hostActive = 0;         // Host has sent a command, streams run
+static int announced  = 0;         // Devices announced in this round
+static int nextReport = 0;         // Device that reports next
+
+// Responses wait for the simulated round trip, in order
+static simPending_t pending[SIM_MAX_PENDING];
+static int pendingHead  = 0;
+static int pendingCount = 0;
+static uint64_t responseDelay = SIM_RESPONSE_DELAY * 1000;
+
+static uint8_t rxFrame[SIM_MAX_FRAME];
+static int     rxLen = -1;         // -1: waiting for a start character
+static int     rxEsc = 0;
+
+static struct {
+    unsigned int commands;
+    unsigned int badFrames;
+    unsigned int frames;
+    unsigned int reports;
+    unsigned int announces;
+} stats;
+
+// -------------------------------------------------------------
+// Helpers
+// -------------------------------------------------------------
+
+static void vQuitSignalHandler( int sig ) {
+    bRunning = 0;
+}
+
+static uint64_t simNow( void ) {
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static simDevice_t * simFindDevice( uint16_t u16ShortAddress ) {
+    int i = u16ShortAddress - SIM_SHORT_BASE;
+    return ( i >= 0 && i < numDevices ) ? &devices[i] : NULL;
+}
+
+static void simPut8( simMsg_t * msg, uint8_t val ) {
+    if ( msg->len < SIM_MAX_MESSAGE ) msg->data[msg->len++] = val;
+}
+
+static void simPut16( simMsg_t * msg, uint16_t val ) {
+    simPut8( msg, val >> 8 );
+    simPut8( msg, val );
+}
+
+static void simPut32( simMsg_t * msg, uint32_t val ) {
+    simPut16( msg, val >> 16 );
+    simPut16( msg, val );
+}
+
+static void simPut64( simMsg_t * msg, uint64_t val ) {
+    simPut32( msg, val >> 32 );
+    simPut32( msg, val );
+}
+
+// -------------------------------------------------------------
+// Serial link framing (see SerialLink.c)
+// -------------------------------------------------------------
+
+static int simEscape( uint8_t * frame, uint8_t byte ) {
+    if ( byte < 0x10 ) {
+        frame[0] = SIM_ESC_CHAR;
+        frame[1] = byte ^ 0x10;
+        return 2;
+    }
+    frame[0] = byte;
+    return 1;
+}
+
+static uint8_t simCrc( uint16_t type, uint16_t len, uint8_t * data ) {
+    uint8_t crc = ( type >> 8 ) ^ ( type & 0xFF ) ^ ( len >> 8 ) ^ ( len & 0xFF );
+    int i;
+    for ( i = 0; i < len; i++ ) crc ^= data[i];
+    return crc;
+}
+
+/**
+ * \brief Writes a frame to the host. When the host does not read (it is
+ * busy, or iot_zb was stopped and the pty filled up) this waits for it
+ */
+static int simWrite( uint8_t * frame, int len ) {
+    int stalled = 0;
+
+    while ( len > 0 && bRunning ) {
+        int n = write( masterFd, frame, len );
+        if ( n > 0 ) {
+            frame += n;
+            len   -= n;
+        } else if ( n < 0 && errno != EINTR && errno != EAGAIN ) {
+            perror( "write" );
+            return -1;
+        } else {
+            struct pollfd pfd = { masterFd, POLLOUT, 0 };
+            if ( poll( &pfd, 1, SIM_WRITE_TIMEOUT_MS ) == 0 && !stalled++ ) {
+                printf( "Host is not reading\n" );
+            }
+        }
+    }
+    return ( len > 0 ) ? -1 : 0;
+}
+
+static int simSend( uint16_t type, simMsg_t * msg ) {
+    uint8_t frame[SIM_MAX_FRAME];
+    int n = 0, i;
+
+    frame[n++] = SIM_START_CHAR;
+    n += simEscape( &frame[n], type >> 8 );
+    n += simEscape( &frame[n], type );
+    n += simEscape( &frame[n], msg->len >> 8 );
+    n += simEscape( &frame[n], msg->len );
+    n += simEscape( &frame[n], simCrc( type, msg->len, msg->data ) );
+    for ( i = 0; i < msg->len; i++ ) {
+        n += simEscape( &frame[n], msg->data[i] );
+    }
+    frame[n++] = SIM_END_CHAR;
+
+    stats.frames++;
+    return simWrite( frame, n );
+}
+
+/**
+ * \brief Queues a response from a device, it is sent after the response
+ * delay (or right away when the delay is 0 or too many are pending)
+ */
+static void simRespond( uint16_t type, simMsg_t * msg ) {
+    simPending_t * resp;
+
+    if ( responseDelay == 0 || pendingCount == SIM_MAX_PENDING ) {
+        simSend( type, msg );
+        return;
+    }
+    resp = &pending[( pendingHead + pendingCount++ ) % SIM_MAX_PENDING];
+    resp->due  = simNow() + responseDelay;
+    resp->type = type;
+    resp->msg  = *msg;
+}
+
+/**
+ * \brief Sends the responses that are due, returns the time until the next
+ * one in ms (-1 if none)
+ */
+static int simSendResponses( uint64_t now ) {
+    while ( pendingCount > 0 && pending[pendingHead].due <= now ) {
+        simSend( pending[pendingHead].type, &pending[pendingHead].msg );
+        pendingHead = ( pendingHead + 1 ) % SIM_MAX_PENDING;
+        pendingCount--;
+    }
+    return pendingCount ? ( pending[pendingHead].due - now ) / 1000 : -1;
+}
+
+// -------------------------------------------------------------
+// Responses
+// -------------------------------------------------------------
+
+static void simStatus( uint8_t seq, uint16_t type, uint8_t status ) {
+    simMsg_t msg = { 0 };
+    simPut8( &msg, status );
+    simPut8( &msg, seq );
+    simPut16( &msg, type );
+    simSend( E_SL_MSG_STATUS, &msg );
+}
+
+/**
+ * \brief Sends a response that only has a sequence number and a status,
+ * e.g. to bind and configure reporting requests
+ */
+static void simResponse( uint16_t type, uint8_t seq ) {
+    simMsg_t msg = { 0 };
+    simPut8( &msg, seq );
+    simPut8( &msg, 0 );
+    simRespond( type, &msg );
+}
+
+static void simVersion( void ) {
+    simMsg_t msg = { 0 };
+    simPut32( &msg, SIM_VERSION );
+    simSend( E_SL_MSG_VERSION_LIST, &msg );
+}
+
+/**
+ * \brief Parent of a device in the simulated tree: the first SIM_FANOUT devices
+ * are children of the coordinator (-1), the next SIM_FANOUT of the first device,
+ * and so on. Sensors are end devices and only get the coordinator as parent.
+ */
+static int simParent( int i ) {
+    int parent = i / SIM_FANOUT - 1;
+    if ( parent < 0 || devices[parent].kind == SIM_SENSOR ) return( -1 );
+    return( parent );
+}
+
+/**
+ * \brief Answers a management LQI request with the children of the target
+ * (the coordinator or a router), SIM_LQI_ENTRIES at a time
+ */
+static void simLqiResponse( uint8_t seq, uint16_t target, int start ) {
+    simMsg_t msg = { 0 };
+    int children[SIM_MAX_DEVICES];
+    int i, size = 0, entries, parent = -1;
+
+    if ( target != 0x0000 ) {
+        simDevice_t * dev = simFindDevice( target );
+        if ( dev == NULL || dev->kind == SIM_SENSOR ) return;
+        parent = dev - devices;
+    }
+    for ( i = 0; i < numDevices; i++ ) {
+        if ( simParent( i ) == parent ) children[size++] = i;
+    }
+
+    entries = size - start;
+    if ( entries < 0 ) entries = 0;
+    if ( entries > SIM_LQI_ENTRIES ) entries = SIM_LQI_ENTRIES;
+
+    simPut8( &msg, seq );
+    simPut8( &msg, CZD_NW_STATUS_SUCCESS );
+    simPut8( &msg, size );
+    simPut8( &msg, entries );
+    simPut8( &msg, start );
+    for ( i = start; i < start + entries; i++ ) {
+        // Bitmap: device type (1 = router, 2 = end device), relationship child
+        simDevice_t * dev = &devices[children[i]];
+        int type = ( dev->kind == SIM_SENSOR ) ? 2 : 1;
+        simPut16( &msg, dev->u16ShortAddress );
+        simPut64( &msg, SIM_PAN_ID );
+        simPut64( &msg, dev->u64IEEEAddress );
+        simPut8( &msg, 1 );
+        simPut8( &msg, 100 + ( rand() % 150 ) );
+        simPut8( &msg, type | ( 1 << 4 ) );
+    }
+    simRespond( E_SL_MSG_MANAGEMENT_LQI_RESPONSE, &msg );
+}
+
+static void simSimpleDescriptor( uint8_t seq, simDevice_t * dev ) {
+    simMsg_t msg = { 0 };
+    int lenPos;
+
+    simPut8( &msg, seq );
+    simPut8( &msg, 0 );
+    simPut16( &msg, dev->u16ShortAddress );
+    lenPos = msg.len;
+    simPut8( &msg, 0 );
+    simPut8( &msg, dev->u8Endpoint );
+    simPut16( &msg, E_ZB_PROFILEID_HA );
+
+    switch ( dev->kind ) {
+    case SIM_PLUG:
+        simPut16( &msg, SIMPLE_DESCR_SMART_PLUG );
+        simPut8( &msg, 1 );
+        simPut8( &msg, 4 );
+        simPut16( &msg, E_ZB_CLUSTERID_BASIC );
+        simPut16( &msg, E_ZB_CLUSTERID_ONOFF );
+        simPut16( &msg, E_ZB_CLUSTERID_SIMPLE_METERING );
+        simPut16( &msg, E_ZB_CLUSTERID_ELECTRICAL_MEASUREMENT );
+        break;
+    case SIM_LAMP:
+        simPut16( &msg, SIMPLE_DESCR_LAMP_COLOUR );
+        simPut8( &msg, 1 );
+        simPut8( &msg, 4 );
+        simPut16( &msg, E_ZB_CLUSTERID_BASIC );
+        simPut16( &msg, E_ZB_CLUSTERID_ONOFF );
+        simPut16( &msg, E_ZB_CLUSTERID_LEVEL_CONTROL );
+        simPut16( &msg, E_ZB_CLUSTERID_COLOR_CONTROL );
+        break;
+    case SIM_SENSOR:
+        simPut16( &msg, SIM_DEVICEID_XIAOMI_HT );
+        simPut8( &msg, 1 );
+        simPut8( &msg, 3 );
+        simPut16( &msg, E_ZB_CLUSTERID_BASIC );
+        simPut16( &msg, E_ZB_CLUSTERID_MEASUREMENTSENSING_TEMP );
+        simPut16( &msg, E_ZB_CLUSTERID_MEASUREMENTSENSING_HUM );
+        break;
+    }
+    simPut8( &msg, 0 );                         // No output clusters
+
+    msg.data[lenPos] = msg.len - lenPos - 1;
+    simRespond( E_SL_MSG_SIMPLE_DESCRIPTOR_RESPONSE, &msg );
+}
+
+static void simActiveEndpoint( uint8_t seq, simDevice_t * dev ) {
+    simMsg_t msg = { 0 };
+    simPut8( &msg, seq );
+    simPut8( &msg, 0 );
+    simPut16( &msg, dev->u16ShortAddress );
+    simPut8( &msg, 1 );
+    simPut8( &msg, dev->u8Endpoint );
+    simRespond( E_SL_MSG_ACTIVE_ENDPOINT_RESPONSE, &msg );
+}
+
+/**
+ * \brief Appends type, status, size and value of an attribute. Values are
+ * sent in the width iot_zb decodes them in (see ZCB_HandleAttributeReport)
+ */
+static void simPutAttribute( simMsg_t * msg, uint8_t type, uint64_t value ) {
+    simPut8( msg, type );
+    simPut8( msg, 0 );
+    switch ( type ) {
+    case E_ZCL_BOOL:
+    case E_ZCL_UINT8:
+    case E_ZCL_ENUM8:
+    case E_ZCL_BMAP8:
+        simPut8( msg, 1 );
+        simPut8( msg, value );
+        break;
+    case E_ZCL_INT16:
+    case E_ZCL_UINT16:
+        simPut8( msg, 2 );
+        simPut16( msg, value );
+        break;
+    case E_ZCL_INT24:
+    case E_ZCL_UINT24:
+    case E_ZCL_UINT32:
+        simPut8( msg, 4 );
+        simPut32( msg, value );
+        break;
+    default:
+        simPut8( msg, 8 );
+        simPut64( msg, value );
+        break;
+    }
+}
+
+/**
+ * \brief Appends type, status, size and value of a character string attribute
+ */
+static void simPutString( simMsg_t * msg, const char * string ) {
+    int i, len = strlen( string );
+    simPut8( msg, E_ZCL_CSTRING );
+    simPut8( msg, 0 );
+    simPut8( msg, len + 1 );
+    simPut8( msg, len );
+    for ( i=0; i<len; i++ ) simPut8( msg, string[i] );
+}
+
+static void simReadAttributes( uint8_t seq, uint8_t * data, int len ) {
+    // Address mode, short address, src/dst endpoint, cluster, direction,
+    // manufacturer specific, manufacturer code, number of attributes, attributes
+    simDevice_t * dev = simFindDevice( ( data[1] << 8 ) | data[2] );
+    uint16_t cluster  = ( data[5] << 8 ) | data[6];
+    int i, num = data[11];
+
+    if ( !dev ) return;
+
+    for ( i = 0; i < num && 12 + 2 * i + 1 < len; i++ ) {
+        uint16_t attr = ( data[12 + 2 * i] << 8 ) | data[13 + 2 * i];
+        simMsg_t msg = { 0 };
+
+        simPut8( &msg, seq );
+        simPut16( &msg, dev->u16ShortAddress );
+        simPut8( &msg, dev->u8Endpoint );
+        simPut16( &msg, cluster );
+        simPut16( &msg, attr );
+        if ( cluster == E_ZB_CLUSTERID_ONOFF && attr == E_ZB_ATTRIBUTEID_ONOFF_ONOFF ) {
+            simPut8( &msg, 0 );
+            simPut8( &msg, E_ZCL_BOOL );
+            simPut16( &msg, 1 );
+            simPut8( &msg, dev->onoff );
+        } else if ( cluster == E_ZB_CLUSTERID_LEVEL_CONTROL && attr == E_ZB_ATTRIBUTEID_LEVEL_CURRENTLEVEL ) {
+            simPut8( &msg, 0 );
+            simPut8( &msg, E_ZCL_UINT8 );
+            simPut16( &msg, 1 );
+            simPut8( &msg, dev->level );
+        } else {
+            simPut8( &msg, ZCL_STATUS_UNSUPPORTED_ATTRIBUTE );
+            simPut8( &msg, 0 );
+            simPut16( &msg, 0 );
+        }
+        simRespond( E_SL_MSG_READ_ATTRIBUTE_RESPONSE, &msg );
+    }
+}
+
+static void simHandleCommand( uint16_t type, uint8_t * data, int len ) {
+    uint8_t seq = u8SequenceNo++;
+    simDevice_t * dev;
+
+    DEBUG_PRINTF( "Command 0x%04X (len %d), seq %d\n", type, len, seq );
+    stats.commands++;
+
+    // The control bridge acknowledges every command first
+    simStatus( seq, type, E_SL_MSG_STATUS_SUCCESS );
+
+    switch ( type ) {
+    case E_SL_MSG_GET_VERSION:
+        simVersion();
+        break;
+
+    case E_SL_MSG_MANAGEMENT_LQI_REQUEST:
+        if ( len >= 3 ) simLqiResponse( seq, ( data[0] << 8 ) | data[1], data[2] );
+        break;
+
+    case E_SL_MSG_SIMPLE_DESCRIPTOR_REQUEST:
+        if ( len >= 3 && ( dev = simFindDevice( ( data[0] << 8 ) | data[1] ) ) ) {
+            simSimpleDescriptor( seq, dev );
+        }
+        break;
+
+    case E_SL_MSG_ACTIVE_ENDPOINT_REQUEST:
+        if ( len >= 2 && ( dev = simFindDevice( ( data[0] << 8 ) | data[1] ) ) ) {
+            simActiveEndpoint( seq, dev );
+        }
+        break;
+
+    case E_SL_MSG_READ_ATTRIBUTE_REQUEST:
+        if ( len >= 12 ) simReadAttributes( seq, data, len );
+        break;
+
+    case E_SL_MSG_BIND:
+        simResponse( E_SL_MSG_BIND_RESPONSE, seq );
+        break;
+
+    case E_SL_MSG_CONFIG_REPORTING_REQUEST:
+        simResponse( E_SL_MSG_CONFIG_REPORTING_RESPONSE, seq );
+        break;
+
+    default:
+        break;
+    }
+
+    if ( !hostActive ) {
+        printf( "Host connected, starting streams\n" );
+        hostActive = 1;
+        announced  = 0;
+    }
+}
+
+static void simRxFrame( uint8_t * frame, int len ) {
+    uint16_t type, length;
+
+    if ( len < 5 ) {
+        stats.badFrames++;
+        return;
+    }
+    type   = ( frame[0] << 8 ) | frame[1];
+    length = ( frame[2] << 8 ) | frame[3];
+    if ( length != len - 5 || frame[4] != simCrc( type, length, &frame[5] ) ) {
+        stats.badFrames++;
+        return;
+    }
+    simHandleCommand( type, &frame[5], length );
+}
+
+static void simRxByte( uint8_t byte ) {
+    if ( byte == SIM_START_CHAR ) {
+        rxLen = 0;
+        rxEsc = 0;
+    } else if ( rxLen < 0 ) {
+        // Not in a frame
+    } else if ( byte == SIM_END_CHAR ) {
+        simRxFrame( rxFrame, rxLen );
+        rxLen = -1;
+    } else if ( byte == SIM_ESC_CHAR ) {
+        rxEsc = 1;
+    } else if ( rxLen < sizeof( rxFrame ) ) {
+        rxFrame[rxLen++] = rxEsc ? byte ^ 0x10 : byte;
+        rxEsc = 0;
+    } else {
+        rxLen = -1;
+    }
+}
+
+// -------------------------------------------------------------
+// Streams
+// -------------------------------------------------------------
+
+static void simAnnounce( simDevice_t * dev ) {
+    simMsg_t msg = { 0 };
+    simPut16( &msg, dev->u16ShortAddress );
+    simPut64( &msg, dev->u64IEEEAddress );
+    simPut8( &msg, ( dev->kind == SIM_SENSOR ) ? 0x80 : 0x8E );
+    stats.announces++;
+    simSend( E_SL_MSG_DEVICE_ANNOUNCE, &msg );
+}
+
+static int simWalk( int value, int step, int min, int max ) {
+    value += ( rand() % ( 2 * step + 1 ) ) - step;
+    return ( value < min ) ? min : ( value > max ) ? max : value;
+}
+
+/**
+ * \brief Sends the next attribute report of a device. Like real devices,
+ * related attributes are sent together in one report: plugs first report
+ * how they format their metering values (W and Wh), once, and then
+ * alternate on/off with summation and instantaneous demand. Sensors
+ * start with their model and power source, as Xiaomi sensors do
+ */
+static void simReport( simDevice_t * dev ) {
+    struct {
+        uint16_t     attr;
+        uint8_t      type;
+        uint64_t     value;
+        const char * string;
+    } records[4];
+    simMsg_t msg = { 0 };
+    uint16_t cluster = E_ZB_CLUSTERID_ONOFF;
+    int i, num = 1;
+
+    records[0].attr   = E_ZB_ATTRIBUTEID_ONOFF_ONOFF;
+    records[0].type   = E_ZCL_BOOL;
+    records[0].value  = dev->onoff;
+    for ( i=0; i<4; i++ ) records[i].string = NULL;
+
+#define SIM_RECORD( a, t, v ) do { records[num].attr = (a); records[num].type = (t); records[num].value = (v); num++; } while ( 0 )
+
+    switch ( dev->kind ) {
+    case SIM_PLUG:
+        if ( dev->step == 0 && !dev->described ) {
+            cluster = E_ZB_CLUSTERID_SIMPLE_METERING;
+            num = 0;
+            SIM_RECORD( E_ZB_ATTRIBUTEID_SM_METERING_DEVICE_TYPE, E_ZCL_BMAP8,  E_CLD_SM_MDT_ELECTRIC );
+            SIM_RECORD( E_ZB_ATTRIBUTEID_SM_UNIT_OF_MEASURE,      E_ZCL_ENUM8,  E_CLD_SM_UOM_KILO_WATTS );
+            SIM_RECORD( E_ZB_ATTRIBUTEID_SM_MULTIPLIER,           E_ZCL_UINT24, 1 );
+            SIM_RECORD( E_ZB_ATTRIBUTEID_SM_DIVISOR,              E_ZCL_UINT24, 1000 );
+            dev->described = 1;
+        } else if ( dev->step == 1 ) {
+            dev->summation += dev->demand;
+            dev->demand = dev->onoff ? simWalk( dev->demand, 50, 0, 3000 ) : 0;
+            cluster = E_ZB_CLUSTERID_SIMPLE_METERING;
+            num = 0;
+            SIM_RECORD( E_ZB_ATTRIBUTEID_SM_CURRENT_SUMMATION_DELIVERED, E_ZCL_UINT48, dev->summation );
+            SIM_RECORD( E_ZB_ATTRIBUTEID_SM_INSTANTANEOUS_DEMAND,        E_ZCL_INT24,  dev->demand );
+        }
+        dev->step = ( dev->step + 1 ) % 2;
+        break;
+
+    case SIM_LAMP:
+        if ( dev->step == 1 ) {
+            dev->level = simWalk( dev->level, 10, 0, 254 );
+            cluster = E_ZB_CLUSTERID_LEVEL_CONTROL;
+            num = 0;
+            SIM_RECORD( E_ZB_ATTRIBUTEID_LEVEL_CURRENTLEVEL, E_ZCL_UINT8, dev->level );
+        }
+        dev->step = ( dev->step + 1 ) % 2;
+        break;
+
+    case SIM_SENSOR:
+        if ( !dev->described ) {
+            cluster = E_ZB_CLUSTERID_BASIC;
+            num = 0;
+            SIM_RECORD( E_ZB_ATTRIBUTEID_BASIC_MODEL_ID, E_ZCL_CSTRING, 0 );
+            records[0].string = "lumi.weather";
+            SIM_RECORD( E_ZB_ATTRIBUTEID_BASIC_POWER_SOURCE, E_ZCL_ENUM8, 3 );  // Battery
+            dev->described = 1;
+        } else if ( dev->step == 0 ) {
+            dev->temperature = simWalk( dev->temperature, 10, -1000, 5000 );
+            cluster = E_ZB_CLUSTERID_MEASUREMENTSENSING_TEMP;
+            num = 0;
+            SIM_RECORD( E_ZB_ATTRIBUTEID_MS_TEMP_MEASURED, E_ZCL_INT16, (uint16_t)dev->temperature );
+            dev->step = 1;
+        } else {
+            dev->humidity = simWalk( dev->humidity, 20, 0, 10000 );
+            cluster = E_ZB_CLUSTERID_MEASUREMENTSENSING_HUM;
+            num = 0;
+            SIM_RECORD( E_ZB_ATTRIBUTEID_MS_HUM_MEASURED, E_ZCL_UINT16, dev->humidity );
+            dev->step = 0;
+        }
+        break;
+    }
+
+#undef SIM_RECORD
+
+    simPut8( &msg, dev->u8SequenceNo++ );
+    simPut16( &msg, dev->u16ShortAddress );
+    simPut8( &msg, dev->u8Endpoint );
+    simPut16( &msg, cluster );
+    for ( i=0; i<num; i++ ) {
+        simPut16( &msg, records[i].attr );
+        if ( records[i].string ) {
+            simPutString( &msg, records[i].string );
+        } else {
+            simPutAttribute( &msg, records[i].type, records[i].value );
+        }
+    }
+    stats.reports++;
+    simSend( E_SL_MSG_ATTRIBUTE_REPORT, &msg );
+}
+
+static void simAddDevices( simKind kind, int num ) {
+    while ( num-- > 0 && numDevices < SIM_MAX_DEVICES ) {
+        simDevice_t * dev = &devices[numDevices];
+        memset( dev, 0, sizeof( simDevice_t ) );
+        dev->kind            = kind;
+        dev->u16ShortAddress = SIM_SHORT_BASE + numDevices;
+        dev->u64IEEEAddress  = SIM_IEEE_BASE + numDevices + 1;
+        dev->u8Endpoint      = ( kind == SIM_LAMP ) ? ZB_ENDPOINT_LAMP : ZB_ENDPOINT_ZHA;
+        dev->onoff           = 1;
+        dev->level           = 128;
+        dev->demand          = 500;
+        dev->temperature     = 2100;
+        dev->humidity        = 5000;
+        numDevices++;
+    }
+}
+
+static void simPrintStats( uint64_t start ) {
+    double secs = ( simNow() - start ) / 1e6;
+    printf( "%.0f s: %u commands (%u bad frames), %u frames sent, %u announces, %u reports (%.0f/s)\n",
+            secs, stats.commands, stats.badFrames, stats.frames, stats.announces,
+            stats.reports, secs > 0 ? stats.reports / secs : 0.0 );
+}
+
+static void usage( char * name ) {
+    printf( "Usage: %s [options]\n", name );
+    printf( "  -l <link>   Symlink to the pseudo-terminal (default %s)\n", SIM_LINK );
+    printf( "  -p <num>    Number of smart plugs (default 1)\n" );
+    printf( "  -L <num>    Number of lamps (default 1)\n" );
+    printf( "  -x <num>    Number of Xiaomi temperature/humidity sensors (default 1)\n" );
+    printf( "  -r <rate>   Attribute reports per second per device (default 1)\n" );
+    printf( "  -a <rate>   Device announces per second (default 10)\n" );
+    printf( "  -A <secs>   Announce all devices again every <secs> (default never)\n" );
+    printf( "  -d <ms>     Delay of responses from devices (default %d)\n", SIM_RESPONSE_DELAY );
+    printf( "  -t <secs>   Stop after <secs> (default never)\n" );
+}
+
+// ------------------------------------------------------------------
+// Main
+// ------------------------------------------------------------------
+
+int main( int argc, char * argv[] ) {
+    char * link = SIM_LINK;
+    int plugs = 1, lamps = 1, sensors = 1;
+    double reportRate = 1, announceRate = 10;
+    int reannounce = 0, duration = 0;
+    uint64_t start, now, nextReportTime = 0, nextAnnounceTime = 0, nextStats, lastAnnounce = 0;
+    uint64_t reportPeriod, announcePeriod;
+    struct termios options;
+    int opt;
+
+    while ( ( opt = getopt( argc, argv, "l:p:L:x:r:a:A:d:t:h" ) ) != -1 ) {
+        switch ( opt ) {
+        case 'l': link          = optarg;                break;
+        case 'p': plugs         = atoi( optarg );        break;
+        case 'L': lamps         = atoi( optarg );        break;
+        case 'x': sensors       = atoi( optarg );        break;
+        case 'r': reportRate    = atof( optarg );        break;
+        case 'a': announceRate  = atof( optarg );        break;
+        case 'A': reannounce    = atoi( optarg );        break;
+        case 'd': responseDelay = atoi( optarg ) * 1000; break;
+        case 't': duration      = atoi( optarg );        break;
+        default:
+            usage( argv[0] );
+            return 1;
+        }
+    }
+
+    simAddDevices( SIM_PLUG,   plugs );
+    simAddDevices( SIM_LAMP,   lamps );
+    simAddDevices( SIM_SENSOR, sensors );
+    if ( numDevices == 0 || reportRate <= 0 || announceRate <= 0 ) {
+        usage( argv[0] );
+        return 1;
+    }
+    reportPeriod   = 1000000 / ( reportRate * numDevices );
+    announcePeriod = 1000000 / announceRate;
+    if ( reportPeriod == 0 ) reportPeriod = 1;
+
+    setvbuf( stdout, NULL, _IOLBF, 0 );
+    signal( SIGTERM, vQuitSignalHandler );
+    signal( SIGINT,  vQuitSignalHandler );
+    signal( SIGALRM, vQuitSignalHandler );
+    signal( SIGPIPE, SIG_IGN );
+    alarm( duration );
+
+    masterFd = posix_openpt( O_RDWR | O_NOCTTY );
+    if ( masterFd < 0 || grantpt( masterFd ) < 0 || unlockpt( masterFd ) < 0 ||
+         fcntl( masterFd, F_SETFL, O_NONBLOCK ) < 0 ) {
+        perror( "posix_openpt" );
+        return 1;
+    }
+
+    // Keep the slave open so the master does not hang up between host runs
+    slaveFd = open( ptsname( masterFd ), O_RDWR | O_NOCTTY );
+    if ( slaveFd < 0 || tcgetattr( slaveFd, &options ) < 0 ) {
+        perror( "open slave" );
+        return 1;
+    }
+    cfmakeraw( &options );
+    tcsetattr( slaveFd, TCSANOW, &options );
+
+    unlink( link );
+    if ( symlink( ptsname( masterFd ), link ) < 0 ) {
+        perror( "symlink" );
+        return 1;
+    }
+
+    printf( "Simulating %d plugs, %d lamps, %d sensors on %s (%s), %.1f reports/s\n",
+            plugs, lamps, sensors, link, ptsname( masterFd ), reportRate * numDevices );
+
+    start = nextStats = simNow();
+    nextStats += SIM_STATS_INTERVAL * 1000000;
+
+    while ( bRunning ) {
+        struct pollfd pfd = { masterFd, POLLIN, 0 };
+        int timeout = -1, pendingTimeout;
+
+        now = simNow();
+
+        if ( now >= nextStats ) {
+            simPrintStats( start );
+            nextStats += SIM_STATS_INTERVAL * 1000000;
+        }
+
+        if ( hostActive ) {
+            if ( reannounce && announced >= numDevices &&
+                 now - lastAnnounce >= (uint64_t)reannounce * 1000000 ) {
+                announced = 0;
+            }
+
+            if ( announced < numDevices ) {
+                if ( announced == 0 ) {
+                    lastAnnounce = nextAnnounceTime = now;
+                }
+                if ( now >= nextAnnounceTime ) {
+                    simAnnounce( &devices[announced++] );
+                    nextAnnounceTime += announcePeriod;
+                    if ( announced == numDevices ) nextReportTime = now;
+                }
+                timeout = ( nextAnnounceTime > now ) ? ( nextAnnounceTime - now ) / 1000 : 0;
+            } else {
+                // Catch up with the schedule, but not beyond one round
+                int burst = 0;
+                while ( hostActive && now >= nextReportTime && burst++ < numDevices ) {
+                    simReport( &devices[nextReport] );
+                    nextReport = ( nextReport + 1 ) % numDevices;
+                    nextReportTime += reportPeriod;
+                }
+                if ( now >= nextReportTime + reportPeriod * numDevices ) nextReportTime = now;
+                timeout = ( nextReportTime > now ) ? ( nextReportTime - now ) / 1000 : 0;
+            }
+        }
+
+        pendingTimeout = simSendResponses( simNow() );
+        if ( pendingTimeout >= 0 && ( timeout < 0 || pendingTimeout < timeout ) ) timeout = pendingTimeout;
+        if ( timeout < 0 || timeout > 1000 ) timeout = 1000;
+        if ( poll( &pfd, 1, timeout ) > 0 && ( pfd.revents & POLLIN ) ) {
+            uint8_t buf[1024];
+            int i, n = read( masterFd, buf, sizeof( buf ) );
+            for ( i = 0; i < n; i++ ) {
+                simRxByte( buf[i] );
+            }
+        }
+    }
+
+    simPrintStats( start );
+    unlink( link );
+    close( slaveFd );
+    close( masterFd );
+    return 0;
+}
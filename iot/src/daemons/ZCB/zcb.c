@@ -15,16 +15,20 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "zcb.h"
 #include "nibbles.h"
 #include "systemtable.h"
 #include "newDb.h"
 #include "dump.h"
+#include "newLog.h"
 #include "jsonCreate.h"
 #include "ZigbeeConstant.h"
 #include "SerialLink.h"
 #include "ZigbeeDevices.h"
+#include "evloop.h"
+#include "devcache.h"
 
 // ---------------------------------------------------------------
 // Macros
@@ -38,6 +42,15 @@
 #define DEBUG_PRINTF(...)
 #endif /* ZCB_DEBUG */
 
+// Number of commands that may wait for their status from the control
+// bridge at the same time (1 = strictly one after the other)
+#define ZCB_COMMAND_WINDOW  4
+
+// Commands per second sent into the mesh, and how many may go back
+// to back, so that interviews and polling do not flood it
+#define ZCB_TX_RATE         20
+#define ZCB_TX_BURST        8
+
 // ---------------------------------------------------------------
 // External Function Prototypes
 // ---------------------------------------------------------------
@@ -48,11 +61,11 @@ extern void announceDevice(
     uint16_t u16ProfileId,
     uint8_t  u8DeviceVersion);
 
-extern void handleAttribute( uint16_t u16ShortAddress,
+extern void handleAttributes( uint16_t u16ShortAddress,
                     uint16_t u16ClusterID,
-                    uint16_t u16AttributeID,
-                    uint64_t u64Data,
-                    uint8_t  u8Endpoint );
+                    uint8_t  u8Endpoint,
+                    tsZcbAttribute * psAttributes,
+                    int      iNumAttributes );
 
 // ---------------------------------------------------------------
 // Local Function Prototypes
@@ -76,6 +89,26 @@ static void ZCB_HandleReadAttrResp              (void *pvUser, uint16_t u16Lengt
 static void ZCB_HandleActiveEndPointResp        (void *pvUser, uint16_t u16Length, void *pvMessage);
 static void ZCB_HandleLog                       (void *pvUser, uint16_t u16Length, void *pvMessage);
 
+static teZcbStatus eZCB_AddListeners(void);
+
+// ---------------------------------------------------------------
+// Local Variables
+// ---------------------------------------------------------------
+
+// Link statistics at the previous summary
+static tsSL_Stats linkStatsPrev;
+static time_t     linkStatsTime;
+static evloopStats_t loopStatsPrev;
+
+// Attribute reports: time from the serial port until handled, i.e. in the
+// device cache. The time to the database is logged by devcacheLog()
+static struct {
+    pthread_mutex_t mutex;
+    uint32_t        count;
+    uint64_t        total;      // us
+    uint32_t        max;        // us
+} reportStats = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0 };
+
 // ---------------------------------------------------------------
 // Helper Functions
 // ---------------------------------------------------------------
@@ -96,6 +129,7 @@ int zcbAddNode( uint16_t  shortAddress, uint64_t extendedAddress ) {
     int iReturn = 1;
     char  mac[LEN_MAC_NIBBLE+2];
     u642nibblestr( extendedAddress, mac );
+    devcacheSetNode( shortAddress, extendedAddress );
     
     newdb_zcb_t zcb;
     if ( newDbGetZcbSaddr( shortAddress, &zcb ) ) {
@@ -186,6 +220,26 @@ teZcbStatus eZCB_Init(char *cpSerialDevice, uint32_t u32BaudRate) {
         return E_ZCB_COMMS_FAILED;
     }
     
+    return eZCB_AddListeners();
+}
+
+
+teZcbStatus eZCB_InitReplay(char *cpCaptureFile, uint32_t u32Speed) {
+
+    if (eSL_InitReplay(cpCaptureFile, u32Speed) != E_SL_OK) {
+        return E_ZCB_COMMS_FAILED;
+    }
+    
+    return eZCB_AddListeners();
+}
+
+
+static teZcbStatus eZCB_AddListeners(void) {
+
+    vSL_SetCommandWindow( ZCB_COMMAND_WINDOW );
+    vSL_SetTxRate( ZCB_TX_RATE, ZCB_TX_BURST );
+    linkStatsTime = time( NULL );
+    
     /* Register listeners , ecoute des messages de la liaison serie  */
     eSL_AddListener(E_SL_MSG_VERSION_LIST,               ZCB_HandleVersionResponse,          NULL);
     eSL_AddListener(E_SL_MSG_NODE_CLUSTER_LIST,          ZCB_HandleNodeClusterList,          NULL);
@@ -335,166 +389,157 @@ teZcbStatus SimpleDescriptorRequest(uint16_t u16ShortAddress) {
 
 
 // ------------------------------------------------------------------
-// Check Neighbours
+// Link statistics
 // ------------------------------------------------------------------
 
-int eZCB_NeighbourTableRequest( int start ) {
-    struct _ManagementLQIRequest
-    {
-        uint16_t    u16TargetAddress;
-        uint8_t     u8StartIndex;
-    } __attribute__((__packed__)) sManagementLQIRequest;
-    
-    struct _ManagementLQIResponse
-    {
-        uint8_t     u8SequenceNo;
-        uint8_t     u8Status;
-        uint8_t     u8NeighbourTableSize;
-        uint8_t     u8TableEntries;
-        uint8_t     u8StartIndex;
-        struct
-        {
-            uint16_t    u16ShortAddress;
-            uint64_t    u64PanID;
-            uint64_t    u64IEEEAddress;
-            uint8_t     u8Depth;
-            uint8_t     u8LQI;
-            struct
-            {
-                unsigned    uDeviceType : 2;
-                unsigned    uPermitJoining: 2;
-                unsigned    uRelationship : 2;
-                unsigned    uMacCapability : 2;
-            } __attribute__((__packed__)) sBitmap;
-        } __attribute__((__packed__)) asNeighbours[2];
-    } __attribute__((__packed__)) *psManagementLQIResponse = NULL;
-
-    uint16_t u16ShortAddress;
-    uint16_t u16Length;
-    uint8_t u8SequenceNo;
-    int i, ret = -1;
-    teSL_Status eStatus;
-    
-    u16ShortAddress = 0;    // GW
-    
-    sManagementLQIRequest.u16TargetAddress = htons(u16ShortAddress);
-    sManagementLQIRequest.u8StartIndex     = start;
-    
-    time_t t = time(NULL);
-    char * szTimeStamp = ctime(&t);
+// Upper bound (ms) of the latency below which percent of the statuses came in
+static int linkLatencyPercentile( uint32_t * histogram, uint32_t count, int percent ) {
+    uint32_t sum = 0;
+    int i;
+    for ( i=0; i<SL_LATENCY_BUCKETS-1; i++ ) {
+        sum += histogram[i];
+        if ( (uint64_t)sum * 100 >= (uint64_t)count * percent ) break;
+    }
+    return( 1 << i );
+}
 
-    DEBUG_PRINTF( "%s:Send management LQI request to 0x%04X for entries starting at %d\n",
-        szTimeStamp, u16ShortAddress, sManagementLQIRequest.u8StartIndex);
-    eStatus = eSL_SendMessage(E_SL_MSG_MANAGEMENT_LQI_REQUEST,
-        sizeof(struct _ManagementLQIRequest), &sManagementLQIRequest, &u8SequenceNo);
-    
-    if ( eStatus != E_SL_OK)
-    {
-      DEBUG_PRINTF( "Error sending management LQI request : %d (%s)\n",
-          eStatus,
-          eSL_PrintError(eStatus));
-        goto done;
+/**
+ * \brief Logs a summary of the serial link since the previous summary: traffic, the
+ * latency of the command statuses and the error counters (totals). The traffic per
+ * message type and the callback workers are only printed.
+ */
+
+void zcbLogLinkStats( void ) {
+    tsSL_Stats stats;
+    uint32_t latency[SL_LATENCY_BUCKETS];
+    uint32_t statuses = 0;
+    char line[NEWLOG_MAX_TEXT+2];
+    int i;
+
+    vSL_GetStats( &stats );
+    time_t now = time( NULL );
+    int secs = ( now > linkStatsTime ) ? (int)( now - linkStatsTime ) : 1;
+
+    for ( i=0; i<SL_LATENCY_BUCKETS; i++ ) {
+        latency[i] = stats.au32Latency[i] - linkStatsPrev.au32Latency[i];
+        statuses  += latency[i];
     }
-    
-    while (1)
-    {
-        /* Wait 1 second for the message to arrive */
-        if (eSL_MessageWait(E_SL_MSG_MANAGEMENT_LQI_RESPONSE, 1000, &u16Length,
-            (void**)&psManagementLQIResponse) != E_SL_OK)
-        {
-            DEBUG_PRINTF( "No response to management LQI request");
-            goto done;
-        }
-        else if (u8SequenceNo == psManagementLQIResponse->u8SequenceNo)
-        {
-            break;
-        }
-        else
-        {
-            DEBUG_PRINTF( "IEEE Address sequence number received 0x%02X does not match that sent 0x%02X\n", 
-                          psManagementLQIResponse->u8SequenceNo, u8SequenceNo);
-            free(psManagementLQIResponse);
-            psManagementLQIResponse = NULL;
+
+    snprintf( line, sizeof( line ), "Link %ds: rx %u fr/s %llu B/s, tx %u fr/s %llu B/s",
+        secs,
+        ( stats.u32RxFrames - linkStatsPrev.u32RxFrames ) / secs,
+        (unsigned long long)( stats.u64RxBytes - linkStatsPrev.u64RxBytes ) / secs,
+        ( stats.u32TxFrames - linkStatsPrev.u32TxFrames ) / secs,
+        (unsigned long long)( stats.u64TxBytes - linkStatsPrev.u64TxBytes ) / secs );
+    printf( "%s\n", line );
+    newLogAdd( NEWLOG_FROM_ZCB_OUT, line );
+
+    if ( statuses ) {
+        snprintf( line, sizeof( line ), "Link status: %u, avg %u ms, p50 < %d, p90 < %d, p99 < %d ms",
+            statuses,
+            (unsigned)( ( stats.u64LatencyTotal - linkStatsPrev.u64LatencyTotal ) / statuses / 1000 ),
+            linkLatencyPercentile( latency, statuses, 50 ),
+            linkLatencyPercentile( latency, statuses, 90 ),
+            linkLatencyPercentile( latency, statuses, 99 ) );
+        printf( "%s\n", line );
+        newLogAdd( NEWLOG_FROM_ZCB_OUT, line );
+    }
+
+    snprintf( line, sizeof( line ), "Link errors: crc %u, len %u, unhandled %u, timeout %u, waiters %u, window %u",
+        stats.u32CrcErrors, stats.u32LengthErrors, stats.u32NoWaiter,
+        stats.u32StatusTimeouts, stats.u32WaiterFull, stats.u32WindowFull );
+    printf( "%s\n", line );
+    newLogAdd( NEWLOG_FROM_ZCB_OUT, line );
+
+    snprintf( line, sizeof( line ), "Link tx wait max: ctl %u, ivw %u, rep %u, mnt %u ms, dropped %u",
+        stats.asClass[E_SL_PRIORITY_INTERACTIVE].u32MaxWait / 1000,
+        stats.asClass[E_SL_PRIORITY_INTERVIEW].u32MaxWait / 1000,
+        stats.asClass[E_SL_PRIORITY_REPORTING].u32MaxWait / 1000,
+        stats.asClass[E_SL_PRIORITY_MAINTENANCE].u32MaxWait / 1000,
+        stats.asClass[E_SL_PRIORITY_INTERACTIVE].u32Dropped +
+        stats.asClass[E_SL_PRIORITY_INTERVIEW].u32Dropped +
+        stats.asClass[E_SL_PRIORITY_REPORTING].u32Dropped +
+        stats.asClass[E_SL_PRIORITY_MAINTENANCE].u32Dropped );
+    printf( "%s\n", line );
+    newLogAdd( NEWLOG_FROM_ZCB_OUT, line );
+
+    printf( "Link status latency: max %u ms, histogram", stats.u32MaxLatency / 1000 );
+    for ( i=0; i<SL_LATENCY_BUCKETS; i++ ) {
+        printf( " %u", stats.au32Latency[i] );
+    }
+    printf( "\n" );
+    for ( i=0; i<SL_STATS_TYPES; i++ ) {
+        tsSL_TypeStats * type = &stats.asType[i];
+        if ( type->u16Type ) {
+            printf( "Link type 0x%04X: rx %u (%llu B), tx %u (%llu B)\n", type->u16Type,
+                type->u32RxFrames, (unsigned long long)type->u64RxBytes,
+                type->u32TxFrames, (unsigned long long)type->u64TxBytes );
         }
     }
-    if (psManagementLQIResponse->u8Status == CZD_NW_STATUS_SUCCESS)
-    {
-      DEBUG_PRINTF( "Received management LQI response. Table size: %d, Entry count: %d, start index: %d\n",
-          psManagementLQIResponse->u8NeighbourTableSize,
-          psManagementLQIResponse->u8TableEntries,
-          psManagementLQIResponse->u8StartIndex);
+    for ( i=0; i<E_SL_PRIORITY_CLASSES; i++ ) {
+        tsSL_ClassStats * class = &stats.asClass[i];
+        printf( "Link class %d: %u sent, %u dropped, queued %u (max %u), wait avg %u max %u us\n", i,
+            class->u32Sent, class->u32Dropped, class->u32Queued, class->u32MaxQueued,
+            class->u32AvgWait, class->u32MaxWait );
+    }
+    for ( i=0; i<SL_CALLBACK_WORKERS; i++ ) {
+        tsSL_WorkerStats * worker = &stats.asWorker[i];
+        printf( "Link worker %d: %u handled, depth %u (max %u), %u overflowed, latency avg %u max %u us\n", i,
+            worker->u32Handled, worker->u32Depth, worker->u32MaxDepth, worker->u32Overflowed,
+            worker->u32AvgLatency, worker->u32MaxLatency );
+    }
 
-      ret = 0;
-      for (i = 0; i < psManagementLQIResponse->u8TableEntries; i++)
-      {
-        psManagementLQIResponse->asNeighbours[i].u16ShortAddress    = ntohs(psManagementLQIResponse->asNeighbours[i].u16ShortAddress);
-        psManagementLQIResponse->asNeighbours[i].u64PanID           = be64toh(psManagementLQIResponse->asNeighbours[i].u64PanID);
-        psManagementLQIResponse->asNeighbours[i].u64IEEEAddress     = be64toh(psManagementLQIResponse->asNeighbours[i].u64IEEEAddress);
+    evloopStats_t loop;
+    uint32_t reports, reportMax;
+    uint64_t reportTotal;
+    evloopGetStats( &loop );
+    pthread_mutex_lock( &reportStats.mutex );
+    reports     = reportStats.count;
+    reportTotal = reportStats.total;
+    reportMax   = reportStats.max;
+    reportStats.count = 0;
+    reportStats.total = 0;
+    reportStats.max   = 0;
+    pthread_mutex_unlock( &reportStats.mutex );
+
+    snprintf( line, sizeof( line ), "Loop: %u msgs (max %u waiting), reports %u, to cache avg %u max %u us",
+        loop.messages - loopStatsPrev.messages, loop.maxPending,
+        reports, reports ? (unsigned)( reportTotal / reports ) : 0, reportMax );
+    printf( "%s\n", line );
+    newLogAdd( NEWLOG_FROM_ZCB_OUT, line );
+
+    devcacheLog();
+
+    linkStatsPrev = stats;
+    linkStatsTime = now;
+    loopStatsPrev = loop;
+}
 
-        if ((psManagementLQIResponse->asNeighbours[i].u16ShortAddress >= 0xFFFA) ||
-            (psManagementLQIResponse->asNeighbours[i].u64IEEEAddress  == 0))
-        {
-          /* Illegal short / IEEE address */
-          continue;
-        }
+// ------------------------------------------------------------------
+// Check Neighbours
+// ------------------------------------------------------------------
 
-        DEBUG_PRINTF( "  Entry %02d: Short Address 0x%04X, PAN ID: 0x%016llX, IEEE Address: 0x%016llX\n", i,
-            psManagementLQIResponse->asNeighbours[i].u16ShortAddress,
-            (unsigned long long int)psManagementLQIResponse->asNeighbours[i].u64PanID,
-            (unsigned long long int)psManagementLQIResponse->asNeighbours[i].u64IEEEAddress);
-
-        DEBUG_PRINTF( "    Type: %d, Permit Joining: %d, Relationship: %d, RxOnWhenIdle: %d\n",
-            psManagementLQIResponse->asNeighbours[i].sBitmap.uDeviceType,
-            psManagementLQIResponse->asNeighbours[i].sBitmap.uPermitJoining,
-            psManagementLQIResponse->asNeighbours[i].sBitmap.uRelationship,
-            psManagementLQIResponse->asNeighbours[i].sBitmap.uMacCapability);
-
-        DEBUG_PRINTF( "    Depth: %d, LQI: %d\n", 
-            psManagementLQIResponse->asNeighbours[i].u8Depth,
-            psManagementLQIResponse->asNeighbours[i].u8LQI);
-
-        newdb_zcb_t zcb;
-        if ( newDbGetZcbSaddr( psManagementLQIResponse->asNeighbours[i].u16ShortAddress, &zcb ) ) {
-          // Existing node
-        } else {
-          // New node
-          DEBUG_PRINTF( "New Node 0x%04X in neighbour table\n", psManagementLQIResponse->asNeighbours[i].u16ShortAddress);
-
-          // Handle as the device announced itself
-          zcbAddNode( psManagementLQIResponse->asNeighbours[i].u16ShortAddress,
-              psManagementLQIResponse->asNeighbours[i].u64IEEEAddress );
-          if ( SimpleDescriptorRequest( psManagementLQIResponse->asNeighbours[i].u16ShortAddress ) != E_ZCB_OK) {
-            DEBUG_PRINTF( "Error sending simple descriptor request\n");
-            ret = -1;
-          }
-        }
-      }
+/**
+ * \brief Handles a node found in a neighbour table: if the database does not
+ * know its short address, it is handled as if the device announced itself
+ * \returns 1 if the node was new, 0 if known, -1 if it could not be asked for its descriptor
+ */
+int zcbNewNeighbour( uint16_t shortAddress, uint64_t extendedAddress ) {
+    newdb_zcb_t zcb;
+    if ( newDbGetZcbSaddr( shortAddress, &zcb ) ) {
+        // Existing node
+        return( 0 );
+    }
 
-      if (psManagementLQIResponse->u8TableEntries > 0)
-      {
-        // We got some entries, so next time request the entries after these.
-        start += psManagementLQIResponse->u8TableEntries;
-        /* Make sure we're still in table boundaries */
-        if (start >= psManagementLQIResponse->u8NeighbourTableSize)
-        {
-          start = 0;
-        }
-      }
-      else
-      {
-        // No more valid entries.
-        start = 0;
-      }
-      if ( ret == 0 ) ret = start;
-    } // if (psManagementLQIResponse->u8Status == CZD_NW_STATUS_SUCCESS)
-    else
-    {
-      DEBUG_PRINTF( "Received error status in management LQI response : 0x%02x\n",
-          psManagementLQIResponse->u8Status);
+    DEBUG_PRINTF( "New Node 0x%04X in neighbour table\n", shortAddress );
+
+    // Handle as the device announced itself
+    zcbAddNode( shortAddress, extendedAddress );
+    if ( SimpleDescriptorRequest( shortAddress ) != E_ZCB_OK ) {
+        DEBUG_PRINTF( "Error sending simple descriptor request\n" );
+        return( -1 );
     }
-done:
-    free(psManagementLQIResponse);
-    return( ret );
+    return( 1 );
 }
 
 // ------------------------------------------------------------------
@@ -1367,71 +1412,66 @@ static void ZCB_HandleMatchDescriptorResponse(void *pvUser, uint16_t u16Length,
 }
 
 
-static void ZCB_HandleAttributeReport(void *pvUser, uint16_t u16Length, void *pvMessage) {
-    DEBUG_PRINTF( "\n************ ZCB_HandleAttributeReport\n" );
-    // { 0x29 0x06 0x19 0x01 0x04 0x02 0x00 0x00 0x29 0x00 0x02 0x08 0x0f }
-	// u8SequenceNo,u16ShortAddress
-//	char temp[100];
-//	uint16_t i;
-//	*psMessage = &temp[0];
-	
-	/*for (i=0 ; i< u16Length;i++)
-	{
-	  printf( "data  = %u\n", u16Length );
-	}*/
-	// modification de la structure 
-    struct _tsAttributeReport {
-        uint8_t     u8SequenceNo;
-        uint16_t    u16ShortAddress;
-        uint8_t     u8Endpoint;
-        uint16_t    u16ClusterID;
-        uint16_t    u16AttributeID;
-		uint8_t     u8Type;
-        uint8_t     u8AttributeStatus;       
-        uint8_t    u16SizeOfAttributesInBytes;
-        union {
-            uint8_t     u8Data;
-            uint16_t    u16Data;
-            uint32_t    u32Data;
-            uint64_t    u64Data;
-        } uData;
-    } __attribute__((__packed__)) *psMessage = (struct _tsAttributeReport *)pvMessage;
-    
-    psMessage->u16ShortAddress  = ntohs(psMessage->u16ShortAddress);
-    psMessage->u16ClusterID     = ntohs(psMessage->u16ClusterID);
-    psMessage->u16AttributeID   = ntohs(psMessage->u16AttributeID);
-    
-    DEBUG_PRINTF( "Attribute report from 0x%04X - Endpoint %d, cluster 0x%04X, attribute 0x%04X.\n", 
-                psMessage->u16ShortAddress,
-                psMessage->u8Endpoint,
-                psMessage->u16ClusterID,
-                psMessage->u16AttributeID
-            );
-    
+/**
+ * \brief Reads a big-endian value of at most u8Width bytes
+ */
+static uint64_t u64ZCB_ReadValue(uint8_t *pu8Data, uint8_t u8Size, uint8_t u8Width) {
     uint64_t u64Data = 0;
-    volatile int32_t  i32Data;
+    int i;
+    if (u8Size < u8Width) u8Width = u8Size;
+    for (i=0; i<u8Width; i++) {
+        u64Data = (u64Data << 8) | pu8Data[i];
+    }
+    return u64Data;
+}
+
+/**
+ * \brief Decodes the value of one attribute record. Values come in the
+ * width of their type, strings are prefixed with their length.
+ * \returns 0 when the type is not known
+ */
+static int iZCB_DecodeAttribute(tsZcbAttribute *psAttribute, uint8_t *pu8Data, uint8_t u8Size) {
+    int32_t  i32Data;
+    uint64_t u64Length;
+
+    psAttribute->u64Data   = 0;
+    psAttribute->pu8String = NULL;
 
-    switch(psMessage->u8Type) {
+    switch(psAttribute->u8Type) {
         case(E_ZCL_GINT8):
         case(E_ZCL_UINT8):
         case(E_ZCL_INT8):
         case(E_ZCL_ENUM8):
         case(E_ZCL_BMAP8):
         case(E_ZCL_BOOL):
-        case(E_ZCL_OSTRING):
-        case(E_ZCL_CSTRING):
-            u64Data = (uint64_t )psMessage->uData.u8Data;
+            psAttribute->u64Data = u64ZCB_ReadValue(pu8Data, u8Size, 1);
             break;
 
+        case(E_ZCL_OSTRING):
+        case(E_ZCL_CSTRING):
         case(E_ZCL_LOSTRING):
         case(E_ZCL_LCSTRING):
+        {
+            uint8_t u8Prefix = ((psAttribute->u8Type == E_ZCL_OSTRING) ||
+                                (psAttribute->u8Type == E_ZCL_CSTRING)) ? 1 : 2;
+            if (u8Size < u8Prefix) return 0;
+            u64Length = u64ZCB_ReadValue(pu8Data, u8Size, u8Prefix);
+            // 0xff(ff) is an invalid string, and never read past the record
+            if (u64Length > (uint64_t)(u8Size - u8Prefix)) u64Length = u8Size - u8Prefix;
+            psAttribute->u64Data   = u64Length;
+            psAttribute->pu8String = pu8Data + u8Prefix;
+            break;
+        }
+
         case(E_ZCL_STRUCT):
         case(E_ZCL_INT16):
         case(E_ZCL_UINT16):
         case(E_ZCL_ENUM16):
         case(E_ZCL_CLUSTER_ID):
         case(E_ZCL_ATTRIBUTE_ID):
-            u64Data = (uint64_t )ntohs(psMessage->uData.u16Data);
+        // YB ajout pour xiaomi smart plug
+        case E_ZCL_FLOAT_SINGLE:
+            psAttribute->u64Data = u64ZCB_ReadValue(pu8Data, u8Size, 2);
             break;
 
         case(E_ZCL_UINT24):
@@ -1440,15 +1480,15 @@ static void ZCB_HandleAttributeReport(void *pvUser, uint16_t u16Length, void *pv
         case(E_ZCL_DATE):
         case(E_ZCL_UTCT):
         case(E_ZCL_BACNET_OID):
-            u64Data = (uint64_t )ntohl(psMessage->uData.u32Data);
+            psAttribute->u64Data = u64ZCB_ReadValue(pu8Data, u8Size, 4);
             break;
-            
+
         case E_ZCL_INT24:
-            i32Data = (int32_t)ntohl(psMessage->uData.u32Data);
+            i32Data = (int32_t)u64ZCB_ReadValue(pu8Data, u8Size, 4);
             // REPAIR/EXTEND SIGN
             i32Data <<= 8;
             i32Data >>= 8;
-            u64Data = (uint64_t )i32Data;
+            psAttribute->u64Data = (uint64_t)i32Data;
             break;
 
         case(E_ZCL_UINT40):
@@ -1456,27 +1496,92 @@ static void ZCB_HandleAttributeReport(void *pvUser, uint16_t u16Length, void *pv
         case(E_ZCL_UINT56):
         case(E_ZCL_UINT64):
         case(E_ZCL_IEEE_ADDR):
-            u64Data = (uint64_t )be64toh(psMessage->uData.u64Data);
+            psAttribute->u64Data = u64ZCB_ReadValue(pu8Data, u8Size, 8);
             break;
-        // YB ajout pour xiaomi smart plug  
-		case E_ZCL_FLOAT_SINGLE:	
-			 u64Data = (uint64_t )ntohs(psMessage->uData.u16Data);
-        break;
+
         default:
-            printf( "Unknown attribute data type (%d)\n", psMessage->u8Type );
-            printf( "-  8: Data = %llx\n", (uint64_t )psMessage->uData.u8Data );
-            printf( "- 16: Data = %llx\n", (uint64_t )ntohs( psMessage->uData.u16Data ) );
-            printf( "- 32: Data = %llx\n", (uint64_t )ntohl( psMessage->uData.u32Data ) );
-            printf( "- 64: Data = %llx\n", (uint64_t )be64toh( psMessage->uData.u64Data ) );
+            printf( "Unknown attribute data type (%d), %d bytes: %llx\n", psAttribute->u8Type, u8Size,
+                    (unsigned long long)u64ZCB_ReadValue(pu8Data, u8Size, 8) );
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * \brief Handles an attribute report. A report carries one or more
+ * records of attribute ID, type, status, size and value, which are all
+ * decoded before being handed to the cluster's handler in one go.
+ */
+static void ZCB_HandleAttributeReport(void *pvUser, uint16_t u16Length, void *pvMessage) {
+    DEBUG_PRINTF( "\n************ ZCB_HandleAttributeReport\n" );
+    // { 0x29 0x06 0x19 0x01 0x04 0x02 0x00 0x00 0x29 0x00 0x02 0x08 0x0f }
+    // u8SequenceNo, u16ShortAddress, u8Endpoint, u16ClusterID, then per attribute:
+    // u16AttributeID, u8Type, u8AttributeStatus, u8Size, au8Data[u8Size]
+    struct _tsAttributeReport {
+        uint8_t     u8SequenceNo;
+        uint16_t    u16ShortAddress;
+        uint8_t     u8Endpoint;
+        uint16_t    u16ClusterID;
+        uint8_t     au8Attributes[];
+    } __attribute__((__packed__)) *psMessage = (struct _tsAttributeReport *)pvMessage;
+
+    tsZcbAttribute asAttributes[ZCB_MAX_REPORT_ATTRIBUTES];
+    int      iNumAttributes = 0;
+    uint16_t u16Offset = 0;
+    uint16_t u16Remaining;
+
+    if (u16Length < sizeof(struct _tsAttributeReport)) {
+        printf( "Attribute report too short (%d bytes)\n", u16Length );
+        return;
+    }
+    u16Remaining = u16Length - sizeof(struct _tsAttributeReport);
+
+    psMessage->u16ShortAddress  = ntohs(psMessage->u16ShortAddress);
+    psMessage->u16ClusterID     = ntohs(psMessage->u16ClusterID);
+
+    // Records need at least ID, type, status and size; anything shorter is trailing data
+    while ((u16Remaining - u16Offset) >= 5 && iNumAttributes < ZCB_MAX_REPORT_ATTRIBUTES) {
+        uint8_t *pu8Record = &psMessage->au8Attributes[u16Offset];
+        tsZcbAttribute *psAttribute = &asAttributes[iNumAttributes];
+        uint8_t u8Size = pu8Record[4];
+
+        if ((u16Remaining - u16Offset - 5) < u8Size) {
+            printf( "Attribute report from 0x%04X truncated after %d attributes\n",
+                    psMessage->u16ShortAddress, iNumAttributes );
             break;
+        }
+
+        psAttribute->u16AttributeID = (pu8Record[0] << 8) | pu8Record[1];
+        psAttribute->u8Type         = pu8Record[2];
+        psAttribute->u8Status       = pu8Record[3];
+        u16Offset += 5 + u8Size;
+
+        if (iZCB_DecodeAttribute(psAttribute, &pu8Record[5], u8Size)) {
+            DEBUG_PRINTF( "Attribute report from 0x%04X - Endpoint %d, cluster 0x%04X, attribute 0x%04X, data 0x%016llx\n",
+                        psMessage->u16ShortAddress,
+                        psMessage->u8Endpoint,
+                        psMessage->u16ClusterID,
+                        psAttribute->u16AttributeID,
+                        (unsigned long long)psAttribute->u64Data
+                    );
+            iNumAttributes++;
+        }
     }
-    DEBUG_PRINTF( "Data = 0x%016llx\n", u64Data);
 
-    handleAttribute( psMessage->u16ShortAddress,
+    if (iNumAttributes == 0) return;
+
+    handleAttributes( psMessage->u16ShortAddress,
                     psMessage->u16ClusterID,
-                    psMessage->u16AttributeID,
-                    u64Data,
-                    psMessage->u8Endpoint );
+                    psMessage->u8Endpoint,
+                    asAttributes,
+                    iNumAttributes );
+
+    uint32_t age = u32SL_MessageAge();
+    pthread_mutex_lock( &reportStats.mutex );
+    reportStats.count++;
+    reportStats.total += age;
+    if ( age > reportStats.max ) reportStats.max = age;
+    pthread_mutex_unlock( &reportStats.mutex );
     
     return;
 }
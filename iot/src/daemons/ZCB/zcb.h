@@ -90,6 +90,21 @@ typedef union
 } tuZcbAttributeData;
 
 
+/** One attribute record of a report. Numeric values are in u64Data, string
+ *  values point into the received message and are not terminated */
+typedef struct
+{
+    uint16_t    u16AttributeID;
+    uint8_t     u8Type;
+    uint8_t     u8Status;
+    uint64_t    u64Data;                /**< Value, or the length of a string */
+    uint8_t    *pu8String;              /**< Characters of a string, else NULL */
+} tsZcbAttribute;
+
+/** Most records a single report can carry */
+#define ZCB_MAX_REPORT_ATTRIBUTES   16
+
+
 /** Enumerated type of module modes */
 typedef enum
 {
@@ -126,6 +141,9 @@ uint64_t zcbNodeGetExtendedAddress( uint16_t shortAddress );
 /** Initialise control bridge connected to serial port */
 teZcbStatus eZCB_Init(char *cpSerialDevice, uint32_t u32BaudRate);
 
+/** Initialise control bridge replayed from a serial link capture, see eSL_InitReplay() */
+teZcbStatus eZCB_InitReplay(char *cpCaptureFile, uint32_t u32Speed);
+
 
 /** Finished with control bridge - call this to tidy up */ 
 teZcbStatus eZCB_Finish(void);
@@ -135,10 +153,14 @@ teZcbStatus eZCB_Finish(void);
  */
 teZcbStatus eZCB_EstablishComms(void);
 
+/** Log a summary of the serial link statistics since the previous summary */
+void zcbLogLinkStats( void );
+
 
 teZcbStatus eOnOff( uint16_t u16ShortAddress, uint8_t u8Mode );
 
-int eZCB_NeighbourTableRequest( int start );
+/** Handle a node found in a neighbour table, see scanner.c */
+int zcbNewNeighbour( uint16_t shortAddress, uint64_t extendedAddress );
 
 teZcbStatus eZCB_WriteAttributeRequest(uint16_t u16ShortAddress,
 				       uint16_t u16ClusterID,
@@ -48,6 +48,7 @@
 #include "newLog.h"
 #include "newDb.h"
 #include "json.h"
+#include "iotMsg.h"
 #include "jsonCreate.h"
 #include "gateway.h"
 #include "parsing.h"
@@ -120,16 +121,16 @@ int dbp_report_discovery_device(char *output);
 int dbp_report_state_device(char *output);
 static char** str_split(char* a_str, const char a_delim);
 
-static void dbp_onError(int error, char * errtext, char * lastchars) {
+static void dbp_onError(void * user, int error, char * errtext, char * lastchars) {
     printf("onError( %d, %s ) @ %s\n", error, errtext, lastchars);
 }
 
-static void dbp_onObjectStart(char * name) {
+static void dbp_onObjectStart(void * user, char * name) {
     printf("onObjectStart( %s )\n", name);
     parsingReset();
 }
 
-static void dbp_onObjectComplete(char * name) {
+static void dbp_onObjectComplete(void * user, char * name) {
     
     char *mac = NULL;
     bool status = false;
@@ -186,20 +187,20 @@ static void dbp_onObjectComplete(char * name) {
     
 }
 
-static void dbp_onArrayStart(char * name) {
+static void dbp_onArrayStart(void * user, char * name) {
     printf("onArrayStart( %s )\n", name);
 }
 
-static void dbp_onArrayComplete(char * name) {
+static void dbp_onArrayComplete(void * user, char * name) {
     printf("onArrayComplete( %s )\n", name);
 }
 
-static void dbp_onString(char * name, char * value) {
+static void dbp_onString(void * user, char * name, char * value) {
     printf("onString( %s, %s )\n", name, value);
     parsingStringAttr( name, value );
 }
 
-static void dbp_onInteger(char * name, int value) {
+static void dbp_onInteger(void * user, char * name, int value) {
     printf("onInteger( %s, %d )\n", name, value);
     parsingIntAttr( name, value );
 }
@@ -342,9 +343,18 @@ int main(int argc, char *argv[])
     return 0;
 }
 
+static const json_callbacks_t dbp_callbacks = {
+    dbp_onError,
+    dbp_onObjectStart,
+    dbp_onObjectComplete,
+    dbp_onArrayStart,
+    dbp_onArrayComplete,
+    dbp_onString,
+    dbp_onInteger
+};
+
 static void *zigbee_msg_receiver(void *arg)
 {
-    int i;
 #if 0
     int cnt = 0;
 #endif
@@ -352,16 +362,15 @@ static void *zigbee_msg_receiver(void *arg)
     /* receive message */
    // printf("Message Receiver's Thread is running\n");
     
-    if( (dbpQueue = queueOpen(QUEUE_KEY_DBP, 0)) != -1 ){
+    /* this thread has its own parser */
+    json_parser_t *parser = jsonParserCreate();
+    if(parser == NULL){
+        newLogAdd( NEWLOG_FROM_DBP,"Could not create parser");
+        return NULL;
+    }
+    jsonParserSetCallbacks(parser, &dbp_callbacks, NULL);
     
-        jsonSetOnError(dbp_onError);
-        jsonSetOnObjectStart(dbp_onObjectStart);
-        jsonSetOnObjectComplete(dbp_onObjectComplete);
-        jsonSetOnArrayStart(dbp_onArrayStart);
-        jsonSetOnArrayComplete(dbp_onArrayComplete);
-        jsonSetOnString(dbp_onString);
-        jsonSetOnInteger(dbp_onInteger);
-        jsonReset();
+    if( (dbpQueue = queueOpen(QUEUE_KEY_DBP, 0)) != -1 ){
         
         int numBytes = 0;
         
@@ -370,10 +379,12 @@ static void *zigbee_msg_receiver(void *arg)
             numBytes = queueRead(dbpQueue, inputBuffer, INPUTBUFFERLEN);
           //  printf("Message received. numBytes = %d\n", numBytes);
             
-            jsonReset();
+            if(iotMsgIsBinary(inputBuffer, numBytes)){
+                iotMsgDecode(inputBuffer, numBytes, &dbp_callbacks, NULL);
+            }else{
+                jsonParserReset(parser);
             
-            for(i=0; i<numBytes; i++){
-                jsonEat(inputBuffer[i]);
+                jsonParserEatBuffer(parser, inputBuffer, numBytes);
             }
             
 #if 0
@@ -391,6 +402,7 @@ static void *zigbee_msg_receiver(void *arg)
         newLogAdd( NEWLOG_FROM_DBP,"Could not open dbp-queue");
     }
     
+    jsonParserDestroy(parser);
     return NULL;
 }
 